@@ -0,0 +1,76 @@
+#!/usr/bin/env python3
+"""
+Unpacking of 1-bit SANE frames (lineart) to 1 byte per pixel: the pure
+Python implementation pyinsane used to have, and the kernels of
+pyinsane2/native/pixels.cpp with each instruction set this CPU supports.
+"""
+
+import os
+import time
+
+from pyinsane2.native import _core
+from pyinsane2.sane.abstract import ImgUtil
+
+
+WIDTH = 4958  # A4, 600dpi
+HEIGHT = 7016
+BYTES_PER_LINE = 624  # padded
+NB_RUNS = 5
+NB_PYTHON_LINES = 64  # the Python version is way too slow for a whole page
+
+
+def unpack_1_to_8_python(whole_raw_packed, pixels_per_line, bytes_per_line):
+    # what ImgUtil.unpack_1_to_8() used to be
+    whole_raw_unpacked = b""
+    positive_bit = bytes([0x00])
+    negative_bit = bytes([0xFF])
+
+    for chunk in range(0, len(whole_raw_packed), bytes_per_line):
+        raw_packed = whole_raw_packed[:bytes_per_line]
+        whole_raw_packed = whole_raw_packed[bytes_per_line:]
+        raw_unpacked = b""
+        for byte in raw_packed:
+            for bit in range(7, -1, -1):
+                if ((byte & (1 << bit)) > 0):
+                    raw_unpacked += positive_bit
+                else:
+                    raw_unpacked += negative_bit
+        raw_unpacked = raw_unpacked[:pixels_per_line]
+        whole_raw_unpacked += raw_unpacked
+    return whole_raw_unpacked
+
+
+def main():
+    page = os.urandom(BYTES_PER_LINE * HEIGHT)
+    print("%dx%d, %d bytes per line" % (WIDTH, HEIGHT, BYTES_PER_LINE))
+
+    band = page[:BYTES_PER_LINE * NB_PYTHON_LINES]
+    start = time.time()
+    expected = unpack_1_to_8_python(band, WIDTH, BYTES_PER_LINE)
+    elapsed = time.time() - start
+    print("%-8s %10.1f ms/page (%d lines: %.1f ms, quadratic)" % (
+        "python", elapsed * HEIGHT / NB_PYTHON_LINES * 1000,
+        NB_PYTHON_LINES, elapsed * 1000
+    ))
+
+    default = _core.pixels_get_simd()
+    reference = None
+    for simd in ("none", "sse2", "ssse3", "avx2", "neon"):
+        if _core.pixels_set_simd(simd) != simd:
+            continue
+        start = time.time()
+        for _ in range(NB_RUNS):
+            out = ImgUtil.unpack_1_to_8(page, WIDTH, BYTES_PER_LINE)
+        elapsed = (time.time() - start) / NB_RUNS
+        assert out[:len(expected)] == expected
+        if reference is None:
+            reference = elapsed
+        print("%-8s %10.1f ms/page %8.1f Mpixels/s    x%.1f" % (
+            simd, elapsed * 1000, WIDTH * HEIGHT / elapsed / 1000000,
+            reference / elapsed
+        ))
+    _core.pixels_set_simd(default)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,56 @@
+#!/usr/bin/env python3
+"""
+Replays a driver writing tiny chunks (a few bytes at a time, like some
+Brother drivers do) against the ring, with and without write coalescing.
+
+Each buffer returned by ring_read() is a trip through the GIL and the
+interpreter: the fewer, the better.
+"""
+
+import time
+
+from pyinsane2.native import _core
+
+
+PAGE_SIZE = 2550 * 3 * 3300  # A4, 300dpi, RGB
+NB_PAGES = 2
+MAX_CHUNK_SIZE = 64  # average write: 32 bytes
+
+
+def run(name, min_bytes, row_size, max_delay_ms):
+    ring = _core.ring_new(64 * 1024 * 1024)
+    _core.ring_set_coalescing(ring, min_bytes, row_size, max_delay_ms)
+    nb_reads = 0
+    start = time.time()
+    producer = _core.ring_produce(ring, PAGE_SIZE, NB_PAGES, MAX_CHUNK_SIZE)
+    while True:
+        try:
+            _core.ring_read(ring)
+            nb_reads += 1
+        except EOFError:
+            pass
+        except StopIteration:
+            break
+    _core.producer_join(producer)
+    elapsed = time.time() - start
+
+    stats = _core.ring_get_stats(ring)
+    print("%-28s %7.1f MB/s    records: %8d    wake-ups: %7d    reads: %7d" % (
+        name, PAGE_SIZE * NB_PAGES / elapsed / 1024 / 1024,
+        stats['records'], stats['consumer_wakeups'], nb_reads
+    ))
+
+
+def main():
+    print("%d pages of %d bytes, written in chunks of up to %d bytes" % (
+        NB_PAGES, PAGE_SIZE, MAX_CHUNK_SIZE
+    ))
+    run("no coalescing", 0, 0, 0)
+    run("64K", 64 * 1024, 0, 0)
+    run("64K or 100ms", 64 * 1024, 0, 100)
+    run("1 line (7650 bytes)", 1024 * 1024, 2550 * 3, 0)
+    run("1M", 1024 * 1024, 0, 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+"""
+Decoding the pages of compressed WIA transfers (JPEG, A4, 300dpi): on the
+thread of the application, one after the other, and with the decode pool
+of ScanSession (_core.decode_pool_*).
+
+The workers of the pool are native threads, but the decoding itself is
+done by PIL: they take the GIL to call it, and run in parallel only
+because PIL releases the GIL while it decodes each block of data.
+
+The pages arrive one after the other, as during a scan: with the pool,
+they are decoded while the next ones are transferred, and the thread of
+the application is free to get them. With more than one CPU, several
+pages can also be decoded at once.
+"""
+
+import io
+import os
+import time
+
+from PIL import Image
+
+from pyinsane2.native import _core
+
+
+SIZE = (2480, 3508)  # A4, 300dpi
+NB_PAGES = 16
+NB_WORKERS = [1, 2, 4]
+
+
+def _decode_page(data):
+    # same as pyinsane2.wia.abstract._decode_page() (WIA isn't importable
+    # everywhere)
+    img = Image.open(io.BytesIO(data))
+    img.load()
+    return img
+
+
+def make_page():
+    # noise compresses badly: decoding it is expensive enough to measure
+    noise = Image.frombytes("L", (SIZE[0] // 4, SIZE[1] // 4),
+                            os.urandom(SIZE[0] * SIZE[1] // 16))
+    img = Image.merge("RGB", [noise.resize(SIZE)] * 3)
+    out = io.BytesIO()
+    img.save(out, "JPEG", quality=90)
+    return out.getvalue()
+
+
+def receive_pages(pages, transfer_time, decode):
+    # The driver sends a page every 'transfer_time' seconds (the thread of
+    # the application just waits for it). Returns (total, time spent by
+    # the application thread in decode())
+    start = time.time()
+    busy = 0.0
+    for page in pages:
+        time.sleep(transfer_time)
+        decode_start = time.time()
+        decode(page)
+        busy += time.time() - decode_start
+    return (time.time() - start, busy)
+
+
+def main():
+    pages = [make_page() for _ in range(NB_PAGES)]
+    print("%d pages of %dx%d, %d KB each (JPEG), %d CPU(s)" % (
+        NB_PAGES, SIZE[0], SIZE[1], len(pages[0]) // 1024, os.cpu_count()
+    ))
+
+    start = time.time()
+    for page in pages:
+        _decode_page(page)
+    transfer_time = (time.time() - start) / NB_PAGES
+    print("transfer time: %.1f ms per page (as long as decoding it)" % (
+        transfer_time * 1000
+    ))
+
+    (total, busy) = receive_pages(pages, transfer_time, _decode_page)
+    print("%-20s total %8.1f ms    application thread busy %8.1f ms" % (
+        "application thread", total * 1000, busy * 1000
+    ))
+
+    for nb_workers in NB_WORKERS:
+        pool = _core.decode_pool_new(_decode_page, nb_workers)
+        start = time.time()
+        (_, busy) = receive_pages(
+            pages, transfer_time,
+            lambda page: _core.decode_pool_submit(pool, page)
+        )
+        for _ in pages:
+            _core.decode_pool_get(pool)
+        total = time.time() - start
+        print("%-20s total %8.1f ms    application thread busy %8.1f ms" % (
+            "pool, %d worker(s)" % nb_workers, total * 1000, busy * 1000
+        ))
+        del pool
+
+
+if __name__ == "__main__":
+    main()
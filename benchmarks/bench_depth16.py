@@ -0,0 +1,58 @@
+#!/usr/bin/env python3
+"""
+Conversion of 16-bit SANE frames to 8 bits (Scanner.scan(to_8bits=...)),
+with the kernels of pyinsane2/native/pixels.cpp and each instruction set
+this CPU supports: most significant bytes only, and through a levels/gamma
+table. PIL's own conversion (of the 16-bit image) is given as a reference.
+"""
+
+import os
+import time
+
+from PIL import Image
+
+from pyinsane2.native import _core
+
+
+WIDTH = 10200  # Letter, 1200dpi, grayscale
+HEIGHT = 13200 // 4  # 1/4th of it
+BYTES_PER_LINE = WIDTH * 2
+NB_RUNS = 5
+
+
+def measure(func):
+    start = time.time()
+    for _ in range(NB_RUNS):
+        func()
+    return (time.time() - start) / NB_RUNS
+
+
+def main():
+    frame = os.urandom(BYTES_PER_LINE * HEIGHT)
+    lut = _core.pixels_lut16(0x0400, 0xF000, 2.2)
+    print("%dx%d, 16 bits per sample" % (WIDTH, HEIGHT))
+
+    def pil():
+        img = Image.frombuffer("I;16", (WIDTH, HEIGHT), frame, "raw", "I;16",
+                               0, 1)
+        img.point(lambda v: v / 256.0).convert("L")
+
+    print("%-8s %-6s %8.1f ms" % ("PIL", "", measure(pil) * 1000))
+
+    default = _core.pixels_get_simd()
+    for (name, table) in (("msb", None), ("levels", lut)):
+        for simd in ("none", "sse2", "ssse3", "avx2", "neon"):
+            if _core.pixels_set_simd(simd) != simd:
+                continue
+            elapsed = measure(lambda: _core.pixels_convert(
+                frame, _core.PIXELS_16_TO_8, WIDTH, BYTES_PER_LINE, HEIGHT,
+                0, 0, table
+            ))
+            print("%-8s %-6s %8.1f ms %8.1f Msamples/s" % (
+                simd, name, elapsed * 1000, WIDTH * HEIGHT / elapsed / 1e6
+            ))
+    _core.pixels_set_simd(default)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+"""
+Storing the lines of a SANE frame as Scan.read() gets them, with a
+progressive preview (Scan.get_image() of the whole page so far) every few
+chunks: the list of lines pyinsane used to have, and LineStore
+(pyinsane2/sane/abstract.py), with and without the height of the frame
+known in advance.
+"""
+
+import os
+import time
+
+from pyinsane2.sane import abstract
+from pyinsane2.sane import rawapi
+
+
+WIDTH = 10200  # Letter, 1200dpi, grayscale
+HEIGHT = 13200 // 4  # 1/4th of it
+CHUNK_SIZE = abstract.SANE_READ_BUFSIZE
+PREVIEW_EVERY = 4  # chunks
+
+
+class Parameters(object):
+    format = rawapi.SaneFrame.GRAY
+    depth = 8
+    pixels_per_line = WIDTH
+    bytes_per_line = WIDTH
+    lines = HEIGHT
+
+
+class OldLines(object):
+    # what Scan.read() / Scan.get_image() used to do
+    def __init__(self, parameters):
+        self.parameters = parameters
+        self.raw_lines = []
+
+    def append(self, read):
+        line_size = self.parameters.bytes_per_line
+        if (len(self.raw_lines) > 0):
+            cut = line_size - len(self.raw_lines[-1])
+            self.raw_lines[-1] += read[:cut]
+            read = read[cut:]
+        for _ in range(0, len(read), line_size):
+            self.raw_lines.append(read[:line_size])
+            read = read[line_size:]
+        if len(read) > 0:
+            self.raw_lines.append(read)
+
+    def get_image(self):
+        r = len(self.raw_lines)
+        if (r > 0 and len(self.raw_lines[-1]) < self.parameters.bytes_per_line):
+            r -= 1
+        lines = b"".join(self.raw_lines[:r])
+        return abstract.ImgUtil.raw_to_img(lines, self.parameters)
+
+
+class NewLines(object):
+    def __init__(self, parameters):
+        self.parameters = parameters
+        self.store = abstract.LineStore(parameters.bytes_per_line,
+                                        parameters.lines)
+
+    def append(self, read):
+        self.store.append(read)
+
+    def get_image(self):
+        return abstract.ImgUtil.raw_to_img(
+            self.store.get_lines(0, self.store.nb_lines), self.parameters
+        )
+
+
+def run(name, lines_class, parameters, frame):
+    start = time.time()
+    lines = lines_class(parameters)
+    for (idx, offset) in enumerate(range(0, len(frame), CHUNK_SIZE)):
+        lines.append(frame[offset:offset + CHUNK_SIZE])
+        if idx % PREVIEW_EVERY == 0:
+            lines.get_image()
+    img = lines.get_image()
+    elapsed = time.time() - start
+    assert img.size == (WIDTH, HEIGHT)
+    print("%-24s %8.1f ms" % (name, elapsed * 1000))
+
+
+def main():
+    frame = os.urandom(WIDTH * HEIGHT)
+    print("%dx%d, %d bytes, chunks of %d bytes, preview every %d chunks" % (
+        WIDTH, HEIGHT, len(frame), CHUNK_SIZE, PREVIEW_EVERY
+    ))
+    run("list of lines", OldLines, Parameters, frame)
+    run("LineStore", NewLines, Parameters, frame)
+
+    class UnknownHeight(Parameters):
+        lines = -1
+
+    run("LineStore (height: -1)", NewLines, UnknownHeight, frame)
+
+
+if __name__ == "__main__":
+    main()
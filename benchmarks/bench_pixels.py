@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+"""
+Row kernels of pyinsane2/native/pixels.cpp (BGR -> RGB, BGRX -> RGB, line
+flip and padding removal), SIMD versions against the scalar references, and
+what it costs to get the same page out of PIL from a BMP.
+"""
+
+import io
+import os
+import time
+
+import PIL.Image
+
+from pyinsane2.native import _core
+
+
+WIDTH = 2551  # A4, 300dpi: odd number of pixels, padded lines
+HEIGHT = 3508
+NB_RUNS = 5
+
+
+def run(name, layout, in_bpp):
+    stride = ((WIDTH * in_bpp + 3) // 4) * 4
+    data = os.urandom(stride * HEIGHT)
+    results = {}
+    _core.pixels_convert(data, layout, WIDTH, stride, HEIGHT)  # warm-up
+    for scalar in (True, False):
+        start = time.time()
+        for _ in range(NB_RUNS):
+            out = _core.pixels_convert(data, layout, WIDTH, stride, HEIGHT,
+                                       True, scalar)
+        elapsed = (time.time() - start) / NB_RUNS
+        results[scalar] = (out, elapsed)
+    assert results[True][0] == results[False][0]
+    print("%-6s scalar: %7.1f MB/s    %s: %7.1f MB/s    x%.1f" % (
+        name, len(data) / results[True][1] / 1024 / 1024,
+        _core.pixels_get_simd(), len(data) / results[False][1] / 1024 / 1024,
+        results[True][1] / results[False][1]
+    ))
+
+
+def run_pil():
+    img = PIL.Image.frombytes("RGB", (WIDTH, HEIGHT),
+                              os.urandom(WIDTH * HEIGHT * 3))
+    out = io.BytesIO()
+    img.save(out, "BMP")
+    bmp = out.getvalue()
+
+    start = time.time()
+    for _ in range(NB_RUNS):
+        PIL.Image.open(io.BytesIO(bmp)).load()
+    print("BMP page, decoded by PIL: %.1f ms" % (
+        (time.time() - start) / NB_RUNS * 1000
+    ))
+
+    # feeding happens while the scan goes on, getting the lines happens each
+    # time the application wants the image
+    for packed in (False, True):
+        feed = get = 0
+        for _ in range(NB_RUNS):
+            start = time.time()
+            dib = _core.dib_new(packed)
+            _core.dib_feed(dib, bmp)
+            feed += time.time() - start
+            start = time.time()
+            (mode, rawmode, size, data, palette) = _core.dib_get_lines(
+                dib, 0, HEIGHT
+            )
+            PIL.Image.frombytes(mode, size, data, "raw", rawmode)
+            get += time.time() - start
+        print("BMP page, %-8s feed: %5.1f ms    get image: %5.1f ms" % (
+            "packed" if packed else "unpacked",
+            feed / NB_RUNS * 1000, get / NB_RUNS * 1000
+        ))
+
+
+def main():
+    print("%dx%d, %d runs" % (WIDTH, HEIGHT, NB_RUNS))
+    run("BGR", _core.PIXELS_BGR, 3)
+    run("BGRX", _core.PIXELS_BGRX, 4)
+    run_pil()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,59 @@
+#!/usr/bin/env python3
+"""
+Building the RGB page of a three-pass scanner (one frame per color): three
+PIL images merged by PIL, as applications had to do it, and the
+interleaving of pyinsane2/native/pixels.cpp (PlanarFrame) with each
+instruction set this CPU supports.
+"""
+
+import os
+import time
+
+from PIL import Image
+
+from pyinsane2.native import _core
+
+
+WIDTH = 10200  # Letter, 1200dpi
+HEIGHT = 13200 // 4  # 1/4th of it
+NB_RUNS = 5
+
+
+def measure(func):
+    start = time.time()
+    for _ in range(NB_RUNS):
+        func()
+    return (time.time() - start) / NB_RUNS
+
+
+def main():
+    planes = [os.urandom(WIDTH * HEIGHT) for _ in range(3)]
+    print("%dx%d, 3 frames of 8 bits per sample" % (WIDTH, HEIGHT))
+
+    def pil():
+        imgs = [Image.frombuffer("L", (WIDTH, HEIGHT), plane, "raw", "L", 0, 1)
+                for plane in planes]
+        return Image.merge("RGB", imgs).tobytes()
+
+    expected = pil()
+    print("%-8s %8.1f ms" % ("PIL", measure(pil) * 1000))
+
+    default = _core.pixels_get_simd()
+    for simd in ("none", "sse2", "ssse3", "avx2", "neon"):
+        if _core.pixels_set_simd(simd) != simd:
+            continue
+
+        def native():
+            return _core.pixels_interleave(planes[0], planes[1], planes[2],
+                                           WIDTH, WIDTH, HEIGHT)
+
+        assert native() == expected
+        elapsed = measure(native)
+        print("%-8s %8.1f ms %8.1f Mpixels/s" % (
+            simd, elapsed * 1000, WIDTH * HEIGHT / elapsed / 1e6
+        ))
+    _core.pixels_set_simd(default)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,66 @@
+#!/usr/bin/env python3
+"""
+Throughput of the native transfer pipeline, without any scanner: a synthetic
+producer thread plays the role of the driver.
+
+Compares the zero-copy buffers of the pool with what the WIA backend used
+to do (one bytes object per chunk, copied again into the page).
+"""
+
+import time
+
+from pyinsane2.native import _core
+
+
+PAGE_SIZE = 600 * 8 * 3 * 600 * 11  # A4, 600dpi, RGB
+NB_PAGES = 4
+CHUNK_SIZE = 64 * 1024
+
+
+def consume(ring, copy, keep=True):
+    pages = []
+    data = bytearray()
+    while True:
+        try:
+            buf = _core.ring_read(ring)
+            if copy:
+                buf = bytes(buf)
+            if keep:
+                data += buf
+        except EOFError:
+            pages.append(data)
+            data = bytearray()
+        except StopIteration:
+            return pages
+
+
+def run(name, copy, slab_size, keep=True):
+    ring = _core.ring_new(64 * 1024 * 1024, slab_size)
+    start = time.time()
+    producer = _core.ring_produce(ring, PAGE_SIZE, NB_PAGES, CHUNK_SIZE)
+    pages = consume(ring, copy, keep)
+    _core.producer_join(producer)
+    elapsed = time.time() - start
+    assert(len(pages) == NB_PAGES)
+
+    stats = _core.ring_get_stats(ring)
+    print("%-24s %8.1f MB/s    slabs allocated: %4d    recycled: %6d" % (
+        name, PAGE_SIZE * NB_PAGES / elapsed / 1024 / 1024,
+        stats['slabs_allocated'], stats['slabs_recycled']
+    ))
+
+
+def main():
+    print("%d pages of %d bytes, written in chunks of up to %d bytes" % (
+        NB_PAGES, PAGE_SIZE, CHUNK_SIZE
+    ))
+    for slab_size in [64 * 1024, 512 * 1024, 4 * 1024 * 1024]:
+        run("zero-copy (slab %dK)" % (slab_size / 1024), False, slab_size)
+    run("bytes copy (slab 512K)", True, 512 * 1024)
+    # pipeline alone: what is left once the application doesn't copy
+    run("zero-copy, discard", False, 512 * 1024, keep=False)
+    run("bytes copy, discard", True, 512 * 1024, keep=False)
+
+
+if __name__ == "__main__":
+    main()
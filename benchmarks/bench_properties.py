@@ -0,0 +1,52 @@
+#!/usr/bin/env python3
+"""
+Cost of the WIA property lookups (name -> property, PROPID -> property,
+value -> name), without any scanner nor Windows: uses the stand-in values of
+pyinsane2/wia/compat.
+
+Compares the hash indexes of the property registry with the linear searches
+the WIA backend used to do.
+"""
+
+import time
+
+from pyinsane2.wia import _testing
+
+
+NB_ROUNDS = 2000
+
+
+def run(func, args):
+    start = time.time()
+    for i in range(NB_ROUNDS):
+        for arg in args:
+            func(*arg)
+    return (time.time() - start) * 1000000000 / (NB_ROUNDS * len(args))
+
+
+def main():
+    properties = [
+        _testing.property_info(idx)
+        for idx in range(_testing.property_count())
+    ]
+    names = [(name,) for (name, propid) in properties]
+    ids = [(propid,) for (name, propid) in properties]
+    idx = _testing.property_find("page_size")
+    values = [(idx, value) for value in range(0, 60)]
+
+    print("%d properties" % len(properties))
+    for (name, func, args) in [
+                ("name, linear", _testing.property_find_linear, names),
+                ("name, registry", _testing.property_find, names),
+                ("PROPID, linear", _testing.property_find_by_id_linear, ids),
+                ("PROPID, registry", _testing.property_find_by_id, ids),
+                ("page_size value, linear", _testing.property_decode_linear,
+                 values),
+                ("page_size value, registry", _testing.property_decode,
+                 values),
+            ]:
+        print("%-26s %8.1f ns/lookup" % (name, run(func, args)))
+
+
+if __name__ == "__main__":
+    main()
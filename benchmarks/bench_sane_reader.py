@@ -0,0 +1,92 @@
+#!/usr/bin/env python3
+"""
+Reading a SANE frame with rawapi.sane_read() from the application thread, and
+with the native reader (rawapi.sane_start_reader()), against a fake device
+with a fixed data rate and an application that spends some time on each
+chunk it gets.
+
+'device idle' is the time the device had data ready but nobody asked for
+it: on sheet-fed scanners, that's when the carriage stops and backtracks.
+"""
+
+import ctypes
+import time
+
+from pyinsane2.sane import rawapi
+
+
+FRAME_SIZE = 2550 * 3 * 3300 // 4  # A4, 300dpi, RGB ; 1/4th of it
+DEVICE_RATE = 20 * 1024 * 1024  # bytes/s
+DEVICE_CHUNK = 32 * 1024  # what the backend returns at once
+
+CONSUMER_DELAYS = [0.0, 0.001, 0.005]  # seconds per read()
+
+
+class FakeDevice(object):
+    def __init__(self):
+        self.data = bytes(bytearray(i % 251 for i in range(DEVICE_CHUNK)))
+        self.remaining = FRAME_SIZE
+        self.idle = 0.0
+        self.last_return = None
+
+    def sane_read(self, handle, buf, max_length, length_ptr):
+        now = time.time()
+        if self.last_return is not None:
+            self.idle += now - self.last_return
+        length_ptr.contents.value = 0
+        if self.remaining <= 0:
+            return rawapi.SaneStatus.EOF
+        nb = min(max_length, DEVICE_CHUNK, self.remaining)
+        # the time the scanner takes to produce it (releases the GIL)
+        time.sleep(float(nb) / DEVICE_RATE)
+        ctypes.memmove(buf, self.data, nb)
+        length_ptr.contents.value = nb
+        self.remaining -= nb
+        self.last_return = time.time()
+        return rawapi.SaneStatus.GOOD
+
+    def sane_cancel(self, handle):
+        pass
+
+
+def run(native, delay):
+    device = FakeDevice()
+    rawapi.SANE_LIB = device
+    handle = ctypes.c_void_p(1)
+    nb_bytes = 0
+    start = time.time()
+    reader = rawapi.sane_start_reader(handle) if native else None
+    while True:
+        try:
+            if reader is not None:
+                nb_bytes += len(reader.read())
+            else:
+                nb_bytes += len(rawapi.sane_read(handle, 512 * 1024))
+        except EOFError:
+            break
+        time.sleep(delay)  # the application doing its job
+    elapsed = time.time() - start
+    rawapi.sane_cancel(handle)
+    assert nb_bytes == FRAME_SIZE
+    print("%-8s %8.1f ms/read %8.2f s %8.1f MB/s %10.2f s" % (
+        "native" if native else "python", delay * 1000, elapsed,
+        nb_bytes / elapsed / 1024 / 1024, device.idle
+    ))
+
+
+def main():
+    rawapi.sane_available = True
+    print("%d bytes at %.0f MB/s, in chunks of %d bytes" % (
+        FRAME_SIZE, DEVICE_RATE / 1024 / 1024, DEVICE_CHUNK
+    ))
+    print("%-8s %15s %10s %13s %12s" % (
+        "reader", "application", "total", "throughput", "device idle"
+    ))
+    for delay in CONSUMER_DELAYS:
+        run(False, delay)
+        if rawapi._rawapi is not None:
+            run(True, delay)
+
+
+if __name__ == "__main__":
+    main()
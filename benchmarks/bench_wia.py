@@ -0,0 +1,110 @@
+#!/usr/bin/env python3
+"""
+Throughput of the WIA backend (rawapi.cpp, rawapi.py and the transfer
+pipeline) without any scanner nor Windows: runs it on top of the mock driver
+(pyinsane2/wia/mock.cpp).
+
+Downloads are measured for various chunk sizes (what the driver writes at
+once) and driver rates, and property reads for get_properties() and
+get_options().
+"""
+
+import sys
+import time
+
+from pyinsane2.wia import _mockapi
+sys.modules['pyinsane2.wia._rawapi'] = _mockapi
+from pyinsane2.wia import rawapi  # noqa: E402
+
+
+NB_PAGES = 10
+NB_PROPERTY_ROUNDS = 200
+
+# A4, 150dpi, RGB: ~6MB per page
+WIDTH = 1240
+HEIGHT = 1754
+
+CHUNKS = [
+    ("512B", (512,)),
+    ("4KB", (4096,)),
+    ("64KB", (64 * 1024,)),
+    ("1MB", (1024 * 1024,)),
+    ("mixed", (100, 64 * 1024, 3, 8192)),
+]
+
+RATES = [
+    ("unlimited", 0),
+    ("50MB/s", 50 * 1024 * 1024),
+    ("10MB/s", 10 * 1024 * 1024),
+]
+
+
+def download(src):
+    reader = rawapi.start_scan(src)
+    nb_bytes = 0
+    while True:
+        try:
+            nb_bytes += len(reader.read())
+        except EOFError:
+            pass
+        except StopIteration:
+            return nb_bytes
+
+
+def bench_download(src, chunks, rate):
+    _mockapi.mock_configure(width=WIDTH, height=HEIGHT, depth=24,
+                            nb_pages=NB_PAGES, chunks=chunks, rate=rate)
+    before = _mockapi.mock_get_stats()
+    start = time.time()
+    nb_bytes = download(src)
+    elapsed = time.time() - start
+    after = _mockapi.mock_get_stats()
+    assert nb_bytes == after['bytes'] - before['bytes']
+    nb_chunks = after['chunks'] - before['chunks']
+    # time spent per chunk beyond what the data rate alone requires
+    ideal = (nb_bytes / float(rate)) if rate > 0 else 0.0
+    return (
+        nb_bytes / elapsed / 1024 / 1024,
+        NB_PAGES * 60 / elapsed,
+        (elapsed - ideal) * 1000000 / nb_chunks,
+    )
+
+
+def bench_properties(func, src):
+    start = time.time()
+    for i in range(NB_PROPERTY_ROUNDS):
+        func(src)
+    return NB_PROPERTY_ROUNDS / (time.time() - start)
+
+
+def main():
+    dev = rawapi.open("mock:0")
+    srcs = dict(rawapi.get_sources(dev))
+    feeder = srcs['0000\\Root\\Feeder']
+
+    print("%d pages of %dx%d RGB per download" % (NB_PAGES, WIDTH, HEIGHT))
+    print("%-10s %-10s %10s %10s %14s" % (
+        "chunks", "rate", "MB/s", "pages/min", "us/chunk"
+    ))
+    for (rate_name, rate) in RATES:
+        for (chunks_name, chunks) in CHUNKS:
+            if rate > 0 and chunks_name == "512B":
+                continue  # too slow to be meaningful
+            (mbps, ppm, overhead) = bench_download(feeder, chunks, rate)
+            print("%-10s %-10s %10.1f %10.1f %14.2f" % (
+                chunks_name, rate_name, mbps, ppm, overhead
+            ))
+
+    print("")
+    for (name, func) in [
+                ("get_properties", rawapi.get_properties),
+                ("get_options", rawapi.get_options),
+            ]:
+        print("%-16s %8.1f calls/s" % (name, bench_properties(func, feeder)))
+
+    dev = srcs = feeder = None
+    rawapi.exit()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+"""
+Latency of the calls to the WIA backend, without any scanner.
+
+Compares the native workers (one per device) with what the WIA backend used
+to do: a single Python thread for all the devices, fed through a
+queue.Queue, each caller waiting on a semaphore.
+"""
+
+import functools
+import queue
+import threading
+import time
+
+from pyinsane2.native import _core
+
+
+NB_CALLS = 20000
+NB_DEVICES = 4
+
+
+class PythonAction(object):
+    def __init__(self, func):
+        self.func = func
+        self.result = None
+        self.sem = threading.Semaphore(0)
+
+    def wait(self, action_queue):
+        action_queue.put(self)
+        self.sem.acquire()
+        return self.result
+
+    def do(self):
+        self.result = self.func()
+        self.sem.release()
+
+
+def python_worker(action_queue):
+    while True:
+        try:
+            action = action_queue.get(block=True, timeout=1)
+            if action is None:
+                return
+            action.do()
+        except queue.Empty:
+            pass
+
+
+def run_python():
+    action_queue = queue.Queue()
+    thread = threading.Thread(target=python_worker, args=(action_queue,))
+    thread.start()
+    start = time.time()
+    for i in range(NB_CALLS):
+        PythonAction(int).wait(action_queue)
+    elapsed = time.time() - start
+    action_queue.put(None)
+    thread.join()
+    return elapsed
+
+
+def run_native():
+    worker = _core.worker_new()
+    start = time.time()
+    for i in range(NB_CALLS):
+        _core.worker_call(worker, int)
+    elapsed = time.time() - start
+    _core.worker_stop(worker)
+    return elapsed
+
+
+def run_devices(workers, slow):
+    # one long action (a download) on the first device, property reads on
+    # the others
+    start = time.time()
+    _core.worker_post(workers[0], functools.partial(time.sleep, slow))
+    for worker in workers[1:]:
+        _core.worker_call(worker, int)
+    return time.time() - start
+
+
+def main():
+    print("%d calls, one caller" % NB_CALLS)
+    for (name, func) in [
+                ("python queue + semaphore", run_python),
+                ("native worker", run_native),
+            ]:
+        elapsed = func()
+        print("%-26s %8.1f us/call" % (name, elapsed * 1000000 / NB_CALLS))
+
+    print("")
+    print("%d devices, 0.5s download on the first one" % NB_DEVICES)
+    workers = [_core.worker_new() for i in range(NB_DEVICES)]
+    print("%-26s %8.3f s before the others answer" % (
+        "one worker per device", run_devices(workers, 0.5)
+    ))
+    for worker in workers:
+        _core.worker_stop(worker)
+    worker = _core.worker_new()
+    print("%-26s %8.3f s before the others answer" % (
+        "single worker", run_devices([worker] * NB_DEVICES, 0.5)
+    ))
+    _core.worker_stop(worker)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,92 @@
+/*
+ * Python view on a region of a pool slab. Supports the buffer protocol, so
+ * it can be given to memoryview(), bytearray.extend(), PIL, etc without any
+ * copy. The slab goes back to its pool when the object is freed.
+ */
+#include <Python.h>
+
+#include "core.h"
+#include "pool.h"
+
+struct pyinsane_buffer {
+    PyObject_HEAD
+    struct pool_slab *slab;
+    char *data;
+    Py_ssize_t len;
+};
+
+
+static void buffer_dealloc(PyObject *self)
+{
+    struct pyinsane_buffer *buffer = (struct pyinsane_buffer *)self;
+
+    if (buffer->slab != NULL)
+        slab_unref(buffer->slab);
+    Py_TYPE(self)->tp_free(self);
+}
+
+
+static int buffer_getbuffer(PyObject *self, Py_buffer *view, int flags)
+{
+    struct pyinsane_buffer *buffer = (struct pyinsane_buffer *)self;
+
+    return PyBuffer_FillInfo(view, self, buffer->data, buffer->len,
+            1 /* read-only */, flags);
+}
+
+
+static Py_ssize_t buffer_length(PyObject *self)
+{
+    return ((struct pyinsane_buffer *)self)->len;
+}
+
+
+static PyBufferProcs buffer_as_buffer = {
+#if PY_VERSION_HEX < 0x03000000
+    NULL, NULL, NULL, NULL,
+#endif
+    buffer_getbuffer,
+    NULL,
+};
+
+
+static PySequenceMethods buffer_as_sequence = {
+    buffer_length,
+};
+
+
+PyTypeObject PyinsaneBuffer_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "pyinsane2.native._core.Buffer",
+    sizeof(struct pyinsane_buffer),
+};
+
+
+int buffer_init_type(void)
+{
+    PyinsaneBuffer_Type.tp_dealloc = buffer_dealloc;
+    PyinsaneBuffer_Type.tp_as_sequence = &buffer_as_sequence;
+    PyinsaneBuffer_Type.tp_as_buffer = &buffer_as_buffer;
+#if PY_VERSION_HEX < 0x03000000
+    PyinsaneBuffer_Type.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER;
+#else
+    PyinsaneBuffer_Type.tp_flags = Py_TPFLAGS_DEFAULT;
+#endif
+    PyinsaneBuffer_Type.tp_doc = "Read-only view on data received from a scanner";
+    return PyType_Ready(&PyinsaneBuffer_Type);
+}
+
+
+PyObject *buffer_new(struct pool_slab *slab, size_t offset, size_t nb_bytes)
+{
+    struct pyinsane_buffer *buffer;
+
+    buffer = PyObject_New(struct pyinsane_buffer, &PyinsaneBuffer_Type);
+    if (buffer == NULL)
+        return NULL;
+    slab_ref(slab);
+    buffer->slab = slab;
+    buffer->data = slab->data + offset;
+    buffer->len = (Py_ssize_t)nb_bytes;
+    return (PyObject *)buffer;
+}
@@ -0,0 +1,37 @@
+#include "cancel.h"
+
+
+PyinsaneCancelToken::PyinsaneCancelToken()
+    : mCancelled(false), mRefCount(1)
+{
+}
+
+
+PyinsaneCancelToken::~PyinsaneCancelToken()
+{
+}
+
+
+void PyinsaneCancelToken::Cancel()
+{
+    mCancelled.store(true);
+}
+
+
+bool PyinsaneCancelToken::IsCancelled() const
+{
+    return mCancelled.load();
+}
+
+
+void PyinsaneCancelToken::AddRef()
+{
+    mRefCount++;
+}
+
+
+void PyinsaneCancelToken::Release()
+{
+    if (--mRefCount == 0)
+        delete this;
+}
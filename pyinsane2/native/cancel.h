@@ -0,0 +1,29 @@
+#ifndef __PYINSANE_NATIVE_CANCEL_H
+#define __PYINSANE_NATIVE_CANCEL_H
+
+#include <atomic>
+
+/*!
+ * Flag shared between the thread that wants to stop a scan and the threads
+ * of the driver. Refcounted: the driver may still hold it after the scan is
+ * gone.
+ */
+class PyinsaneCancelToken
+{
+public:
+    PyinsaneCancelToken();
+
+    void Cancel();
+    bool IsCancelled() const;
+
+    void AddRef();
+    void Release();
+
+private:
+    ~PyinsaneCancelToken();
+
+    std::atomic<bool> mCancelled;
+    std::atomic<int> mRefCount;
+};
+
+#endif
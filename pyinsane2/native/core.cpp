@@ -0,0 +1,1587 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <Python.h>
+
+#include "core.h"
+#include "decode.h"
+#include "dib.h"
+#include "mapped.h"
+#include "pixels.h"
+#include "record.h"
+#include "ring.h"
+#include "snapshot.h"
+#include "telemetry.h"
+#include "worker.h"
+
+// Default size of the slabs filled by the driver thread.
+#define RING_SLAB_SIZE (512 * 1024)
+
+
+static void free_ring(PyObject *capsule)
+{
+    PyinsaneRing *ring;
+
+    ring = (PyinsaneRing *)PyCapsule_GetPointer(capsule, NATIVE_PYCAPSULE_RING_NAME);
+    delete ring;
+}
+
+
+PyinsaneRing *capsule2ring(PyObject *capsule)
+{
+    return (PyinsaneRing *)PyCapsule_GetPointer(capsule, NATIVE_PYCAPSULE_RING_NAME);
+}
+
+
+static PyObject *ring_new(PyObject *, PyObject *args)
+{
+    Py_ssize_t max_bytes;
+    Py_ssize_t slab_size = RING_SLAB_SIZE;
+    PyinsaneRing *ring;
+
+    if (!PyArg_ParseTuple(args, "n|n", &max_bytes, &slab_size)) {
+        return NULL;
+    }
+    if (max_bytes <= 0 || slab_size <= 0) {
+        PyErr_SetString(PyExc_ValueError, "ring_new(): sizes must be > 0");
+        return NULL;
+    }
+
+    ring = new PyinsaneRing((size_t)max_bytes, (size_t)slab_size);
+    return PyCapsule_New(ring, NATIVE_PYCAPSULE_RING_NAME, free_ring);
+}
+
+
+static PyObject *ring_read(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyObject *out;
+    PyinsaneRing *ring;
+    struct ring_record record;
+    struct pool_slab *slab;
+    size_t offset, end;
+    bool has_record;
+
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        return NULL;
+    }
+    if ((ring = capsule2ring(capsule)) == NULL) {
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS;
+    has_record = ring->Front(&record, true);
+    Py_END_ALLOW_THREADS;
+
+    if (!has_record) {
+        ring->Discard();
+        PyErr_SetString(PyExc_IOError, "Scan aborted");
+        return NULL;
+    }
+
+    switch (record.type) {
+        case RING_END_OF_PAGE:
+            ring->Pop();
+            PyErr_SetNone(PyExc_EOFError);
+            return NULL;
+        case RING_END_OF_SCAN:
+            // not popped: any following call must raise StopIteration too
+            PyErr_SetNone(PyExc_StopIteration);
+            return NULL;
+        case RING_DATA:
+            break;
+    }
+
+    // Zero-copy: hand over the region of the slab itself. Consecutive writes
+    // of the driver in the same slab are merged into a single buffer.
+    slab = record.slab;
+    offset = record.offset;
+    end = record.offset + record.nb_bytes;
+    slab_ref(slab);
+    ring->Pop();
+
+    while (ring->Front(&record, false) && record.type == RING_DATA
+            && record.slab == slab && record.offset == end) {
+        end += record.nb_bytes;
+        ring->Pop();
+    }
+
+    out = buffer_new(slab, offset, end - offset);
+    slab_unref(slab);
+    return out;
+}
+
+
+static PyObject *ring_abort(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyinsaneRing *ring;
+
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        return NULL;
+    }
+    if ((ring = capsule2ring(capsule)) == NULL) {
+        return NULL;
+    }
+
+    ring->Abort();
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *ring_set_coalescing(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyinsaneRing *ring;
+    Py_ssize_t min_bytes, row_size;
+    unsigned int max_delay_ms;
+
+    if (!PyArg_ParseTuple(args, "OnnI", &capsule, &min_bytes, &row_size, &max_delay_ms)) {
+        return NULL;
+    }
+    if ((ring = capsule2ring(capsule)) == NULL) {
+        return NULL;
+    }
+    if (min_bytes < 0 || row_size < 0) {
+        PyErr_SetString(PyExc_ValueError, "ring_set_coalescing(): sizes must be >= 0");
+        return NULL;
+    }
+
+    ring->SetCoalescing((size_t)min_bytes, (size_t)row_size, max_delay_ms);
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *ring_get_stats(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyinsaneRing *ring;
+    PyinsaneBufferPool *pool;
+
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        return NULL;
+    }
+    if ((ring = capsule2ring(capsule)) == NULL) {
+        return NULL;
+    }
+
+    pool = ring->GetPool();
+    return Py_BuildValue(
+        "{s:n,s:n,s:k,s:k,s:k,s:k}",
+        "buffered", (Py_ssize_t)ring->GetBuffered(),
+        "slab_size", (Py_ssize_t)pool->GetSlabSize(),
+        "slabs_allocated", pool->GetNbAllocated(),
+        "slabs_recycled", pool->GetNbRecycled(),
+        "records", ring->GetNbRecords(),
+        "consumer_wakeups", ring->GetNbWakeUps()
+    );
+}
+
+
+static void free_dib(PyObject *capsule)
+{
+    PyinsaneDibDecoder *dib;
+
+    dib = (PyinsaneDibDecoder *)PyCapsule_GetPointer(capsule, NATIVE_PYCAPSULE_DIB_NAME);
+    delete dib;
+}
+
+
+static PyinsaneDibDecoder *capsule2dib(PyObject *capsule)
+{
+    return (PyinsaneDibDecoder *)PyCapsule_GetPointer(capsule, NATIVE_PYCAPSULE_DIB_NAME);
+}
+
+
+static PyObject *dib_new(PyObject *, PyObject *args)
+{
+    int packed = 0;
+
+    if (!PyArg_ParseTuple(args, "|i", &packed)) {
+        return NULL;
+    }
+    return PyCapsule_New(new PyinsaneDibDecoder(packed != 0), NATIVE_PYCAPSULE_DIB_NAME,
+            free_dib);
+}
+
+
+static PyObject *dib_feed(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyinsaneDibDecoder *dib;
+    Py_buffer data;
+    bool ok;
+
+    if (!PyArg_ParseTuple(args, "Os*", &capsule, &data)) {
+        return NULL;
+    }
+    if ((dib = capsule2dib(capsule)) == NULL) {
+        PyBuffer_Release(&data);
+        return NULL;
+    }
+
+    ok = dib->Feed(data.buf, data.len);
+    PyBuffer_Release(&data);
+    if (!ok) {
+        return PyErr_NoMemory();
+    }
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *dib_get_size(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyinsaneDibDecoder *dib;
+
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        return NULL;
+    }
+    if ((dib = capsule2dib(capsule)) == NULL) {
+        return NULL;
+    }
+    return PyLong_FromSize_t(dib->GetSize());
+}
+
+
+static PyObject *dib_get_infos(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyinsaneDibDecoder *dib;
+    const struct dib_infos *infos;
+
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        return NULL;
+    }
+    if ((dib = capsule2dib(capsule)) == NULL) {
+        return NULL;
+    }
+    if ((infos = dib->GetInfos()) == NULL) {
+        Py_RETURN_NONE;
+    }
+    return Py_BuildValue(
+        "{s:i,s:i,s:i,s:O,s:n}",
+        "width", infos->width,
+        "height", infos->height,
+        "bits_per_pixel", infos->bits_per_pixel,
+        "supported", (dib->GetPixelFormat() != DIB_UNSUPPORTED ? Py_True : Py_False),
+        "expected_size", (Py_ssize_t)(infos->pixel_offset + infos->stride * infos->height)
+    );
+}
+
+
+static PyObject *dib_get_available_lines(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyinsaneDibDecoder *dib;
+    int first, last;
+
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        return NULL;
+    }
+    if ((dib = capsule2dib(capsule)) == NULL) {
+        return NULL;
+    }
+    dib->GetAvailableLines(&first, &last);
+    return Py_BuildValue("(ii)", first, last);
+}
+
+
+/*!
+ * Returns (mode, rawmode, (width, nb_lines), data, palette) for the lines
+ * [start, end[, ready to be given to PIL.Image.frombytes().
+ * palette is None except for mode 'P' (and then it is RGB RGB RGB ...).
+ */
+static PyObject *dib_get_lines(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyObject *data;
+    PyObject *palette = NULL;
+    PyObject *out;
+    PyinsaneDibDecoder *dib;
+    const struct dib_infos *infos;
+    const char *mode, *rawmode;
+    char rgb[256 * 3];
+    int start, end;
+    unsigned int i;
+
+    if (!PyArg_ParseTuple(args, "Oii", &capsule, &start, &end)) {
+        return NULL;
+    }
+    if ((dib = capsule2dib(capsule)) == NULL) {
+        return NULL;
+    }
+    infos = dib->GetInfos();
+    if (infos == NULL || dib->GetPixelFormat() == DIB_UNSUPPORTED) {
+        PyErr_SetString(PyExc_ValueError, "dib_get_lines(): unsupported or incomplete bitmap");
+        return NULL;
+    }
+    if (start < 0 || end > infos->height || start > end) {
+        PyErr_SetString(PyExc_ValueError, "dib_get_lines(): invalid line range");
+        return NULL;
+    }
+
+    switch (dib->GetPixelFormat()) {
+        case DIB_RGB:
+            mode = rawmode = "RGB";
+            break;
+        case DIB_GRAY:
+            mode = rawmode = "L";
+            break;
+        case DIB_BW:
+            mode = "1";
+            rawmode = (infos->palette[0][0] == 0 ? "1" : "1;I");
+            break;
+        case DIB_PALETTE:
+        default:
+            mode = rawmode = "P";
+            for (i = 0 ; i < infos->nb_colors ; i++) {
+                rgb[3 * i] = infos->palette[i][2];
+                rgb[(3 * i) + 1] = infos->palette[i][1];
+                rgb[(3 * i) + 2] = infos->palette[i][0];
+            }
+            palette = PyBytes_FromStringAndSize(rgb, 3 * infos->nb_colors);
+            if (palette == NULL)
+                return NULL;
+            break;
+    }
+
+    data = PyBytes_FromStringAndSize(NULL, dib->GetOutputLineSize() * (end - start));
+    if (data == NULL) {
+        Py_XDECREF(palette);
+        return NULL;
+    }
+    dib->GetLines(start, end, (uint8_t *)PyBytes_AS_STRING(data));
+
+    if (palette == NULL) {
+        Py_INCREF(Py_None);
+        palette = Py_None;
+    }
+    out = Py_BuildValue("(ss(ii)NN)", mode, rawmode, infos->width, end - start, data, palette);
+    return out;
+}
+
+
+static PyObject *dib_get_raw(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyinsaneDibDecoder *dib;
+
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        return NULL;
+    }
+    if ((dib = capsule2dib(capsule)) == NULL) {
+        return NULL;
+    }
+    return PyBytes_FromStringAndSize(dib->GetData(), dib->GetRawSize());
+}
+
+
+// True if 'nb_lines' lines 'stride' bytes apart, of 'line_size' bytes each,
+// fit in 'len' bytes. Nothing can overflow.
+static bool lines_fit(size_t len, size_t stride, int nb_lines, size_t line_size)
+{
+    if (nb_lines <= 0)
+        return true;
+    if (line_size > len)
+        return false;
+    return (nb_lines == 1 || stride <= (len - line_size) / (size_t)(nb_lines - 1));
+}
+
+
+/*!
+ * pixels_convert(data, layout, nb, stride, nb_lines, bottom_up=False,
+ * scalar=False, lut=None): runs a row kernel of pixels.h on 'nb_lines' lines
+ * of 'stride' bytes. Returns the packed lines, top-down. 'lut': see
+ * pixels_lut16() (PIXELS_16_TO_8 only).
+ */
+static PyObject *pixels_convert(PyObject *, PyObject *args)
+{
+    Py_buffer data;
+    Py_buffer lut;
+    PyObject *lut_obj = Py_None;
+    PyObject *out;
+    int layout, nb_lines, bottom_up = 0, scalar = 0;
+    Py_ssize_t nb, stride;
+    size_t in_size, out_size;
+    uint8_t *dst;
+    const uint8_t *table = NULL;
+
+    if (!PyArg_ParseTuple(args, "s*innn|iiO", &data, &layout, &nb, &stride, &nb_lines,
+                &bottom_up, &scalar, &lut_obj)) {
+        return NULL;
+    }
+    if (layout < PIXELS_COPY || layout > PIXELS_16_TO_8) {
+        PyBuffer_Release(&data);
+        PyErr_SetString(PyExc_ValueError, "pixels_convert(): invalid layout");
+        return NULL;
+    }
+    // at most 4 bytes per pixel: the sizes below can't overflow
+    if (nb < 0 || nb > PY_SSIZE_T_MAX / 4 || stride < 0 || nb_lines < 0) {
+        PyBuffer_Release(&data);
+        PyErr_SetString(PyExc_ValueError, "pixels_convert(): invalid arguments");
+        return NULL;
+    }
+    in_size = pixels_get_input_size((enum pixels_layout)layout, nb);
+    out_size = pixels_get_output_size((enum pixels_layout)layout, nb);
+    if ((size_t)stride < in_size || !lines_fit(data.len, stride, nb_lines, in_size)) {
+        PyBuffer_Release(&data);
+        PyErr_SetString(PyExc_ValueError, "pixels_convert(): not enough data");
+        return NULL;
+    }
+    if (lut_obj != Py_None) {
+        if (PyObject_GetBuffer(lut_obj, &lut, PyBUF_SIMPLE) < 0) {
+            PyBuffer_Release(&data);
+            return NULL;
+        }
+        if (layout != PIXELS_16_TO_8 || lut.len != PIXELS_LUT16_SIZE) {
+            PyBuffer_Release(&lut);
+            PyBuffer_Release(&data);
+            PyErr_SetString(PyExc_ValueError, "pixels_convert(): invalid lut");
+            return NULL;
+        }
+        table = (const uint8_t *)lut.buf;
+    }
+
+    out = PyBytes_FromStringAndSize(NULL, out_size * nb_lines);
+    if (out != NULL) {
+        dst = (uint8_t *)PyBytes_AS_STRING(out);
+        Py_BEGIN_ALLOW_THREADS;
+        if (bottom_up && nb_lines > 0) {
+            pixels_convert_lines((enum pixels_layout)layout, (const uint8_t *)data.buf, stride,
+                    dst + out_size * (nb_lines - 1), -(ptrdiff_t)out_size, nb, nb_lines,
+                    scalar != 0, table);
+        } else {
+            pixels_convert_lines((enum pixels_layout)layout, (const uint8_t *)data.buf, stride,
+                    dst, out_size, nb, nb_lines, scalar != 0, table);
+        }
+        Py_END_ALLOW_THREADS;
+    }
+    if (table != NULL)
+        PyBuffer_Release(&lut);
+    PyBuffer_Release(&data);
+    return out;
+}
+
+
+/*!
+ * pixels_interleave(red, green, blue, nb, stride, nb_lines, sample_size=1,
+ * scalar=False): interleaves 'nb_lines' lines of 'stride' bytes of each
+ * plane. Returns the packed RGB lines.
+ */
+static PyObject *pixels_interleave(PyObject *, PyObject *args)
+{
+    Py_buffer planes[3];
+    PyObject *out;
+    int nb_lines, sample_size = 1, scalar = 0, i, y;
+    Py_ssize_t nb, stride;
+    size_t in_size, out_size;
+    uint8_t *dst;
+
+    if (!PyArg_ParseTuple(args, "s*s*s*nni|ii", &planes[0], &planes[1], &planes[2],
+                &nb, &stride, &nb_lines, &sample_size, &scalar)) {
+        return NULL;
+    }
+    out = NULL;
+    // output: 3 * 2 bytes per sample at most
+    if ((sample_size != 1 && sample_size != 2) || nb < 0 || nb > PY_SSIZE_T_MAX / 6
+            || stride < 0 || nb_lines < 0 || (size_t)stride < (size_t)nb * sample_size) {
+        PyErr_SetString(PyExc_ValueError, "pixels_interleave(): invalid arguments");
+        goto end;
+    }
+    in_size = (size_t)nb * sample_size;
+    for (i = 0 ; i < 3 ; i++) {
+        if (!lines_fit(planes[i].len, stride, nb_lines, in_size)) {
+            PyErr_SetString(PyExc_ValueError, "pixels_interleave(): not enough data");
+            goto end;
+        }
+    }
+
+    out_size = 3 * in_size;
+    out = PyBytes_FromStringAndSize(NULL, out_size * nb_lines);
+    if (out == NULL) {
+        goto end;
+    }
+    dst = (uint8_t *)PyBytes_AS_STRING(out);
+    Py_BEGIN_ALLOW_THREADS;
+    for (y = 0 ; y < nb_lines ; y++) {
+        pixels_interleave_line(
+            (const uint8_t *)planes[0].buf + (size_t)stride * y,
+            (const uint8_t *)planes[1].buf + (size_t)stride * y,
+            (const uint8_t *)planes[2].buf + (size_t)stride * y,
+            dst + out_size * y, nb, sample_size, scalar != 0
+        );
+    }
+    Py_END_ALLOW_THREADS;
+
+end:
+    for (i = 0 ; i < 3 ; i++)
+        PyBuffer_Release(&planes[i]);
+    return out;
+}
+
+
+/*!
+ * pixels_lut16(black, white, gamma): table for pixels_convert() with
+ * PIXELS_16_TO_8 (see pixels_make_lut16()).
+ */
+static PyObject *pixels_lut16(PyObject *, PyObject *args)
+{
+    unsigned int black, white;
+    double gamma;
+    PyObject *out;
+
+    if (!PyArg_ParseTuple(args, "IId", &black, &white, &gamma)) {
+        return NULL;
+    }
+    if (black >= white || white >= PIXELS_LUT16_ENTRIES || !(gamma > 0.0)) {
+        PyErr_SetString(PyExc_ValueError, "pixels_lut16(): invalid levels");
+        return NULL;
+    }
+    out = PyBytes_FromStringAndSize(NULL, PIXELS_LUT16_SIZE);
+    if (out == NULL) {
+        return NULL;
+    }
+    pixels_make_lut16((uint8_t *)PyBytes_AS_STRING(out), black, white, gamma);
+    return out;
+}
+
+
+static PyObject *pixels_get_simd(PyObject *, PyObject *args)
+{
+    if (!PyArg_ParseTuple(args, "")) {
+        return NULL;
+    }
+    return Py_BuildValue("s", ::pixels_get_simd());
+}
+
+
+/*!
+ * pixels_set_simd(name): restricts the kernels to the given instruction set
+ * and the ones below ("none", "sse2", "ssse3", "avx2", "neon"). Returns the
+ * one actually used (see pixels_get_simd()).
+ */
+static PyObject *pixels_set_simd(PyObject *, PyObject *args)
+{
+    static const char *names[] = { "none", "sse2", "ssse3", "avx2", "neon" };
+    const char *name;
+    unsigned int i;
+
+    if (!PyArg_ParseTuple(args, "s", &name)) {
+        return NULL;
+    }
+    for (i = 0 ; i < sizeof(names) / sizeof(names[0]) ; i++) {
+        if (strcmp(names[i], name) == 0) {
+            ::pixels_set_simd((enum pixels_simd)i);
+            return Py_BuildValue("s", ::pixels_get_simd());
+        }
+    }
+    PyErr_SetString(PyExc_ValueError, "pixels_set_simd(): unknown instruction set");
+    return NULL;
+}
+
+
+static void free_mapped(PyObject *capsule)
+{
+    PyinsaneMappedStore *store;
+
+    store = (PyinsaneMappedStore *)PyCapsule_GetPointer(capsule, NATIVE_PYCAPSULE_MAPPED_NAME);
+    delete store;
+}
+
+
+static PyinsaneMappedStore *capsule2mapped(PyObject *capsule)
+{
+    return (PyinsaneMappedStore *)PyCapsule_GetPointer(capsule, NATIVE_PYCAPSULE_MAPPED_NAME);
+}
+
+
+static PyObject *mapped_new(PyObject *, PyObject *args)
+{
+    const char *directory = NULL;
+    PyinsaneMappedStore *store;
+
+    if (!PyArg_ParseTuple(args, "|z", &directory)) {
+        return NULL;
+    }
+    store = new PyinsaneMappedStore(directory);
+    if (!store->IsValid()) {
+        delete store;
+        PyErr_SetString(PyExc_IOError, "mapped_new(): failed to create the backing file");
+        return NULL;
+    }
+    return PyCapsule_New(store, NATIVE_PYCAPSULE_MAPPED_NAME, free_mapped);
+}
+
+
+static PyObject *mapped_write(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyinsaneMappedStore *store;
+    Py_buffer data;
+    bool ok;
+
+    if (!PyArg_ParseTuple(args, "Os*", &capsule, &data)) {
+        return NULL;
+    }
+    if ((store = capsule2mapped(capsule)) == NULL) {
+        PyBuffer_Release(&data);
+        return NULL;
+    }
+    ok = store->Write(data.buf, data.len);
+    PyBuffer_Release(&data);
+    if (!ok) {
+        PyErr_SetString(PyExc_IOError, "mapped_write(): failed to grow the mapping");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *mapped_read(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyObject *out;
+    PyinsaneMappedStore *store;
+    Py_ssize_t nb_bytes;
+    size_t nb_read;
+
+    if (!PyArg_ParseTuple(args, "On", &capsule, &nb_bytes)) {
+        return NULL;
+    }
+    if ((store = capsule2mapped(capsule)) == NULL) {
+        return NULL;
+    }
+    if (nb_bytes < 0) {
+        PyErr_SetString(PyExc_ValueError, "mapped_read(): invalid size");
+        return NULL;
+    }
+
+    out = PyBytes_FromStringAndSize(NULL, nb_bytes);
+    if (out == NULL)
+        return NULL;
+    nb_read = store->Read(PyBytes_AS_STRING(out), nb_bytes);
+    if (nb_read != (size_t)nb_bytes)
+        _PyBytes_Resize(&out, nb_read);
+    return out;
+}
+
+
+static PyObject *mapped_seek(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyinsaneMappedStore *store;
+    long long offset;
+    int origin;
+    uint64_t position;
+
+    if (!PyArg_ParseTuple(args, "OLi", &capsule, &offset, &origin)) {
+        return NULL;
+    }
+    if ((store = capsule2mapped(capsule)) == NULL) {
+        return NULL;
+    }
+    if (!store->Seek(offset, (enum mapped_origin)origin, &position)) {
+        PyErr_SetString(PyExc_ValueError, "mapped_seek(): invalid position");
+        return NULL;
+    }
+    return PyLong_FromUnsignedLongLong(position);
+}
+
+
+static PyObject *mapped_set_size(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyinsaneMappedStore *store;
+    unsigned long long size;
+
+    if (!PyArg_ParseTuple(args, "OK", &capsule, &size)) {
+        return NULL;
+    }
+    if ((store = capsule2mapped(capsule)) == NULL) {
+        return NULL;
+    }
+    if (!store->SetSize(size)) {
+        PyErr_SetString(PyExc_IOError, "mapped_set_size(): failed to grow the mapping");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *mapped_get_stats(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyinsaneMappedStore *store;
+
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        return NULL;
+    }
+    if ((store = capsule2mapped(capsule)) == NULL) {
+        return NULL;
+    }
+    return Py_BuildValue(
+        "{s:K,s:K,s:K}",
+        "size", (unsigned long long)store->GetSize(),
+        "position", (unsigned long long)store->GetPosition(),
+        "capacity", (unsigned long long)store->GetCapacity()
+    );
+}
+
+
+static void free_decode_pool(PyObject *capsule)
+{
+    PyinsaneDecodePool *pool;
+
+    pool = (PyinsaneDecodePool *)PyCapsule_GetPointer(capsule, NATIVE_PYCAPSULE_DECODE_POOL_NAME);
+    delete pool;
+}
+
+
+static PyinsaneDecodePool *capsule2decode_pool(PyObject *capsule)
+{
+    return (PyinsaneDecodePool *)PyCapsule_GetPointer(capsule, NATIVE_PYCAPSULE_DECODE_POOL_NAME);
+}
+
+
+static PyObject *decode_pool_new(PyObject *, PyObject *args)
+{
+    PyObject *decoder;
+    int nb_workers;
+
+    if (!PyArg_ParseTuple(args, "Oi", &decoder, &nb_workers)) {
+        return NULL;
+    }
+    if (!PyCallable_Check(decoder) || nb_workers <= 0) {
+        PyErr_SetString(PyExc_ValueError,
+            "decode_pool_new(): expected a callable and a number of workers > 0");
+        return NULL;
+    }
+    return PyCapsule_New(
+        new PyinsaneDecodePool(decoder, nb_workers),
+        NATIVE_PYCAPSULE_DECODE_POOL_NAME, free_decode_pool
+    );
+}
+
+
+static PyObject *decode_pool_submit(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyObject *data;
+    PyinsaneDecodePool *pool;
+
+    if (!PyArg_ParseTuple(args, "OO", &capsule, &data)) {
+        return NULL;
+    }
+    if ((pool = capsule2decode_pool(capsule)) == NULL) {
+        return NULL;
+    }
+    pool->Submit(data);
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *decode_pool_get(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyObject *out;
+    PyinsaneDecodePool *pool;
+    struct decode_job *job;
+
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        return NULL;
+    }
+    if ((pool = capsule2decode_pool(capsule)) == NULL) {
+        return NULL;
+    }
+
+    job = pool->Next();
+    if (job == NULL) {
+        PyErr_SetString(PyExc_IndexError, "decode_pool_get(): no page submitted");
+        return NULL;
+    }
+
+    if (job->result == NULL) {
+        // re-raise the exception of the decoder in the caller thread
+        PyErr_Restore(job->exc_type, job->exc_value, job->exc_traceback);
+        job->exc_type = job->exc_value = job->exc_traceback = NULL;
+        PyinsaneDecodePool::FreeJob(job);
+        return NULL;
+    }
+    out = job->result;
+    Py_INCREF(out);
+    PyinsaneDecodePool::FreeJob(job);
+    return out;
+}
+
+
+static PyObject *decode_pool_get_stats(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyinsaneDecodePool *pool;
+
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        return NULL;
+    }
+    if ((pool = capsule2decode_pool(capsule)) == NULL) {
+        return NULL;
+    }
+    return Py_BuildValue(
+        "{s:I,s:n}",
+        "workers", pool->GetNbWorkers(),
+        "pending", (Py_ssize_t)pool->GetNbJobs()
+    );
+}
+
+
+static void free_telemetry(PyObject *capsule)
+{
+    PyinsaneTransferTelemetry *telemetry;
+
+    telemetry = (PyinsaneTransferTelemetry *)PyCapsule_GetPointer(
+        capsule, NATIVE_PYCAPSULE_TELEMETRY_NAME
+    );
+    delete telemetry;
+}
+
+
+static PyObject *telemetry_new(PyObject *, PyObject *args)
+{
+    if (!PyArg_ParseTuple(args, "")) {
+        return NULL;
+    }
+    return PyCapsule_New(new PyinsaneTransferTelemetry(), NATIVE_PYCAPSULE_TELEMETRY_NAME,
+            free_telemetry);
+}
+
+
+static PyObject *telemetry_page2dict(const struct telemetry_page *page)
+{
+    return Py_BuildValue(
+        "{s:K,s:k,s:d,s:d,s:d,s:d}",
+        "bytes", (unsigned long long)page->bytes,
+        "chunks", page->chunks,
+        "duration", page->duration,
+        "time_to_first_byte", page->firstByte,
+        "throughput", (page->duration > 0 ? page->bytes / page->duration : 0.0),
+        "blocked", page->blocked
+    );
+}
+
+
+static PyObject *telemetry_get_stats(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyinsaneTransferTelemetry *telemetry;
+    struct telemetry_stats stats;
+    std::vector<struct telemetry_page> pages;
+    PyObject *histogram, *pylist, *obj, *key, *result;
+    size_t i;
+
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        return NULL;
+    }
+    telemetry = (PyinsaneTransferTelemetry *)PyCapsule_GetPointer(
+        capsule, NATIVE_PYCAPSULE_TELEMETRY_NAME
+    );
+    if (telemetry == NULL) {
+        return NULL;
+    }
+
+    telemetry->GetStats(&stats);
+    pages = telemetry->GetPages();
+
+    // chunk size (lower bound of the bucket) --> number of chunks
+    histogram = PyDict_New();
+    for (i = 0 ; i < TELEMETRY_NB_BUCKETS ; i++) {
+        if (stats.histogram[i] == 0)
+            continue;
+        key = PyLong_FromUnsignedLongLong(i == 0 ? 0 : (1ULL << i));
+        obj = PyLong_FromUnsignedLong(stats.histogram[i]);
+        PyDict_SetItem(histogram, key, obj);
+        Py_DECREF(key);
+        Py_DECREF(obj);
+    }
+
+    pylist = PyList_New(pages.size());
+    for (i = 0 ; i < pages.size() ; i++) {
+        PyList_SET_ITEM(pylist, i, telemetry_page2dict(&pages[i]));
+    }
+
+    result = Py_BuildValue(
+        "{s:i,s:K,s:K,s:k,s:k,s:l,s:d,s:d,s:d,s:d,s:N,s:N}",
+        "percent", stats.percent,
+        "driver_bytes", (unsigned long long)stats.driverBytes,
+        "bytes", (unsigned long long)stats.bytes,
+        "chunks", stats.chunks,
+        "callbacks", stats.callbacks,
+        "last_error", stats.lastError,
+        "elapsed", stats.elapsed,
+        "time_to_first_byte", stats.firstByte,
+        "throughput", stats.throughput,
+        "blocked", stats.blocked,
+        "chunk_sizes", histogram,
+        "pages", pylist
+    );
+    return result;
+}
+
+
+static void free_recorder(PyObject *capsule)
+{
+    PyinsaneTransferRecorder *recorder;
+
+    recorder = (PyinsaneTransferRecorder *)PyCapsule_GetPointer(
+        capsule, NATIVE_PYCAPSULE_RECORDER_NAME
+    );
+    delete recorder;
+}
+
+
+static PyinsaneTransferRecorder *capsule2recorder(PyObject *capsule)
+{
+    return (PyinsaneTransferRecorder *)PyCapsule_GetPointer(
+        capsule, NATIVE_PYCAPSULE_RECORDER_NAME
+    );
+}
+
+
+static PyObject *recorder_new(PyObject *, PyObject *args)
+{
+    const char *path;
+    int backend;
+    int with_data = 1;
+    PyinsaneTransferRecorder *recorder;
+
+    if (!PyArg_ParseTuple(args, "si|i", &path, &backend, &with_data)) {
+        return NULL;
+    }
+    if (backend != RECORD_BACKEND_SANE && backend != RECORD_BACKEND_WIA) {
+        PyErr_SetString(PyExc_ValueError, "recorder_new(): invalid backend");
+        return NULL;
+    }
+    recorder = new PyinsaneTransferRecorder(path, (enum record_backend)backend,
+            with_data != 0);
+    if (!recorder->IsValid()) {
+        delete recorder;
+        PyErr_SetString(PyExc_IOError, "recorder_new(): failed to create the file");
+        return NULL;
+    }
+    return PyCapsule_New(recorder, NATIVE_PYCAPSULE_RECORDER_NAME, free_recorder);
+}
+
+
+static PyObject *recorder_parameters(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyinsaneTransferRecorder *recorder;
+    struct record_parameters parameters;
+
+    if (!PyArg_ParseTuple(args, "Oiiiiii", &capsule, &parameters.format,
+                &parameters.lastFrame, &parameters.bytesPerLine,
+                &parameters.pixelsPerLine, &parameters.lines, &parameters.depth)) {
+        return NULL;
+    }
+    if ((recorder = capsule2recorder(capsule)) == NULL) {
+        return NULL;
+    }
+    recorder->OnParameters(&parameters);
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *recorder_chunk(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyinsaneTransferRecorder *recorder;
+    Py_buffer data;
+
+    if (!PyArg_ParseTuple(args, "Os*", &capsule, &data)) {
+        return NULL;
+    }
+    if ((recorder = capsule2recorder(capsule)) == NULL) {
+        PyBuffer_Release(&data);
+        return NULL;
+    }
+    recorder->OnChunk(data.buf, data.len);
+    PyBuffer_Release(&data);
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *recorder_status(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyinsaneTransferRecorder *recorder;
+    int percent;
+    unsigned long long bytes;
+
+    if (!PyArg_ParseTuple(args, "OiK", &capsule, &percent, &bytes)) {
+        return NULL;
+    }
+    if ((recorder = capsule2recorder(capsule)) == NULL) {
+        return NULL;
+    }
+    recorder->OnStatus(percent, bytes);
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *recorder_end_of_page(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyinsaneTransferRecorder *recorder;
+
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        return NULL;
+    }
+    if ((recorder = capsule2recorder(capsule)) == NULL) {
+        return NULL;
+    }
+    recorder->OnEndOfPage();
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *recorder_end_of_scan(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyinsaneTransferRecorder *recorder;
+    long status = 0;
+
+    if (!PyArg_ParseTuple(args, "O|l", &capsule, &status)) {
+        return NULL;
+    }
+    if ((recorder = capsule2recorder(capsule)) == NULL) {
+        return NULL;
+    }
+    recorder->OnEndOfScan(status);
+    Py_RETURN_NONE;
+}
+
+
+// Returns False if some events couldn't be written (disk full, etc)
+static PyObject *recorder_close(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyinsaneTransferRecorder *recorder;
+
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        return NULL;
+    }
+    if ((recorder = capsule2recorder(capsule)) == NULL) {
+        return NULL;
+    }
+    recorder->Close();
+    return PyBool_FromLong(recorder->IsValid());
+}
+
+
+static void free_replay(PyObject *capsule)
+{
+    PyinsaneTransferReplay *replay;
+
+    replay = (PyinsaneTransferReplay *)PyCapsule_GetPointer(
+        capsule, NATIVE_PYCAPSULE_REPLAY_NAME
+    );
+    delete replay;
+}
+
+
+static PyinsaneTransferReplay *capsule2replay(PyObject *capsule)
+{
+    return (PyinsaneTransferReplay *)PyCapsule_GetPointer(
+        capsule, NATIVE_PYCAPSULE_REPLAY_NAME
+    );
+}
+
+
+static PyObject *replay_open(PyObject *, PyObject *args)
+{
+    const char *path;
+    PyinsaneTransferReplay *replay;
+    bool ok;
+
+    if (!PyArg_ParseTuple(args, "s", &path)) {
+        return NULL;
+    }
+    replay = new PyinsaneTransferReplay();
+    Py_BEGIN_ALLOW_THREADS;
+    ok = replay->Load(path);
+    Py_END_ALLOW_THREADS;
+    if (!ok) {
+        delete replay;
+        PyErr_SetString(PyExc_IOError, "replay_open(): not a valid recording");
+        return NULL;
+    }
+    return PyCapsule_New(replay, NATIVE_PYCAPSULE_REPLAY_NAME, free_replay);
+}
+
+
+static PyObject *parameters2tuple(const struct record_parameters *parameters)
+{
+    return Py_BuildValue(
+        "(iiiiii)",
+        parameters->format, parameters->lastFrame, parameters->bytesPerLine,
+        parameters->pixelsPerLine, parameters->lines, parameters->depth
+    );
+}
+
+
+static PyObject *replay_get_infos(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyinsaneTransferReplay *replay;
+    unsigned long nb_pages = 0, nb_chunks = 0;
+    unsigned long long nb_bytes = 0;
+    double duration = 0.0;
+    PyObject *parameters = NULL;
+    size_t i;
+
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        return NULL;
+    }
+    if ((replay = capsule2replay(capsule)) == NULL) {
+        return NULL;
+    }
+
+    const std::vector<struct record_event> &events = replay->GetEvents();
+    for (i = 0 ; i < events.size() ; i++) {
+        switch (events[i].type) {
+            case RECORD_PARAMETERS:
+                if (parameters == NULL)
+                    parameters = parameters2tuple(&events[i].parameters);
+                break;
+            case RECORD_CHUNK:
+                nb_chunks++;
+                nb_bytes += events[i].size;
+                break;
+            case RECORD_END_OF_PAGE:
+                nb_pages++;
+                break;
+            default:
+                break;
+        }
+        duration = events[i].time;
+    }
+    if (parameters == NULL) {
+        Py_INCREF(Py_None);
+        parameters = Py_None;
+    }
+
+    return Py_BuildValue(
+        "{s:s,s:O,s:n,s:k,s:k,s:K,s:d,s:N}",
+        "backend", (replay->GetBackend() == RECORD_BACKEND_WIA ? "wia" : "sane"),
+        "with_data", (replay->HasData() ? Py_True : Py_False),
+        "events", (Py_ssize_t)events.size(),
+        "pages", nb_pages,
+        "chunks", nb_chunks,
+        "bytes", nb_bytes,
+        "duration", duration,
+        "parameters", parameters
+    );
+}
+
+
+static PyObject *replay_rewind(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyinsaneTransferReplay *replay;
+
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        return NULL;
+    }
+    if ((replay = capsule2replay(capsule)) == NULL) {
+        return NULL;
+    }
+    replay->Rewind();
+    Py_RETURN_NONE;
+}
+
+
+// Waits until the next event is due (speed <= 0: doesn't wait) and returns
+// it: ("parameters", (format, last_frame, bytes_per_line, pixels_per_line,
+// lines, depth)), ("chunk", bytes), ("status", (percent, bytes)),
+// ("end_of_page", None) or ("end_of_scan", status). None at the end.
+static PyObject *replay_next(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyinsaneTransferReplay *replay;
+    struct record_event event;
+    double speed = 0.0;
+    PyObject *data;
+    bool ok;
+
+    if (!PyArg_ParseTuple(args, "O|d", &capsule, &speed)) {
+        return NULL;
+    }
+    if ((replay = capsule2replay(capsule)) == NULL) {
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS;
+    ok = replay->Next(speed, &event);
+    Py_END_ALLOW_THREADS;
+    if (!ok) {
+        Py_RETURN_NONE;
+    }
+
+    switch (event.type) {
+        case RECORD_PARAMETERS:
+            return Py_BuildValue("(sN)", "parameters", parameters2tuple(&event.parameters));
+        case RECORD_CHUNK:
+            data = PyBytes_FromStringAndSize(NULL, event.size);
+            if (data == NULL)
+                return NULL;
+            replay->GetChunk(&event, PyBytes_AS_STRING(data));
+            return Py_BuildValue("(sN)", "chunk", data);
+        case RECORD_STATUS:
+            return Py_BuildValue("(s(iL))", "status", (int)event.values[0],
+                    (long long)event.values[1]);
+        case RECORD_END_OF_PAGE:
+            return Py_BuildValue("(sO)", "end_of_page", Py_None);
+        case RECORD_END_OF_SCAN:
+            return Py_BuildValue("(sl)", "end_of_scan", (long)event.values[0]);
+    }
+    Py_RETURN_NONE;
+}
+
+
+static void free_worker(PyObject *capsule)
+{
+    PyinsaneWorker *worker;
+
+    worker = (PyinsaneWorker *)PyCapsule_GetPointer(capsule, NATIVE_PYCAPSULE_WORKER_NAME);
+    if (worker->IsCurrentThread()) {
+        // dropped by one of its own actions: it can't join itself. Leaked.
+        worker->Stop();
+        return;
+    }
+    delete worker;
+}
+
+
+static PyinsaneWorker *capsule2worker(PyObject *capsule)
+{
+    return (PyinsaneWorker *)PyCapsule_GetPointer(capsule, NATIVE_PYCAPSULE_WORKER_NAME);
+}
+
+
+static PyObject *worker_new(PyObject *, PyObject *args)
+{
+    PyObject *init = Py_None;
+    PyObject *exit = Py_None;
+
+    if (!PyArg_ParseTuple(args, "|OO", &init, &exit)) {
+        return NULL;
+    }
+    if ((init != Py_None && !PyCallable_Check(init))
+            || (exit != Py_None && !PyCallable_Check(exit))) {
+        PyErr_SetString(PyExc_ValueError, "worker_new(): hooks must be callable");
+        return NULL;
+    }
+
+    return PyCapsule_New(
+        new PyinsaneWorker(init != Py_None ? init : NULL, exit != Py_None ? exit : NULL),
+        NATIVE_PYCAPSULE_WORKER_NAME, free_worker
+    );
+}
+
+
+static PyObject *worker_call(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyObject *func;
+    PyinsaneWorker *worker;
+
+    if (!PyArg_ParseTuple(args, "OO", &capsule, &func)) {
+        return NULL;
+    }
+    if ((worker = capsule2worker(capsule)) == NULL) {
+        return NULL;
+    }
+    if (!PyCallable_Check(func)) {
+        PyErr_SetString(PyExc_ValueError, "worker_call(): not a callable");
+        return NULL;
+    }
+    return worker->Call(func);
+}
+
+
+static PyObject *worker_post(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyObject *func;
+    PyinsaneWorker *worker;
+
+    if (!PyArg_ParseTuple(args, "OO", &capsule, &func)) {
+        return NULL;
+    }
+    if ((worker = capsule2worker(capsule)) == NULL) {
+        return NULL;
+    }
+    if (!PyCallable_Check(func)) {
+        PyErr_SetString(PyExc_ValueError, "worker_post(): not a callable");
+        return NULL;
+    }
+    if (!worker->Post(func)) {
+        PyErr_SetString(PyExc_RuntimeError, "Worker stopped");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *worker_stop(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyinsaneWorker *worker;
+
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        return NULL;
+    }
+    if ((worker = capsule2worker(capsule)) == NULL) {
+        return NULL;
+    }
+    worker->Stop();
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *worker_get_stats(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyinsaneWorker *worker;
+
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        return NULL;
+    }
+    if ((worker = capsule2worker(capsule)) == NULL) {
+        return NULL;
+    }
+    return Py_BuildValue(
+        "{s:k,s:k,s:O}",
+        "actions", worker->GetNbActions(),
+        "wakeups", worker->GetNbWakeUps(),
+        "stopped", worker->IsStopped() ? Py_True : Py_False
+    );
+}
+
+
+static void free_snapshot(PyObject *capsule)
+{
+    PyinsanePropertySnapshot *snapshot;
+
+    snapshot = (PyinsanePropertySnapshot *)PyCapsule_GetPointer(
+        capsule, NATIVE_PYCAPSULE_SNAPSHOT_NAME
+    );
+    delete snapshot;
+}
+
+
+static PyinsanePropertySnapshot *capsule2snapshot(PyObject *capsule, Py_ssize_t idx)
+{
+    PyinsanePropertySnapshot *snapshot;
+
+    snapshot = (PyinsanePropertySnapshot *)PyCapsule_GetPointer(
+        capsule, NATIVE_PYCAPSULE_SNAPSHOT_NAME
+    );
+    if (snapshot == NULL)
+        return NULL;
+    if (idx < 0 || (size_t)idx >= snapshot->GetNbProperties()) {
+        PyErr_SetString(PyExc_IndexError, "Invalid property index");
+        return NULL;
+    }
+    return snapshot;
+}
+
+
+static PyObject *snapshot_new(PyObject *, PyObject *args)
+{
+    Py_ssize_t nb_properties;
+
+    if (!PyArg_ParseTuple(args, "n", &nb_properties)) {
+        return NULL;
+    }
+    if (nb_properties < 0) {
+        PyErr_SetString(PyExc_ValueError, "snapshot_new(): invalid number of properties");
+        return NULL;
+    }
+    return PyCapsule_New(new PyinsanePropertySnapshot(nb_properties),
+            NATIVE_PYCAPSULE_SNAPSHOT_NAME, free_snapshot);
+}
+
+
+// 'value' == None: property not available
+static PyObject *snapshot_update(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    Py_ssize_t idx;
+    PyObject *value;
+    int constraint = 0;
+    PyinsanePropertySnapshot *snapshot;
+    bool changed;
+
+    if (!PyArg_ParseTuple(args, "OnO|i", &capsule, &idx, &value, &constraint)) {
+        return NULL;
+    }
+    if ((snapshot = capsule2snapshot(capsule, idx)) == NULL) {
+        return NULL;
+    }
+
+    if (value == Py_None)
+        value = NULL;
+    Py_XINCREF(value);
+    if (constraint)
+        changed = snapshot->UpdateConstraint(idx, value);
+    else
+        changed = snapshot->UpdateValue(idx, value);
+    return PyBool_FromLong(changed);
+}
+
+
+static PyObject *snapshot_mark_written(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    Py_ssize_t idx;
+    PyinsanePropertySnapshot *snapshot;
+
+    if (!PyArg_ParseTuple(args, "On", &capsule, &idx)) {
+        return NULL;
+    }
+    if ((snapshot = capsule2snapshot(capsule, idx)) == NULL) {
+        return NULL;
+    }
+    snapshot->MarkWritten(idx);
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *snapshot_is_written(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    Py_ssize_t idx;
+    PyinsanePropertySnapshot *snapshot;
+
+    if (!PyArg_ParseTuple(args, "On", &capsule, &idx)) {
+        return NULL;
+    }
+    if ((snapshot = capsule2snapshot(capsule, idx)) == NULL) {
+        return NULL;
+    }
+    return PyBool_FromLong(snapshot->IsWritten(idx));
+}
+
+
+static PyMethodDef core_methods[] = {
+    {"ring_new", ring_new, METH_VARARGS, NULL},
+    {"ring_read", ring_read, METH_VARARGS, NULL},
+    {"ring_abort", ring_abort, METH_VARARGS, NULL},
+    {"ring_set_coalescing", ring_set_coalescing, METH_VARARGS, NULL},
+    {"ring_get_stats", ring_get_stats, METH_VARARGS, NULL},
+    {"ring_produce", ring_produce, METH_VARARGS, NULL},
+    {"producer_join", producer_join, METH_VARARGS, NULL},
+    {"dib_new", dib_new, METH_VARARGS, NULL},
+    {"dib_feed", dib_feed, METH_VARARGS, NULL},
+    {"dib_get_size", dib_get_size, METH_VARARGS, NULL},
+    {"dib_get_infos", dib_get_infos, METH_VARARGS, NULL},
+    {"dib_get_available_lines", dib_get_available_lines, METH_VARARGS, NULL},
+    {"dib_get_lines", dib_get_lines, METH_VARARGS, NULL},
+    {"dib_get_raw", dib_get_raw, METH_VARARGS, NULL},
+    {"pixels_convert", pixels_convert, METH_VARARGS, NULL},
+    {"pixels_get_simd", pixels_get_simd, METH_VARARGS, NULL},
+    {"pixels_set_simd", pixels_set_simd, METH_VARARGS, NULL},
+    {"pixels_lut16", pixels_lut16, METH_VARARGS, NULL},
+    {"pixels_interleave", pixels_interleave, METH_VARARGS, NULL},
+    {"mapped_new", mapped_new, METH_VARARGS, NULL},
+    {"mapped_write", mapped_write, METH_VARARGS, NULL},
+    {"mapped_read", mapped_read, METH_VARARGS, NULL},
+    {"mapped_seek", mapped_seek, METH_VARARGS, NULL},
+    {"mapped_set_size", mapped_set_size, METH_VARARGS, NULL},
+    {"mapped_get_stats", mapped_get_stats, METH_VARARGS, NULL},
+    {"decode_pool_new", decode_pool_new, METH_VARARGS, NULL},
+    {"decode_pool_submit", decode_pool_submit, METH_VARARGS, NULL},
+    {"decode_pool_get", decode_pool_get, METH_VARARGS, NULL},
+    {"decode_pool_get_stats", decode_pool_get_stats, METH_VARARGS, NULL},
+    {"telemetry_new", telemetry_new, METH_VARARGS, NULL},
+    {"telemetry_get_stats", telemetry_get_stats, METH_VARARGS, NULL},
+    {"recorder_new", recorder_new, METH_VARARGS, NULL},
+    {"recorder_parameters", recorder_parameters, METH_VARARGS, NULL},
+    {"recorder_chunk", recorder_chunk, METH_VARARGS, NULL},
+    {"recorder_status", recorder_status, METH_VARARGS, NULL},
+    {"recorder_end_of_page", recorder_end_of_page, METH_VARARGS, NULL},
+    {"recorder_end_of_scan", recorder_end_of_scan, METH_VARARGS, NULL},
+    {"recorder_close", recorder_close, METH_VARARGS, NULL},
+    {"replay_open", replay_open, METH_VARARGS, NULL},
+    {"replay_get_infos", replay_get_infos, METH_VARARGS, NULL},
+    {"replay_rewind", replay_rewind, METH_VARARGS, NULL},
+    {"replay_next", replay_next, METH_VARARGS, NULL},
+    {"worker_new", worker_new, METH_VARARGS, NULL},
+    {"worker_call", worker_call, METH_VARARGS, NULL},
+    {"worker_post", worker_post, METH_VARARGS, NULL},
+    {"worker_stop", worker_stop, METH_VARARGS, NULL},
+    {"worker_get_stats", worker_get_stats, METH_VARARGS, NULL},
+    {"snapshot_new", snapshot_new, METH_VARARGS, NULL},
+    {"snapshot_update", snapshot_update, METH_VARARGS, NULL},
+    {"snapshot_mark_written", snapshot_mark_written, METH_VARARGS, NULL},
+    {"snapshot_is_written", snapshot_is_written, METH_VARARGS, NULL},
+    {NULL, NULL, 0, NULL},
+};
+
+#if PY_VERSION_HEX < 0x03000000
+
+PyMODINIT_FUNC
+init_core(void)
+{
+    PyObject *module;
+
+    if (buffer_init_type() < 0)
+        return;
+    module = Py_InitModule("_core", core_methods);
+    Py_INCREF(&PyinsaneBuffer_Type);
+    PyModule_AddObject(module, "Buffer", (PyObject *)&PyinsaneBuffer_Type);
+    PyModule_AddIntConstant(module, "RECORD_SANE", RECORD_BACKEND_SANE);
+    PyModule_AddIntConstant(module, "RECORD_WIA", RECORD_BACKEND_WIA);
+    PyModule_AddIntConstant(module, "PIXELS_COPY", PIXELS_COPY);
+    PyModule_AddIntConstant(module, "PIXELS_BGR", PIXELS_BGR);
+    PyModule_AddIntConstant(module, "PIXELS_BGRX", PIXELS_BGRX);
+    PyModule_AddIntConstant(module, "PIXELS_BITS", PIXELS_BITS);
+    PyModule_AddIntConstant(module, "PIXELS_16_TO_LE", PIXELS_16_TO_LE);
+    PyModule_AddIntConstant(module, "PIXELS_16_TO_8", PIXELS_16_TO_8);
+}
+
+#else
+
+static struct PyModuleDef core_module = {
+    PyModuleDef_HEAD_INIT,
+    "_core",
+    NULL /* doc */,
+    -1,
+    core_methods,
+};
+
+PyMODINIT_FUNC PyInit__core(void)
+{
+    PyObject *module;
+
+    if (buffer_init_type() < 0)
+        return NULL;
+    module = PyModule_Create(&core_module);
+    if (module == NULL)
+        return NULL;
+    Py_INCREF(&PyinsaneBuffer_Type);
+    PyModule_AddObject(module, "Buffer", (PyObject *)&PyinsaneBuffer_Type);
+    PyModule_AddIntConstant(module, "RECORD_SANE", RECORD_BACKEND_SANE);
+    PyModule_AddIntConstant(module, "RECORD_WIA", RECORD_BACKEND_WIA);
+    PyModule_AddIntConstant(module, "PIXELS_COPY", PIXELS_COPY);
+    PyModule_AddIntConstant(module, "PIXELS_BGR", PIXELS_BGR);
+    PyModule_AddIntConstant(module, "PIXELS_BGRX", PIXELS_BGRX);
+    PyModule_AddIntConstant(module, "PIXELS_BITS", PIXELS_BITS);
+    PyModule_AddIntConstant(module, "PIXELS_16_TO_LE", PIXELS_16_TO_LE);
+    PyModule_AddIntConstant(module, "PIXELS_16_TO_8", PIXELS_16_TO_8);
+    return module;
+}
+
+#endif
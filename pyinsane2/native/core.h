@@ -0,0 +1,20 @@
+#ifndef __PYINSANE_NATIVE_CORE_H
+#define __PYINSANE_NATIVE_CORE_H
+
+#include <Python.h>
+
+#include "pool.h"
+#include "ring.h"
+
+PyinsaneRing *capsule2ring(PyObject *capsule);
+
+// buffer.cpp
+extern PyTypeObject PyinsaneBuffer_Type;
+int buffer_init_type(void);
+PyObject *buffer_new(struct pool_slab *slab, size_t offset, size_t nb_bytes);
+
+// testing.cpp
+PyObject *ring_produce(PyObject *, PyObject *args);
+PyObject *producer_join(PyObject *, PyObject *args);
+
+#endif
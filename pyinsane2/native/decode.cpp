@@ -0,0 +1,140 @@
+#include <assert.h>
+
+#include "decode.h"
+
+
+PyinsaneDecodePool::PyinsaneDecodePool(PyObject *decoder, unsigned int nbWorkers)
+    : mDecoder(decoder), mStopping(false)
+{
+    unsigned int i;
+
+#if PY_VERSION_HEX < 0x03070000
+    PyEval_InitThreads();
+#endif
+    Py_INCREF(mDecoder);
+    for (i = 0 ; i < nbWorkers ; i++) {
+        mWorkers.push_back(std::thread(&PyinsaneDecodePool::Work, this));
+    }
+}
+
+
+PyinsaneDecodePool::~PyinsaneDecodePool()
+{
+    std::vector<std::thread>::iterator it;
+    std::deque<struct decode_job *>::iterator job;
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopping = true;
+        mQueue.clear(); // still referenced by mJobs
+        mWorkCond.notify_all();
+    }
+
+    // a worker may be waiting for the GIL to finish its job
+    Py_BEGIN_ALLOW_THREADS;
+    for (it = mWorkers.begin() ; it != mWorkers.end() ; it++) {
+        it->join();
+    }
+    Py_END_ALLOW_THREADS;
+
+    for (job = mJobs.begin() ; job != mJobs.end() ; job++) {
+        FreeJob(*job);
+    }
+    Py_DECREF(mDecoder);
+}
+
+
+void PyinsaneDecodePool::Work()
+{
+    struct decode_job *job;
+    PyGILState_STATE gil;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            while (!mStopping && mQueue.empty()) {
+                mWorkCond.wait(lock);
+            }
+            if (mStopping)
+                return;
+            job = mQueue.front();
+            mQueue.pop_front();
+        }
+
+        gil = PyGILState_Ensure();
+        job->result = PyObject_CallFunctionObjArgs(mDecoder, job->data, NULL);
+        if (job->result == NULL) {
+            PyErr_Fetch(&job->exc_type, &job->exc_value, &job->exc_traceback);
+        }
+        PyGILState_Release(gil);
+
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            job->done = true;
+            mDoneCond.notify_all();
+        }
+    }
+}
+
+
+void PyinsaneDecodePool::Submit(PyObject *data)
+{
+    struct decode_job *job;
+
+    job = new decode_job();
+    job->data = data;
+    Py_INCREF(data);
+    job->result = NULL;
+    job->exc_type = job->exc_value = job->exc_traceback = NULL;
+    job->done = false;
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    mJobs.push_back(job);
+    mQueue.push_back(job);
+    mWorkCond.notify_one();
+}
+
+
+struct decode_job *PyinsaneDecodePool::Next()
+{
+    struct decode_job *job = NULL;
+
+    Py_BEGIN_ALLOW_THREADS;
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        while (!mJobs.empty() && !mJobs.front()->done) {
+            mDoneCond.wait(lock);
+        }
+        if (!mJobs.empty()) {
+            job = mJobs.front();
+            mJobs.pop_front();
+        }
+    }
+    Py_END_ALLOW_THREADS;
+
+    return job;
+}
+
+
+void PyinsaneDecodePool::FreeJob(struct decode_job *job)
+{
+    Py_DECREF(job->data);
+    Py_XDECREF(job->result);
+    Py_XDECREF(job->exc_type);
+    Py_XDECREF(job->exc_value);
+    Py_XDECREF(job->exc_traceback);
+    delete job;
+}
+
+
+unsigned int PyinsaneDecodePool::GetNbWorkers() const
+{
+    return (unsigned int)mWorkers.size();
+}
+
+
+size_t PyinsaneDecodePool::GetNbJobs()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mJobs.size();
+}
@@ -0,0 +1,64 @@
+#ifndef __PYINSANE_NATIVE_DECODE_H
+#define __PYINSANE_NATIVE_DECODE_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <Python.h>
+
+#define NATIVE_PYCAPSULE_DECODE_POOL_NAME "Pyinsane decode pool"
+
+struct decode_job {
+    PyObject *data;
+    PyObject *result; // NULL if the decoder raised an exception
+    PyObject *exc_type;
+    PyObject *exc_value;
+    PyObject *exc_traceback;
+    bool done;
+};
+
+/*!
+ * Pool of native threads decoding the pages of compressed transfers, so
+ * neither the thread of the driver nor the thread calling Scan.read() has to.
+ *
+ * Nothing is decoded natively: 'decoder' is a Python callable (data ->
+ * image, in practice PIL), and each worker holds the GIL while calling it.
+ * Workers only run in parallel (with each other and with the application)
+ * while PIL releases the GIL, i.e. while it decodes each block of data.
+ * See benchmarks/bench_decode.py.
+ *
+ * Results are returned in the order the pages were submitted.
+ * Submit(), Next() and the destructor must be called with the GIL held.
+ */
+class PyinsaneDecodePool
+{
+public:
+    PyinsaneDecodePool(PyObject *decoder, unsigned int nbWorkers);
+    ~PyinsaneDecodePool();
+
+    void Submit(PyObject *data);
+    // Waits for the oldest job (without the GIL) and removes it from the
+    // pool. Returns NULL if there is no job at all.
+    struct decode_job *Next();
+    static void FreeJob(struct decode_job *job);
+
+    unsigned int GetNbWorkers() const;
+    size_t GetNbJobs();
+
+private:
+    void Work();
+
+    PyObject *mDecoder;
+    std::vector<std::thread> mWorkers;
+    std::deque<struct decode_job *> mQueue; // not started yet
+    std::deque<struct decode_job *> mJobs; // not collected yet, in order
+    bool mStopping;
+    std::mutex mMutex;
+    std::condition_variable mWorkCond;
+    std::condition_variable mDoneCond;
+};
+
+#endif
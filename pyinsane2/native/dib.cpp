@@ -0,0 +1,476 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "dib.h"
+
+#define DIB_FILE_HEADER_SIZE 14
+#define DIB_INFO_HEADER_MIN_SIZE 40
+#define DIB_BI_RGB 0
+#define DIB_BI_BITFIELDS 3
+// Larger than any scanner can produce (4800dpi over more than a meter):
+// beyond that, the header is garbage
+#define DIB_MAX_DIMENSION (1 << 18)
+#define DIB_MAX_BITS_PER_PIXEL 64
+
+
+static uint32_t le16(const char *data)
+{
+    const uint8_t *d = (const uint8_t *)data;
+    return d[0] | (d[1] << 8);
+}
+
+
+static uint32_t le32(const char *data)
+{
+    const uint8_t *d = (const uint8_t *)data;
+    return d[0] | (d[1] << 8) | (d[2] << 16) | ((uint32_t)d[3] << 24);
+}
+
+
+PyinsaneDibDecoder::PyinsaneDibDecoder(bool packed)
+    : mData(NULL), mSize(0), mStored(0), mAllocated(0), mPacked(packed), mPixels(NULL),
+    mNbPacked(0), mHasHeader(false), mInvalid(false), mFormat(DIB_UNSUPPORTED)
+{
+    memset(&mInfos, 0, sizeof(mInfos));
+}
+
+
+PyinsaneDibDecoder::~PyinsaneDibDecoder()
+{
+    free(mData);
+    free(mPixels);
+}
+
+
+bool PyinsaneDibDecoder::Store(const void *data, size_t nbBytes)
+{
+    size_t allocated;
+    char *ndata;
+
+    if (mStored + nbBytes > mAllocated) {
+        // geometric growth until we know the size of the image from its
+        // headers
+        allocated = mAllocated * 2;
+        if (allocated < mStored + nbBytes)
+            allocated = mStored + nbBytes;
+        if (allocated < 64 * 1024)
+            allocated = 64 * 1024;
+        ndata = (char *)realloc(mData, allocated);
+        if (ndata == NULL)
+            return false;
+        mData = ndata;
+        mAllocated = allocated;
+    }
+    // may overlap: see StartPacking()
+    memmove(mData + mStored, data, nbBytes);
+    mStored += nbBytes;
+    return true;
+}
+
+
+bool PyinsaneDibDecoder::Feed(const void *data, size_t nbBytes)
+{
+    mSize += nbBytes;
+    if (mPixels != NULL)
+        return FeedLines((const uint8_t *)data, nbBytes);
+
+    if (!Store(data, nbBytes))
+        return false;
+    if (!mHasHeader && !mInvalid && ParseHeader()) {
+        mHasHeader = true;
+        if (mPacked && mFormat != DIB_UNSUPPORTED)
+            return StartPacking();
+    }
+    return true;
+}
+
+
+bool PyinsaneDibDecoder::ParseHeader()
+{
+    size_t info_offset = 0;
+    size_t palette_offset;
+    size_t pixel_offset = 0;
+    size_t expected;
+    uint32_t info_size;
+    int32_t width, height;
+    unsigned int i;
+    char *ndata;
+
+    if (mStored < 4)
+        return false;
+
+    if (mData[0] == 'B' && mData[1] == 'M') {
+        // BMP file
+        if (mStored < DIB_FILE_HEADER_SIZE)
+            return false;
+        info_offset = DIB_FILE_HEADER_SIZE;
+        pixel_offset = le32(mData + 10);
+    }
+    // else: memory BMP: starts directly with the BITMAPINFOHEADER
+
+    if (mStored < info_offset + 4)
+        return false;
+    info_size = le32(mData + info_offset);
+    if (info_size < DIB_INFO_HEADER_MIN_SIZE || info_size > 4096) {
+        // BITMAPCOREHEADER or garbage
+        mInvalid = true;
+        return false;
+    }
+    if (mStored < info_offset + info_size)
+        return false;
+
+    width = (int32_t)le32(mData + info_offset + 4);
+    height = (int32_t)le32(mData + info_offset + 8);
+    mInfos.bits_per_pixel = le16(mData + info_offset + 14);
+    mInfos.compression = le32(mData + info_offset + 16);
+    mInfos.nb_colors = le32(mData + info_offset + 32);
+
+    // checked before anything is computed from them
+    if (width <= 0 || width > DIB_MAX_DIMENSION
+            || height == 0 || height < -DIB_MAX_DIMENSION || height > DIB_MAX_DIMENSION
+            || mInfos.bits_per_pixel == 0 || mInfos.bits_per_pixel > DIB_MAX_BITS_PER_PIXEL) {
+        mInvalid = true;
+        return false;
+    }
+    mInfos.width = width;
+    mInfos.top_down = (height < 0);
+    mInfos.height = (height < 0 ? -height : height);
+    mInfos.stride = (((uint64_t)mInfos.width * mInfos.bits_per_pixel + 31) / 32) * 4;
+    if ((uint64_t)mInfos.stride * mInfos.height > SIZE_MAX / 4
+            || pixel_offset > SIZE_MAX / 4) {
+        // can't be allocated anyway (32-bit hosts)
+        mInvalid = true;
+        return false;
+    }
+
+    palette_offset = info_offset + info_size;
+    if (mInfos.compression == DIB_BI_BITFIELDS && info_size == DIB_INFO_HEADER_MIN_SIZE)
+        palette_offset += 12; // color masks
+
+    if (mInfos.bits_per_pixel <= 8) {
+        if (mInfos.nb_colors == 0)
+            mInfos.nb_colors = 1 << mInfos.bits_per_pixel;
+        if (mInfos.nb_colors > 256) {
+            mInvalid = true;
+            return false;
+        }
+        if (mStored < palette_offset + 4 * mInfos.nb_colors)
+            return false;
+        for (i = 0 ; i < mInfos.nb_colors ; i++) {
+            memcpy(mInfos.palette[i], mData + palette_offset + 4 * i, 4);
+        }
+    }
+
+    if (pixel_offset == 0)
+        pixel_offset = palette_offset + 4 * mInfos.nb_colors;
+    mInfos.pixel_offset = pixel_offset;
+
+    mFormat = DIB_UNSUPPORTED;
+    if (mInfos.compression == DIB_BI_RGB) {
+        switch (mInfos.bits_per_pixel) {
+            case 24:
+            case 32:
+                mFormat = DIB_RGB;
+                break;
+            case 8:
+                mFormat = DIB_GRAY;
+                for (i = 0 ; i < mInfos.nb_colors ; i++) {
+                    if (mInfos.palette[i][0] != i || mInfos.palette[i][1] != i
+                            || mInfos.palette[i][2] != i) {
+                        mFormat = DIB_PALETTE;
+                        break;
+                    }
+                }
+                break;
+            case 1:
+                mFormat = DIB_PALETTE;
+                if (mInfos.nb_colors == 2
+                        && mInfos.palette[0][0] == mInfos.palette[0][1]
+                        && mInfos.palette[0][1] == mInfos.palette[0][2]
+                        && mInfos.palette[1][0] == mInfos.palette[1][1]
+                        && mInfos.palette[1][1] == mInfos.palette[1][2]
+                        && (mInfos.palette[0][0] ^ mInfos.palette[1][0]) == 0xFF)
+                    mFormat = DIB_BW;
+                break;
+            case 4:
+                mFormat = DIB_PALETTE;
+                break;
+        }
+    }
+
+    // now we know how much memory we will need. In packed mode: one line at
+    // most, when it is split between 2 chunks.
+    if (mPacked && mFormat != DIB_UNSUPPORTED)
+        expected = mInfos.pixel_offset + mInfos.stride;
+    else
+        expected = mInfos.pixel_offset + mInfos.stride * mInfos.height;
+    if (expected > mAllocated) {
+        ndata = (char *)realloc(mData, expected);
+        if (ndata != NULL) {
+            mData = ndata;
+            mAllocated = expected;
+        }
+    }
+
+    return true;
+}
+
+
+bool PyinsaneDibDecoder::HasHeader() const
+{
+    return mHasHeader;
+}
+
+
+const struct dib_infos *PyinsaneDibDecoder::GetInfos() const
+{
+    return (mHasHeader ? &mInfos : NULL);
+}
+
+
+enum dib_pixel_format PyinsaneDibDecoder::GetPixelFormat() const
+{
+    return mFormat;
+}
+
+
+size_t PyinsaneDibDecoder::GetOutputLineSize() const
+{
+    switch (mFormat) {
+        case DIB_RGB:
+            return (size_t)mInfos.width * 3;
+        case DIB_GRAY:
+        case DIB_PALETTE:
+            return (size_t)mInfos.width;
+        case DIB_BW:
+            return ((size_t)mInfos.width + 7) / 8;
+        case DIB_UNSUPPORTED:
+            break;
+    }
+    return 0;
+}
+
+
+size_t PyinsaneDibDecoder::GetSize() const
+{
+    return mSize;
+}
+
+
+size_t PyinsaneDibDecoder::GetRawSize() const
+{
+    return mStored;
+}
+
+
+const char *PyinsaneDibDecoder::GetData() const
+{
+    return mData;
+}
+
+
+int PyinsaneDibDecoder::GetNbCompleteLines() const
+{
+    size_t nb;
+
+    if (mPixels != NULL)
+        return mNbPacked;
+    if (!mHasHeader || mStored < mInfos.pixel_offset)
+        return 0;
+    nb = (mStored - mInfos.pixel_offset) / mInfos.stride;
+    if (nb > (size_t)mInfos.height)
+        nb = mInfos.height;
+    return (int)nb;
+}
+
+
+void PyinsaneDibDecoder::GetAvailableLines(int *first, int *last) const
+{
+    int nb = GetNbCompleteLines();
+
+    if (!mHasHeader) {
+        *first = *last = 0;
+    } else if (mInfos.top_down) {
+        *first = 0;
+        *last = nb;
+    } else {
+        // bottom-up bitmap: we get the last lines of the image first
+        *first = mInfos.height - nb;
+        *last = mInfos.height;
+    }
+}
+
+
+// Formats that only need a row kernel (see pixels.h): 'nb' is what it expects
+static bool get_layout(const struct dib_infos *infos, enum dib_pixel_format format,
+        enum pixels_layout *layout, size_t *nb)
+{
+    switch (format) {
+        case DIB_RGB:
+            *layout = (infos->bits_per_pixel == 32 ? PIXELS_BGRX : PIXELS_BGR);
+            *nb = infos->width;
+            return true;
+        case DIB_GRAY:
+            *layout = PIXELS_COPY;
+            *nb = infos->width;
+            return true;
+        case DIB_BW:
+            *layout = PIXELS_COPY;
+            *nb = (infos->width + 7) / 8;
+            return true;
+        case DIB_PALETTE:
+            *layout = PIXELS_COPY;
+            *nb = infos->width;
+            return (infos->bits_per_pixel == 8);
+        case DIB_UNSUPPORTED:
+            break;
+    }
+    return false;
+}
+
+
+static void convert_line(const struct dib_infos *infos, enum dib_pixel_format format,
+        const uint8_t *in, uint8_t *out)
+{
+    enum pixels_layout layout;
+    size_t nb;
+    int x;
+
+    if (get_layout(infos, format, &layout, &nb)) {
+        pixels_convert_line(layout, in, out, nb);
+        return;
+    }
+
+    switch (format) {
+        case DIB_PALETTE:
+            switch (infos->bits_per_pixel) {
+                case 4:
+                    for (x = 0 ; x < infos->width ; x++) {
+                        out[x] = (in[x / 2] >> ((x % 2) ? 0 : 4)) & 0x0F;
+                    }
+                    break;
+                case 1:
+                    for (x = 0 ; x < infos->width ; x++) {
+                        out[x] = (in[x / 8] >> (7 - (x % 8))) & 0x01;
+                    }
+                    break;
+            }
+            break;
+        default:
+            assert(0);
+            break;
+    }
+}
+
+
+bool PyinsaneDibDecoder::StartPacking()
+{
+    size_t nb;
+
+    mPixels = (uint8_t *)malloc(GetOutputLineSize() * (size_t)mInfos.height);
+    if (mPixels == NULL)
+        return false;
+    if (mStored <= mInfos.pixel_offset)
+        return true;
+    // the first lines came with the headers. What remains of them once
+    // converted is moved back to where they start: it fits in what is
+    // already allocated.
+    nb = mStored - mInfos.pixel_offset;
+    mStored = mInfos.pixel_offset;
+    return FeedLines((const uint8_t *)mData + mInfos.pixel_offset, nb);
+}
+
+
+bool PyinsaneDibDecoder::FeedLines(const uint8_t *data, size_t nbBytes)
+{
+    size_t partial, nb;
+    int nbLines;
+
+    // what follows the last line is ignored
+    while (nbBytes > 0 && mNbPacked < mInfos.height) {
+        if (mStored < mInfos.pixel_offset) {
+            // between the headers and the first line
+            nb = std::min(nbBytes, mInfos.pixel_offset - mStored);
+            if (!Store(data, nb))
+                return false;
+        } else if ((partial = mStored - mInfos.pixel_offset) > 0
+                || nbBytes < mInfos.stride) {
+            // line split between 2 chunks
+            nb = std::min(nbBytes, mInfos.stride - partial);
+            if (!Store(data, nb))
+                return false;
+            if (partial + nb == mInfos.stride) {
+                PackLines((const uint8_t *)mData + mInfos.pixel_offset, 1);
+                mStored = mInfos.pixel_offset;
+            }
+        } else {
+            // straight from the chunk
+            nbLines = (int)std::min(nbBytes / mInfos.stride,
+                    (size_t)(mInfos.height - mNbPacked));
+            PackLines(data, nbLines);
+            nb = nbLines * mInfos.stride;
+        }
+        data += nb;
+        nbBytes -= nb;
+    }
+    return true;
+}
+
+
+void PyinsaneDibDecoder::PackLines(const uint8_t *in, int nbLines)
+{
+    size_t line_size = GetOutputLineSize();
+    enum pixels_layout layout;
+    ptrdiff_t out_stride;
+    uint8_t *out;
+    size_t nb;
+    int y;
+
+    if (mInfos.top_down) {
+        out = mPixels + (size_t)mNbPacked * line_size;
+        out_stride = line_size;
+    } else {
+        out = mPixels + (size_t)(mInfos.height - 1 - mNbPacked) * line_size;
+        out_stride = -(ptrdiff_t)line_size;
+    }
+    mNbPacked += nbLines;
+
+    if (get_layout(&mInfos, mFormat, &layout, &nb)) {
+        pixels_convert_lines(layout, in, mInfos.stride, out, out_stride, nb, nbLines);
+        return;
+    }
+    for (y = 0 ; y < nbLines ; y++, in += mInfos.stride, out += out_stride) {
+        convert_line(&mInfos, mFormat, in, out);
+    }
+}
+
+
+void PyinsaneDibDecoder::GetLines(int start, int end, uint8_t *out) const
+{
+    size_t line_size = GetOutputLineSize();
+    int first, last;
+    int y, file_y;
+
+    GetAvailableLines(&first, &last);
+
+    for (y = start ; y < end ; y++, out += line_size) {
+        if (y < first || y >= last) {
+            memset(out, 0, line_size);
+            continue;
+        }
+        if (mPixels != NULL) {
+            memcpy(out, mPixels + (size_t)y * line_size, line_size);
+            continue;
+        }
+        file_y = (mInfos.top_down ? y : mInfos.height - 1 - y);
+        convert_line(
+            &mInfos, mFormat,
+            (const uint8_t *)mData + mInfos.pixel_offset + (size_t)file_y * mInfos.stride,
+            out
+        );
+    }
+}
@@ -0,0 +1,93 @@
+#ifndef __PYINSANE_NATIVE_DIB_H
+#define __PYINSANE_NATIVE_DIB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pixels.h"
+
+#define NATIVE_PYCAPSULE_DIB_NAME "Pyinsane DIB decoder"
+
+struct dib_infos {
+    int width;
+    int height; // always > 0
+    int top_down;
+    int bits_per_pixel;
+    uint32_t compression;
+    size_t pixel_offset; // offset of the first pixel in the stream
+    size_t stride; // size of a line in the stream, including DWORD padding
+    unsigned int nb_colors;
+    uint8_t palette[256][4]; // B, G, R, 0 (as in the stream)
+};
+
+enum dib_pixel_format {
+    DIB_UNSUPPORTED = 0, // let PIL handle it
+    DIB_RGB, // 24 or 32 bits per pixel, output as RGB
+    DIB_GRAY, // 8 bits per pixel with a grayscale palette
+    DIB_PALETTE, // 1, 4 or 8 bits per pixel
+    DIB_BW, // 1 bit per pixel, black and white
+};
+
+/*!
+ * Streaming parser for the bitmaps (BMP or memory BMP) returned by WIA.
+ *
+ * Data are appended as they come. Headers are parsed once, as soon as they are
+ * complete. After that, the number of complete lines is known in O(1), and
+ * any range of lines can be extracted (top-down, without padding, RGB order)
+ * without decoding the whole image again.
+ *
+ * In packed mode, the lines of the supported formats are converted as they
+ * arrive (see pixels.h) into a buffer of tightly packed top-down lines, and
+ * the lines as sent by the driver are not kept: GetData() only returns what
+ * preceded them (headers, palette). Extracting lines is then a mere copy.
+ */
+class PyinsaneDibDecoder
+{
+public:
+    PyinsaneDibDecoder(bool packed = false);
+    ~PyinsaneDibDecoder();
+
+    bool Feed(const void *data, size_t nbBytes);
+
+    bool HasHeader() const;
+    const struct dib_infos *GetInfos() const;
+    enum dib_pixel_format GetPixelFormat() const;
+    size_t GetOutputLineSize() const;
+
+    // number of bytes fed so far
+    size_t GetSize() const;
+    // what has been kept of them (all of them, except in packed mode)
+    size_t GetRawSize() const;
+    const char *GetData() const;
+
+    // [first, last[ lines of the image (top-down) already received
+    void GetAvailableLines(int *first, int *last) const;
+
+    // Lines not received yet are filled with 0.
+    // 'out' must be at least (end - start) * GetOutputLineSize() bytes.
+    void GetLines(int start, int end, uint8_t *out) const;
+
+private:
+    bool Store(const void *data, size_t nbBytes);
+    bool ParseHeader();
+    bool StartPacking();
+    bool FeedLines(const uint8_t *data, size_t nbBytes);
+    void PackLines(const uint8_t *in, int nbLines);
+    int GetNbCompleteLines() const;
+
+    char *mData;
+    size_t mSize;
+    size_t mStored;
+    size_t mAllocated;
+
+    bool mPacked;
+    uint8_t *mPixels; // packed mode: the lines converted so far
+    int mNbPacked;
+
+    bool mHasHeader;
+    bool mInvalid;
+    struct dib_infos mInfos;
+    enum dib_pixel_format mFormat;
+};
+
+#endif
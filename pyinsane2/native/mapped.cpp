@@ -0,0 +1,259 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <string>
+
+#include "mapped.h"
+
+// Capacity grows by doubling, from at least this size.
+#define MAPPED_MIN_CAPACITY (1024 * 1024)
+
+
+PyinsaneMappedStore::PyinsaneMappedStore(const char *directory)
+    : mData(NULL), mCapacity(0), mSize(0), mPosition(0), mValid(true)
+{
+#ifdef _WIN32
+    char path[MAX_PATH];
+
+    mFile = INVALID_HANDLE_VALUE;
+    mMapping = NULL;
+    if (directory != NULL) {
+        if (GetTempFileNameA(directory, "pyi", 0, path) == 0) {
+            mValid = false;
+            return;
+        }
+        mFile = CreateFileA(
+            path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+            FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL
+        );
+        if (mFile == INVALID_HANDLE_VALUE)
+            mValid = false;
+    }
+#else
+    std::string path;
+
+    mFd = -1;
+    if (directory != NULL) {
+        path = std::string(directory) + "/pyinsane-XXXXXX";
+        mFd = mkstemp(&path[0]);
+        if (mFd < 0) {
+            mValid = false;
+            return;
+        }
+        // only reachable through our file descriptor from now on
+        unlink(path.c_str());
+    }
+#endif
+}
+
+
+PyinsaneMappedStore::~PyinsaneMappedStore()
+{
+    Unmap();
+#ifdef _WIN32
+    if (mFile != INVALID_HANDLE_VALUE)
+        CloseHandle(mFile);
+#else
+    if (mFd >= 0)
+        close(mFd);
+#endif
+}
+
+
+void PyinsaneMappedStore::Unmap()
+{
+    if (mData == NULL)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(mData);
+    CloseHandle(mMapping);
+    mMapping = NULL;
+#else
+    munmap(mData, (size_t)mCapacity);
+#endif
+    mData = NULL;
+}
+
+
+bool PyinsaneMappedStore::Reserve(uint64_t capacity)
+{
+    uint64_t ncapacity;
+    char *ndata;
+
+    if (!mValid)
+        return false;
+    if (capacity <= mCapacity)
+        return true;
+
+    ncapacity = (mCapacity > 0 ? mCapacity * 2 : MAPPED_MIN_CAPACITY);
+    while (ncapacity < capacity) {
+        ncapacity *= 2;
+    }
+    if ((size_t)ncapacity != ncapacity)
+        return false; // doesn't fit in our address space
+
+#ifdef _WIN32
+    HANDLE nmapping;
+
+    // A view can't grow: map a bigger one. With a file, its content is
+    // kept by the file itself. Otherwise, we have to copy it.
+    nmapping = CreateFileMapping(
+        mFile, NULL, PAGE_READWRITE,
+        (DWORD)(ncapacity >> 32), (DWORD)(ncapacity & 0xFFFFFFFF), NULL
+    );
+    if (nmapping == NULL)
+        return false;
+    if (mFile != INVALID_HANDLE_VALUE)
+        Unmap();
+    ndata = (char *)MapViewOfFile(nmapping, FILE_MAP_ALL_ACCESS, 0, 0, (SIZE_T)ncapacity);
+    if (ndata == NULL) {
+        CloseHandle(nmapping);
+        mValid = false;
+        return false;
+    }
+    if (mData != NULL) {
+        memcpy(ndata, mData, (size_t)mSize);
+        Unmap();
+    }
+    mMapping = nmapping;
+#else
+    if (mFd >= 0) {
+        // content is kept by the file
+        Unmap();
+        if (ftruncate(mFd, (off_t)ncapacity) < 0) {
+            mValid = false;
+            return false;
+        }
+        ndata = (char *)mmap(NULL, (size_t)ncapacity, PROT_READ | PROT_WRITE,
+                MAP_SHARED, mFd, 0);
+    } else if (mData != NULL) {
+#ifdef __linux__
+        ndata = (char *)mremap(mData, (size_t)mCapacity, (size_t)ncapacity, MREMAP_MAYMOVE);
+        if (ndata != MAP_FAILED)
+            mData = NULL; // already unmapped by mremap()
+#else
+        ndata = (char *)mmap(NULL, (size_t)ncapacity, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ndata != MAP_FAILED) {
+            memcpy(ndata, mData, (size_t)mSize);
+            Unmap();
+        }
+#endif
+    } else {
+        ndata = (char *)mmap(NULL, (size_t)ncapacity, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (ndata == MAP_FAILED) {
+        // with a file, we unmapped what we had: nothing can be saved
+        if (mFd >= 0)
+            mValid = false;
+        return false;
+    }
+#endif
+
+    mData = ndata;
+    mCapacity = ncapacity;
+    return true;
+}
+
+
+bool PyinsaneMappedStore::IsValid() const
+{
+    return mValid;
+}
+
+
+bool PyinsaneMappedStore::Write(const void *data, size_t nbBytes)
+{
+    if (!Reserve(mPosition + nbBytes))
+        return false;
+    if (mPosition > mSize) {
+        // the writer seeked after the end: fill the gap
+        memset(mData + mSize, 0, (size_t)(mPosition - mSize));
+    }
+    memcpy(mData + mPosition, data, nbBytes);
+    mPosition += nbBytes;
+    if (mPosition > mSize)
+        mSize = mPosition;
+    return true;
+}
+
+
+size_t PyinsaneMappedStore::Read(void *out, size_t nbBytes)
+{
+    if (mPosition >= mSize)
+        return 0;
+    if (nbBytes > mSize - mPosition)
+        nbBytes = (size_t)(mSize - mPosition);
+    memcpy(out, mData + mPosition, nbBytes);
+    mPosition += nbBytes;
+    return nbBytes;
+}
+
+
+bool PyinsaneMappedStore::Seek(int64_t offset, enum mapped_origin origin, uint64_t *newPosition)
+{
+    int64_t base;
+
+    switch (origin) {
+        case MAPPED_SEEK_SET:
+            base = 0;
+            break;
+        case MAPPED_SEEK_CUR:
+            base = (int64_t)mPosition;
+            break;
+        case MAPPED_SEEK_END:
+            base = (int64_t)mSize;
+            break;
+        default:
+            return false;
+    }
+    if (base + offset < 0)
+        return false;
+    mPosition = (uint64_t)(base + offset);
+    if (newPosition != NULL)
+        *newPosition = mPosition;
+    return true;
+}
+
+
+bool PyinsaneMappedStore::SetSize(uint64_t size)
+{
+    if (!Reserve(size))
+        return false;
+    if (size > mSize)
+        memset(mData + mSize, 0, (size_t)(size - mSize));
+    mSize = size;
+    return true;
+}
+
+
+uint64_t PyinsaneMappedStore::GetSize() const
+{
+    return mSize;
+}
+
+
+uint64_t PyinsaneMappedStore::GetPosition() const
+{
+    return mPosition;
+}
+
+
+uint64_t PyinsaneMappedStore::GetCapacity() const
+{
+    return mCapacity;
+}
+
+
+const char *PyinsaneMappedStore::GetData() const
+{
+    return mData;
+}
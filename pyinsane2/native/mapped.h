@@ -0,0 +1,67 @@
+#ifndef __PYINSANE_NATIVE_MAPPED_H
+#define __PYINSANE_NATIVE_MAPPED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#define NATIVE_PYCAPSULE_MAPPED_NAME "Pyinsane mapped store"
+
+enum mapped_origin {
+    MAPPED_SEEK_SET = 0,
+    MAPPED_SEEK_CUR = 1,
+    MAPPED_SEEK_END = 2,
+};
+
+/*!
+ * Seekable, resizable byte store backed by a memory mapping, for drivers that
+ * need to go back and patch what they wrote (TIFF, multipage, some PNG / JPEG
+ * writers).
+ *
+ * If 'directory' is NULL, the mapping is anonymous. Otherwise, it is backed
+ * by a temporary file created in this directory (and deleted automatically),
+ * so big pages don't have to fit in memory.
+ *
+ * Not thread-safe. GetData() is only valid until the next call that may grow
+ * the store (Write(), SetSize()).
+ */
+class PyinsaneMappedStore
+{
+public:
+    PyinsaneMappedStore(const char *directory = NULL);
+    ~PyinsaneMappedStore();
+
+    bool IsValid() const;
+
+    bool Write(const void *data, size_t nbBytes);
+    size_t Read(void *out, size_t nbBytes);
+    bool Seek(int64_t offset, enum mapped_origin origin, uint64_t *newPosition);
+    bool SetSize(uint64_t size);
+
+    uint64_t GetSize() const;
+    uint64_t GetPosition() const;
+    uint64_t GetCapacity() const;
+    const char *GetData() const;
+
+private:
+    bool Reserve(uint64_t capacity);
+    void Unmap();
+
+    char *mData;
+    uint64_t mCapacity;
+    uint64_t mSize;
+    uint64_t mPosition;
+    bool mValid;
+
+#ifdef _WIN32
+    HANDLE mFile;
+    HANDLE mMapping;
+#else
+    int mFd;
+#endif
+};
+
+#endif
@@ -0,0 +1,739 @@
+#include <math.h>
+#include <string.h>
+
+#include <atomic>
+
+#include "pixels.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define PIXELS_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define PIXELS_TARGET_SSE2
+#define PIXELS_TARGET_SSSE3
+#define PIXELS_TARGET_AVX2
+#else
+#define PIXELS_TARGET_SSE2 __attribute__((target("sse2")))
+#define PIXELS_TARGET_SSSE3 __attribute__((target("ssse3")))
+#define PIXELS_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define PIXELS_NEON
+#include <arm_neon.h>
+#endif
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define PIXELS_BIG_ENDIAN
+#endif
+
+
+static void bgr_to_rgb_scalar(const uint8_t *in, uint8_t *out, size_t nb)
+{
+    size_t x;
+
+    for (x = 0 ; x < nb ; x++, in += 3, out += 3) {
+        out[0] = in[2];
+        out[1] = in[1];
+        out[2] = in[0];
+    }
+}
+
+
+static void bgrx_to_rgb_scalar(const uint8_t *in, uint8_t *out, size_t nb)
+{
+    size_t x;
+
+    for (x = 0 ; x < nb ; x++, in += 4, out += 3) {
+        out[0] = in[2];
+        out[1] = in[1];
+        out[2] = in[0];
+    }
+}
+
+
+static void bits_to_bytes_scalar(const uint8_t *in, uint8_t *out, size_t nb)
+{
+    size_t x;
+    int bit;
+
+    for ( ; nb >= 8 ; nb -= 8, in++, out += 8) {
+        for (bit = 0 ; bit < 8 ; bit++) {
+            out[bit] = ((*in >> (7 - bit)) & 1) ? 0x00 : 0xFF;
+        }
+    }
+    // last byte of the line: the remaining bits are padding
+    for (x = 0 ; x < nb ; x++) {
+        out[x] = ((*in >> (7 - x)) & 1) ? 0x00 : 0xFF;
+    }
+}
+
+
+
+static inline uint16_t load16(const uint8_t *in)
+{
+    uint16_t v;
+
+    memcpy(&v, in, 2);
+    return v;
+}
+
+
+static void to_le16_scalar(const uint8_t *in, uint8_t *out, size_t nb)
+{
+#ifdef PIXELS_BIG_ENDIAN
+    size_t x;
+
+    for (x = 0 ; x < nb ; x++, in += 2, out += 2) {
+        out[0] = in[1];
+        out[1] = in[0];
+    }
+#else
+    memcpy(out, in, 2 * nb);
+#endif
+}
+
+
+static void high_bytes_scalar(const uint8_t *in, uint8_t *out, size_t nb)
+{
+    size_t x;
+
+    for (x = 0 ; x < nb ; x++, in += 2)
+        out[x] = (uint8_t)(load16(in) >> 8);
+}
+
+
+static void lut16_scalar(const uint8_t *in, uint8_t *out, size_t nb, const uint8_t *lut)
+{
+    size_t x;
+
+    for (x = 0 ; x < nb ; x++, in += 2)
+        out[x] = lut[load16(in)];
+}
+
+
+
+static void interleave_scalar(const uint8_t *red, const uint8_t *green, const uint8_t *blue,
+        uint8_t *out, size_t nb, size_t sampleSize)
+{
+    size_t x;
+
+    if (sampleSize == 2) {
+        for (x = 0 ; x < nb ; x++, red += 2, green += 2, blue += 2, out += 6) {
+            memcpy(out, red, 2);
+            memcpy(out + 2, green, 2);
+            memcpy(out + 4, blue, 2);
+        }
+        return;
+    }
+    for (x = 0 ; x < nb ; x++, out += 3) {
+        out[0] = red[x];
+        out[1] = green[x];
+        out[2] = blue[x];
+    }
+}
+
+
+#ifdef PIXELS_X86
+
+static enum pixels_simd detect_simd()
+{
+#ifdef _MSC_VER
+    int infos[4];
+    bool avx = false;
+
+    __cpuid(infos, 1);
+    // the OS must save the AVX registers too
+    if ((infos[2] & (1 << 27)) && (infos[2] & (1 << 28)))
+        avx = ((_xgetbv(0) & 6) == 6);
+    if (avx) {
+        int ext[4];
+
+        __cpuidex(ext, 7, 0);
+        if (ext[1] & (1 << 5))
+            return PIXELS_SIMD_AVX2;
+    }
+    if (infos[2] & (1 << 9))
+        return PIXELS_SIMD_SSSE3;
+    if (infos[3] & (1 << 26))
+        return PIXELS_SIMD_SSE2;
+    return PIXELS_SIMD_NONE;
+#else
+    // may run before the constructor of libgcc that usually does it
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return PIXELS_SIMD_AVX2;
+    if (__builtin_cpu_supports("ssse3"))
+        return PIXELS_SIMD_SSSE3;
+    if (__builtin_cpu_supports("sse2"))
+        return PIXELS_SIMD_SSE2;
+    return PIXELS_SIMD_NONE;
+#endif
+}
+
+
+// 5 pixels per iteration. Each store writes 1 byte too many, rewritten by the
+// next iteration (or the scalar tail): we must stop while there are at least
+// 6 pixels left.
+PIXELS_TARGET_SSSE3
+static void bgr_to_rgb_ssse3(const uint8_t *in, uint8_t *out, size_t nb)
+{
+    const __m128i mask = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15);
+    __m128i v;
+
+    for ( ; nb >= 6 ; nb -= 5, in += 15, out += 15) {
+        v = _mm_loadu_si128((const __m128i *)in);
+        _mm_storeu_si128((__m128i *)out, _mm_shuffle_epi8(v, mask));
+    }
+    bgr_to_rgb_scalar(in, out, nb);
+}
+
+
+// 4 pixels per iteration: 16 bytes in, 12 bytes out (+ 4 rewritten later)
+PIXELS_TARGET_SSSE3
+static void bgrx_to_rgb_ssse3(const uint8_t *in, uint8_t *out, size_t nb)
+{
+    const __m128i mask = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    __m128i v;
+
+    for ( ; nb >= 6 ; nb -= 4, in += 16, out += 12) {
+        v = _mm_loadu_si128((const __m128i *)in);
+        _mm_storeu_si128((__m128i *)out, _mm_shuffle_epi8(v, mask));
+    }
+    bgrx_to_rgb_scalar(in, out, nb);
+}
+
+
+// 'v' holds 2 input bytes, each repeated 8 times: 16 output bytes
+PIXELS_TARGET_SSE2
+static inline void store_bits_sse2(uint8_t *out, __m128i v, __m128i mask)
+{
+    v = _mm_cmpeq_epi8(_mm_and_si128(v, mask), _mm_setzero_si128());
+    _mm_storeu_si128((__m128i *)out, v);
+}
+
+
+// 8 input bytes (in the low half of 'v'): 64 output bytes
+PIXELS_TARGET_SSE2
+static inline void bits_to_bytes_8_sse2(uint8_t *out, __m128i v, __m128i mask)
+{
+    __m128i w;
+
+    v = _mm_unpacklo_epi8(v, v); // b0 b0 b1 b1 ... b7 b7
+    w = _mm_unpacklo_epi16(v, v); // b0 x4 ... b3 x4
+    store_bits_sse2(out, _mm_unpacklo_epi32(w, w), mask);
+    store_bits_sse2(out + 16, _mm_unpackhi_epi32(w, w), mask);
+    w = _mm_unpackhi_epi16(v, v); // b4 x4 ... b7 x4
+    store_bits_sse2(out + 32, _mm_unpacklo_epi32(w, w), mask);
+    store_bits_sse2(out + 48, _mm_unpackhi_epi32(w, w), mask);
+}
+
+
+// 16 bytes (128 samples) per iteration
+PIXELS_TARGET_SSE2
+static void bits_to_bytes_sse2(const uint8_t *in, uint8_t *out, size_t nb)
+{
+    const __m128i mask = _mm_setr_epi8(
+        -128, 64, 32, 16, 8, 4, 2, 1, -128, 64, 32, 16, 8, 4, 2, 1
+    );
+    __m128i v;
+
+    for ( ; nb >= 128 ; nb -= 128, in += 16, out += 128) {
+        v = _mm_loadu_si128((const __m128i *)in);
+        bits_to_bytes_8_sse2(out, v, mask);
+        bits_to_bytes_8_sse2(out + 64, _mm_unpackhi_epi64(v, v), mask);
+    }
+    bits_to_bytes_scalar(in, out, nb);
+}
+
+
+// 4 bytes (32 samples) per iteration: each of them is broadcast to 8 bytes
+PIXELS_TARGET_AVX2
+static void bits_to_bytes_avx2(const uint8_t *in, uint8_t *out, size_t nb)
+{
+    const __m256i shuffle = _mm256_setr_epi8(
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+        2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3
+    );
+    const __m256i mask = _mm256_set1_epi64x((long long)0x0102040810204080ULL);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i v;
+    int32_t word;
+
+    for ( ; nb >= 32 ; nb -= 32, in += 4, out += 32) {
+        memcpy(&word, in, 4);
+        v = _mm256_shuffle_epi8(_mm256_set1_epi32(word), shuffle);
+        v = _mm256_cmpeq_epi8(_mm256_and_si256(v, mask), zero);
+        _mm256_storeu_si256((__m256i *)out, v);
+    }
+    bits_to_bytes_scalar(in, out, nb);
+}
+
+
+// For each 16-byte block of the output (48 bytes: 16 bytes of each plane),
+// the bytes of each plane that go into it (-1: none)
+struct interleave_masks {
+    int8_t masks[3][3][16];
+};
+
+
+static struct interleave_masks make_interleave_masks(size_t sampleSize)
+{
+    struct interleave_masks m;
+    size_t block, plane, i, sample;
+
+    for (block = 0 ; block < 3 ; block++) {
+        for (plane = 0 ; plane < 3 ; plane++) {
+            for (i = 0 ; i < 16 ; i++) {
+                sample = (16 * block + i) / sampleSize;
+                m.masks[block][plane][i] = (sample % 3 != plane ? -1 :
+                    (int8_t)((sample / 3) * sampleSize + i % sampleSize));
+            }
+        }
+    }
+    return m;
+}
+
+
+static const struct interleave_masks g_interleave_masks[2] = {
+    make_interleave_masks(1), make_interleave_masks(2),
+};
+
+
+// 16 bytes of each plane per iteration
+PIXELS_TARGET_SSSE3
+static void interleave_ssse3(const uint8_t *red, const uint8_t *green, const uint8_t *blue,
+        uint8_t *out, size_t nb, size_t sampleSize)
+{
+    const struct interleave_masks *m = &g_interleave_masks[sampleSize - 1];
+    const size_t step = 16 / sampleSize;
+    __m128i masks[3][3];
+    __m128i r, g, b, v;
+    int block, plane;
+
+    for (block = 0 ; block < 3 ; block++) {
+        for (plane = 0 ; plane < 3 ; plane++)
+            masks[block][plane] = _mm_loadu_si128((const __m128i *)m->masks[block][plane]);
+    }
+    for ( ; nb >= step ; nb -= step, red += 16, green += 16, blue += 16, out += 48) {
+        r = _mm_loadu_si128((const __m128i *)red);
+        g = _mm_loadu_si128((const __m128i *)green);
+        b = _mm_loadu_si128((const __m128i *)blue);
+        for (block = 0 ; block < 3 ; block++) {
+            v = _mm_or_si128(
+                _mm_or_si128(_mm_shuffle_epi8(r, masks[block][0]),
+                    _mm_shuffle_epi8(g, masks[block][1])),
+                _mm_shuffle_epi8(b, masks[block][2])
+            );
+            _mm_storeu_si128((__m128i *)(out + 16 * block), v);
+        }
+    }
+    interleave_scalar(red, green, blue, out, nb, sampleSize);
+}
+
+
+// 16 samples per iteration
+PIXELS_TARGET_SSE2
+static void high_bytes_sse2(const uint8_t *in, uint8_t *out, size_t nb)
+{
+    __m128i a, b;
+
+    for ( ; nb >= 16 ; nb -= 16, in += 32, out += 16) {
+        a = _mm_srli_epi16(_mm_loadu_si128((const __m128i *)in), 8);
+        b = _mm_srli_epi16(_mm_loadu_si128((const __m128i *)(in + 16)), 8);
+        _mm_storeu_si128((__m128i *)out, _mm_packus_epi16(a, b));
+    }
+    high_bytes_scalar(in, out, nb);
+}
+
+
+// 32 samples per iteration. _mm256_packus_epi16() works on each half: the
+// quarters must be put back in order.
+PIXELS_TARGET_AVX2
+static void high_bytes_avx2(const uint8_t *in, uint8_t *out, size_t nb)
+{
+    __m256i a, b;
+
+    for ( ; nb >= 32 ; nb -= 32, in += 64, out += 32) {
+        a = _mm256_srli_epi16(_mm256_loadu_si256((const __m256i *)in), 8);
+        b = _mm256_srli_epi16(_mm256_loadu_si256((const __m256i *)(in + 32)), 8);
+        a = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+        _mm256_storeu_si256((__m256i *)out, a);
+    }
+    high_bytes_scalar(in, out, nb);
+}
+
+
+// 16 samples per iteration: 2 gathers of 8 entries (32-bit loads, hence
+// PIXELS_LUT16_SIZE)
+PIXELS_TARGET_AVX2
+static void lut16_avx2(const uint8_t *in, uint8_t *out, size_t nb, const uint8_t *lut)
+{
+    const __m256i mask = _mm256_set1_epi32(0xFF);
+    __m256i a, b;
+
+    for ( ; nb >= 16 ; nb -= 16, in += 32, out += 16) {
+        a = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)in));
+        b = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(in + 16)));
+        a = _mm256_and_si256(_mm256_i32gather_epi32((const int *)lut, a, 1), mask);
+        b = _mm256_and_si256(_mm256_i32gather_epi32((const int *)lut, b, 1), mask);
+        a = _mm256_permute4x64_epi64(_mm256_packus_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+        _mm_storeu_si128((__m128i *)out, _mm_packus_epi16(
+            _mm256_castsi256_si128(a), _mm256_extracti128_si256(a, 1)
+        ));
+    }
+    lut16_scalar(in, out, nb, lut);
+}
+
+#elif defined(PIXELS_NEON)
+
+static enum pixels_simd detect_simd()
+{
+    return PIXELS_SIMD_NEON;
+}
+
+
+// 16 pixels per iteration
+static void bgr_to_rgb_neon(const uint8_t *in, uint8_t *out, size_t nb)
+{
+    uint8x16x3_t v;
+    uint8x16_t tmp;
+
+    for ( ; nb >= 16 ; nb -= 16, in += 48, out += 48) {
+        v = vld3q_u8(in);
+        tmp = v.val[0];
+        v.val[0] = v.val[2];
+        v.val[2] = tmp;
+        vst3q_u8(out, v);
+    }
+    bgr_to_rgb_scalar(in, out, nb);
+}
+
+
+static void bgrx_to_rgb_neon(const uint8_t *in, uint8_t *out, size_t nb)
+{
+    uint8x16x4_t v;
+    uint8x16x3_t rgb;
+
+    for ( ; nb >= 16 ; nb -= 16, in += 64, out += 48) {
+        v = vld4q_u8(in);
+        rgb.val[0] = v.val[2];
+        rgb.val[1] = v.val[1];
+        rgb.val[2] = v.val[0];
+        vst3q_u8(out, rgb);
+    }
+    bgrx_to_rgb_scalar(in, out, nb);
+}
+
+
+// 2 bytes (16 samples) per iteration
+static void bits_to_bytes_neon(const uint8_t *in, uint8_t *out, size_t nb)
+{
+    static const uint8_t bits[16] = {
+        0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+        0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+    };
+    const uint8x16_t mask = vld1q_u8(bits);
+    const uint8x16_t zero = vdupq_n_u8(0);
+    uint8x16_t v;
+
+    for ( ; nb >= 16 ; nb -= 16, in += 2, out += 16) {
+        v = vcombine_u8(vdup_n_u8(in[0]), vdup_n_u8(in[1]));
+        vst1q_u8(out, vceqq_u8(vandq_u8(v, mask), zero));
+    }
+    bits_to_bytes_scalar(in, out, nb);
+}
+
+
+// 16 samples per iteration
+static void high_bytes_neon(const uint8_t *in, uint8_t *out, size_t nb)
+{
+    uint16x8_t a, b;
+
+    for ( ; nb >= 16 ; nb -= 16, in += 32, out += 16) {
+        a = vld1q_u16((const uint16_t *)in);
+        b = vld1q_u16((const uint16_t *)(in + 16));
+        vst1q_u8(out, vcombine_u8(vshrn_n_u16(a, 8), vshrn_n_u16(b, 8)));
+    }
+    high_bytes_scalar(in, out, nb);
+}
+
+
+static void interleave_neon(const uint8_t *red, const uint8_t *green, const uint8_t *blue,
+        uint8_t *out, size_t nb, size_t sampleSize)
+{
+    uint8x16x3_t v;
+    uint16x8x3_t w;
+
+    if (sampleSize == 2) {
+        for ( ; nb >= 8 ; nb -= 8, red += 16, green += 16, blue += 16, out += 48) {
+            w.val[0] = vld1q_u16((const uint16_t *)red);
+            w.val[1] = vld1q_u16((const uint16_t *)green);
+            w.val[2] = vld1q_u16((const uint16_t *)blue);
+            vst3q_u16((uint16_t *)out, w);
+        }
+    } else {
+        for ( ; nb >= 16 ; nb -= 16, red += 16, green += 16, blue += 16, out += 48) {
+            v.val[0] = vld1q_u8(red);
+            v.val[1] = vld1q_u8(green);
+            v.val[2] = vld1q_u8(blue);
+            vst3q_u8(out, v);
+        }
+    }
+    interleave_scalar(red, green, blue, out, nb, sampleSize);
+}
+
+#else
+
+static enum pixels_simd detect_simd()
+{
+    return PIXELS_SIMD_NONE;
+}
+
+#endif
+
+static const enum pixels_simd g_detected = detect_simd();
+static std::atomic<int> g_level(g_detected);
+
+
+const char *pixels_get_simd()
+{
+    switch (pixels_get_simd_level()) {
+        case PIXELS_SIMD_SSE2:
+            return "sse2";
+        case PIXELS_SIMD_SSSE3:
+            return "ssse3";
+        case PIXELS_SIMD_AVX2:
+            return "avx2";
+        case PIXELS_SIMD_NEON:
+            return "neon";
+        case PIXELS_SIMD_NONE:
+            break;
+    }
+    return "none";
+}
+
+
+enum pixels_simd pixels_set_simd(enum pixels_simd simd)
+{
+    if (g_detected == PIXELS_SIMD_NEON)
+        simd = (simd == PIXELS_SIMD_NONE ? PIXELS_SIMD_NONE : PIXELS_SIMD_NEON);
+    else if (simd > g_detected)
+        simd = g_detected;
+    g_level.store(simd);
+    return simd;
+}
+
+
+enum pixels_simd pixels_get_simd_level()
+{
+    return (enum pixels_simd)g_level.load(std::memory_order_relaxed);
+}
+
+
+void pixels_make_lut16(uint8_t lut[PIXELS_LUT16_SIZE], unsigned int black,
+        unsigned int white, double gamma)
+{
+    unsigned int v;
+    double level;
+
+    for (v = 0 ; v < PIXELS_LUT16_ENTRIES ; v++) {
+        if (v <= black) {
+            lut[v] = 0;
+        } else if (v >= white) {
+            lut[v] = 255;
+        } else {
+            level = (double)(v - black) / (double)(white - black);
+            lut[v] = (uint8_t)(pow(level, 1.0 / gamma) * 255.0 + 0.5);
+        }
+    }
+    memset(lut + PIXELS_LUT16_ENTRIES, 0, PIXELS_LUT16_SIZE - PIXELS_LUT16_ENTRIES);
+}
+
+
+size_t pixels_get_input_size(enum pixels_layout layout, size_t nb)
+{
+    switch (layout) {
+        case PIXELS_BGR:
+            return 3 * nb;
+        case PIXELS_BGRX:
+            return 4 * nb;
+        case PIXELS_BITS:
+            return (nb + 7) / 8;
+        case PIXELS_16_TO_LE:
+        case PIXELS_16_TO_8:
+            return 2 * nb;
+        case PIXELS_COPY:
+            break;
+    }
+    return nb;
+}
+
+
+size_t pixels_get_output_size(enum pixels_layout layout, size_t nb)
+{
+    switch (layout) {
+        case PIXELS_BGR:
+        case PIXELS_BGRX:
+            return 3 * nb;
+        case PIXELS_16_TO_LE:
+            return 2 * nb;
+        case PIXELS_BITS:
+        case PIXELS_16_TO_8:
+        case PIXELS_COPY:
+            break;
+    }
+    return nb;
+}
+
+
+void pixels_convert_line_scalar(enum pixels_layout layout, const uint8_t *in, uint8_t *out,
+        size_t nb, const uint8_t *lut)
+{
+    switch (layout) {
+        case PIXELS_COPY:
+            memcpy(out, in, nb);
+            break;
+        case PIXELS_BGR:
+            bgr_to_rgb_scalar(in, out, nb);
+            break;
+        case PIXELS_BGRX:
+            bgrx_to_rgb_scalar(in, out, nb);
+            break;
+        case PIXELS_BITS:
+            bits_to_bytes_scalar(in, out, nb);
+            break;
+        case PIXELS_16_TO_LE:
+            to_le16_scalar(in, out, nb);
+            break;
+        case PIXELS_16_TO_8:
+            if (lut != NULL)
+                lut16_scalar(in, out, nb, lut);
+            else
+                high_bytes_scalar(in, out, nb);
+            break;
+    }
+}
+
+
+void pixels_convert_line(enum pixels_layout layout, const uint8_t *in, uint8_t *out,
+        size_t nb, const uint8_t *lut)
+{
+    enum pixels_simd simd = pixels_get_simd_level();
+
+    switch (layout) {
+        case PIXELS_COPY:
+            memcpy(out, in, nb);
+            return;
+        case PIXELS_BGR:
+#ifdef PIXELS_X86
+            if (simd >= PIXELS_SIMD_SSSE3) {
+                bgr_to_rgb_ssse3(in, out, nb);
+                return;
+            }
+#elif defined(PIXELS_NEON)
+            if (simd == PIXELS_SIMD_NEON) {
+                bgr_to_rgb_neon(in, out, nb);
+                return;
+            }
+#endif
+            break;
+        case PIXELS_BGRX:
+#ifdef PIXELS_X86
+            if (simd >= PIXELS_SIMD_SSSE3) {
+                bgrx_to_rgb_ssse3(in, out, nb);
+                return;
+            }
+#elif defined(PIXELS_NEON)
+            if (simd == PIXELS_SIMD_NEON) {
+                bgrx_to_rgb_neon(in, out, nb);
+                return;
+            }
+#endif
+            break;
+        case PIXELS_BITS:
+#ifdef PIXELS_X86
+            if (simd >= PIXELS_SIMD_AVX2) {
+                bits_to_bytes_avx2(in, out, nb);
+                return;
+            }
+            if (simd >= PIXELS_SIMD_SSE2) {
+                bits_to_bytes_sse2(in, out, nb);
+                return;
+            }
+#elif defined(PIXELS_NEON)
+            if (simd == PIXELS_SIMD_NEON) {
+                bits_to_bytes_neon(in, out, nb);
+                return;
+            }
+#endif
+            break;
+        case PIXELS_16_TO_LE:
+            // a copy on little endian hosts
+            break;
+        case PIXELS_16_TO_8:
+#ifdef PIXELS_X86
+            if (lut != NULL) {
+                if (simd >= PIXELS_SIMD_AVX2) {
+                    lut16_avx2(in, out, nb, lut);
+                    return;
+                }
+                break;
+            }
+            if (simd >= PIXELS_SIMD_AVX2) {
+                high_bytes_avx2(in, out, nb);
+                return;
+            }
+            if (simd >= PIXELS_SIMD_SSE2) {
+                high_bytes_sse2(in, out, nb);
+                return;
+            }
+#elif defined(PIXELS_NEON)
+            if (lut == NULL && simd == PIXELS_SIMD_NEON) {
+                high_bytes_neon(in, out, nb);
+                return;
+            }
+#endif
+            break;
+    }
+    (void)simd;
+    pixels_convert_line_scalar(layout, in, out, nb, lut);
+}
+
+
+void pixels_convert_lines(enum pixels_layout layout, const uint8_t *in, size_t inStride,
+        uint8_t *out, ptrdiff_t outStride, size_t nb, int nbLines, bool scalar,
+        const uint8_t *lut)
+{
+    int y;
+
+    for (y = 0 ; y < nbLines ; y++, in += inStride, out += outStride) {
+        if (scalar)
+            pixels_convert_line_scalar(layout, in, out, nb, lut);
+        else
+            pixels_convert_line(layout, in, out, nb, lut);
+    }
+}
+
+
+void pixels_interleave_line(const uint8_t *red, const uint8_t *green, const uint8_t *blue,
+        uint8_t *out, size_t nb, size_t sampleSize, bool scalar)
+{
+    enum pixels_simd simd = pixels_get_simd_level();
+
+    if (!scalar) {
+#ifdef PIXELS_X86
+        if (simd >= PIXELS_SIMD_SSSE3) {
+            interleave_ssse3(red, green, blue, out, nb, sampleSize);
+            return;
+        }
+#elif defined(PIXELS_NEON)
+        if (simd == PIXELS_SIMD_NEON) {
+            interleave_neon(red, green, blue, out, nb, sampleSize);
+            return;
+        }
+#endif
+    }
+    (void)simd;
+    interleave_scalar(red, green, blue, out, nb, sampleSize);
+}
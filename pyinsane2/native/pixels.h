@@ -0,0 +1,91 @@
+#ifndef __PYINSANE_NATIVE_PIXELS_H
+#define __PYINSANE_NATIVE_PIXELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Row kernels turning the lines of a bitmap as sent by the drivers into
+ * tightly packed top-down lines, as expected by PIL:
+ * - WIA: bottom-up or top-down, BGR or BGRX, padded to a multiple of 4 bytes
+ * - SANE: 1 bit per sample (1 = black), padded to 'bytes_per_line'
+ * - SANE: 16 bits per sample, in the byte order of the host
+ * - SANE: one frame per color (three-pass scanners), to interleave
+ *
+ * Each kernel has SIMD versions (SSE2 / SSSE3 / AVX2 on x86, selected at
+ * runtime ; NEON on ARM) and a scalar one. The scalar ones are the reference:
+ * all of them must always return the same result. No compiler flag is
+ * required: the SIMD versions are built for their own target only.
+ */
+
+enum pixels_layout {
+    PIXELS_COPY = 0, // 1 or 8 bits per pixel: copied as is
+    PIXELS_BGR, // 24 bits per pixel, output as RGB
+    PIXELS_BGRX, // 32 bits per pixel, output as RGB
+    PIXELS_BITS, // 1 bit per sample, MSB first, output as 0x00 (1) / 0xFF (0)
+    PIXELS_16_TO_LE, // 16 bits per sample, host byte order, output as little endian
+    PIXELS_16_TO_8, // 16 bits per sample, host byte order, output as lut[sample] or >> 8
+};
+
+/*
+ * Tables of PIXELS_16_TO_8: one entry per 16-bit value. The last bytes are
+ * never used as such: they allow reading an entry with 32-bit loads.
+ */
+#define PIXELS_LUT16_ENTRIES 65536
+#define PIXELS_LUT16_SIZE (PIXELS_LUT16_ENTRIES + 4)
+
+// Instruction sets, from the slowest to the fastest
+enum pixels_simd {
+    PIXELS_SIMD_NONE = 0,
+    PIXELS_SIMD_SSE2,
+    PIXELS_SIMD_SSSE3,
+    PIXELS_SIMD_AVX2,
+    PIXELS_SIMD_NEON,
+};
+
+// "avx2", "ssse3", "sse2", "neon" or "none": the best one in use
+const char *pixels_get_simd();
+/*!
+ * Restricts the kernels to the instruction sets up to 'simd' (for tests and
+ * benchmarks). Returns what is actually used: never more than what the CPU
+ * supports.
+ */
+enum pixels_simd pixels_set_simd(enum pixels_simd simd);
+enum pixels_simd pixels_get_simd_level();
+
+/*!
+ * Levels: 'black' and below become 0, 'white' and above become 255, with
+ * 'gamma' (> 0) applied in between (> 1: brighter midtones).
+ */
+void pixels_make_lut16(uint8_t lut[PIXELS_LUT16_SIZE], unsigned int black,
+        unsigned int white, double gamma);
+
+// 'nbBytes' of the output line with PIXELS_COPY, number of pixels (or
+// samples with PIXELS_BITS and PIXELS_16_*) otherwise. 'lut': PIXELS_16_TO_8
+// only (NULL: the most significant byte of each sample)
+void pixels_convert_line(enum pixels_layout layout, const uint8_t *in, uint8_t *out,
+        size_t nb, const uint8_t *lut = NULL);
+void pixels_convert_line_scalar(enum pixels_layout layout, const uint8_t *in, uint8_t *out,
+        size_t nb, const uint8_t *lut = NULL);
+
+// bytes of input and output required for 'nb' (see above)
+size_t pixels_get_input_size(enum pixels_layout layout, size_t nb);
+size_t pixels_get_output_size(enum pixels_layout layout, size_t nb);
+
+/*!
+ * Converts 'nbLines' lines of 'inStride' bytes. Output lines are 'outStride'
+ * bytes apart: a negative 'outStride' flips the image ('out' must then point
+ * to the last line).
+ */
+void pixels_convert_lines(enum pixels_layout layout, const uint8_t *in, size_t inStride,
+        uint8_t *out, ptrdiff_t outStride, size_t nb, int nbLines, bool scalar = false,
+        const uint8_t *lut = NULL);
+
+/*!
+ * Interleaves 'nb' samples of 'sampleSize' bytes (1 or 2) of each plane
+ * into RGB pixels ('out': 3 * nb * sampleSize bytes)
+ */
+void pixels_interleave_line(const uint8_t *red, const uint8_t *green, const uint8_t *blue,
+        uint8_t *out, size_t nb, size_t sampleSize, bool scalar = false);
+
+#endif
@@ -0,0 +1,114 @@
+#include <assert.h>
+#include <stdlib.h>
+
+#include <new>
+
+#include "pool.h"
+
+
+PyinsaneBufferPool::PyinsaneBufferPool(size_t slabSize, unsigned int maxFree)
+    : mSlabSize(slabSize), mMaxFree(maxFree), mRefCount(1), mNbAllocated(0),
+    mNbRecycled(0)
+{
+}
+
+
+PyinsaneBufferPool::~PyinsaneBufferPool()
+{
+    std::vector<struct pool_slab *>::iterator it;
+
+    for (it = mFree.begin() ; it != mFree.end() ; it++) {
+        free(*it);
+    }
+}
+
+
+struct pool_slab *PyinsaneBufferPool::Acquire()
+{
+    struct pool_slab *slab = NULL;
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (!mFree.empty()) {
+            slab = mFree.back();
+            mFree.pop_back();
+            mNbRecycled++;
+        }
+    }
+
+    if (slab == NULL) {
+        // header and data in one allocation
+        slab = (struct pool_slab *)malloc(sizeof(struct pool_slab) + mSlabSize);
+        if (slab == NULL)
+            return NULL;
+        new (&slab->refcount) std::atomic<int>(0);
+        slab->pool = this;
+        slab->size = mSlabSize;
+        slab->data = (char *)(slab + 1);
+        mNbAllocated++;
+    }
+
+    slab->refcount.store(1);
+    AddRef(); // each slab in use keeps the pool alive
+    return slab;
+}
+
+
+void PyinsaneBufferPool::Recycle(struct pool_slab *slab)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mFree.size() < mMaxFree) {
+            mFree.push_back(slab);
+            slab = NULL;
+        }
+    }
+    free(slab);
+    Release();
+}
+
+
+void PyinsaneBufferPool::AddRef()
+{
+    mRefCount++;
+}
+
+
+void PyinsaneBufferPool::Release()
+{
+    if (--mRefCount == 0) {
+        delete this;
+    }
+}
+
+
+size_t PyinsaneBufferPool::GetSlabSize() const
+{
+    return mSlabSize;
+}
+
+
+unsigned long PyinsaneBufferPool::GetNbAllocated() const
+{
+    return mNbAllocated.load();
+}
+
+
+unsigned long PyinsaneBufferPool::GetNbRecycled() const
+{
+    return mNbRecycled.load();
+}
+
+
+void slab_ref(struct pool_slab *slab)
+{
+    slab->refcount++;
+}
+
+
+void slab_unref(struct pool_slab *slab)
+{
+    if (--slab->refcount == 0) {
+        slab->pool->Recycle(slab);
+    }
+}
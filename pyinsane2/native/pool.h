@@ -0,0 +1,60 @@
+#ifndef __PYINSANE_NATIVE_POOL_H
+#define __PYINSANE_NATIVE_POOL_H
+
+#include <atomic>
+#include <mutex>
+#include <stddef.h>
+#include <vector>
+
+class PyinsaneBufferPool;
+
+struct pool_slab {
+    std::atomic<int> refcount;
+    PyinsaneBufferPool *pool;
+    size_t size;
+    char *data;
+};
+
+/*!
+ * Pool of fixed-size slabs, filled directly by the driver thread and handed
+ * as-is to Python.
+ *
+ * The pool never blocks: if no slab is free, a new one is allocated (the
+ * caller may keep as many buffers as it wants). When released, slabs go back
+ * to the pool, up to 'maxFree' of them.
+ *
+ * Both the pool and the slabs are refcounted: buffers may outlive the scan
+ * that produced them.
+ */
+class PyinsaneBufferPool
+{
+public:
+    PyinsaneBufferPool(size_t slabSize, unsigned int maxFree);
+
+    struct pool_slab *Acquire();
+
+    void AddRef();
+    void Release();
+
+    size_t GetSlabSize() const;
+    unsigned long GetNbAllocated() const;
+    unsigned long GetNbRecycled() const;
+
+private:
+    ~PyinsaneBufferPool();
+    void Recycle(struct pool_slab *slab);
+    friend void slab_unref(struct pool_slab *slab);
+
+    size_t mSlabSize;
+    unsigned int mMaxFree;
+    std::atomic<int> mRefCount;
+    std::atomic<unsigned long> mNbAllocated;
+    std::atomic<unsigned long> mNbRecycled;
+    std::mutex mMutex;
+    std::vector<struct pool_slab *> mFree;
+};
+
+void slab_ref(struct pool_slab *slab);
+void slab_unref(struct pool_slab *slab);
+
+#endif
@@ -0,0 +1,378 @@
+#include <string.h>
+
+#include <thread>
+
+#include "record.h"
+
+// File header: magic, version, backend, flags
+#define RECORD_MAGIC "PYIREC"
+#define RECORD_MAGIC_SIZE 6
+#define RECORD_VERSION 1
+#define RECORD_FLAG_DATA 0x01
+
+
+PyinsaneTransferRecorder::PyinsaneTransferRecorder(const char *path,
+        enum record_backend backend, bool withData)
+    : mWithData(withData), mValid(true), mLast(std::chrono::steady_clock::now())
+{
+    uint8_t header[3];
+
+    mFile = fopen(path, "wb");
+    if (mFile == NULL) {
+        mValid = false;
+        return;
+    }
+    header[0] = RECORD_VERSION;
+    header[1] = (uint8_t)backend;
+    header[2] = (withData ? RECORD_FLAG_DATA : 0);
+    Put(RECORD_MAGIC, RECORD_MAGIC_SIZE);
+    Put(header, sizeof(header));
+}
+
+
+PyinsaneTransferRecorder::~PyinsaneTransferRecorder()
+{
+    Close();
+}
+
+
+bool PyinsaneTransferRecorder::IsValid()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mValid;
+}
+
+
+void PyinsaneTransferRecorder::Put(const void *data, size_t nbBytes)
+{
+    if (!mValid || mFile == NULL)
+        return; // failed or closed
+    if (fwrite(data, 1, nbBytes, mFile) != nbBytes)
+        mValid = false;
+}
+
+
+void PyinsaneTransferRecorder::PutVarint(uint64_t value)
+{
+    uint8_t out[10];
+    size_t nb = 0;
+
+    do {
+        out[nb] = (uint8_t)(value & 0x7F);
+        value >>= 7;
+        if (value != 0)
+            out[nb] |= 0x80;
+        nb++;
+    } while (value != 0);
+    Put(out, nb);
+}
+
+
+void PyinsaneTransferRecorder::PutSigned(int64_t value)
+{
+    // zigzag: small negative values stay small
+    PutVarint(((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+
+void PyinsaneTransferRecorder::Begin(enum record_event_type type)
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    uint8_t t = (uint8_t)type;
+
+    Put(&t, 1);
+    PutVarint(std::chrono::duration_cast<std::chrono::microseconds>(now - mLast).count());
+    mLast = now;
+}
+
+
+void PyinsaneTransferRecorder::OnParameters(const struct record_parameters *parameters)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    Begin(RECORD_PARAMETERS);
+    PutSigned(parameters->format);
+    PutSigned(parameters->lastFrame);
+    PutSigned(parameters->bytesPerLine);
+    PutSigned(parameters->pixelsPerLine);
+    PutSigned(parameters->lines);
+    PutSigned(parameters->depth);
+}
+
+
+void PyinsaneTransferRecorder::OnChunk(const void *data, size_t nbBytes)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    Begin(RECORD_CHUNK);
+    PutVarint(nbBytes);
+    if (mWithData)
+        Put(data, nbBytes);
+}
+
+
+void PyinsaneTransferRecorder::OnStatus(int percent, uint64_t bytes)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    Begin(RECORD_STATUS);
+    PutSigned(percent);
+    PutVarint(bytes);
+}
+
+
+void PyinsaneTransferRecorder::OnEndOfPage()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    Begin(RECORD_END_OF_PAGE);
+}
+
+
+void PyinsaneTransferRecorder::OnEndOfScan(long status)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    Begin(RECORD_END_OF_SCAN);
+    PutSigned(status);
+    if (mValid && mFile != NULL && fflush(mFile) != 0)
+        mValid = false;
+}
+
+
+void PyinsaneTransferRecorder::Close()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    if (mFile == NULL)
+        return;
+    if (fclose(mFile) != 0)
+        mValid = false;
+    mFile = NULL;
+}
+
+
+// Reads the recording. Returns false once there is nothing left or if it is
+// truncated.
+class RecordReader
+{
+public:
+    RecordReader(const std::vector<uint8_t> &data) : mData(data), mPosition(0) { }
+
+    bool AtEnd() const
+    {
+        return mPosition >= mData.size();
+    }
+
+    size_t GetPosition() const
+    {
+        return mPosition;
+    }
+
+    bool Get(uint8_t *out)
+    {
+        if (AtEnd())
+            return false;
+        *out = mData[mPosition++];
+        return true;
+    }
+
+    bool GetVarint(uint64_t *out)
+    {
+        uint8_t byte;
+        int shift;
+
+        *out = 0;
+        for (shift = 0 ; shift < 64 ; shift += 7) {
+            if (!Get(&byte))
+                return false;
+            *out |= (uint64_t)(byte & 0x7F) << shift;
+            if (!(byte & 0x80))
+                return true;
+        }
+        return false;
+    }
+
+    bool GetSigned(int64_t *out)
+    {
+        uint64_t value;
+
+        if (!GetVarint(&value))
+            return false;
+        *out = (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+        return true;
+    }
+
+    bool GetInt(int *out)
+    {
+        int64_t value;
+
+        if (!GetSigned(&value))
+            return false;
+        *out = (int)value;
+        return true;
+    }
+
+    bool Skip(uint64_t nbBytes)
+    {
+        if (nbBytes > mData.size() - mPosition)
+            return false;
+        mPosition += nbBytes;
+        return true;
+    }
+
+private:
+    const std::vector<uint8_t> &mData;
+    size_t mPosition;
+};
+
+
+PyinsaneTransferReplay::PyinsaneTransferReplay()
+    : mBackend(RECORD_BACKEND_SANE), mWithData(false), mNext(0)
+{
+}
+
+
+bool PyinsaneTransferReplay::Load(const char *path)
+{
+    struct record_event event;
+    uint8_t type;
+    uint64_t delta, value;
+    int64_t svalue;
+    double time = 0.0;
+    int page = 0;
+    uint64_t pageOffset = 0;
+    bool ok;
+    FILE *fp;
+    size_t nb;
+    uint8_t buf[64 * 1024];
+
+    mEvents.clear();
+    mData.clear();
+    Rewind();
+
+    fp = fopen(path, "rb");
+    if (fp == NULL)
+        return false;
+    while ((nb = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        mData.insert(mData.end(), buf, buf + nb);
+    }
+    ok = !ferror(fp);
+    fclose(fp);
+    if (!ok || mData.size() < RECORD_MAGIC_SIZE + 3
+            || memcmp(mData.data(), RECORD_MAGIC, RECORD_MAGIC_SIZE) != 0
+            || mData[RECORD_MAGIC_SIZE] != RECORD_VERSION) {
+        mData.clear();
+        return false;
+    }
+    mBackend = (enum record_backend)mData[RECORD_MAGIC_SIZE + 1];
+    mWithData = (mData[RECORD_MAGIC_SIZE + 2] & RECORD_FLAG_DATA) != 0;
+
+    // chunks point to their data in the file, kept as is. A truncated
+    // recording (crash during the scan, etc) is replayed up to where it stops.
+    RecordReader reader(mData);
+    reader.Skip(RECORD_MAGIC_SIZE + 3);
+    while (!reader.AtEnd()) {
+        memset(&event, 0, sizeof(event));
+        if (!reader.Get(&type) || !reader.GetVarint(&delta))
+            break;
+        time += delta / 1000000.0;
+        event.type = (enum record_event_type)type;
+        event.time = time;
+
+        switch (type) {
+            case RECORD_PARAMETERS:
+                ok = (reader.GetInt(&event.parameters.format)
+                        && reader.GetInt(&event.parameters.lastFrame)
+                        && reader.GetInt(&event.parameters.bytesPerLine)
+                        && reader.GetInt(&event.parameters.pixelsPerLine)
+                        && reader.GetInt(&event.parameters.lines)
+                        && reader.GetInt(&event.parameters.depth));
+                break;
+            case RECORD_CHUNK:
+                ok = reader.GetVarint(&value);
+                event.size = (size_t)value;
+                event.page = page;
+                event.pageOffset = pageOffset;
+                event.dataOffset = reader.GetPosition();
+                pageOffset += value;
+                if (ok && mWithData)
+                    ok = reader.Skip(value);
+                break;
+            case RECORD_STATUS:
+                ok = (reader.GetSigned(&event.values[0]) && reader.GetVarint(&value));
+                event.values[1] = (int64_t)value;
+                break;
+            case RECORD_END_OF_PAGE:
+                page++;
+                pageOffset = 0;
+                ok = true;
+                break;
+            case RECORD_END_OF_SCAN:
+                ok = reader.GetSigned(&svalue);
+                event.values[0] = svalue;
+                break;
+            default:
+                ok = false;
+                break;
+        }
+        if (!ok)
+            break;
+        mEvents.push_back(event);
+    }
+    return true;
+}
+
+
+enum record_backend PyinsaneTransferReplay::GetBackend() const
+{
+    return mBackend;
+}
+
+
+bool PyinsaneTransferReplay::HasData() const
+{
+    return mWithData;
+}
+
+
+const std::vector<struct record_event> &PyinsaneTransferReplay::GetEvents() const
+{
+    return mEvents;
+}
+
+
+void PyinsaneTransferReplay::Rewind()
+{
+    mNext = 0;
+}
+
+
+bool PyinsaneTransferReplay::Next(double speed, struct record_event *event)
+{
+    if (mNext >= mEvents.size())
+        return false;
+    if (mNext == 0)
+        mStart = std::chrono::steady_clock::now();
+    *event = mEvents[mNext++];
+    if (speed > 0) {
+        std::this_thread::sleep_until(mStart + std::chrono::duration_cast<
+                std::chrono::steady_clock::duration>(
+                    std::chrono::duration<double>(event->time / speed)));
+    }
+    return true;
+}
+
+
+void PyinsaneTransferReplay::GetChunk(const struct record_event *event, void *out) const
+{
+    uint8_t *dst = (uint8_t *)out;
+    size_t i;
+
+    if (mWithData) {
+        memcpy(out, mData.data() + event->dataOffset, event->size);
+        return;
+    }
+    for (i = 0 ; i < event->size ; i++) {
+        dst[i] = (uint8_t)((event->pageOffset + i + event->page * 7) % 251);
+    }
+}
@@ -0,0 +1,130 @@
+#ifndef __PYINSANE_NATIVE_RECORD_H
+#define __PYINSANE_NATIVE_RECORD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define NATIVE_PYCAPSULE_RECORDER_NAME "Pyinsane transfer recorder"
+#define NATIVE_PYCAPSULE_REPLAY_NAME "Pyinsane transfer replay"
+
+enum record_backend {
+    RECORD_BACKEND_SANE = 0,
+    RECORD_BACKEND_WIA = 1,
+};
+
+enum record_event_type {
+    RECORD_PARAMETERS = 1,
+    RECORD_CHUNK = 2,
+    RECORD_STATUS = 3, // progress reported by the driver
+    RECORD_END_OF_PAGE = 4,
+    RECORD_END_OF_SCAN = 5,
+};
+
+// Same fields as SANE_Parameters. WIA fills them from the item properties,
+// with 'format' = -1 (the data are a file: BMP, TIFF, etc).
+struct record_parameters {
+    int format;
+    int lastFrame;
+    int bytesPerLine;
+    int pixelsPerLine;
+    int lines;
+    int depth;
+};
+
+struct record_event {
+    enum record_event_type type;
+    double time; // seconds since the start of the recording
+    // RECORD_CHUNK: number of bytes, page they belong to and where they
+    // start in this page
+    size_t size;
+    int page;
+    uint64_t pageOffset;
+    size_t dataOffset; // in the data of the replay, if it has any
+    // RECORD_STATUS: percent, bytes ; RECORD_END_OF_SCAN: status
+    int64_t values[2];
+    struct record_parameters parameters; // RECORD_PARAMETERS
+};
+
+/*!
+ * Writes everything a driver does during a transfer in a compact binary file:
+ * each event has a type and a timestamp (microseconds since the previous
+ * event), and its arguments, all stored as variable-length integers. Chunks
+ * include their data only if 'withData' is true: without them, a recording
+ * only describes the timing and the sizes (see PyinsaneTransferReplay).
+ *
+ * Thread-safe: events may come from the thread of the driver and from the
+ * thread of the application. Errors (disk full, etc) are sticky: once a write
+ * failed, the following events are dropped and IsValid() returns false.
+ */
+class PyinsaneTransferRecorder
+{
+public:
+    PyinsaneTransferRecorder(const char *path, enum record_backend backend, bool withData);
+    ~PyinsaneTransferRecorder();
+
+    bool IsValid();
+
+    void OnParameters(const struct record_parameters *parameters);
+    void OnChunk(const void *data, size_t nbBytes);
+    void OnStatus(int percent, uint64_t bytes);
+    void OnEndOfPage();
+    void OnEndOfScan(long status);
+    // flushes the file ; implicit on destruction
+    void Close();
+
+private:
+    void Begin(enum record_event_type type);
+    void PutVarint(uint64_t value);
+    void PutSigned(int64_t value);
+    void Put(const void *data, size_t nbBytes);
+
+    std::mutex mMutex;
+    FILE *mFile;
+    bool mWithData;
+    bool mValid;
+    std::chrono::steady_clock::time_point mLast;
+};
+
+/*!
+ * A recording loaded in memory, to feed it back to the code that consumes the
+ * transfers. Chunks recorded without their data are replayed with the same
+ * pattern as the fake drivers: (offset in the page + page * 7) % 251.
+ *
+ * Next() waits until the event is due, according to the timestamps of the
+ * recording divided by 'speed' (<= 0: no waiting at all). Time is counted from
+ * the first call to Next(), or from Rewind(). Not thread-safe.
+ */
+class PyinsaneTransferReplay
+{
+public:
+    PyinsaneTransferReplay();
+
+    // false if the file is missing or isn't a valid recording
+    bool Load(const char *path);
+
+    enum record_backend GetBackend() const;
+    bool HasData() const;
+    const std::vector<struct record_event> &GetEvents() const;
+
+    void Rewind();
+    // false at the end of the recording
+    bool Next(double speed, struct record_event *event);
+    // data of a chunk returned by Next() ; recorded or generated
+    void GetChunk(const struct record_event *event, void *out) const;
+
+private:
+    enum record_backend mBackend;
+    bool mWithData;
+    std::vector<struct record_event> mEvents;
+    std::vector<uint8_t> mData;
+    size_t mNext;
+    std::chrono::steady_clock::time_point mStart;
+};
+
+#endif
@@ -0,0 +1,332 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+
+
+PyinsaneRing::PyinsaneRing(size_t maxBytes, size_t slabSize, unsigned int nbSlots)
+    : mMaxBytes(maxBytes), mCurrent(NULL), mFill(0), mPublished(0),
+    mMinBytes(0), mRowSize(0), mMaxDelay(0), mHead(0), mTail(0),
+    mBuffered(0), mToken(new PyinsaneCancelToken()), mNbRecords(0), mNbWakeUps(0),
+    mConsumerWaiting(false), mProducerWaiting(false)
+{
+    unsigned int size;
+
+    // round up to a power of 2 so we can use a mask instead of a modulo
+    for (size = 2 ; size < nbSlots ; size <<= 1)
+    { }
+    mMask = size - 1;
+    mSlots = (struct ring_record *)calloc(size, sizeof(struct ring_record));
+
+    // enough free slabs to cycle through them when the ring is full
+    mPool = new PyinsaneBufferPool(slabSize, (unsigned int)(maxBytes / slabSize) + 2);
+}
+
+
+PyinsaneRing::~PyinsaneRing()
+{
+    size_t head;
+    size_t tail = mTail.load();
+
+    for (head = mHead.load() ; head != tail ; head++) {
+        if (mSlots[head & mMask].slab != NULL)
+            slab_unref(mSlots[head & mMask].slab);
+    }
+    free(mSlots);
+    if (mCurrent != NULL)
+        slab_unref(mCurrent);
+    mPool->Release();
+    mToken->Release();
+}
+
+
+void PyinsaneRing::WakeUp(std::atomic<bool> *waiting)
+{
+    // The other side sets its flag *before* checking the indexes one last
+    // time, and we check its flag *after* updating them: at least one of us
+    // sees the other.
+    if (waiting->load()) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mCond.notify_all();
+    }
+}
+
+
+bool PyinsaneRing::WaitForRoom(size_t nbBytes)
+{
+    // Always accept a record when nothing is buffered, even if it is bigger
+    // than mMaxBytes. Otherwise we would wait forever.
+    auto has_room = [&]() {
+        size_t buffered = mBuffered.load();
+        return mToken->IsCancelled()
+            || ((mTail.load() - mHead.load()) <= mMask
+                && (buffered == 0 || buffered + nbBytes <= mMaxBytes));
+    };
+
+    if (has_room())
+        return !mToken->IsCancelled();
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    mProducerWaiting.store(true);
+    while (!has_room()) {
+        mCond.wait(lock);
+    }
+    mProducerWaiting.store(false);
+    return !mToken->IsCancelled();
+}
+
+
+bool PyinsaneRing::Push(enum ring_record_type type, struct pool_slab *slab,
+        size_t offset, size_t nbBytes)
+{
+    size_t tail = mTail.load(std::memory_order_relaxed);
+    struct ring_record *record = &mSlots[tail & mMask];
+
+    record->type = type;
+    record->slab = slab;
+    record->offset = offset;
+    record->nb_bytes = nbBytes;
+    mBuffered += nbBytes;
+    mTail.store(tail + 1);
+    mNbRecords++;
+
+    WakeUp(&mConsumerWaiting);
+    return true;
+}
+
+
+void PyinsaneRing::SetCoalescing(size_t minBytes, size_t rowSize, unsigned int maxDelayMs)
+{
+    // never keep more than what the consumer is allowed to buffer
+    mMinBytes = (minBytes < mMaxBytes ? minBytes : mMaxBytes);
+    mRowSize = rowSize;
+    mMaxDelay = std::chrono::milliseconds(maxDelayMs);
+}
+
+
+bool PyinsaneRing::ShouldFlush()
+{
+    size_t pending = mFill - mPublished;
+
+    if (pending == 0)
+        return false;
+    if (pending >= mMinBytes)
+        return true;
+    if (mRowSize > 0 && pending >= mRowSize)
+        return true;
+    return (mMaxDelay.count() > 0
+        && std::chrono::steady_clock::now() - mPendingSince >= mMaxDelay);
+}
+
+
+bool PyinsaneRing::Flush()
+{
+    size_t nb = mFill - mPublished;
+
+    if (nb == 0)
+        return !mToken->IsCancelled();
+    if (!WaitForRoom(nb))
+        return false;
+    slab_ref(mCurrent);
+    Push(RING_DATA, mCurrent, mPublished, nb);
+    mPublished = mFill;
+    return true;
+}
+
+
+bool PyinsaneRing::NextSlab()
+{
+    if (mCurrent != NULL && mFill < mCurrent->size)
+        return true;
+    if (mCurrent != NULL) {
+        if (!Flush())
+            return false;
+        slab_unref(mCurrent);
+    }
+    mCurrent = mPool->Acquire();
+    mFill = 0;
+    mPublished = 0;
+    return (mCurrent != NULL);
+}
+
+
+bool PyinsaneRing::Write(const void *data, size_t nbBytes)
+{
+    const char *cdata = (const char *)data;
+    size_t nb;
+
+    if (mFill == mPublished && mMaxDelay.count() > 0)
+        mPendingSince = std::chrono::steady_clock::now();
+
+    for ( ; nbBytes > 0 ; nbBytes -= nb, cdata += nb) {
+        if (!NextSlab())
+            return false;
+
+        nb = mCurrent->size - mFill;
+        if (nb > nbBytes)
+            nb = nbBytes;
+
+        // the only copy: from the memory of the driver to the slab
+        memcpy(mCurrent->data + mFill, cdata, nb);
+        mFill += nb;
+    }
+
+    if (ShouldFlush())
+        return Flush();
+    return !mToken->IsCancelled();
+}
+
+
+void *PyinsaneRing::Reserve(size_t *nbBytes)
+{
+    if (mToken->IsCancelled() || !NextSlab())
+        return NULL;
+    if (*nbBytes > mCurrent->size - mFill)
+        *nbBytes = mCurrent->size - mFill;
+    return mCurrent->data + mFill;
+}
+
+
+bool PyinsaneRing::Commit(size_t nbBytes)
+{
+    assert(mCurrent != NULL && mFill + nbBytes <= mCurrent->size);
+
+    if (nbBytes == 0)
+        return Tick();
+    if (mFill == mPublished && mMaxDelay.count() > 0)
+        mPendingSince = std::chrono::steady_clock::now();
+    mFill += nbBytes;
+    if (ShouldFlush())
+        return Flush();
+    return !mToken->IsCancelled();
+}
+
+
+bool PyinsaneRing::Tick()
+{
+    if (ShouldFlush())
+        return Flush();
+    return !mToken->IsCancelled();
+}
+
+
+bool PyinsaneRing::EndOfPage()
+{
+    if (!Flush() || !WaitForRoom(0))
+        return false;
+    return Push(RING_END_OF_PAGE, NULL, 0, 0);
+}
+
+
+bool PyinsaneRing::EndOfScan()
+{
+    if (!Flush() || !WaitForRoom(0))
+        return false;
+    return Push(RING_END_OF_SCAN, NULL, 0, 0);
+}
+
+
+bool PyinsaneRing::Front(struct ring_record *out, bool block)
+{
+    size_t head = mHead.load(std::memory_order_relaxed);
+    auto has_data = [&]() {
+        return mToken->IsCancelled() || head != mTail.load();
+    };
+
+    if (!has_data()) {
+        if (!block)
+            return false;
+
+        std::unique_lock<std::mutex> lock(mMutex);
+        mConsumerWaiting.store(true);
+        while (!has_data()) {
+            mCond.wait(lock);
+        }
+        mConsumerWaiting.store(false);
+        mNbWakeUps++;
+    }
+
+    if (mToken->IsCancelled())
+        return false;
+
+    *out = mSlots[head & mMask];
+    return true;
+}
+
+
+void PyinsaneRing::Pop()
+{
+    size_t head = mHead.load(std::memory_order_relaxed);
+    struct ring_record *slot = &mSlots[head & mMask];
+
+    assert(head != mTail.load());
+
+    if (slot->slab != NULL)
+        slab_unref(slot->slab);
+    mBuffered -= slot->nb_bytes;
+    slot->slab = NULL;
+    slot->nb_bytes = 0;
+    mHead.store(head + 1);
+
+    WakeUp(&mProducerWaiting);
+}
+
+
+void PyinsaneRing::Discard()
+{
+    // frees what the consumer won't read anyway
+    while (mHead.load(std::memory_order_relaxed) != mTail.load()) {
+        Pop();
+    }
+}
+
+
+void PyinsaneRing::Abort()
+{
+    mToken->Cancel();
+    std::lock_guard<std::mutex> lock(mMutex);
+    mCond.notify_all();
+}
+
+
+bool PyinsaneRing::IsAborted() const
+{
+    return mToken->IsCancelled();
+}
+
+
+size_t PyinsaneRing::GetBuffered() const
+{
+    return mBuffered.load();
+}
+
+
+size_t PyinsaneRing::GetMaxBytes() const
+{
+    return mMaxBytes;
+}
+
+
+PyinsaneCancelToken *PyinsaneRing::GetCancelToken() const
+{
+    return mToken;
+}
+
+
+PyinsaneBufferPool *PyinsaneRing::GetPool() const
+{
+    return mPool;
+}
+
+
+unsigned long PyinsaneRing::GetNbRecords() const
+{
+    return mNbRecords.load();
+}
+
+
+unsigned long PyinsaneRing::GetNbWakeUps() const
+{
+    return mNbWakeUps.load();
+}
@@ -0,0 +1,118 @@
+#ifndef __PYINSANE_NATIVE_RING_H
+#define __PYINSANE_NATIVE_RING_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stddef.h>
+
+#include "cancel.h"
+#include "pool.h"
+
+#define NATIVE_PYCAPSULE_RING_NAME "Pyinsane ring"
+
+enum ring_record_type {
+    RING_DATA = 0,
+    RING_END_OF_PAGE,
+    RING_END_OF_SCAN,
+};
+
+struct ring_record {
+    enum ring_record_type type;
+    struct pool_slab *slab;
+    size_t offset;
+    size_t nb_bytes;
+};
+
+/*!
+ * Single-producer / single-consumer queue between the thread of the driver
+ * (producer) and the thread calling Scan.read() (consumer).
+ *
+ * Neither side needs the GIL. The fast path is lock-free: the mutex and the
+ * condition are only used to put one side to sleep when the queue is empty
+ * (consumer) or when more than 'maxBytes' are already buffered (producer).
+ *
+ * Data are written directly in slabs of a PyinsaneBufferPool. Each record
+ * references a region of a slab; consecutive writes share the same slab
+ * until it is full.
+ *
+ * Some drivers write a few bytes at a time. To not wake up the consumer for
+ * each of them, writes can be coalesced (see SetCoalescing()): they are only
+ * published once 'minBytes' (or a whole line of 'rowSize' bytes) are pending,
+ * or once the oldest pending byte is 'maxDelayMs' old. Deadlines are checked
+ * on each Write() and each Tick().
+ *
+ * Producers that can write wherever they are told (sane_read() for instance)
+ * can skip the copy of Write(): Reserve() returns the free part of the current
+ * slab, and Commit() publishes what has been written there.
+ */
+class PyinsaneRing
+{
+public:
+    PyinsaneRing(size_t maxBytes, size_t slabSize, unsigned int nbSlots = 1024);
+    ~PyinsaneRing();
+
+    // producer side
+    void SetCoalescing(size_t minBytes, size_t rowSize, unsigned int maxDelayMs);
+    bool Write(const void *data, size_t nbBytes);
+    // NULL if aborted. '*nbBytes' is reduced to what is left in the slab.
+    void *Reserve(size_t *nbBytes);
+    bool Commit(size_t nbBytes);
+    bool Tick();
+    bool Flush();
+    bool EndOfPage();
+    bool EndOfScan();
+
+    // consumer side
+    bool Front(struct ring_record *out, bool block);
+    void Pop();
+    void Discard();
+
+    // any side
+    void Abort();
+    bool IsAborted() const;
+    // Cancelled by Abort(). Can be given to the driver callbacks so they stop
+    // without even touching the ring (see PyinsaneWiaTransferCallback).
+    PyinsaneCancelToken *GetCancelToken() const;
+    size_t GetBuffered() const;
+    size_t GetMaxBytes() const;
+    PyinsaneBufferPool *GetPool() const;
+    unsigned long GetNbRecords() const;
+    unsigned long GetNbWakeUps() const;
+
+private:
+    bool Push(enum ring_record_type type, struct pool_slab *slab, size_t offset, size_t nbBytes);
+    bool WaitForRoom(size_t nbBytes);
+    bool NextSlab();
+    bool ShouldFlush();
+    void WakeUp(std::atomic<bool> *waiting);
+
+    struct ring_record *mSlots;
+    unsigned int mMask;
+    size_t mMaxBytes;
+
+    PyinsaneBufferPool *mPool;
+    struct pool_slab *mCurrent; // slab being filled by the producer
+    size_t mFill;
+    size_t mPublished; // what is before that in mCurrent has been pushed
+
+    size_t mMinBytes;
+    size_t mRowSize;
+    std::chrono::steady_clock::duration mMaxDelay;
+    std::chrono::steady_clock::time_point mPendingSince;
+
+    std::atomic<size_t> mHead; // next slot to read (written by the consumer)
+    std::atomic<size_t> mTail; // next slot to write (written by the producer)
+    std::atomic<size_t> mBuffered;
+    PyinsaneCancelToken *mToken; // cancelled when aborted
+    std::atomic<unsigned long> mNbRecords;
+    std::atomic<unsigned long> mNbWakeUps;
+
+    std::atomic<bool> mConsumerWaiting;
+    std::atomic<bool> mProducerWaiting;
+    std::mutex mMutex;
+    std::condition_variable mCond;
+};
+
+#endif
@@ -0,0 +1,92 @@
+#include <assert.h>
+
+#include "snapshot.h"
+
+
+PyinsanePropertySnapshot::PyinsanePropertySnapshot(size_t nbProperties)
+    : mValues(nbProperties, NULL), mConstraints(nbProperties, NULL),
+    mWritten(nbProperties, false)
+{
+}
+
+
+PyinsanePropertySnapshot::~PyinsanePropertySnapshot()
+{
+    size_t i;
+
+    for (i = 0 ; i < mValues.size() ; i++) {
+        Py_XDECREF(mValues[i]);
+        Py_XDECREF(mConstraints[i]);
+    }
+}
+
+
+size_t PyinsanePropertySnapshot::GetNbProperties() const
+{
+    return mValues.size();
+}
+
+
+bool PyinsanePropertySnapshot::Update(PyObject **current, PyObject *value)
+{
+    PyObject *previous = *current;
+    int equal;
+
+    *current = value;
+    if (previous == NULL || value == NULL) {
+        Py_XDECREF(previous);
+        return (previous != value);
+    }
+
+    equal = PyObject_RichCompareBool(previous, value, Py_EQ);
+    if (equal < 0) {
+        // can't tell: assume it changed
+        PyErr_Clear();
+        equal = 0;
+    }
+    Py_DECREF(previous);
+    return !equal;
+}
+
+
+bool PyinsanePropertySnapshot::UpdateValue(size_t idx, PyObject *value)
+{
+    assert(idx < mValues.size());
+    return Update(&mValues[idx], value);
+}
+
+
+bool PyinsanePropertySnapshot::UpdateConstraint(size_t idx, PyObject *constraint)
+{
+    assert(idx < mConstraints.size());
+    mWritten[idx] = false;
+    return Update(&mConstraints[idx], constraint);
+}
+
+
+PyObject *PyinsanePropertySnapshot::GetValue(size_t idx) const
+{
+    assert(idx < mValues.size());
+    return mValues[idx];
+}
+
+
+PyObject *PyinsanePropertySnapshot::GetConstraint(size_t idx) const
+{
+    assert(idx < mConstraints.size());
+    return mConstraints[idx];
+}
+
+
+void PyinsanePropertySnapshot::MarkWritten(size_t idx)
+{
+    assert(idx < mWritten.size());
+    mWritten[idx] = true;
+}
+
+
+bool PyinsanePropertySnapshot::IsWritten(size_t idx) const
+{
+    assert(idx < mWritten.size());
+    return mWritten[idx];
+}
@@ -0,0 +1,50 @@
+#ifndef __PYINSANE_NATIVE_SNAPSHOT_H
+#define __PYINSANE_NATIVE_SNAPSHOT_H
+
+#include <stddef.h>
+#include <vector>
+
+#include <Python.h>
+
+#define NATIVE_PYCAPSULE_SNAPSHOT_NAME "Pyinsane property snapshot"
+
+/*!
+ * Last known value and constraint of each property of a scanner item,
+ * indexed like the property table of the backend. Every read of the item
+ * goes through it, so the backend can tell Python what changed since the
+ * previous read instead of sending everything again.
+ *
+ * Properties written since their constraint was last read are flagged: the
+ * driver may have changed their constraint even if it kept the value.
+ *
+ * Must be used with the GIL held.
+ */
+class PyinsanePropertySnapshot
+{
+public:
+    PyinsanePropertySnapshot(size_t nbProperties);
+    ~PyinsanePropertySnapshot();
+
+    size_t GetNbProperties() const;
+
+    // Steal the reference (NULL == property not available). Return true if
+    // it differs from the previous one.
+    bool UpdateValue(size_t idx, PyObject *value);
+    bool UpdateConstraint(size_t idx, PyObject *constraint);
+
+    // Borrowed references. NULL if unknown.
+    PyObject *GetValue(size_t idx) const;
+    PyObject *GetConstraint(size_t idx) const;
+
+    void MarkWritten(size_t idx);
+    bool IsWritten(size_t idx) const;
+
+private:
+    static bool Update(PyObject **current, PyObject *value);
+
+    std::vector<PyObject *> mValues;
+    std::vector<PyObject *> mConstraints;
+    std::vector<bool> mWritten;
+};
+
+#endif
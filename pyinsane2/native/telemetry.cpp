@@ -0,0 +1,121 @@
+#include <string.h>
+
+#include "telemetry.h"
+
+
+PyinsaneTransferTelemetry::PyinsaneTransferTelemetry()
+{
+    Start();
+}
+
+
+double PyinsaneTransferTelemetry::Seconds(std::chrono::steady_clock::duration duration)
+{
+    return std::chrono::duration_cast<std::chrono::duration<double> >(duration).count();
+}
+
+
+void PyinsaneTransferTelemetry::Start()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    memset(&mStats, 0, sizeof(mStats));
+    mStats.firstByte = -1.0;
+    memset(&mPage, 0, sizeof(mPage));
+    mPage.firstByte = -1.0;
+    mPages.clear();
+    mStart = mPageStart = std::chrono::steady_clock::now();
+}
+
+
+void PyinsaneTransferTelemetry::OnCallback()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mStats.callbacks++;
+}
+
+
+void PyinsaneTransferTelemetry::OnProgress(int percent, uint64_t driverBytes)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mStats.percent = percent;
+    mStats.driverBytes = driverBytes;
+}
+
+
+void PyinsaneTransferTelemetry::OnError(long status)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mStats.lastError = status;
+}
+
+
+void PyinsaneTransferTelemetry::OnChunk(size_t nbBytes)
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    int bucket = 0;
+
+    while (bucket < TELEMETRY_NB_BUCKETS - 1 && (nbBytes >> (bucket + 1)) != 0) {
+        bucket++;
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mStats.firstByte < 0 && nbBytes > 0) {
+        mFirstByte = now;
+        mStats.firstByte = Seconds(now - mStart);
+    }
+    if (mPage.firstByte < 0 && nbBytes > 0)
+        mPage.firstByte = Seconds(now - mPageStart);
+    mLastByte = now;
+    mStats.bytes += nbBytes;
+    mStats.chunks++;
+    mStats.histogram[bucket]++;
+    mPage.bytes += nbBytes;
+    mPage.chunks++;
+}
+
+
+void PyinsaneTransferTelemetry::OnBlocked(std::chrono::steady_clock::duration duration)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mStats.blocked += Seconds(duration);
+    mPage.blocked += Seconds(duration);
+}
+
+
+void PyinsaneTransferTelemetry::OnEndOfPage()
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    mPage.duration = Seconds(now - mPageStart);
+    mPages.push_back(mPage);
+    memset(&mPage, 0, sizeof(mPage));
+    mPage.firstByte = -1.0;
+    mPageStart = now;
+}
+
+
+void PyinsaneTransferTelemetry::GetStats(struct telemetry_stats *out)
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    double duration;
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    *out = mStats;
+    out->elapsed = Seconds(now - mStart);
+    out->throughput = 0.0;
+    if (mStats.firstByte >= 0) {
+        duration = Seconds(mLastByte - mFirstByte);
+        if (duration > 0)
+            out->throughput = mStats.bytes / duration;
+    }
+    out->nbPages = mPages.size();
+}
+
+
+std::vector<struct telemetry_page> PyinsaneTransferTelemetry::GetPages()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mPages;
+}
@@ -0,0 +1,80 @@
+#ifndef __PYINSANE_NATIVE_TELEMETRY_H
+#define __PYINSANE_NATIVE_TELEMETRY_H
+
+#include <chrono>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#define NATIVE_PYCAPSULE_TELEMETRY_NAME "Pyinsane transfer telemetry"
+
+// bucket i counts the chunks of [2^i ; 2^(i+1)[ bytes (bucket 0 includes 0)
+#define TELEMETRY_NB_BUCKETS 32
+
+struct telemetry_page {
+    uint64_t bytes;
+    unsigned long chunks;
+    double duration; // from the end of the previous page (or Start())
+    double firstByte; // from the end of the previous page ; < 0 if no data
+    double blocked;
+};
+
+struct telemetry_stats {
+    int percent; // as reported by the driver
+    uint64_t driverBytes; // as reported by the driver
+    uint64_t bytes; // actually written by the driver
+    unsigned long chunks;
+    unsigned long callbacks;
+    long lastError; // last non-zero error status reported by the driver
+    double elapsed; // since Start()
+    double firstByte; // since Start() ; < 0 if no data yet
+    double throughput; // bytes/s, from the first byte to the last one
+    double blocked;
+    unsigned long histogram[TELEMETRY_NB_BUCKETS];
+    size_t nbPages;
+};
+
+/*!
+ * What the driver tells us during a download, and how fast it actually sends
+ * the data. Meant to find the driver / settings combinations that starve the
+ * scanner.
+ *
+ * 'blocked' is the time the driver spent in our data callbacks: they never
+ * take the GIL, but they wait for the reader (and so for the GIL) once the
+ * ring is full.
+ *
+ * Updated by the thread of the driver, readable from any thread at any time.
+ */
+class PyinsaneTransferTelemetry
+{
+public:
+    PyinsaneTransferTelemetry();
+
+    // driver side
+    void Start();
+    void OnCallback();
+    void OnProgress(int percent, uint64_t driverBytes);
+    void OnError(long status);
+    void OnChunk(size_t nbBytes);
+    void OnBlocked(std::chrono::steady_clock::duration duration);
+    void OnEndOfPage();
+
+    // any side
+    void GetStats(struct telemetry_stats *out);
+    std::vector<struct telemetry_page> GetPages();
+
+private:
+    static double Seconds(std::chrono::steady_clock::duration duration);
+
+    std::mutex mMutex;
+    struct telemetry_stats mStats;
+    std::chrono::steady_clock::time_point mStart;
+    std::chrono::steady_clock::time_point mFirstByte;
+    std::chrono::steady_clock::time_point mLastByte;
+    struct telemetry_page mPage; // current one
+    std::chrono::steady_clock::time_point mPageStart;
+    std::vector<struct telemetry_page> mPages;
+};
+
+#endif
@@ -0,0 +1,159 @@
+/*
+ * Synthetic producers. They let us exercise the transfer pipeline from
+ * threads that do not hold the GIL, exactly like a WIA driver would, but
+ * without WIA nor a scanner.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <thread>
+
+#include <Python.h>
+
+#include "core.h"
+#include "ring.h"
+
+#define NATIVE_PYCAPSULE_PRODUCER_NAME "Pyinsane synthetic producer"
+
+struct synthetic_producer {
+    std::thread thread;
+    PyObject *ring_capsule;
+    PyinsaneRing *ring;
+    size_t page_size;
+    int nb_pages;
+    size_t chunk_size;
+    size_t written;
+    int joined;
+};
+
+
+/* Page 'page', byte 'offset' is always ((offset + page * 7) % 251). */
+static void fill_pattern(uint8_t *out, size_t nb_bytes, size_t offset, int page)
+{
+    uint8_t period[251];
+    size_t i, start, nb;
+
+    for (i = 0 ; i < sizeof(period) ; i++) {
+        period[i] = (uint8_t)i;
+    }
+
+    // fast enough to not be the bottleneck of the benchmarks
+    start = (offset + page * 7) % sizeof(period);
+    for ( ; nb_bytes > 0 ; nb_bytes -= nb, out += nb, start = 0) {
+        nb = sizeof(period) - start;
+        if (nb > nb_bytes)
+            nb = nb_bytes;
+        memcpy(out, period + start, nb);
+    }
+}
+
+
+static void produce(struct synthetic_producer *producer)
+{
+    uint8_t *chunk;
+    size_t offset, nb;
+    uint32_t lcg = 12345;
+    int page;
+
+    chunk = (uint8_t *)malloc(producer->chunk_size);
+
+    for (page = 0 ; page < producer->nb_pages ; page++) {
+        for (offset = 0 ; offset < producer->page_size ; offset += nb) {
+            // chunks of random sizes, like real drivers do
+            lcg = lcg * 1103515245 + 12345;
+            nb = 1 + ((lcg >> 8) % producer->chunk_size);
+            if (nb > producer->page_size - offset)
+                nb = producer->page_size - offset;
+            fill_pattern(chunk, nb, offset, page);
+            if (!producer->ring->Write(chunk, nb))
+                goto end;
+            producer->written += nb;
+        }
+        if (!producer->ring->EndOfPage())
+            goto end;
+    }
+    producer->ring->EndOfScan();
+
+end:
+    free(chunk);
+}
+
+
+static void free_producer(PyObject *capsule)
+{
+    struct synthetic_producer *producer;
+
+    producer = (struct synthetic_producer *)PyCapsule_GetPointer(
+        capsule, NATIVE_PYCAPSULE_PRODUCER_NAME
+    );
+    if (!producer->joined) {
+        producer->ring->Abort();
+        Py_BEGIN_ALLOW_THREADS;
+        producer->thread.join();
+        Py_END_ALLOW_THREADS;
+        Py_DECREF(producer->ring_capsule);
+    }
+    delete producer;
+}
+
+
+PyObject *ring_produce(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyinsaneRing *ring;
+    Py_ssize_t page_size, chunk_size;
+    int nb_pages;
+    struct synthetic_producer *producer;
+
+    if (!PyArg_ParseTuple(args, "Onin", &capsule, &page_size, &nb_pages, &chunk_size)) {
+        return NULL;
+    }
+    if ((ring = capsule2ring(capsule)) == NULL) {
+        return NULL;
+    }
+    if (page_size <= 0 || nb_pages < 0 || chunk_size <= 0) {
+        PyErr_SetString(PyExc_ValueError, "ring_produce(): invalid sizes");
+        return NULL;
+    }
+
+    producer = new synthetic_producer();
+    producer->ring_capsule = capsule;
+    Py_INCREF(capsule);
+    producer->ring = ring;
+    producer->page_size = page_size;
+    producer->nb_pages = nb_pages;
+    producer->chunk_size = chunk_size;
+    producer->written = 0;
+    producer->joined = 0;
+    producer->thread = std::thread(produce, producer);
+
+    return PyCapsule_New(producer, NATIVE_PYCAPSULE_PRODUCER_NAME, free_producer);
+}
+
+
+PyObject *producer_join(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    struct synthetic_producer *producer;
+
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        return NULL;
+    }
+    producer = (struct synthetic_producer *)PyCapsule_GetPointer(
+        capsule, NATIVE_PYCAPSULE_PRODUCER_NAME
+    );
+    if (producer == NULL) {
+        return NULL;
+    }
+
+    if (!producer->joined) {
+        Py_BEGIN_ALLOW_THREADS;
+        producer->thread.join();
+        Py_END_ALLOW_THREADS;
+        producer->joined = 1;
+        Py_DECREF(producer->ring_capsule);
+    }
+
+    return PyLong_FromSize_t(producer->written);
+}
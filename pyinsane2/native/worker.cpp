@@ -0,0 +1,236 @@
+#include "worker.h"
+
+
+PyinsaneWorker::PyinsaneWorker(PyObject *init, PyObject *exit)
+    : mInit(init), mExit(exit), mStopping(false), mJoining(false), mStopped(false),
+    mNbActions(0), mNbWakeUps(0)
+{
+#if PY_VERSION_HEX < 0x03070000
+    PyEval_InitThreads();
+#endif
+    Py_XINCREF(mInit);
+    Py_XINCREF(mExit);
+    mThread = std::thread(&PyinsaneWorker::Run, this);
+}
+
+
+PyinsaneWorker::~PyinsaneWorker()
+{
+    Stop();
+    Py_XDECREF(mInit);
+    Py_XDECREF(mExit);
+}
+
+
+static void call_hook(PyObject *hook)
+{
+    PyObject *result;
+
+    if (hook == NULL)
+        return;
+    result = PyObject_CallObject(hook, NULL);
+    if (result == NULL)
+        PyErr_WriteUnraisable(hook);
+    Py_XDECREF(result);
+}
+
+
+void PyinsaneWorker::Run()
+{
+    std::deque<struct worker_action *> batch;
+    std::deque<struct worker_action *>::iterator it;
+    PyGILState_STATE gil;
+
+    gil = PyGILState_Ensure();
+    call_hook(mInit);
+    PyGILState_Release(gil);
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            while (!mStopping && mQueue.empty()) {
+                mWorkCond.wait(lock);
+            }
+            if (mQueue.empty())
+                break; // stopping, and nothing left to do
+            batch.swap(mQueue);
+            mNbWakeUps++;
+        }
+
+        gil = PyGILState_Ensure();
+        for (it = batch.begin() ; it != batch.end() ; it++) {
+            bool posted = (*it)->posted;
+
+            RunAction(*it);
+            if (posted)
+                FreeAction(*it);
+
+            // Call() may return (and free the action) as soon as it's done,
+            // without waiting for the rest of the batch
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (!posted)
+                (*it)->done = true;
+            mNbActions++;
+            mDoneCond.notify_all();
+        }
+        PyGILState_Release(gil);
+
+        batch.clear();
+    }
+
+    gil = PyGILState_Ensure();
+    call_hook(mExit);
+    PyGILState_Release(gil);
+}
+
+
+void PyinsaneWorker::RunAction(struct worker_action *action)
+{
+    action->result = PyObject_CallObject(action->func, NULL);
+    if (action->result != NULL)
+        return;
+    if (action->posted) {
+        PyErr_WriteUnraisable(action->func);
+        return;
+    }
+    PyErr_Fetch(&action->exc_type, &action->exc_value, &action->exc_traceback);
+}
+
+
+void PyinsaneWorker::FreeAction(struct worker_action *action)
+{
+    Py_DECREF(action->func);
+    Py_XDECREF(action->result);
+    Py_XDECREF(action->exc_type);
+    Py_XDECREF(action->exc_value);
+    Py_XDECREF(action->exc_traceback);
+    delete action;
+}
+
+
+struct worker_action *PyinsaneWorker::Submit(PyObject *func, bool posted)
+{
+    struct worker_action *action;
+
+    action = new worker_action();
+    action->func = func;
+    Py_INCREF(func);
+    action->result = NULL;
+    action->exc_type = action->exc_value = action->exc_traceback = NULL;
+    action->posted = posted;
+    action->done = false;
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mStopping) {
+        Py_DECREF(func);
+        delete action;
+        return NULL;
+    }
+    mQueue.push_back(action);
+    mWorkCond.notify_one();
+    return action;
+}
+
+
+PyObject *PyinsaneWorker::Call(PyObject *func)
+{
+    struct worker_action *action;
+    PyObject *result;
+
+    if (IsCurrentThread()) {
+        // waiting for ourselves would never end
+        return PyObject_CallObject(func, NULL);
+    }
+
+    action = Submit(func, false);
+    if (action == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "Worker stopped");
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS;
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        while (!action->done) {
+            mDoneCond.wait(lock);
+        }
+    }
+    Py_END_ALLOW_THREADS;
+
+    result = action->result;
+    action->result = NULL;
+    if (result == NULL) {
+        // PyErr_Restore() steals the references
+        PyErr_Restore(action->exc_type, action->exc_value, action->exc_traceback);
+        action->exc_type = action->exc_value = action->exc_traceback = NULL;
+    }
+    FreeAction(action);
+    return result;
+}
+
+
+bool PyinsaneWorker::Post(PyObject *func)
+{
+    return (Submit(func, true) != NULL);
+}
+
+
+void PyinsaneWorker::Stop()
+{
+    bool join;
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopping = true;
+        mWorkCond.notify_all();
+        if (IsCurrentThread()) {
+            // stops once the current batch is done
+            return;
+        }
+        join = !mJoining;
+        mJoining = true;
+    }
+
+    // the thread needs the GIL to finish the remaining actions and 'exit'
+    Py_BEGIN_ALLOW_THREADS;
+    if (join) {
+        mThread.join();
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopped = true;
+        mDoneCond.notify_all();
+    } else {
+        // someone else is already joining the thread
+        std::unique_lock<std::mutex> lock(mMutex);
+        while (!mStopped) {
+            mDoneCond.wait(lock);
+        }
+    }
+    Py_END_ALLOW_THREADS;
+}
+
+
+bool PyinsaneWorker::IsCurrentThread() const
+{
+    return (std::this_thread::get_id() == mThread.get_id());
+}
+
+
+bool PyinsaneWorker::IsStopped() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mStopping;
+}
+
+
+unsigned long PyinsaneWorker::GetNbActions() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mNbActions;
+}
+
+
+unsigned long PyinsaneWorker::GetNbWakeUps() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mNbWakeUps;
+}
@@ -0,0 +1,76 @@
+#ifndef __PYINSANE_NATIVE_WORKER_H
+#define __PYINSANE_NATIVE_WORKER_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include <Python.h>
+
+#define NATIVE_PYCAPSULE_WORKER_NAME "Pyinsane worker"
+
+struct worker_action {
+    PyObject *func;
+    PyObject *result; // NULL if func raised an exception
+    PyObject *exc_type;
+    PyObject *exc_value;
+    PyObject *exc_traceback;
+    bool posted; // nobody waits for it: freed by the worker
+    bool done;
+};
+
+/*!
+ * Thread running Python callables, in order, for APIs whose objects must
+ * always be used from the thread that created them (COM). 'init' and 'exit'
+ * (may be NULL) are called on the thread itself, when it starts and when it
+ * stops (CoInitialize() / CoUninitialize()).
+ *
+ * The thread sleeps until an action is submitted and then runs all the queued
+ * actions at once, taking the GIL only once per batch. Call() returns as soon
+ * as its own action is done, not at the end of the batch.
+ *
+ * Call(), Post() and Stop() must be called with the GIL held. Call() waits
+ * without it. If Call() is used from the worker thread itself (an action
+ * submitting another one), the action is run immediately.
+ */
+class PyinsaneWorker
+{
+public:
+    PyinsaneWorker(PyObject *init, PyObject *exit);
+    ~PyinsaneWorker();
+
+    // Returns a new reference, or NULL with an exception set
+    PyObject *Call(PyObject *func);
+    // Result is dropped. Exceptions are reported with PyErr_WriteUnraisable()
+    bool Post(PyObject *func);
+    // Runs the remaining actions, then 'exit', and joins the thread (unless
+    // called from the worker thread itself)
+    void Stop();
+
+    bool IsCurrentThread() const;
+    bool IsStopped() const;
+    unsigned long GetNbActions() const;
+    unsigned long GetNbWakeUps() const;
+
+private:
+    void Run();
+    void RunAction(struct worker_action *action);
+    static void FreeAction(struct worker_action *action);
+    struct worker_action *Submit(PyObject *func, bool posted);
+
+    PyObject *mInit;
+    PyObject *mExit;
+    std::thread mThread;
+    std::deque<struct worker_action *> mQueue;
+    bool mStopping;
+    bool mJoining;
+    bool mStopped;
+    unsigned long mNbActions;
+    unsigned long mNbWakeUps;
+    mutable std::mutex mMutex;
+    std::condition_variable mWorkCond;
+    std::condition_variable mDoneCond;
+};
+
+#endif
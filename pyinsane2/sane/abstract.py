@@ -4,6 +4,7 @@ from PIL import Image
 
 from . import rawapi
 from .. import util
+from ..native import _core
 
 # import basic elements directly, so the caller
 # doesn't have to import rawapi if they need them.
@@ -107,6 +108,18 @@ class ScannerOption(object):
     value = property(_get_value, _set_value)
 
 
+class FrameFormat(object):
+    """
+    What ImgUtil.raw_to_img() needs to know of the lines of a frame (see
+    rawapi.SaneParameters), when they have been converted by Scan.read()
+    """
+    def __init__(self, format, depth, pixels_per_line, bytes_per_line):
+        self.format = format
+        self.depth = depth
+        self.pixels_per_line = pixels_per_line
+        self.bytes_per_line = bytes_per_line
+
+
 class ImgUtil(object):
     COLOR_BYTES = {
         1: {  # we expanded the bits to bytes on-the-fly
@@ -126,63 +139,255 @@ class ImgUtil(object):
     @staticmethod
     def unpack_1_to_8(whole_raw_packed, pixels_per_line, bytes_per_line):
         # Each color is on one bit. We unpack immediately so each color
-        # is on one byte.
+        # is on one byte (see pixels.h: PIXELS_BITS).
         # We must take care of one thing : the last byte of each line
-        # contains unused bits. They must be dropped
-        whole_raw_unpacked = b""
-
-        if sys.version_info < (3, ):
-            positive_bit = chr(0x00)
-            negative_bit = chr(0xFF)
-        else:
-            positive_bit = bytes([0x00])
-            negative_bit = bytes([0xFF])
-
-        for chunk in range(0, len(whole_raw_packed), bytes_per_line):
-            raw_packed = whole_raw_packed[:bytes_per_line]
-            whole_raw_packed = whole_raw_packed[bytes_per_line:]
-            raw_unpacked = b""
+        # contains unused bits. They must be dropped. So must the padding of
+        # the lines, if any.
+        # 'pixels_per_line': number of samples of each line (x3 for RGB)
+        nb_lines = len(whole_raw_packed) // bytes_per_line
+        return _core.pixels_convert(whole_raw_packed, _core.PIXELS_BITS,
+                                    pixels_per_line, bytes_per_line, nb_lines)
 
-            for byte in raw_packed:
-                if type(byte) == str:
-                    byte = ord(byte)
-                for bit in range(7, -1, -1):
-                    if ((byte & (1 << bit)) > 0):
-                        raw_unpacked += positive_bit
-                    else:
-                        raw_unpacked += negative_bit
-            assert(len(raw_packed) * 8 == len(raw_unpacked))
-
-            raw_unpacked = raw_unpacked[:pixels_per_line]
-            whole_raw_unpacked += raw_unpacked
+    @staticmethod
+    def get_line_converter(parameters, to_8bits=False):
+        """
+        Returns how the lines of a frame must be converted as they arrive:
+        (function(data, nb_lines), FrameFormat of the converted lines), or
+        (None, parameters) if they can be used as is.
 
-        return whole_raw_unpacked
+        16 bits per sample: SANE returns them in the byte order of the host.
+        They are kept little endian, or converted to 8 bits (see
+        Scanner.scan()).
+        """
+        if parameters.depth != 16:
+            return (None, parameters)
+        mode = rawapi.SaneFrame(parameters.format).get_pil_format()
+        nb_samples = parameters.pixels_per_line * ImgUtil.COLOR_BYTES[8][mode]
+        lut = None
+        if to_8bits:
+            layout = _core.PIXELS_16_TO_8
+            depth = 8
+            if to_8bits is not True:
+                (black, white, gamma) = to_8bits
+                lut = _core.pixels_lut16(black, white, gamma)
+        elif sys.byteorder == 'little':
+            return (None, parameters)
+        else:
+            layout = _core.PIXELS_16_TO_LE
+            depth = 16
+        frame_format = FrameFormat(
+            parameters.format, depth, parameters.pixels_per_line,
+            nb_samples * depth // 8
+        )
+        in_bytes_per_line = parameters.bytes_per_line
+
+        def convert(data, nb_lines):
+            return _core.pixels_convert(data, layout, nb_samples,
+                                        in_bytes_per_line, nb_lines, 0, 0, lut)
+        return (convert, frame_format)
 
     @staticmethod
     def raw_to_img(raw, parameters):
+        # 'raw' may be any buffer (see LineStore.get_lines()): PIL maps it
+        # instead of copying it when it can
         mode = rawapi.SaneFrame(parameters.format).get_pil_format()
-        # color_bytes = ImgUtil.COLOR_BYTES[parameters.depth][mode]
+        rawmode = mode
         width = parameters.pixels_per_line
-        height = (len(raw) / parameters.bytes_per_line)
+        height = len(raw) // parameters.bytes_per_line
+        stride = parameters.bytes_per_line
         if parameters.depth == 1:
-            raw = ImgUtil.unpack_1_to_8(raw, width,
-                                        parameters.bytes_per_line)
+            raw = ImgUtil.unpack_1_to_8(
+                raw, width * ImgUtil.COLOR_BYTES[1][mode],
+                parameters.bytes_per_line
+            )
+            stride = 0
+        elif parameters.depth == 16 and mode == "L":
+            # little endian (see get_line_converter())
+            mode = rawmode = "I;16"
+        elif parameters.depth == 16:
+            # PIL has no mode for 48-bit RGB: most significant bytes only
+            rawmode = "RGB;16L"
         return Image.frombuffer(mode, (int(width), int(height)), raw, "raw",
-                                mode, 0, 1)
+                                rawmode, stride, 1)
+
+
+class LineStore(object):
+    """
+    The lines of the frame being read, in one contiguous buffer: allocated
+    at once when the driver tells how many lines to expect, grown
+    geometrically otherwise (hand-held scanners report -1).
+
+    Lines are never modified once written: images can be built on views of
+    them (see get_lines()) and remain valid while the frame keeps coming.
+    """
+    # lines allocated first when the height of the frame is unknown
+    MIN_LINES = 64
+
+    def __init__(self, bytes_per_line, lines=-1, data=None):
+        self.bytes_per_line = bytes_per_line
+        if data is not None:
+            # complete frame, used as is (nothing can be appended)
+            self._buf = data
+            self.size = len(data)
+            return
+        self.size = 0
+        if lines <= 0:
+            lines = self.MIN_LINES
+        self._buf = bytearray(bytes_per_line * lines)
+
+    def append(self, data):
+        data = memoryview(data)
+        end = self.size + len(data)
+        if end > len(self._buf):
+            # a new buffer rather than resizing this one: it can't be
+            # resized while images still use it
+            buf = bytearray(max(end, 2 * len(self._buf)))
+            buf[:self.size] = memoryview(self._buf)[:self.size]
+            self._buf = buf
+        self._buf[self.size:end] = data
+        self.size = end
+
+    def _get_nb_lines(self):
+        # complete lines only
+        return self.size // self.bytes_per_line
+
+    nb_lines = property(_get_nb_lines)
+
+    def _get_incomplete(self):
+        # bytes received of the last line, if incomplete
+        return self.size % self.bytes_per_line
+
+    incomplete = property(_get_incomplete)
+
+    def get_lines(self, start_line, end_line):
+        """
+        Returns a read-only view on the lines [start_line, end_line[ (no
+        copy).
+        """
+        end_line = min(end_line, self.nb_lines)
+        view = memoryview(self._buf)[start_line * self.bytes_per_line:
+                                     end_line * self.bytes_per_line]
+        return view.toreadonly() if hasattr(view, 'toreadonly') else view
+
+
+class ConvertedLineStore(LineStore):
+    """
+    LineStore of lines converted as soon as they are complete (see
+    ImgUtil.get_line_converter()). Only the incomplete last line is kept as
+    received.
+    """
+    def __init__(self, convert, in_bytes_per_line, bytes_per_line, lines=-1):
+        LineStore.__init__(self, bytes_per_line, lines)
+        self._convert = convert
+        self._in_bytes_per_line = in_bytes_per_line
+        self._incomplete = b""
+
+    def append(self, data):
+        data = memoryview(data)
+        line_size = self._in_bytes_per_line
+        if len(self._incomplete) > 0:
+            cut = min(line_size - len(self._incomplete), len(data))
+            self._incomplete += data[:cut].tobytes()
+            data = data[cut:]
+            if len(self._incomplete) < line_size:
+                return
+            LineStore.append(self, self._convert(self._incomplete, 1))
+        nb_lines = len(data) // line_size
+        if nb_lines > 0:
+            LineStore.append(self, self._convert(data, nb_lines))
+        self._incomplete = data[nb_lines * line_size:].tobytes()
+
+    def _get_incomplete(self):
+        return len(self._incomplete)
+
+    incomplete = property(_get_incomplete)
+
+
+class PlanarFrame(object):
+    """
+    Page of a three-pass scanner: one frame per color (RED, GREEN, BLUE, in
+    any order, 'last_frame' set on the last one). Each of them is kept in
+    its own LineStore (a plane) until the last one arrives: they are then
+    interleaved at once into RGB lines.
+    """
+    PLANES = {
+        rawapi.SaneFrame.RED: 0,
+        rawapi.SaneFrame.GREEN: 1,
+        rawapi.SaneFrame.BLUE: 2,
+    }
+
+    def __init__(self):
+        # (LineStore, FrameFormat) for each plane
+        self.planes = [None, None, None]
+
+    @staticmethod
+    def is_plane(parameters):
+        return parameters.format in PlanarFrame.PLANES
+
+    def add(self, parameters, lines, frame_format):
+        self.planes[self.PLANES[parameters.format]] = (lines, frame_format)
+
+    def interleave(self):
+        """
+        Returns the page: (LineStore, FrameFormat). A missing plane is
+        black.
+        """
+        planes = [plane for plane in self.planes if plane is not None]
+        frame_format = planes[0][1]
+        nb_lines = min(lines.nb_lines for (lines, _) in planes)
+        width = frame_format.pixels_per_line
+        sample_size = 2 if frame_format.depth == 16 else 1
+        stride = frame_format.bytes_per_line
+        if frame_format.depth == 1:
+            stride = width
+
+        data = []
+        for plane in self.planes:
+            if plane is None:
+                data.append(b"\0" * (stride * nb_lines))
+                continue
+            raw = plane[0].get_lines(0, nb_lines)
+            if frame_format.depth == 1:
+                raw = ImgUtil.unpack_1_to_8(raw, width,
+                                            frame_format.bytes_per_line)
+            data.append(raw)
+        rgb = _core.pixels_interleave(data[0], data[1], data[2], width,
+                                      stride, nb_lines, sample_size)
+        bytes_per_line = 3 * width * sample_size
+        return (
+            LineStore(bytes_per_line, data=rgb),
+            FrameFormat(rawapi.SaneFrame.RGB, 8 * sample_size, width,
+                        bytes_per_line),
+        )
 
 
 class Scan(object):
-    def __init__(self, scanner):
+    def __init__(self, scanner, record=None, to_8bits=False):
         self.scanner = scanner
         self.__session = None
-        self.__raw_lines = []
+        # see Scanner.scan()
+        self.to_8bits = to_8bits
+        # see LineStore. Created once the parameters of the frame are known
+        self.__lines = None
+        self.__format = None
+        # three-pass scanners only: see PlanarFrame
+        self.__planes = None
         self.__img_finished = False
+        # reads the current frame on a native thread (see
+        # rawapi.sane_start_reader()). None: sane_read() is called directly
+        self.reader = None
+        # see rawapi.sane_record()
+        self.recorder = None
+        if record is not None:
+            self.recorder = _core.recorder_new(record, _core.RECORD_SANE)
 
     def _set_session(self, session):
         self.__session = session
 
     def _init(self):
         self.scanner._open()
+        if self.recorder is not None:
+            rawapi.sane_record(sane_dev_handle[1], self.recorder)
         rawapi.sane_start(sane_dev_handle[1])
         try:
             self.parameters = \
@@ -190,55 +395,76 @@ class Scan(object):
         except Exception:
             rawapi.sane_cancel(sane_dev_handle[1])
             raise
+        self._start_reader()
+
+    def _next_frame(self):
+        # next frame of the same page (three-pass scanners)
+        rawapi.sane_start(sane_dev_handle[1])
+        self.parameters = rawapi.sane_get_parameters(sane_dev_handle[1])
+        self._start_reader()
+
+    def _start_reader(self):
+        # the device keeps being read while the application is busy
+        self.reader = rawapi.sane_start_reader(sane_dev_handle[1])
+
+    def _new_lines(self):
+        # Not reusing the previous buffer: the image of the previous frame
+        # may still use it
+        (convert, self.__format) = ImgUtil.get_line_converter(
+            self.parameters, self.to_8bits
+        )
+        if convert is None:
+            self.__lines = LineStore(self.parameters.bytes_per_line,
+                                     self.parameters.lines)
+        else:
+            self.__lines = ConvertedLineStore(
+                convert, self.parameters.bytes_per_line,
+                self.__format.bytes_per_line, self.parameters.lines
+            )
 
     def read(self):
-        if self.__img_finished:
+        if self.__img_finished or self.__lines is None:
             # start a new one
-            self.__raw_lines = []
+            self.__planes = None
+            self._new_lines()
             self.__img_finished = False
 
         try:
-            read = rawapi.sane_read(sane_dev_handle[1], SANE_READ_BUFSIZE)
+            if self.reader is not None:
+                read = self.reader.read()
+            else:
+                read = rawapi.sane_read(sane_dev_handle[1], SANE_READ_BUFSIZE)
         except EOFError:
-            line_size = self.parameters.bytes_per_line
-            for line in self.__raw_lines:
-                if len(line) != line_size:
-                    print(("Pyinsane: Warning: Unexpected line size: %d"
-                           " instead of %d") % (len(line), line_size))
-            raw = (b'').join(self.__raw_lines)
+            lines = self.__lines
+            if lines.incomplete != 0:
+                print(("Pyinsane: Warning: Unexpected line size: %d"
+                       " instead of %d") % (lines.incomplete,
+                                            self.parameters.bytes_per_line))
+            if PlanarFrame.is_plane(self.parameters):
+                if self.__planes is None:
+                    self.__planes = PlanarFrame()
+                self.__planes.add(self.parameters, lines, self.__format)
+                if not self.parameters.last_frame:
+                    # the caller only sees the end of the page
+                    self._next_frame()
+                    self._new_lines()
+                    return
+                (lines, self.__format) = self.__planes.interleave()
+                self.__lines = lines
+                self.__planes = None
             # don't do purge the lines here. wait for the next call to read()
             # because, in the meantime, the caller might use get_image()
             self.__img_finished = True
             self.__session.images.append(ImgUtil.raw_to_img(
-                raw, self.parameters))
+                lines.get_lines(0, lines.nb_lines), self.__format))
             raise
 
-        # cut what we just read, line by line
-
-        line_size = self.parameters.bytes_per_line
-
-        if (len(self.__raw_lines) > 0):
-            cut = line_size - len(self.__raw_lines[-1])
-            self.__raw_lines[-1] += read[:cut]
-            read = read[cut:]
-
-        range_func = range
-        if sys.version_info.major < 3:
-            range_func = xrange
-
-        for _ in range_func(0, len(read), line_size):
-            self.__raw_lines.append(read[:line_size])
-            read = read[line_size:]
-
-        if len(read) > 0:
-            self.__raw_lines.append(read)
+        self.__lines.append(read)
 
     def _get_available_lines(self):
-        line_size = self.parameters.bytes_per_line
-        r = len(self.__raw_lines)
-        if (r > 0 and len(self.__raw_lines[-1]) < line_size):
-            r -= 1
-        return (0, r)
+        if self.__lines is None:
+            return (0, 0)
+        return (0, self.__lines.nb_lines)
 
     available_lines = property(_get_available_lines)
 
@@ -260,19 +486,33 @@ class Scan(object):
 
     def get_image(self, start_line=0, end_line=-1):
         if end_line < 0:
-            end_line = len(self.__raw_lines)
+            end_line = self.__lines.nb_lines
         assert(end_line > start_line)
-        lines = self.__raw_lines[start_line:end_line]
-        lines = b"".join(lines)
-        return ImgUtil.raw_to_img(lines, self.parameters)
+        lines = self.__lines.get_lines(start_line, end_line)
+        return ImgUtil.raw_to_img(lines, self.__format)
+
+    def get_raw_lines(self, start_line=0, end_line=-1):
+        """
+        Returns a view on the lines of the current frame, as stored: with
+        16 bits per sample, they are little endian (for the applications
+        that need more than the 8-bit RGB images PIL can give). Only valid
+        until the next frame starts.
+        """
+        if end_line < 0:
+            end_line = self.__lines.nb_lines
+        return self.__lines.get_lines(start_line, end_line)
 
     def _cancel(self):
         rawapi.sane_cancel(sane_dev_handle[1])
+        if self.recorder is not None:
+            rawapi.sane_record(sane_dev_handle[1], None)
+            if not _core.recorder_close(self.recorder):
+                print("Pyinsane: Warning: Failed to write the recording")
 
 
 class SingleScan(Scan):
-    def __init__(self, scanner):
-        Scan.__init__(self, scanner)
+    def __init__(self, scanner, record=None, to_8bits=False):
+        Scan.__init__(self, scanner, record, to_8bits)
 
         self.is_scanning = True
 
@@ -293,8 +533,8 @@ class SingleScan(Scan):
 
 
 class MultipleScan(Scan):
-    def __init__(self, scanner):
-        Scan.__init__(self, scanner)
+    def __init__(self, scanner, record=None, to_8bits=False):
+        Scan.__init__(self, scanner, record, to_8bits)
         self.is_scanning = False
         self.is_finished = False
         self.must_request_next_frame = False
@@ -317,6 +557,8 @@ class MultipleScan(Scan):
                 self.is_scanning = False
                 raise
             self.must_request_next_frame = False
+            self.parameters = rawapi.sane_get_parameters(sane_dev_handle[1])
+            self._start_reader()
 
         try:
             Scan.read(self)
@@ -441,7 +683,16 @@ class Scanner(object):
 
     options = property(_get_options)
 
-    def scan(self, multiple=False):
+    def scan(self, multiple=False, record=None, to_8bits=False):
+        """
+        record -- path of a file where everything the driver returns is
+            recorded, to play the scan back later without the scanner (see
+            pyinsane2.sane.replay)
+        to_8bits -- frames with 16 bits per sample only (option 'depth').
+            False: they are kept as is ('I;16' images in grayscale).
+            True: they are converted to 8 bits as they arrive.
+            (black, white, gamma): same, with these levels applied.
+        """
         if (not ('source' in self.options and
                  self.options['source'].capabilities.is_active())):
             value = ""
@@ -455,9 +706,9 @@ class Scanner(object):
             # else than an ADF. If we try, we will never get
             # SANE_STATUS_NO_DOCS from sane_start()/sane_read() and we will
             # loop forever
-            scan = SingleScan(self)
+            scan = SingleScan(self, record, to_8bits)
         else:
-            scan = MultipleScan(self)
+            scan = MultipleScan(self, record, to_8bits)
         return ScanSession(scan)
 
     def __str__(self):
@@ -203,9 +203,11 @@ class Scan(object):
 
 
 class ScanSession(object):
-    def __init__(self, scanner, multiple=False):
+    def __init__(self, scanner, multiple=False, record=None,
+                 to_8bits=False):
         self._scanner = scanner.name
-        self._remote_session = remote_do('scan', scanner.name, multiple)
+        self._remote_session = remote_do('scan', scanner.name, multiple,
+                                         record, to_8bits)
         self.scan = Scan(scanner.name)
 
     def __get_imgs(self):
@@ -264,8 +266,10 @@ class Scanner(object):
 
     options = property(_get_options)
 
-    def scan(self, multiple=False):
-        return ScanSession(self, multiple)
+    def scan(self, multiple=False, record=None, to_8bits=False):
+        # see abstract.Scanner.scan(). The recording is written by the
+        # scanning process.
+        return ScanSession(self, multiple, record, to_8bits)
 
     def __str__(self):
         return ("'%s' (%s, %s, %s)"
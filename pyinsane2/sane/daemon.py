@@ -47,10 +47,11 @@ def set_option_value(scanner_name, option_name, option_value):
     get_device(scanner_name).options[option_name].value = option_value
 
 
-def make_scan_session(scanner_name, multiple=False):
+def make_scan_session(scanner_name, multiple=False, record=None,
+                      to_8bits=False):
     global scan_sessions
 
-    scan_session = get_device(scanner_name).scan(multiple)
+    scan_session = get_device(scanner_name).scan(multiple, record, to_8bits)
     scan_sessions[scanner_name] = scan_session
     return scan_session
 
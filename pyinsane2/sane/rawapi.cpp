@@ -0,0 +1,157 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <Python.h>
+
+#include "reader.h"
+#include "record.h"
+#include "ring.h"
+#include "telemetry.h"
+
+/*
+ * Native side of the SANE backend. libsane itself is still loaded and driven
+ * by rawapi.py: only the reading of the frames is done here (see reader.h).
+ */
+
+// The capsules used by the thread are kept alive as long as it may run
+struct sane_reader {
+    PyinsaneSaneReader *reader;
+    PyObject *ring;
+    PyObject *telemetry;
+    PyObject *recorder;
+};
+
+
+static void free_reader(PyObject *capsule)
+{
+    struct sane_reader *reader;
+
+    reader = (struct sane_reader *)PyCapsule_GetPointer(capsule, SANE_PYCAPSULE_READER_NAME);
+    if (reader == NULL)
+        return;
+    // the thread may be waiting for the GIL (ctypes callbacks)
+    Py_BEGIN_ALLOW_THREADS;
+    delete reader->reader;
+    Py_END_ALLOW_THREADS;
+    Py_DECREF(reader->ring);
+    Py_DECREF(reader->telemetry);
+    Py_DECREF(reader->recorder);
+    free(reader);
+}
+
+
+/*!
+ * reader_start(sane_read, handle, ring, chunk_size, telemetry=None,
+ * recorder=None): 'sane_read' and 'handle' are addresses (see
+ * rawapi.SaneReader). Reads the current frame into 'ring' until its end.
+ */
+static PyObject *reader_start(PyObject *, PyObject *args)
+{
+    unsigned long long read_addr, handle_addr;
+    PyObject *ring_capsule;
+    PyObject *telemetry_capsule = Py_None;
+    PyObject *recorder_capsule = Py_None;
+    PyinsaneRing *ring;
+    PyinsaneTransferTelemetry *telemetry = NULL;
+    PyinsaneTransferRecorder *recorder = NULL;
+    Py_ssize_t chunk_size;
+    struct sane_reader *reader;
+
+    if (!PyArg_ParseTuple(args, "KKOn|OO", &read_addr, &handle_addr, &ring_capsule,
+                &chunk_size, &telemetry_capsule, &recorder_capsule)) {
+        return NULL;
+    }
+    if (read_addr == 0 || chunk_size <= 0) {
+        PyErr_SetString(PyExc_ValueError, "reader_start(): invalid arguments");
+        return NULL;
+    }
+    ring = (PyinsaneRing *)PyCapsule_GetPointer(ring_capsule, NATIVE_PYCAPSULE_RING_NAME);
+    if (ring == NULL) {
+        return NULL;
+    }
+    if (telemetry_capsule != Py_None) {
+        telemetry = (PyinsaneTransferTelemetry *)PyCapsule_GetPointer(
+            telemetry_capsule, NATIVE_PYCAPSULE_TELEMETRY_NAME
+        );
+        if (telemetry == NULL) {
+            return NULL;
+        }
+    }
+    if (recorder_capsule != Py_None) {
+        recorder = (PyinsaneTransferRecorder *)PyCapsule_GetPointer(
+            recorder_capsule, NATIVE_PYCAPSULE_RECORDER_NAME
+        );
+        if (recorder == NULL) {
+            return NULL;
+        }
+    }
+
+    reader = (struct sane_reader *)malloc(sizeof(struct sane_reader));
+    if (reader == NULL) {
+        return PyErr_NoMemory();
+    }
+    Py_INCREF(ring_capsule);
+    reader->ring = ring_capsule;
+    Py_INCREF(telemetry_capsule);
+    reader->telemetry = telemetry_capsule;
+    Py_INCREF(recorder_capsule);
+    reader->recorder = recorder_capsule;
+    reader->reader = new PyinsaneSaneReader(
+        (sane_read_fn)(uintptr_t)read_addr, (void *)(uintptr_t)handle_addr, ring,
+        (size_t)chunk_size, telemetry, recorder
+    );
+    return PyCapsule_New(reader, SANE_PYCAPSULE_READER_NAME, free_reader);
+}
+
+
+static PyObject *reader_join(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    struct sane_reader *reader;
+    int status;
+
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        return NULL;
+    }
+    reader = (struct sane_reader *)PyCapsule_GetPointer(capsule, SANE_PYCAPSULE_READER_NAME);
+    if (reader == NULL) {
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS;
+    status = reader->reader->Join();
+    Py_END_ALLOW_THREADS;
+    return Py_BuildValue("i", status);
+}
+
+
+static PyMethodDef rawapi_methods[] = {
+    {"reader_start", reader_start, METH_VARARGS, NULL},
+    {"reader_join", reader_join, METH_VARARGS, NULL},
+    {NULL, NULL, 0, NULL},
+};
+
+#if PY_VERSION_HEX < 0x03000000
+
+PyMODINIT_FUNC
+init_rawapi(void)
+{
+    Py_InitModule("_rawapi", rawapi_methods);
+}
+
+#else
+
+static struct PyModuleDef rawapi_module = {
+    PyModuleDef_HEAD_INIT,
+    "_rawapi",
+    NULL /* doc */,
+    -1,
+    rawapi_methods,
+};
+
+PyMODINIT_FUNC PyInit__rawapi(void)
+{
+    return PyModule_Create(&rawapi_module);
+}
+
+#endif
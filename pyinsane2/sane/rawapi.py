@@ -1,7 +1,15 @@
+import atexit
 import ctypes
 import functools
 
 from .. import util
+from ..native import _core
+
+try:
+    # native reader (see reader.h). Not built on Windows.
+    from . import _rawapi
+except ImportError:
+    _rawapi = None
 
 
 __all__ = [
@@ -37,6 +45,9 @@ __all__ = [
     'sane_set_io_mode',
     'sane_get_select_fd',
     'sane_strstatus',
+    'sane_record',
+    'sane_start_reader',
+    'SaneReader',
 ]
 
 
@@ -436,6 +447,13 @@ sane_is_init = 0
 sane_version = None
 
 sane_available = False
+SANE_LIB = None
+
+AUTH_CALLBACK_DEF = ctypes.CFUNCTYPE(None, ctypes.c_char_p, ctypes.c_char_p,
+                                     ctypes.c_char_p)
+SANE_READ_DEF = ctypes.CFUNCTYPE(ctypes.c_int, ctypes.c_void_p,
+                                 ctypes.c_void_p, ctypes.c_int,
+                                 ctypes.POINTER(ctypes.c_int))
 
 for libname in ["libsane.so.1", "libsane.1.dylib"]:
     try:
@@ -446,8 +464,6 @@ for libname in ["libsane.so.1", "libsane.1.dylib"]:
         pass
 
 if sane_available:
-    AUTH_CALLBACK_DEF = ctypes.CFUNCTYPE(None, ctypes.c_char_p, ctypes.c_char_p,
-                                         ctypes.c_char_p)
     SANE_LIB.sane_init.argtypes = [
         ctypes.POINTER(ctypes.c_int), AUTH_CALLBACK_DEF
     ]
@@ -515,6 +531,132 @@ if sane_available:
     SANE_LIB.sane_get_select_fd.restype = ctypes.c_int
 
 
+# handle value --> recorder (see sane_record())
+sane_recorders = {}
+
+
+def _get_recorder(handle):
+    if not sane_recorders:
+        return None
+    return sane_recorders.get(handle.value)
+
+
+def sane_record(handle, recorder):
+    """
+    Writes everything the driver returns through this handle (frame
+    parameters, data, ends of pages, ends of scans) to 'recorder' (see
+    _core.recorder_new()), until called again with recorder=None. The
+    recording can be played back with pyinsane2.sane.replay.
+    """
+    if recorder is None:
+        sane_recorders.pop(handle.value, None)
+    else:
+        sane_recorders[handle.value] = recorder
+
+
+# handle value --> SaneReader (see sane_start_reader())
+sane_readers = {}
+
+
+class SaneReader(object):
+    """
+    Reads the current frame on a native thread: sane_read() is called again as
+    soon as it returns, without the GIL, while the application does whatever
+    it wants. read() just drains what has been read so far.
+    """
+    # Maximum amount of data buffered between the thread and read(). Once
+    # reached, the thread waits for read() to catch up.
+    MAX_BUFFERED = 64 * 1024 * 1024
+    # Maximum size of each sane_read()
+    CHUNK_SIZE = 512 * 1024
+
+    # Small reads are coalesced: read() only returns once COALESCE_BYTES are
+    # available, or once the oldest byte is COALESCE_DELAY_MS old (checked
+    # each time sane_read() returns).
+    COALESCE_BYTES = 64 * 1024
+    COALESCE_DELAY_MS = 100
+
+    def __init__(self, handle, max_buffered=MAX_BUFFERED,
+                 chunk_size=CHUNK_SIZE):
+        self.ring = _core.ring_new(max_buffered, chunk_size)
+        _core.ring_set_coalescing(self.ring, self.COALESCE_BYTES, 0,
+                                  self.COALESCE_DELAY_MS)
+        # 'blocked': time the thread spent waiting for read()
+        self.telemetry = _core.telemetry_new()
+        if isinstance(SANE_LIB, ctypes.CDLL):
+            self._read_function = SANE_LIB.sane_read
+        else:
+            # Python stand-in for libsane (see replay.ReplayLib): called back
+            # from the thread, with the GIL
+            self._read_function = SANE_READ_DEF(SANE_LIB.sane_read)
+        self.reader = _rawapi.reader_start(
+            ctypes.cast(self._read_function, ctypes.c_void_p).value,
+            handle.value or 0, self.ring, chunk_size, self.telemetry,
+            _get_recorder(handle)
+        )
+
+    def read(self):
+        # Returns a _core.Buffer (see WiaReader.read())
+        # will raise EOFError at the end of the frame
+        # will raise StopIteration when there are no more documents
+        try:
+            return _core.ring_read(self.ring)
+        except IOError:
+            raise SaneException(SaneStatus(_rawapi.reader_join(self.reader)))
+
+    def get_telemetry(self):
+        return _core.telemetry_get_stats(self.telemetry)
+
+    def abort(self):
+        # the thread stops before its next sane_read()
+        _core.ring_abort(self.ring)
+
+    def join(self):
+        return _rawapi.reader_join(self.reader)
+
+
+def sane_start_reader(handle, max_buffered=SaneReader.MAX_BUFFERED,
+                      chunk_size=SaneReader.CHUNK_SIZE):
+    """
+    Starts reading the current frame (see sane_start()) on a native thread.
+    The thread stops at the end of the frame. Until then, the handle belongs
+    to it: only sane_cancel() may be called.
+
+    Returns a SaneReader, or None if the native side of the backend isn't
+    available (sane_read() must then be used).
+    """
+    if _rawapi is None:
+        return None
+    previous = sane_readers.pop(handle.value, None)
+    if previous is not None:
+        previous.join()
+    reader = SaneReader(handle, max_buffered, chunk_size)
+    sane_readers[handle.value] = reader
+    return reader
+
+
+def _stop_reader(handle):
+    # returns False if there was no reader on this handle
+    reader = sane_readers.pop(handle.value, None)
+    if reader is None:
+        return False
+    reader.abort()
+    # sane_cancel() may be called while the thread is in sane_read(): it
+    # makes it return
+    SANE_LIB.sane_cancel(handle)
+    reader.join()
+    return True
+
+
+def _stop_readers():
+    for handle in list(sane_readers.keys()):
+        _stop_reader(ctypes.c_void_p(handle))
+
+
+# native threads don't stop by themselves with the interpreter
+atexit.register(_stop_readers)
+
+
 def is_sane_available():
     global sane_available
     return sane_available
@@ -597,6 +739,7 @@ def sane_close(handle):
     global sane_available
     assert(sane_available)
 
+    _stop_reader(handle)
     SANE_LIB.sane_close(handle)
 
 
@@ -682,6 +825,13 @@ def sane_get_parameters(handle):
     if status != SaneStatus.GOOD:
         raise SaneException(SaneStatus(status))
 
+    recorder = _get_recorder(handle)
+    if recorder is not None:
+        _core.recorder_parameters(
+            recorder, parameters.format, parameters.last_frame,
+            parameters.bytes_per_line, parameters.pixels_per_line,
+            parameters.lines, parameters.depth
+        )
     return parameters
 
 
@@ -691,6 +841,9 @@ def sane_start(handle):
 
     status = SANE_LIB.sane_start(handle)
     if status == SaneStatus.NO_DOCS:
+        recorder = _get_recorder(handle)
+        if recorder is not None:
+            _core.recorder_end_of_scan(recorder, status)
         raise StopIteration()
     if status != SaneStatus.GOOD:
         raise SaneException(SaneStatus(status))
@@ -705,6 +858,14 @@ def sane_read(handle, nb_bytes):
 
     status = SANE_LIB.sane_read(handle, ctypes.pointer(buf), len(buf),
                                 ctypes.pointer(length))
+    recorder = _get_recorder(handle)
+    if recorder is not None:
+        if status == SaneStatus.GOOD:
+            _core.recorder_chunk(recorder, buf[:length.value])
+        elif status == SaneStatus.EOF:
+            _core.recorder_end_of_page(recorder)
+        else:
+            _core.recorder_end_of_scan(recorder, status)
     if status == SaneStatus.NO_DOCS:
         raise StopIteration()
     elif status == SaneStatus.EOF:
@@ -718,7 +879,11 @@ def sane_cancel(handle):
     global sane_available
     assert(sane_available)
 
-    SANE_LIB.sane_cancel(handle)
+    if not _stop_reader(handle):
+        SANE_LIB.sane_cancel(handle)
+    recorder = _get_recorder(handle)
+    if recorder is not None:
+        _core.recorder_end_of_scan(recorder, SaneStatus.CANCELLED)
 
 
 def sane_set_io_mode(handle, non_blocking=False):
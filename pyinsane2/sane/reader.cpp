@@ -0,0 +1,104 @@
+#include "reader.h"
+
+
+PyinsaneSaneReader::PyinsaneSaneReader(sane_read_fn read, void *handle, PyinsaneRing *ring,
+        size_t chunkSize, PyinsaneTransferTelemetry *telemetry,
+        PyinsaneTransferRecorder *recorder)
+    : mRead(read), mHandle(handle), mRing(ring), mChunkSize(chunkSize),
+    mTelemetry(telemetry), mRecorder(recorder), mStatus(SANE_READER_GOOD)
+{
+    if (mTelemetry != NULL)
+        mTelemetry->Start();
+    mThread = std::thread(&PyinsaneSaneReader::Run, this);
+}
+
+
+PyinsaneSaneReader::~PyinsaneSaneReader()
+{
+    if (mThread.joinable()) {
+        mRing->Abort();
+        mThread.join();
+    }
+}
+
+
+int PyinsaneSaneReader::Join()
+{
+    if (mThread.joinable())
+        mThread.join();
+    return mStatus.load();
+}
+
+
+void PyinsaneSaneReader::Run()
+{
+    std::chrono::steady_clock::time_point start;
+    unsigned char *buf;
+    size_t nb;
+    int length, status;
+    bool ok;
+
+    while (true) {
+        // waits for room if the application is late
+        nb = mChunkSize;
+        start = std::chrono::steady_clock::now();
+        buf = (unsigned char *)mRing->Reserve(&nb);
+        if (mTelemetry != NULL)
+            mTelemetry->OnBlocked(std::chrono::steady_clock::now() - start);
+        if (buf == NULL) {
+            status = SANE_READER_CANCELLED;
+            break;
+        }
+
+        length = 0;
+        status = mRead(mHandle, buf, (int)nb, &length);
+        if (status != SANE_READER_GOOD)
+            break;
+
+        // some backends return GOOD with no data instead of blocking
+        if (length < 0 || (size_t)length > nb)
+            length = 0;
+        if (mRecorder != NULL)
+            mRecorder->OnChunk(buf, length);
+        if (mTelemetry != NULL)
+            mTelemetry->OnChunk(length);
+        start = std::chrono::steady_clock::now();
+        ok = mRing->Commit(length);
+        if (mTelemetry != NULL)
+            mTelemetry->OnBlocked(std::chrono::steady_clock::now() - start);
+        if (!ok) {
+            status = SANE_READER_CANCELLED;
+            break;
+        }
+    }
+
+    switch (status) {
+        case SANE_READER_EOF:
+            if (mRecorder != NULL)
+                mRecorder->OnEndOfPage();
+            if (mTelemetry != NULL)
+                mTelemetry->OnEndOfPage();
+            mRing->EndOfPage();
+            break;
+        case SANE_READER_NO_DOCS:
+            if (mRecorder != NULL)
+                mRecorder->OnEndOfScan(status);
+            mRing->EndOfScan();
+            break;
+        default:
+            // cancelled by the application: it records it itself (see
+            // rawapi.sane_cancel())
+            if (mRing->IsAborted()) {
+                status = SANE_READER_CANCELLED;
+                break;
+            }
+            if (mRecorder != NULL)
+                mRecorder->OnEndOfScan(status);
+            if (mTelemetry != NULL)
+                mTelemetry->OnError(status);
+            // wakes up the reader: the status is returned by Join()
+            mRing->Abort();
+            break;
+    }
+    mStatus.store(status);
+}
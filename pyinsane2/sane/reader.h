@@ -0,0 +1,65 @@
+#ifndef __PYINSANE_SANE_READER_H
+#define __PYINSANE_SANE_READER_H
+
+#include <atomic>
+#include <thread>
+
+#include "record.h"
+#include "ring.h"
+#include "telemetry.h"
+
+#define SANE_PYCAPSULE_READER_NAME "Pyinsane SANE reader"
+
+// Same values as SANE_Status (sane/sane.h)
+enum sane_reader_status {
+    SANE_READER_GOOD = 0,
+    SANE_READER_CANCELLED = 2,
+    SANE_READER_EOF = 5,
+    SANE_READER_NO_DOCS = 7,
+};
+
+// sane_read(). libsane is loaded by rawapi.py (ctypes): we only get the
+// address of the function (or of a ctypes callback standing for it).
+typedef int (*sane_read_fn)(void *handle, unsigned char *data, int maxLength, int *length);
+
+/*!
+ * Reads one frame on its own thread, without the GIL: sane_read() is called
+ * again as soon as it returns, straight into the slabs of the ring (see
+ * PyinsaneRing::Reserve()), whatever the application is doing. Scan.read()
+ * only drains the ring.
+ *
+ * The thread stops at the end of the frame (the next one requires
+ * sane_start(), called by the application), on error, or once the ring is
+ * aborted. Until then, the SANE handle belongs to the thread.
+ *
+ * Once 'maxBytes' of the ring are buffered, the thread waits for the
+ * application: the time it spends waiting is reported as 'blocked' by the
+ * telemetry.
+ */
+class PyinsaneSaneReader
+{
+public:
+    PyinsaneSaneReader(sane_read_fn read, void *handle, PyinsaneRing *ring,
+            size_t chunkSize, PyinsaneTransferTelemetry *telemetry = NULL,
+            PyinsaneTransferRecorder *recorder = NULL);
+    // aborts the ring and joins the thread if Join() hasn't been called
+    ~PyinsaneSaneReader();
+
+    // Waits for the end of the thread. Returns the last status returned by
+    // sane_read() (SANE_READER_CANCELLED if the ring was aborted first).
+    int Join();
+
+private:
+    void Run();
+
+    sane_read_fn mRead;
+    void *mHandle;
+    PyinsaneRing *mRing;
+    size_t mChunkSize;
+    PyinsaneTransferTelemetry *mTelemetry;
+    PyinsaneTransferRecorder *mRecorder;
+    std::atomic<int> mStatus;
+    std::thread mThread;
+};
+
+#endif
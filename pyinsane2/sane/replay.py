@@ -0,0 +1,193 @@
+"""
+Plays back a scan recorded with Scanner.scan(record=...) (or
+rawapi.sane_record()), without the scanner: stands for libsane, so the
+recording goes through the same code (rawapi, abstract) as the original scan.
+
+    replay = ReplayLib("scan.rec", speed=0)
+    with replay.installed():
+        scanner = abstract.Scanner("replay")
+        session = scanner.scan(multiple=(replay.nb_pages > 1))
+        ...
+
+speed -- 1.0: same timing as the original scan ; 2.0: twice as fast ; 0:
+    as fast as possible.
+
+The device has only one option, 'source' (read-only): "ADF" if the recording
+has more than one page, "Flatbed" otherwise, so Scanner.scan(multiple=True)
+works as it did on the original scanner. The frame parameters and the data are
+the recorded ones, whatever the application does.
+"""
+
+import contextlib
+import ctypes
+
+from . import rawapi
+from .rawapi import SaneStatus
+from ..native import _core
+
+
+__all__ = [
+    'ReplayLib',
+]
+
+
+class ReplayLib(object):
+    SOURCE_SIZE = 32
+
+    OPTION_DESCRIPTORS = [
+        rawapi.SaneOptionDescriptor(
+            name=b"", title=b"Number of options", desc=b"",
+            type=rawapi.SaneValueType.INT, unit=rawapi.SaneUnit.NONE,
+            size=ctypes.sizeof(ctypes.c_int),
+            cap=rawapi.SaneCapabilities.SOFT_DETECT,
+            constraint_type=rawapi.SaneConstraintType.NONE,
+        ),
+        rawapi.SaneOptionDescriptor(
+            name=b"source", title=b"Scan source", desc=b"Replayed source",
+            type=rawapi.SaneValueType.STRING, unit=rawapi.SaneUnit.NONE,
+            size=SOURCE_SIZE, cap=rawapi.SaneCapabilities.SOFT_DETECT,
+            constraint_type=rawapi.SaneConstraintType.NONE,
+        ),
+    ]
+
+    def __init__(self, path, speed=1.0):
+        self.replay = _core.replay_open(path)
+        infos = _core.replay_get_infos(self.replay)
+        if infos['backend'] != 'sane':
+            raise rawapi.SaneException(SaneStatus(SaneStatus.INVAL))
+        self.nb_pages = infos['pages']
+        self.source = b"ADF" if self.nb_pages > 1 else b"Flatbed"
+        self.speed = speed
+        self._next = None
+        self._pending = b""
+        self._parameters = (0, 1, 0, 0, 0, 8)
+        self._handle = ctypes.c_int(0)
+
+    def _peek(self):
+        if self._next is None:
+            self._next = _core.replay_next(self.replay, self.speed)
+        return self._next
+
+    def _pop(self):
+        event = self._peek()
+        self._next = None
+        return event
+
+    def _pop_parameters(self):
+        event = self._peek()
+        if event is not None and event[0] == 'parameters':
+            self._parameters = self._pop()[1]
+
+    @contextlib.contextmanager
+    def installed(self):
+        # Replaces libsane until the end of the block
+        previous = (rawapi.SANE_LIB, rawapi.sane_available)
+        rawapi.SANE_LIB = self
+        rawapi.sane_available = True
+        try:
+            yield self
+        finally:
+            (rawapi.SANE_LIB, rawapi.sane_available) = previous
+
+    # Same prototypes as libsane (see the ctypes declarations in rawapi)
+
+    def sane_init(self, version_code, auth_callback):
+        version_code.contents.value = (1 << 24)
+        return SaneStatus.GOOD
+
+    def sane_exit(self):
+        pass
+
+    def sane_get_devices(self, devices_ptr, local_only):
+        # kept alive as long as libsane would: until the next call
+        self._device = rawapi.SaneDevice(name=b"replay", vendor=b"Pyinsane",
+                                         model=b"Replay", type=b"replay")
+        self._devices = (ctypes.POINTER(rawapi.SaneDevice) * 2)(
+            ctypes.pointer(self._device)  # NULL-terminated
+        )
+        devices_ptr[0] = ctypes.cast(
+            self._devices, ctypes.POINTER(ctypes.POINTER(rawapi.SaneDevice))
+        )
+        return SaneStatus.GOOD
+
+    def sane_open(self, name, handle_ptr):
+        handle_ptr.contents.value = ctypes.addressof(self._handle)
+        return SaneStatus.GOOD
+
+    def sane_close(self, handle):
+        pass
+
+    def sane_get_option_descriptor(self, handle, option_idx):
+        if option_idx.value >= len(self.OPTION_DESCRIPTORS):
+            return ctypes.POINTER(rawapi.SaneOptionDescriptor)()
+        return ctypes.pointer(self.OPTION_DESCRIPTORS[option_idx.value])
+
+    def sane_control_option(self, handle, option_idx, action, value, info):
+        if action != rawapi.SaneAction.GET_VALUE:
+            return SaneStatus.INVAL
+        if option_idx.value == 0:
+            ctypes.cast(value, ctypes.POINTER(ctypes.c_int)).contents.value = \
+                len(self.OPTION_DESCRIPTORS)
+        elif option_idx.value == 1:
+            ctypes.memmove(value, self.source + b"\0", len(self.source) + 1)
+        else:
+            return SaneStatus.INVAL
+        return SaneStatus.GOOD
+
+    def sane_start(self, handle):
+        # what remains of the previous frame, if it wasn't read entirely
+        self._pending = b""
+        while True:
+            event = self._peek()
+            if event is None:
+                return SaneStatus.NO_DOCS
+            if (event[0] == 'end_of_scan' and
+                    event[1] == SaneStatus.CANCELLED):
+                # sane_cancel() of the previous scan
+                self._pop()
+                continue
+            if event[0] == 'end_of_scan':
+                self._pop()
+                return event[1]
+            self._pop_parameters()
+            return SaneStatus.GOOD
+
+    def sane_get_parameters(self, handle, parameters_ptr):
+        self._pop_parameters()
+        parameters = parameters_ptr.contents
+        (parameters.format, parameters.last_frame, parameters.bytes_per_line,
+         parameters.pixels_per_line, parameters.lines,
+         parameters.depth) = self._parameters
+        return SaneStatus.GOOD
+
+    def sane_read(self, handle, buf, max_length, length_ptr):
+        length_ptr.contents.value = 0
+        while not self._pending:
+            event = self._pop()
+            if event is None:
+                return SaneStatus.NO_DOCS
+            (event_type, value) = event
+            if event_type == 'chunk':
+                self._pending = value
+            elif event_type == 'end_of_page':
+                return SaneStatus.EOF
+            elif event_type == 'end_of_scan':
+                return value
+            # progress, parameters: nothing to return
+        data = self._pending[:max_length]
+        self._pending = self._pending[max_length:]
+        ctypes.memmove(buf, data, len(data))
+        length_ptr.contents.value = len(data)
+        return SaneStatus.GOOD
+
+    def sane_cancel(self, handle):
+        event = self._peek()
+        if (event is not None and event[0] == 'end_of_scan' and
+                event[1] == SaneStatus.CANCELLED):
+            self._pop()
+
+    def sane_set_io_mode(self, handle, non_blocking):
+        return SaneStatus.UNSUPPORTED
+
+    def sane_get_select_fd(self, handle, fd_ptr):
+        return SaneStatus.UNSUPPORTED
@@ -1,11 +1,15 @@
+import collections
 import io
 import logging
+import threading
+import time
 
 import PIL.Image
 import PIL.ImageFile
 
 from . import rawapi
 from .. import util
+from ..native import _core
 from .rawapi import WIAException
 
 
@@ -38,58 +42,118 @@ class Scan(object):
     # --> We ignore BMP too small
     MIN_BYTES = 1024
 
-    def __init__(self, session, source, multiple=False):
+    def __init__(self, session, source, multiple=False, compressed=False,
+                 batch=False, raw=False):
         self._session = session
         self.source = source
-        self._data = b""
+        # raw: lines are converted to packed top-down RGB/L as they arrive
+        self.raw = raw
+        self._dib = _core.dib_new(raw)
         self._img_size = None
-        self.scan = rawapi.start_scan(self.source)
+        # compressed formats may require the driver to seek in the stream
+        self.scan = rawapi.start_scan(self.source, mapped=compressed,
+                                      recorder=session.recorder)
         self.multiple = multiple
+        self.compressed = compressed
+        # batch: this download returns all the pages of the feeder
+        self.batch = batch
 
     def read(self):
         # will raise EOFError at the end of each page
         # will raise StopIteration when all the pages are done
         try:
             buf = self.scan.read()
-            self._data += buf
+            _core.dib_feed(self._dib, buf)
             self._got_data = True
+            return
         except EOFError:
-            if len(self._data) >= self.MIN_BYTES:
-                self._session._add_image(self._get_current_image())
-                if self.multiple:
+            self._log_page_telemetry()
+            if _core.dib_get_size(self._dib) >= self.MIN_BYTES:
+                if self.compressed:
+                    self._session._add_compressed_page(
+                        _core.dib_get_raw(self._dib)
+                    )
+                else:
+                    self._session._add_image(self._get_current_image())
+                if self.batch:
+                    # next page, same download
+                    self._dib = _core.dib_new(self.raw)
+                elif self.multiple:
                     self._session._next()
                 raise
             else:
                 # Too small. Scrap the crap from the drivers.
-                self._data = b""
-                raise StopIteration()
+                self._dib = _core.dib_new(self.raw)
+                if not self.batch:
+                    raise StopIteration()
+        # batch: not a page. Skip it and go on with the next one (the end of
+        # the download will tell us if there are more pages)
+        return self.read()
+
+    def get_telemetry(self):
+        # see rawapi.WiaReader.get_telemetry()
+        return self.scan.get_telemetry()
+
+    def _log_page_telemetry(self):
+        telemetry = self.get_telemetry()
+        if not telemetry['pages']:
+            return
+        page = telemetry['pages'][-1]
+        logger.info(
+            "Page {}: {} bytes in {:.3f}s ({:.0f} B/s), first byte after"
+            " {:.3f}s, {} chunks, driver blocked {:.3f}s".format(
+                len(telemetry['pages']), page['bytes'], page['duration'],
+                page['throughput'], page['time_to_first_byte'],
+                page['chunks'], page['blocked']
+            )
+        )
+
+    def _get_infos(self):
+        infos = _core.dib_get_infos(self._dib)
+        if infos is not None:
+            self._img_size = (infos['width'], infos['height'])
+        return infos
+
+    def _get_lines(self, start_line, end_line):
+        # Only the requested lines are converted: we don't decode the whole
+        # bitmap again each time the caller wants to display a few more lines
+        (mode, rawmode, size, data, palette) = _core.dib_get_lines(
+            self._dib, start_line, end_line
+        )
+        img = PIL.Image.frombytes(mode, size, data, "raw", rawmode)
+        if palette is not None:
+            img.putpalette(palette)
+        return img
 
     def _get_current_image(self):
+        infos = self._get_infos()
+        if infos is not None and infos['supported']:
+            return self._get_lines(0, infos['height'])
+        # Compressed or exotic bitmap: let PIL handle it.
         # We get the image as a truncated bitmap.
         # ('rawrgb' is not supported by all drivers ...)
-        # Bitmap headers are annoying.
         PIL.ImageFile.LOAD_TRUNCATED_IMAGES = True
-        stream = io.BytesIO(self._data)
+        stream = io.BytesIO(_core.dib_get_raw(self._dib))
         img = PIL.Image.open(stream)
         self._img_size = img.size
         return img
 
     def _get_available_lines(self):
-        if self._img_size is None:
-            try:
-                self._get_current_image()
-            except:
-                # assumes we just got truncated headers for now
-                return (0, 0)
+        infos = self._get_infos()
+        if infos is None:
+            # assumes we just got truncated headers for now
+            return (0, 0)
+        if infos['supported']:
+            return _core.dib_get_available_lines(self._dib)
         # estimated
         line_size = self._img_size[0] * 3  # rgb
-        data = len(self._data) - 1024  # - headers
+        data = _core.dib_get_size(self._dib) - 1024  # - headers
         return (0, int(data / line_size))
 
     available_lines = property(_get_available_lines)
 
     def _get_expected_size(self):
-        if self._img_size:
+        if self._img_size or self._get_infos() is not None:
             return self._img_size
         options = self._session.scanner.options
         return (
@@ -100,6 +164,11 @@ class Scan(object):
     expected_size = property(_get_expected_size)
 
     def get_image(self, start_line=0, end_line=-1):
+        infos = self._get_infos()
+        if infos is not None and infos['supported']:
+            if end_line < 0:
+                end_line = infos['height']
+            return self._get_lines(start_line, end_line)
         img = self._get_current_image()
         img_size = img.size
         if start_line > 0:
@@ -110,26 +179,70 @@ class Scan(object):
         return img
 
     def cancel(self):
-        # TODO
-        raise NotImplementedError()
+        self.scan.cancel()
+        self._dib = _core.dib_new(self.raw)
 
     def __str__(self):
         return ("Scan instance for session {}".format(self._session))
 
 
+def _decode_page(data):
+    img = PIL.Image.open(io.BytesIO(data))
+    img.load()
+    return img
+
+
 class ScanSession(object):
-    def __init__(self, scanner, srcid, multiple):
+    # Number of native threads decoding the pages of compressed transfers
+    # (with PIL: they need the GIL, see _core.decode_pool_new())
+    DECODE_WORKERS = 2
+
+    def __init__(self, scanner, srcid, multiple, compressed=False,
+                 batch=False, record=None, raw=False):
         self.scanner = scanner
         self.multiple = multiple
+        self.compressed = compressed
+        self.batch = batch
+        self.raw = raw
         self.source = scanner.srcs[srcid]
-        self.images = []
-        self.scan = Scan(self, self.source, self.multiple)
+        self._images = []
+        # compressed transfers only: the pages as returned by the driver
+        # (JPEG, PNG, TIFF, ...), for applications that store them as-is.
+        self.compressed_pages = []
+        self._decode_pool = None
+        if compressed:
+            self._decode_pool = _core.decode_pool_new(
+                _decode_page, self.DECODE_WORKERS
+            )
+        # all the downloads of the session go to the same recording
+        self.recorder = None
+        if record is not None:
+            self.recorder = _core.recorder_new(record, _core.RECORD_WIA)
+        self.scan = Scan(self, self.source, self.multiple, self.compressed,
+                         self.batch, self.raw)
 
     def _add_image(self, img):
-        self.images.append(img)
+        self._images.append(img)
+
+    def _add_compressed_page(self, data):
+        self.compressed_pages.append(data)
+        _core.decode_pool_submit(self._decode_pool, data)
+
+    def _get_images(self):
+        # wait for the pages still being decoded, if any
+        while len(self._images) < len(self.compressed_pages):
+            img = None
+            try:
+                img = _core.decode_pool_get(self._decode_pool)
+            finally:
+                self._images.append(img)
+        return self._images
+
+    images = property(_get_images)
 
     def _next(self):
-        self.scan = Scan(self, self.source, self.multiple)
+        self.scan = Scan(self, self.source, self.multiple, self.compressed,
+                         raw=self.raw)
 
 
 class ScannerCapabilities(object):
@@ -157,6 +270,7 @@ class ScannerOption(object):
 
     constraint_type = None  # TODO
     constraint = None
+    _default_constraint = False  # constraint made from possible_values
 
     def __init__(self, scanner, objsrc, name, value, possible_values,
                  accessright, constraint):
@@ -164,40 +278,45 @@ class ScannerOption(object):
         self.scanner = scanner
         self.name = name
         self._value = value
+        self.possible_values = possible_values
+        self._set_constraint(constraint)
+        self.accessright = accessright
+        self.capabilities = ScannerCapabilities(self)
+
+    def _set_constraint(self, constraint):
+        self._default_constraint = not constraint
         if constraint:
             self.constraint = constraint
+        elif self.possible_values is not None:
+            # the possible values are tuples shared by all the options, but
+            # a tuple constraint means a range
+            self.constraint = list(self.possible_values)
         else:
-            self.constraint = possible_values
+            self.constraint = None
+
+    def _update(self, value, possible_values, accessright):
+        # constraints are updated separately (see Scanner._apply_changes())
+        changed = possible_values is not self.possible_values
+        self._value = value
+        self.possible_values = possible_values
         self.accessright = accessright
-        self.capabilities = ScannerCapabilities(self)
+        if changed and self._default_constraint:
+            self._set_constraint(None)
 
     def _get_value(self):
         return self._value
 
-    def _set_value(self, new_value):
+    def _get_writes(self, new_value, pending):
+        # properties to write to set this option to new_value, given the
+        # writes already pending ({property name: value})
         if self.accessright != 'rw':
             raise rawapi.WIAException("Property {} is read-only".format(
                 self.name
             ))
-        has_success = False
-        exc = None
-        for obj in self.objsrc:
-            try:
-                rawapi.set_property(obj, self.name, new_value)
-                has_success = True
-            except rawapi.WIAException as _exc:
-                logger.warning("Exception while setting {}: {}".format(
-                    self.name, _exc
-                ))
-                logger.exception(_exc)
-                exc = _exc
-        self._value = new_value
-        try:
-            self.scanner.reload_options()
-        except:
-            pass
-        if not has_success:
-            raise exc
+        return [(self.name, new_value)]
+
+    def _set_value(self, new_value):
+        self.scanner.set_options([(self.name, new_value)])
 
     value = property(_get_value, _set_value)
 
@@ -273,23 +392,22 @@ class ModeOption(object):
             return 'Gray'
         return 'Color'
 
+    def _get_writes(self, new_value, pending):
+        depths = {
+            "BW": 1,
+            "Gray": 8,
+            "Color": 24,
+        }
+        if new_value not in depths:
+            raise WIAException("Unknown value '{}' for option 'mode'".format(
+                new_value
+            ))
+        return self.scanner.options['depth']._get_writes(
+            depths[new_value], pending
+        )
+
     def _set_value(self, new_value):
-        opts = self.scanner.options
-        if new_value == "BW":
-            opts['depth'].value = 1
-            self.scanner.reload_options()
-            return
-        if new_value == "Gray":
-            opts['depth'].value = 8
-            self.scanner.reload_options()
-            return
-        if new_value == "Color":
-            opts['depth'].value = 24
-            self.scanner.reload_options()
-            return
-        raise WIAException("Unknown value '{}' for option 'mode'".format(
-            new_value
-        ))
+        self.scanner.set_options([(self.name, new_value)])
 
     value = property(_get_value, _set_value)
 
@@ -337,11 +455,17 @@ class PosOption(object):
     def _get_value(self):
         return self._options[self.base_name + 'pos'].value
 
+    def _get_writes(self, new_value, pending):
+        opt_pos = self._options[self.base_name + 'pos']
+        opt_extent = self._options[self.base_name + 'extent']
+        pos = pending.get(opt_pos.name, opt_pos.value)
+        extent = pending.get(opt_extent.name, opt_extent.value)
+        # the bottom-right corner doesn't move
+        return (opt_pos._get_writes(new_value, pending) +
+                opt_extent._get_writes(extent + pos - new_value, pending))
+
     def _set_value(self, new_value):
-        diff = self._options[self.base_name + 'pos'].value - self.value
-        extent = self._options[self.base_name + 'extent'].value
-        self._options[self.base_name + 'pos'].value = new_value
-        self._options[self.base_name + 'extent'].value = extent - diff
+        self.scanner.set_options([(self.name, new_value)])
 
     value = property(_get_value, _set_value)
 
@@ -386,9 +510,14 @@ class ExtendOption(object):
         return (self._options[self.base_name + 'extent'].value +
                 self._options[self.base_name + 'pos'].value)
 
+    def _get_writes(self, new_value, pending):
+        opt_pos = self._options[self.base_name + 'pos']
+        opt_extent = self._options[self.base_name + 'extent']
+        pos = pending.get(opt_pos.name, opt_pos.value)
+        return opt_extent._get_writes(new_value - pos, pending)
+
     def _set_value(self, new_value):
-        new_value -= self._options[self.base_name + 'pos'].value
-        self._options[self.base_name + 'extent'].value = new_value
+        self.scanner.set_options([(self.name, new_value)])
 
     value = property(_get_value, _set_value)
 
@@ -409,22 +538,74 @@ class ExtendOption(object):
 
 
 class Scanner(object):
-    def __init__(self, name):
-        self._dev = rawapi.open(name)
-        self._srcs_list = rawapi.get_sources(self._dev)
-        self.srcs = {}
-        for (srcid, src) in self._srcs_list:
-            self.srcs[srcid] = src
-
-        self.options = {}
-        self.reload_options()
-
+    # Transfer formats tried, in order, by scan(compressed=True):
+    # (format, compression)
+    COMPRESSED_FORMATS = [
+        ('jpeg', 'jpeg'),
+        ('png', 'png'),
+    ]
+    COMPRESSED_FORMATS_BW = [
+        ('tiff', 'g4'),
+        ('png', 'png'),
+    ]
+    # Transfer formats tried, in order, by scan(raw=True). 'rawrgb' isn't
+    # tried: without header, the channel order and the padding of its lines
+    # depend on the driver.
+    RAW_FORMATS = [
+        ('memorybmp', None),
+    ]
+
+    # WIA_IPS_PAGES: the driver keeps going until the feeder is empty
+    ALL_PAGES = 0
+
+    def __init__(self, name, nice_name=None):
+        # Nothing is asked to the device until it is actually used: see
+        # open() and 'options'. 'nice_name' comes from the device list.
+        # True once scan() requested something else than the default format
+        self._format_changed = False
         self.name = name
-        self.nice_name = self.options['dev_name'].value
-        self.vendor = self.options['vend_desc'].value
-        self.model = self.options['dev_desc'].value
-        self.dev_type = self.options['dev_type'].value
-
+        self.nice_name = nice_name if nice_name is not None else name
+        self._lock = threading.RLock()
+        self._dev = None
+        self._srcs_list = []
+        self.__srcs = {}
+        self.__options = None
+
+    def open(self):
+        # Opens the device and lists its sources (once)
+        with self._lock:
+            if self._dev is not None:
+                return
+            dev = rawapi.open(self.name)
+            self._srcs_list = rawapi.get_sources(dev)
+            self.__srcs = dict(self._srcs_list)
+            self._dev = dev
+
+    def _get_srcs(self):
+        self.open()
+        return self.__srcs
+
+    srcs = property(_get_srcs)
+
+    def __load_options(self):
+        with self._lock:
+            if self.__options is not None:
+                return
+            self.open()
+            self.reload_options()
+            self.__preset_options()
+
+    def _get_options(self):
+        self.__load_options()
+        return self.__options
+
+    options = property(_get_options)
+
+    vendor = property(lambda self: self.options['vend_desc'].value)
+    model = property(lambda self: self.options['dev_desc'].value)
+    dev_type = property(lambda self: self.options['dev_type'].value)
+
+    def __preset_options(self):
         for (opt, val) in [
             ('current_intent', 'image_type_color,maximize_quality'),
             ('format', 'bmp'),
@@ -432,10 +613,10 @@ class Scanner(object):
             ('page_size', 'a4'),
             ('depth', 24),
         ]:
-            if opt not in self.options:
+            if opt not in self.__options:
                 continue
             try:
-                self.options[opt].value = val
+                self.__options[opt].value = val
                 logger.warning("Option '{}' preset to '{}' on [{}]".format(opt, val, self))
             except:
                 logger.warning("Failed to pre-set option '{}' on [{}]".format(opt, self))
@@ -451,37 +632,20 @@ class Scanner(object):
             }
         return out
 
-    @staticmethod
-    def _merge_constraints(props, constraints):
-        for (propname, constraint) in constraints:
-            if propname not in props:
-                logger.warning("Constraint found on property [{}] but property not found".format(propname))
-                continue
-            if isinstance(constraint, list):
-                constraint.sort()
-            props[propname]['constraint'] = constraint
-
     def reload_options(self):
-        original = self.options
+        self.open()
+        original = self.__options if self.__options is not None else {}
 
-        self.options = {}
+        self.__options = {}
 
-        dev_properties = self._convert_prop_list_to_dict(
-            rawapi.get_properties(self._dev)
-        )
-        dev_constraints = rawapi.get_constraints(self._dev)
-        self._merge_constraints(dev_properties, dev_constraints)
+        dev_properties = rawapi.get_options(self._dev)
 
         src_properties = {}
         for (srcid, src) in self._srcs_list:
-            src_properties[srcid] = self._convert_prop_list_to_dict(
-                rawapi.get_properties(src)
-            )
-            src_constraints = rawapi.get_constraints(src)
-            self._merge_constraints(src_properties[srcid], src_constraints)
+            src_properties[srcid] = rawapi.get_options(src)
 
         for (opt_name, opt_infos) in dev_properties.items():
-            self.options[opt_name] = ScannerOption(
+            self.__options[opt_name] = ScannerOption(
                 self,
                 [self._dev],
                 opt_name, opt_infos['value'], opt_infos['possible_values'],
@@ -499,74 +663,323 @@ class Scanner(object):
                     opt_infos['accessright'],
                     opt_infos['constraint'] if 'constraint' in opt_infos else None
                 )
-                if opt_name in self.options:
-                    if self.options[opt_name] != opt:
+                if opt_name in self.__options:
+                    if self.__options[opt_name] != opt:
                         logger.warning("Got multiple time the option [{}], but they are not identical".format(opt_name))
-                self.options[opt_name] = opt
+                self.__options[opt_name] = opt
+
+        self._make_aliases()
+
+        if 'source' in original:
+            self.__options['source'] = original['source']
+        else:
+            self.__options['source'] = SourceOption(self._srcs_list)
+        if 'mode' in original:
+            self.__options['mode'] = original['mode']
+        else:
+            self.__options['mode'] = ModeOption(self)
 
+    def _make_aliases(self):
         # aliases to match Sane
-        if "xpos" in self.options.keys() and "xextent" in self.options.keys():
-            self.options['tl-x'] = PosOption(
-                self, "tl-x", "x", self.options, "min_horizontal_size",
+        if "xpos" in self.__options.keys() and "xextent" in self.__options.keys():
+            self.__options['tl-x'] = PosOption(
+                self, "tl-x", "x", self.__options, "min_horizontal_size",
                 "max_horizontal_size", "xres"
             )
-            self.options['br-x'] = ExtendOption(
-                self, "br-x", "x", self.options, "min_horizontal_size",
+            self.__options['br-x'] = ExtendOption(
+                self, "br-x", "x", self.__options, "min_horizontal_size",
                 "max_horizontal_size", "xres"
             )
-        if "ypos" in self.options.keys() and "yextent" in self.options.keys():
-            self.options['tl-y'] = PosOption(
-                self, "tl-y", "y", self.options, "min_vertical_size",
+        if "ypos" in self.__options.keys() and "yextent" in self.__options.keys():
+            self.__options['tl-y'] = PosOption(
+                self, "tl-y", "y", self.__options, "min_vertical_size",
                 "max_vertical_size", "yres"
             )
-            self.options['br-y'] = ExtendOption(
-                self, "br-y", "y", self.options, "min_vertical_size",
+            self.__options['br-y'] = ExtendOption(
+                self, "br-y", "y", self.__options, "min_vertical_size",
                 "max_vertical_size", "yres"
             )
         res_alias_for = []
-        if "xres" in self.options.keys():
+        if "xres" in self.__options.keys():
             res_alias_for.append("xres")
-        if "yres" in self.options.keys():
+        if "yres" in self.__options.keys():
             res_alias_for.append("yres")
         if res_alias_for != []:
-            self.options['resolution'] = util.AliasOption(
-                "resolution", res_alias_for, self.options
+            self.__options['resolution'] = util.AliasOption(
+                "resolution", res_alias_for, self.__options
             )
 
-        if 'source' in original:
-            self.options['source'] = original['source']
-        else:
-            self.options['source'] = SourceOption(self._srcs_list)
-        if 'mode' in original:
-            self.options['mode'] = original['mode']
+    def _apply_changes(self, objsrc, changes):
+        (props, constraints, removed) = changes
+        for propname in removed:
+            if isinstance(self.__options.get(propname), ScannerOption):
+                self.__options.pop(propname)
+        props = self._convert_prop_list_to_dict(props)
+        for (opt_name, opt_infos) in props.items():
+            opt = self.__options.get(opt_name)
+            if isinstance(opt, ScannerOption):
+                opt._update(opt_infos['value'], opt_infos['possible_values'],
+                            opt_infos['accessright'])
+            else:
+                opt = ScannerOption(
+                    self, objsrc,
+                    opt_name, opt_infos['value'], opt_infos['possible_values'],
+                    opt_infos['accessright'], None
+                )
+                self.__options[opt_name] = opt
+        for (propname, constraint) in constraints:
+            opt = self.__options.get(propname)
+            if not isinstance(opt, ScannerOption):
+                logger.warning("Constraint found on property [{}] but property not found".format(propname))
+                continue
+            opt._set_constraint(constraint)
+
+    def refresh_options(self, objs=None):
+        """
+        Update the options from what changed on the given device / sources
+        (all by default) since they were last read, instead of reloading
+        everything (see reload_options()).
+        """
+        if self.__options is None:
+            # nothing read yet
+            self.__load_options()
+            return
+        if objs is None:
+            objs = [self._dev] + list(self.srcs.values())
+        for obj in objs:
+            objsrc = [self._dev] if obj is self._dev else self.srcs.values()
+            self._apply_changes(objsrc, rawapi.get_property_changes(obj))
+        self._make_aliases()
+
+    def _add_writes(self, opt_name, value, writes, others):
+        opt = self.options[opt_name]
+        if isinstance(opt, util.AliasOption):
+            for alias_for in opt.alias_for:
+                self._add_writes(alias_for, value, writes, others)
+        elif hasattr(opt, '_get_writes'):
+            for (propname, propvalue) in opt._get_writes(value, writes):
+                writes[propname] = propvalue
         else:
-            self.options['mode'] = ModeOption(self)
+            # not a WIA property (source)
+            others.append((opt, value))
+
+    def set_options(self, values):
+        """
+        Set several options at once: [(option name, value), ...] or
+        {option name: value}.
+
+        Composite options (tl-x, br-x, mode, resolution, ...) are translated
+        into the WIA properties they are made of, and all the properties of a
+        device or source are written in a single call, so the driver
+        validates them together.
+        """
+        if isinstance(values, dict):
+            values = values.items()
+        writes = collections.OrderedDict()  # property name --> value
+        others = []
+        for (opt_name, value) in values:
+            self._add_writes(opt_name, value, writes, others)
+
+        per_obj = []  # [(device or source, {property name: value}), ...]
+        for (propname, value) in writes.items():
+            for obj in self.options[propname].objsrc:
+                for (written_obj, props) in per_obj:
+                    if written_obj is obj:
+                        break
+                else:
+                    props = collections.OrderedDict()
+                    per_obj.append((obj, props))
+                props[propname] = value
+
+        # like Sane, an option is set if at least one of its sources accepted
+        # it
+        succeeded = set()
+        written = []
+        for (obj, props) in per_obj:
+            try:
+                failed = rawapi.set_properties(obj, props)
+            except rawapi.WIAException as exc:
+                logger.exception(exc)
+                failed = list(props.keys())
+            for propname in props.keys():
+                if propname in failed:
+                    logger.warning("Failed to set {} to {}".format(
+                        propname, props[propname]
+                    ))
+                else:
+                    succeeded.add(propname)
+            if len(failed) < len(props):
+                written.append(obj)
+
+        for propname in succeeded:
+            self.options[propname]._value = writes[propname]
+        try:
+            # the driver may have adjusted the options we set and the ones
+            # depending on them
+            self.refresh_options(written)
+        except Exception as exc:
+            logger.exception(exc)
 
-    def scan(self, multiple=False):
-        if 'pages' in self.options:
+        for (opt, value) in others:
+            opt.value = value
+
+        failed = [propname for propname in writes if propname not in succeeded]
+        if failed:
+            raise WIAException("Failed to set scanner properties: {}".format(
+                ", ".join(failed)
+            ))
+
+    def _set_transfer_format(self, compressed, raw=False):
+        formats = [('bmp', None)]
+        if raw:
+            formats = self.RAW_FORMATS + formats
+        if compressed:
+            if self.options['mode'].value == 'BW':
+                formats = self.COMPRESSED_FORMATS_BW + formats
+            else:
+                formats = self.COMPRESSED_FORMATS + formats
+
+        for (fmt, compression) in formats:
+            if 'format' not in self.options:
+                return None
+            constraint = self.options['format'].constraint
+            if (fmt != 'bmp' and
+                    (not isinstance(constraint, list) or
+                     fmt not in constraint)):
+                # only negotiate what the device advertises
+                continue
             try:
-                # Even with an ADF, Pyinsane actually request one page
-                # after the other.
-                # This is not orthodox at all, but still, it has proven to be
-                # the most reliable way.
-                self.options['pages'].value = 1
-            except:
-                logger.exception("Failed to set options [pages]")
-        return ScanSession(self, self.options['source'].value, multiple)
+                self.options['format'].value = fmt
+                if 'preferred_format' in self.options:
+                    self.options['preferred_format'].value = fmt
+                if compression is not None and 'compression' in self.options:
+                    constraint = self.options['compression'].constraint
+                    if (isinstance(constraint, list) and
+                            compression in constraint):
+                        self.options['compression'].value = compression
+                elif 'compression' in self.options:
+                    self.options['compression'].value = 'none'
+            except Exception as exc:
+                logger.warning("Failed to set transfer format {}/{}: {}".format(
+                    fmt, compression, exc))
+                continue
+            return fmt
+        return None
+
+    def scan(self, multiple=False, compressed=False, batch=False,
+             record=None, raw=False):
+        """
+        compressed -- if True, negotiate the most compact format advertised by
+            the device (see COMPRESSED_FORMATS). Pages are decoded on native
+            worker threads, and their compressed versions are available in
+            ScanSession.compressed_pages.
+        batch -- with multiple=True only: request all the pages of the feeder
+            in a single download, instead of one download per page. Much
+            faster on big batches, but some drivers don't support it. If the
+            driver refuses, falls back to one download per page.
+        record -- path of a file where everything the driver sends is
+            recorded, to play the scan back later without the scanner (see
+            _mockapi.mock_configure(replay=...))
+        raw -- request raw pixels (memory bitmap) if the device supports
+            them. Either way, lines are flipped, converted to RGB and stripped
+            of their padding as they arrive, so get_image() and the final
+            image don't have to decode the bitmap. Ignored if the transfer
+            is compressed.
+        """
+        if compressed or raw or self._format_changed:
+            fmt = self._set_transfer_format(compressed, raw)
+            self._format_changed = (compressed or raw)
+            compressed = (fmt is not None and
+                          fmt not in ('bmp', 'memorybmp'))
+        raw = raw and not compressed
+        batch = batch and multiple
+        if 'pages' in self.options:
+            if batch:
+                try:
+                    self.options['pages'].value = self.ALL_PAGES
+                except Exception as exc:
+                    logger.warning(
+                        "Failed to request all the pages at once ({})."
+                        " Will request them one by one".format(exc)
+                    )
+                    batch = False
+            if not batch:
+                try:
+                    # Even with an ADF, Pyinsane actually request one page
+                    # after the other.
+                    # This is not orthodox at all, but still, it has proven
+                    # to be the most reliable way.
+                    self.options['pages'].value = 1
+                except:
+                    logger.exception("Failed to set options [pages]")
+        else:
+            batch = False
+        return ScanSession(self, self.options['source'].value, multiple,
+                           compressed, batch, record, raw)
 
     def __str__(self):
+        if self.__options is None:
+            # don't wake the device up just for that
+            return "'%s'" % self.nice_name
         return ("'%s' (%s, %s, %s)"
                 % (self.nice_name, self.vendor, self.model, self.dev_type))
 
 
-def get_devices(local_only=False):
-    devs = rawapi.get_devices()
+# Seconds each device gets to open when get_devices() probes them. They are
+# all probed at the same time: a device that doesn't answer (a sleeping
+# network scanner, for instance) is left out instead of delaying the others.
+PROBE_TIMEOUT = 5.0
+
+
+def _probe(scanner, opened):
+    try:
+        scanner.open()
+        opened.set()
+    except Exception as exc:
+        logger.warning("Failed to access scanner {} : {}".format(
+            scanner.name, exc
+        ))
+        logger.exception(exc)
+
+
+def get_devices(local_only=False, probe_timeout=PROBE_TIMEOUT):
+    """
+    Options of the scanners returned are only loaded when first used.
+
+    If probe_timeout is None, the scanners are returned as listed by WIA,
+    without opening them. Otherwise, they are all opened in parallel, and only
+    those opened within probe_timeout seconds are returned.
+    """
+    scanners = [
+        Scanner(devid, nice_name=devname)
+        for (devid, devname) in rawapi.get_devices()
+    ]
+    if probe_timeout is None:
+        return scanners
+
+    probes = []
+    for scanner in scanners:
+        # one event per probe: those finishing after the deadline must not
+        # change the result
+        opened = threading.Event()
+        # daemon: a device that never answers must not prevent the
+        # application from exiting
+        probe = threading.Thread(target=_probe, args=(scanner, opened))
+        probe.daemon = True
+        probe.start()
+        probes.append((scanner, probe, opened))
+
+    deadline = time.time() + probe_timeout
+    # keep the order of WIA
     out = []
-    for dev in devs:
-        try:
-            scanner = Scanner(dev[0])
+    for (scanner, probe, opened) in probes:
+        probe.join(max(0, deadline - time.time()))
+        if opened.is_set():
             out.append(scanner)
-        except Exception as exc:
-            logger.warning("Failed to access scanner {} : {}".format(dev, exc))
-            logger.exception(exc)
+        elif probe.is_alive():
+            logger.warning(
+                "Scanner {} didn't answer within {}s. Ignored".format(
+                    scanner.name, probe_timeout
+                )
+            )
     return out
@@ -0,0 +1 @@
+/* Nothing from Shlwapi.h is needed by the transfer code. See compat/windows.h. */
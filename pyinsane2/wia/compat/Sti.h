@@ -0,0 +1,17 @@
+#ifndef __PYINSANE_WIA_COMPAT_STI_H
+#define __PYINSANE_WIA_COMPAT_STI_H
+
+/* Subset of Sti.h used by the property registry and rawapi.cpp. See
+ * compat/windows.h. */
+
+#include "windows.h"
+
+// the type is in the high word of WIA_DIP_DEV_TYPE
+#define GET_STIDEVICE_TYPE(dwDevType) HIWORD(dwDevType)
+
+#define StiDeviceTypeDefault 0
+#define StiDeviceTypeScanner 1
+#define StiDeviceTypeDigitalCamera 2
+#define StiDeviceTypeStreamingVideo 3
+
+#endif
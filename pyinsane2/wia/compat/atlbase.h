@@ -0,0 +1,83 @@
+#ifndef __PYINSANE_WIA_COMPAT_ATLBASE_H
+#define __PYINSANE_WIA_COMPAT_ATLBASE_H
+
+/* Subset of atlbase.h used by rawapi.cpp. See compat/windows.h. */
+
+#include <string>
+
+#include "windows.h"
+
+template<typename T>
+class CComPtr
+{
+public:
+    CComPtr() : p(NULL) { }
+
+    CComPtr(T *ptr) : p(ptr)
+    {
+        if (p != NULL)
+            p->AddRef();
+    }
+
+    CComPtr(const CComPtr &other) : p(other.p)
+    {
+        if (p != NULL)
+            p->AddRef();
+    }
+
+    ~CComPtr()
+    {
+        if (p != NULL)
+            p->Release();
+    }
+
+    CComPtr &operator=(T *ptr)
+    {
+        if (ptr != NULL)
+            ptr->AddRef();
+        if (p != NULL)
+            p->Release();
+        p = ptr;
+        return *this;
+    }
+
+    CComPtr &operator=(const CComPtr &other)
+    {
+        return (*this = other.p);
+    }
+
+    operator T *() const { return p; }
+    T *operator->() const { return p; }
+    T **operator&() { return &p; }
+    bool operator==(T *ptr) const { return p == ptr; }
+
+    HRESULT CoCreateInstance(REFCLSID clsid, IUnknown *outer = NULL,
+            DWORD context = CLSCTX_ALL)
+    {
+        return ::CoCreateInstance(clsid, outer, context, compat_uuidof<T>(), (void **)&p);
+    }
+
+    T *p;
+};
+
+template<typename T>
+class CComQIPtr : public CComPtr<T>
+{
+public:
+    CComQIPtr(IUnknown *unknown)
+    {
+        if (unknown != NULL)
+            unknown->QueryInterface(compat_uuidof<T>(), (void **)&this->p);
+    }
+};
+
+// Device ids are ASCII
+static inline std::wstring compat_a2w(const char *str)
+{
+    return std::wstring(str, str + strlen(str));
+}
+
+#define USES_CONVERSION
+#define A2W(str) (compat_a2w(str).c_str())
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef __PYINSANE_WIA_COMPAT_COMDEF_H
+#define __PYINSANE_WIA_COMPAT_COMDEF_H
+
+/* Subset of comdef.h used by rawapi.cpp. See compat/windows.h. */
+
+#include <stdio.h>
+
+#include "windows.h"
+
+class _com_error
+{
+public:
+    _com_error(HRESULT hr)
+    {
+        snprintf(mMessage, sizeof(mMessage), "HRESULT 0x%08X", (unsigned int)hr);
+    }
+
+    LPCTSTR ErrorMessage() const { return mMessage; }
+
+private:
+    char mMessage[32];
+};
+
+#endif
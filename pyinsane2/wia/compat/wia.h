@@ -0,0 +1,505 @@
+#ifndef __PYINSANE_WIA_COMPAT_WIA_H
+#define __PYINSANE_WIA_COMPAT_WIA_H
+
+/*
+ * Subset of wia.h used by the transfer code and the property registry. See
+ * compat/windows.h.
+ *
+ * The flags have the values of the Windows SDK (the registry decodes them bit
+ * by bit). Everything else is a stand-in: the values are only distinct,
+ * except the aliases that the SDK has too (WIA_IPA_BUFFER_SIZE,
+ * WIA_PAGE_USLETTER, ...).
+ */
+
+#include "windows.h"
+
+#define WIA_TRANSFER_MSG_STATUS 0x00001
+#define WIA_TRANSFER_MSG_END_OF_STREAM 0x00002
+#define WIA_TRANSFER_MSG_END_OF_TRANSFER 0x00003
+#define WIA_TRANSFER_MSG_DEVICE_STATUS 0x00005
+#define WIA_TRANSFER_MSG_NEW_PAGE 0x00006
+
+#define WIA_STATUS_WARMING_UP ((HRESULT)0x00210001L)
+#define WIA_ERROR_PAPER_EMPTY ((HRESULT)0x80210003L)
+#define WIA_ERROR_OFFLINE ((HRESULT)0x80210005L)
+
+#define WIA_DEVINFO_ENUM_ALL 0x00000000
+
+// Property attributes
+
+#define WIA_PROP_READ 0x01
+#define WIA_PROP_WRITE 0x02
+#define WIA_PROP_RW (WIA_PROP_READ | WIA_PROP_WRITE)
+#define WIA_PROP_SYNC_REQUIRED 0x04
+#define WIA_PROP_NONE 0x08
+#define WIA_PROP_RANGE 0x10
+#define WIA_PROP_LIST 0x20
+#define WIA_PROP_FLAG 0x40
+
+// Property IDs
+
+#define WIA_DIP_DEV_ID 2
+#define WIA_DIP_VEND_DESC 3
+#define WIA_DIP_DEV_DESC 4
+#define WIA_DIP_DEV_TYPE 5
+#define WIA_DIP_PORT_NAME 6
+#define WIA_DIP_DEV_NAME 7
+#define WIA_DIP_SERVER_NAME 8
+#define WIA_DIP_REMOTE_DEV_ID 9
+#define WIA_DIP_UI_CLSID 10
+#define WIA_DIP_HW_CONFIG 11
+#define WIA_DIP_BAUDRATE 12
+#define WIA_DIP_STI_GEN_CAPABILITIES 13
+#define WIA_DIP_WIA_VERSION 14
+#define WIA_DIP_DRIVER_VERSION 15
+#define WIA_DIP_PNP_ID 16
+#define WIA_DIP_STI_DRIVER_VERSION 17
+
+#define WIA_DPA_FIRMWARE_VERSION 1026
+#define WIA_DPA_CONNECT_STATUS 1027
+#define WIA_DPA_DEVICE_TIME 1028
+
+#define WIA_DPS_HORIZONTAL_BED_SIZE 3074
+#define WIA_DPS_VERTICAL_BED_SIZE 3075
+#define WIA_DPS_HORIZONTAL_SHEET_FEED_SIZE 3076
+#define WIA_DPS_VERTICAL_SHEET_FEED_SIZE 3077
+#define WIA_DPS_SHEET_FEEDER_REGISTRATION 3078
+#define WIA_DPS_HORIZONTAL_BED_REGISTRATION 3079
+#define WIA_DPS_VERTICAL_BED_REGISTRATION 3080
+#define WIA_DPS_PLATEN_COLOR 3081
+#define WIA_DPS_PAD_COLOR 3082
+#define WIA_DPS_DOCUMENT_HANDLING_CAPABILITIES 3086
+#define WIA_DPS_DOCUMENT_HANDLING_STATUS 3087
+#define WIA_DPS_DOCUMENT_HANDLING_SELECT 3088
+#define WIA_DPS_OPTICAL_XRES 3090
+#define WIA_DPS_OPTICAL_YRES 3091
+#define WIA_DPS_ENDORSER_CHARACTERS 3092
+#define WIA_DPS_ENDORSER_STRING 3093
+#define WIA_DPS_SCAN_AHEAD_PAGES 3094
+#define WIA_DPS_MAX_SCAN_TIME 3095
+#define WIA_DPS_PAGES 3096
+#define WIA_DPS_PAGE_SIZE 3097
+#define WIA_DPS_PAGE_WIDTH 3098
+#define WIA_DPS_PAGE_HEIGHT 3099
+#define WIA_DPS_PREVIEW 3100
+#define WIA_DPS_SHOW_PREVIEW_CONTROL 3103
+#define WIA_DPS_MIN_HORIZONTAL_SHEET_FEED_SIZE 3104
+#define WIA_DPS_MIN_VERTICAL_SHEET_FEED_SIZE 3105
+#define WIA_DPS_USER_NAME 3112
+#define WIA_DPS_SERVICE_ID 3113
+#define WIA_DPS_DEVICE_ID 3114
+#define WIA_DPS_GLOBAL_IDENTITY 3115
+#define WIA_DPS_SCAN_AVAILABLE_ITEM 3116
+
+#define WIA_IPA_ITEM_NAME 4098
+#define WIA_IPA_FIRST WIA_IPA_ITEM_NAME
+#define WIA_IPA_FULL_ITEM_NAME 4099
+#define WIA_IPA_ITEM_TIME 4100
+#define WIA_IPA_ITEM_FLAGS 4101
+#define WIA_IPA_ACCESS_RIGHTS 4102
+#define WIA_IPA_DATATYPE 4103
+#define WIA_IPA_DEPTH 4104
+#define WIA_IPA_PREFERRED_FORMAT 4105
+#define WIA_IPA_FORMAT 4106
+#define WIA_IPA_COMPRESSION 4107
+#define WIA_IPA_TYMED 4108
+#define WIA_IPA_CHANNELS_PER_PIXEL 4109
+#define WIA_IPA_BITS_PER_CHANNEL 4110
+#define WIA_IPA_PLANAR 4111
+#define WIA_IPA_PIXELS_PER_LINE 4112
+#define WIA_IPA_BYTES_PER_LINE 4113
+#define WIA_IPA_NUMBER_OF_LINES 4114
+#define WIA_IPA_GAMMA_CURVES 4115
+#define WIA_IPA_ITEM_SIZE 4116
+#define WIA_IPA_COLOR_PROFILE 4117
+#define WIA_IPA_MIN_BUFFER_SIZE 4118
+#define WIA_IPA_BUFFER_SIZE WIA_IPA_MIN_BUFFER_SIZE
+#define WIA_IPA_REGION_TYPE 4119
+#define WIA_IPA_ICM_PROFILE_NAME 4120
+#define WIA_IPA_PROP_STREAM_COMPAT_ID 4122
+#define WIA_IPA_FILENAME_EXTENSION 4123
+#define WIA_IPA_SUPPRESS_PROPERTY_PAGE 4124
+#define WIA_IPA_ITEM_CATEGORY 4125
+#define WIA_IPA_UPLOAD_ITEM_SIZE 4126
+#define WIA_IPA_ITEMS_STORED 4127
+#define WIA_IPA_RAW_BITS_PER_CHANNEL 4128
+
+#define WIA_IPS_CUR_INTENT 6146
+#define WIA_IPS_XRES 6147
+#define WIA_IPS_YRES 6148
+#define WIA_IPS_XPOS 6149
+#define WIA_IPS_YPOS 6150
+#define WIA_IPS_XEXTENT 6151
+#define WIA_IPS_YEXTENT 6152
+#define WIA_IPS_PHOTOMETRIC_INTERP 6153
+#define WIA_IPS_BRIGHTNESS 6154
+#define WIA_IPS_CONTRAST 6155
+#define WIA_IPS_ORIENTATION 6156
+#define WIA_IPS_ROTATION 6157
+#define WIA_IPS_MIRROR 6158
+#define WIA_IPS_THRESHOLD 6159
+#define WIA_IPS_INVERT 6160
+#define WIA_IPS_WARM_UP_TIME 6161
+#define WIA_IPS_DESKEW_X 6162
+#define WIA_IPS_DESKEW_Y 6163
+#define WIA_IPS_SEGMENTATION 6164
+#define WIA_IPS_MAX_HORIZONTAL_SIZE 6165
+#define WIA_IPS_MAX_VERTICAL_SIZE 6166
+#define WIA_IPS_MIN_HORIZONTAL_SIZE 6167
+#define WIA_IPS_MIN_VERTICAL_SIZE 6168
+#define WIA_IPS_TRANSFER_CAPABILITIES 6169
+#define WIA_IPS_SHEET_FEEDER_REGISTRATION 6170
+#define WIA_IPS_DOCUMENT_HANDLING_SELECT 6171
+#define WIA_IPS_OPTICAL_XRES 6172
+#define WIA_IPS_OPTICAL_YRES 6173
+#define WIA_IPS_PREVIEW 6174
+#define WIA_IPS_SHOW_PREVIEW_CONTROL 6175
+#define WIA_IPS_FILM_SCAN_MODE 6176
+#define WIA_IPS_LAMP 6177
+#define WIA_IPS_LAMP_AUTO_OFF 6178
+#define WIA_IPS_AUTO_DESKEW 6179
+#define WIA_IPS_SUPPORTS_CHILD_ITEM_CREATION 6180
+#define WIA_IPS_XSCALING 6181
+#define WIA_IPS_YSCALING 6182
+#define WIA_IPS_PREVIEW_TYPE 6183
+#define WIA_IPS_FILM_NODE_NAME 6184
+#define WIA_IPS_PAGE_SIZE 6185
+#define WIA_IPS_PAGE_WIDTH 6186
+#define WIA_IPS_PAGE_HEIGHT 6187
+#define WIA_IPS_PAGES 6188
+
+// Flags
+
+#define WIA_ITEM_READ 1
+#define WIA_ITEM_WRITE 2
+#define WIA_ITEM_CAN_BE_DELETED 4
+#define WIA_ITEM_RD (WIA_ITEM_READ | WIA_ITEM_CAN_BE_DELETED)
+#define WIA_ITEM_RWD (WIA_ITEM_READ | WIA_ITEM_WRITE | WIA_ITEM_CAN_BE_DELETED)
+
+#define WiaItemTypeFree 0x00000000
+#define WiaItemTypeImage 0x00000001
+#define WiaItemTypeFile 0x00000002
+#define WiaItemTypeFolder 0x00000004
+#define WiaItemTypeRoot 0x00000008
+#define WiaItemTypeAnalyze 0x00000010
+#define WiaItemTypeAudio 0x00000020
+#define WiaItemTypeDevice 0x00000040
+#define WiaItemTypeDeleted 0x00000080
+#define WiaItemTypeDisconnected 0x00000100
+#define WiaItemTypeHPanorama 0x00000200
+#define WiaItemTypeVPanorama 0x00000400
+#define WiaItemTypeBurst 0x00000800
+#define WiaItemTypeStorage 0x00001000
+#define WiaItemTypeTransfer 0x00002000
+#define WiaItemTypeGenerated 0x00004000
+#define WiaItemTypeHasAttachments 0x00008000
+#define WiaItemTypeVideo 0x00010000
+#define WiaItemTypeDocument 0x00040000
+#define WiaItemTypeProgrammableDataSource 0x00080000
+
+#define FEED 0x001
+#define FLAT 0x002
+#define DUP 0x004
+#define DETECT_FLAT 0x008
+#define DETECT_SCAN 0x010
+#define DETECT_FEED 0x020
+#define DETECT_DUP 0x040
+#define DETECT_FEED_AVAIL 0x080
+#define DETECT_DUP_AVAIL 0x100
+#define FILM_TPA 0x200
+#define DETECT_FILM_TPA 0x400
+#define STOR 0x800
+#define DETECT_STOR 0x1000
+#define ADVANCED_DUP 0x2000
+#define AUTO_SOURCE 0x8000
+
+#define FEEDER 0x001
+#define FLATBED 0x002
+#define DUPLEX 0x004
+#define FRONT_FIRST 0x008
+#define BACK_FIRST 0x010
+#define FRONT_ONLY 0x020
+#define BACK_ONLY 0x040
+#define NEXT_PAGE 0x080
+#define PREFEED 0x100
+#define AUTO_ADVANCE 0x200
+
+#define FEED_READY 0x001
+#define FLAT_READY 0x002
+#define DUP_READY 0x004
+#define FLAT_COVER_UP 0x008
+#define PATH_COVER_UP 0x010
+#define PAPER_JAM 0x020
+#define FILM_TPA_READY 0x040
+#define STORAGE_READY 0x080
+#define STORAGE_FULL 0x100
+#define MULTIPLE_FEED 0x200
+#define DEVICE_ATTENTION 0x400
+#define LAMP_ERR 0x800
+
+#define WIA_INTENT_NONE 0x00000000
+#define WIA_INTENT_IMAGE_TYPE_COLOR 0x00000001
+#define WIA_INTENT_IMAGE_TYPE_GRAYSCALE 0x00000002
+#define WIA_INTENT_IMAGE_TYPE_TEXT 0x00000004
+#define WIA_INTENT_IMAGE_TYPE_MASK 0x0000000F
+#define WIA_INTENT_MINIMIZE_SIZE 0x00010000
+#define WIA_INTENT_MAXIMIZE_QUALITY 0x00020000
+#define WIA_INTENT_SIZE_MASK 0x000F0000
+#define WIA_INTENT_BEST_PREVIEW 0x00040000
+
+#define TYMED_FILE 2
+#define TYMED_CALLBACK 128
+#define TYMED_MULTIPAGE_FILE 256
+#define TYMED_MULTIPAGE_CALLBACK 512
+
+// Enumerations
+
+#define WIA_DEVICE_NOT_CONNECTED 0
+#define WIA_DEVICE_CONNECTED 1
+
+#define WIA_COMPRESSION_NONE 0
+#define WIA_COMPRESSION_BI_RLE4 1
+#define WIA_COMPRESSION_BI_RLE8 2
+#define WIA_COMPRESSION_G3 3
+#define WIA_COMPRESSION_G4 4
+#define WIA_COMPRESSION_JPEG 5
+#define WIA_COMPRESSION_JBIG 6
+#define WIA_COMPRESSION_JPEG2K 7
+#define WIA_COMPRESSION_PNG 8
+
+#define WIA_DATA_THRESHOLD 0
+#define WIA_DATA_DITHER 1
+#define WIA_DATA_GRAYSCALE 2
+#define WIA_DATA_COLOR 3
+#define WIA_DATA_COLOR_THRESHOLD 4
+#define WIA_DATA_COLOR_DITHER 5
+#define WIA_DATA_RAW_RGB 6
+#define WIA_DATA_RAW_BGR 7
+#define WIA_DATA_RAW_YUV 8
+#define WIA_DATA_RAW_YUVK 9
+#define WIA_DATA_RAW_CMY 10
+#define WIA_DATA_RAW_CMYK 11
+
+#define WIA_LAMP_ON 0
+#define WIA_LAMP_OFF 1
+
+#define WIA_PHOTO_WHITE_1 0
+#define WIA_PHOTO_WHITE_0 1
+
+#define WIA_ADVANCED_PREVIEW 0
+#define WIA_BASIC_PREVIEW 1
+
+#define PORTRAIT 0
+#define LANDSCAPE 1
+#define ROT180 2
+#define ROT270 3
+
+#define WIA_USE_SEGMENTATION_FILTER 0
+#define WIA_DONT_USE_SEGMENTATION_FILTER 1
+
+#define WIA_PACKED_PIXEL 0
+#define WIA_PLANAR 1
+
+#define WIA_PROPPAGE_SCANNER_ITEM_GENERAL 1
+#define WIA_PROPPAGE_CAMERA_ITEM_GENERAL 2
+
+#define LEFT_JUSTIFIED 0
+#define CENTERED 1
+#define RIGHT_JUSTIFIED 2
+#define TOP_JUSTIFIED 0
+#define BOTTOM_JUSTIFIED 2
+
+#define WIA_FINAL_SCAN 0
+#define WIA_PREVIEW_SCAN 1
+
+#define WIA_SHOW_PREVIEW_CONTROL 0
+#define WIA_DONT_SHOW_PREVIEW_CONTROL 1
+
+#define WIA_AUTO_DESKEW_ON 0
+#define WIA_AUTO_DESKEW_OFF 1
+
+#define WIA_FILM_COLOR_SLIDE 0
+#define WIA_FILM_COLOR_NEGATIVE 1
+#define WIA_FILM_BW_NEGATIVE 2
+
+#define WIA_PAGE_A4 0
+#define WIA_PAGE_LETTER 1
+#define WIA_PAGE_CUSTOM 2
+#define WIA_PAGE_USLEGAL 3
+#define WIA_PAGE_USLETTER WIA_PAGE_LETTER
+#define WIA_PAGE_USLEDGER 4
+#define WIA_PAGE_USSTATEMENT 5
+#define WIA_PAGE_BUSINESSCARD 6
+#define WIA_PAGE_ISO_A0 7
+#define WIA_PAGE_ISO_A1 8
+#define WIA_PAGE_ISO_A2 9
+#define WIA_PAGE_ISO_A3 10
+#define WIA_PAGE_ISO_A4 WIA_PAGE_A4
+#define WIA_PAGE_ISO_A5 11
+#define WIA_PAGE_ISO_A6 12
+#define WIA_PAGE_ISO_A7 13
+#define WIA_PAGE_ISO_A8 14
+#define WIA_PAGE_ISO_A9 15
+#define WIA_PAGE_ISO_A10 16
+#define WIA_PAGE_ISO_B0 17
+#define WIA_PAGE_ISO_B1 18
+#define WIA_PAGE_ISO_B2 19
+#define WIA_PAGE_ISO_B3 20
+#define WIA_PAGE_ISO_B4 21
+#define WIA_PAGE_ISO_B5 22
+#define WIA_PAGE_ISO_B6 23
+#define WIA_PAGE_ISO_B7 24
+#define WIA_PAGE_ISO_B8 25
+#define WIA_PAGE_ISO_B9 26
+#define WIA_PAGE_ISO_B10 27
+#define WIA_PAGE_ISO_C0 28
+#define WIA_PAGE_ISO_C1 29
+#define WIA_PAGE_ISO_C2 30
+#define WIA_PAGE_ISO_C3 31
+#define WIA_PAGE_ISO_C4 32
+#define WIA_PAGE_ISO_C5 33
+#define WIA_PAGE_ISO_C6 34
+#define WIA_PAGE_ISO_C7 35
+#define WIA_PAGE_ISO_C8 36
+#define WIA_PAGE_ISO_C9 37
+#define WIA_PAGE_ISO_C10 38
+#define WIA_PAGE_JIS_B0 39
+#define WIA_PAGE_JIS_B1 40
+#define WIA_PAGE_JIS_B2 41
+#define WIA_PAGE_JIS_B3 42
+#define WIA_PAGE_JIS_B4 43
+#define WIA_PAGE_JIS_B5 44
+#define WIA_PAGE_JIS_B6 45
+#define WIA_PAGE_JIS_B7 46
+#define WIA_PAGE_JIS_B8 47
+#define WIA_PAGE_JIS_B9 48
+#define WIA_PAGE_JIS_B10 49
+#define WIA_PAGE_JIS_2A 50
+#define WIA_PAGE_JIS_4A 51
+#define WIA_PAGE_DIN_2B 52
+#define WIA_PAGE_DIN_4B 53
+#define WIA_PAGE_AUTO 100
+#define WIA_PAGE_CUSTOM_BASE 0x8000
+
+// GUIDs
+
+#define WIA_COMPAT_GUID(name, n) \
+    static const GUID name = \
+        { 0xb96b3c00 + (n), 0x0728, 0x11d3, { 0x9d, 0x7b, 0x00, 0x00, 0xf8, 0x1e, 0xf3, 0x2e } }
+
+WIA_COMPAT_GUID(WiaImgFmt_MEMORYBMP, 0xaa);
+WIA_COMPAT_GUID(WiaImgFmt_BMP, 0xab);
+WIA_COMPAT_GUID(WiaImgFmt_JPEG, 0xae);
+WIA_COMPAT_GUID(WiaImgFmt_PNG, 0xaf);
+WIA_COMPAT_GUID(WiaImgFmt_GIF, 0xb0);
+WIA_COMPAT_GUID(WiaImgFmt_TIFF, 0xb1);
+WIA_COMPAT_GUID(WiaImgFmt_EXIF, 0xb2);
+WIA_COMPAT_GUID(WiaImgFmt_PHOTOCD, 0xb3);
+WIA_COMPAT_GUID(WiaImgFmt_FLASHPIX, 0xb4);
+WIA_COMPAT_GUID(WiaImgFmt_ICO, 0xb5);
+WIA_COMPAT_GUID(WiaImgFmt_CIFF, 0xc0);
+WIA_COMPAT_GUID(WiaImgFmt_PICT, 0xc1);
+WIA_COMPAT_GUID(WiaImgFmt_JPEG2K, 0xc2);
+WIA_COMPAT_GUID(WiaImgFmt_JPEG2KX, 0xc3);
+WIA_COMPAT_GUID(WiaImgFmt_RAW, 0xc4);
+WIA_COMPAT_GUID(WiaImgFmt_RAWRGB, 0xc5);
+WIA_COMPAT_GUID(WiaImgFmt_PDFA, 0xc6);
+WIA_COMPAT_GUID(WiaImgFmt_JBIG, 0xc7);
+
+WIA_COMPAT_GUID(WIA_CATEGORY_ROOT, 0xd0);
+WIA_COMPAT_GUID(WIA_CATEGORY_FLATBED, 0xd1);
+WIA_COMPAT_GUID(WIA_CATEGORY_FEEDER, 0xd2);
+WIA_COMPAT_GUID(WIA_CATEGORY_FEEDER_FRONT, 0xd3);
+WIA_COMPAT_GUID(WIA_CATEGORY_FEEDER_BACK, 0xd4);
+WIA_COMPAT_GUID(WIA_CATEGORY_FILM, 0xd5);
+WIA_COMPAT_GUID(WIA_CATEGORY_FOLDER, 0xd6);
+WIA_COMPAT_GUID(WIA_CATEGORY_FINISHED_FILE, 0xd7);
+WIA_COMPAT_GUID(WIA_CATEGORY_AUTO, 0xd8);
+
+
+typedef struct _WiaTransferParams {
+    LONG lMessage;
+    LONG lPercentComplete;
+    ULONG64 ulTransferredBytes;
+    HRESULT hrErrorStatus;
+} WiaTransferParams;
+
+static const IID IID_IWiaTransferCallback =
+    { 0x27d4eaaf, 0x28a6, 0x4ca5, { 0x9a, 0xab, 0xe6, 0x78, 0x16, 0x8b, 0x95, 0x27 } };
+
+struct IWiaTransferCallback : public IUnknown
+{
+    virtual HRESULT STDMETHODCALLTYPE TransferCallback(LONG lFlags,
+            WiaTransferParams *pWiaTransferParams) = 0;
+    virtual HRESULT STDMETHODCALLTYPE GetNextStream(LONG lFlags, BSTR bstrItemName,
+            BSTR bstrFullItemName, IStream **ppDestination) = 0;
+};
+
+
+// COM interfaces used by rawapi.cpp (only the methods it calls), implemented
+// by the mock driver (pyinsane2/wia/mock.cpp)
+
+WIA_COMPAT_GUID(CLSID_WiaDevMgr2, 0xe0);
+WIA_COMPAT_GUID(IID_IWiaDevMgr2, 0xe1);
+WIA_COMPAT_GUID(IID_IEnumWIA_DEV_INFO, 0xe2);
+WIA_COMPAT_GUID(IID_IWiaItem2, 0xe3);
+WIA_COMPAT_GUID(IID_IEnumWiaItem2, 0xe4);
+WIA_COMPAT_GUID(IID_IWiaPropertyStorage, 0xe5);
+WIA_COMPAT_GUID(IID_IWiaTransfer, 0xe6);
+
+struct IWiaPropertyStorage : public IUnknown
+{
+    virtual HRESULT STDMETHODCALLTYPE ReadMultiple(ULONG cpspec, const PROPSPEC rgpspec[],
+            PROPVARIANT rgpropvar[]) = 0;
+    virtual HRESULT STDMETHODCALLTYPE WriteMultiple(ULONG cpspec, const PROPSPEC rgpspec[],
+            const PROPVARIANT rgpropvar[], PROPID propidNameFirst) = 0;
+    virtual HRESULT STDMETHODCALLTYPE GetPropertyAttributes(ULONG cpspec, PROPSPEC rgpspec[],
+            ULONG rgflags[], PROPVARIANT rgpropvar[]) = 0;
+};
+
+struct IEnumWIA_DEV_INFO : public IUnknown
+{
+    virtual HRESULT STDMETHODCALLTYPE Next(ULONG celt, IWiaPropertyStorage **rgelt,
+            ULONG *pceltFetched) = 0;
+    virtual HRESULT STDMETHODCALLTYPE GetCount(ULONG *celt) = 0;
+};
+
+struct IWiaItem2;
+
+struct IEnumWiaItem2 : public IUnknown
+{
+    virtual HRESULT STDMETHODCALLTYPE Next(ULONG cElt, IWiaItem2 **ppIWiaItem2,
+            ULONG *pcEltFetched) = 0;
+};
+
+struct IWiaItem2 : public IUnknown
+{
+    virtual HRESULT STDMETHODCALLTYPE EnumChildItems(const GUID *pCategoryGUID,
+            IEnumWiaItem2 **ppIEnumWiaItem2) = 0;
+};
+
+struct IWiaDevMgr2 : public IUnknown
+{
+    virtual HRESULT STDMETHODCALLTYPE EnumDeviceInfo(LONG lFlags,
+            IEnumWIA_DEV_INFO **ppIEnum) = 0;
+    virtual HRESULT STDMETHODCALLTYPE CreateDevice(LONG lFlags, BSTR bstrDeviceID,
+            IWiaItem2 **ppWiaItem2Root) = 0;
+};
+
+struct IWiaTransfer : public IUnknown
+{
+    virtual HRESULT STDMETHODCALLTYPE Download(LONG lFlags,
+            IWiaTransferCallback *pIWiaTransferCallback) = 0;
+};
+
+#define WIA_COMPAT_UUIDOF(iface) \
+    template<> inline const IID &compat_uuidof<iface>() { return IID_##iface; }
+
+WIA_COMPAT_UUIDOF(IWiaDevMgr2)
+WIA_COMPAT_UUIDOF(IEnumWIA_DEV_INFO)
+WIA_COMPAT_UUIDOF(IWiaItem2)
+WIA_COMPAT_UUIDOF(IEnumWiaItem2)
+WIA_COMPAT_UUIDOF(IWiaPropertyStorage)
+WIA_COMPAT_UUIDOF(IWiaTransfer)
+
+#endif
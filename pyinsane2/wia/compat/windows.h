@@ -0,0 +1,357 @@
+#ifndef __PYINSANE_WIA_COMPAT_WINDOWS_H
+#define __PYINSANE_WIA_COMPAT_WINDOWS_H
+
+/*
+ * Just enough of the Win32 / COM API to build the WIA code on other
+ * platforms, so it can be tested without Windows (see pyinsane2/wia/testing.cpp
+ * and pyinsane2/wia/mock.cpp). Only used when building pyinsane2.wia._testing
+ * and pyinsane2.wia._mockapi. Never on Windows.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+
+#include <mutex>
+
+#define STDMETHODCALLTYPE
+
+typedef int32_t HRESULT;
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef uint32_t DWORD;
+typedef uint16_t WORD;
+typedef uint64_t ULONG64;
+typedef wchar_t WCHAR;
+typedef WCHAR *BSTR;
+typedef WCHAR *LPOLESTR;
+typedef const char *LPCTSTR;
+typedef void *HANDLE;
+typedef int BOOL;
+
+#define TRUE 1
+#define FALSE 0
+
+#define HIWORD(l) ((WORD)((((DWORD)(l)) >> 16) & 0xFFFF))
+
+#define S_OK ((HRESULT)0x00000000L)
+#define S_FALSE ((HRESULT)0x00000001L)
+#define E_NOTIMPL ((HRESULT)0x80004001L)
+#define E_NOINTERFACE ((HRESULT)0x80004002L)
+#define E_ABORT ((HRESULT)0x80004004L)
+#define E_FAIL ((HRESULT)0x80004005L)
+#define E_OUTOFMEMORY ((HRESULT)0x8007000EL)
+#define E_INVALIDARG ((HRESULT)0x80070057L)
+#define REGDB_E_CLASSNOTREG ((HRESULT)0x80040154L)
+#define STG_E_INVALIDFUNCTION ((HRESULT)0x80030001L)
+#define STG_E_MEDIUMFULL ((HRESULT)0x80030070L)
+
+#define SUCCEEDED(hr) (((HRESULT)(hr)) >= 0)
+#define FAILED(hr) (((HRESULT)(hr)) < 0)
+
+typedef union _LARGE_INTEGER {
+    struct {
+        DWORD LowPart;
+        LONG HighPart;
+    } u;
+    int64_t QuadPart;
+} LARGE_INTEGER;
+
+typedef union _ULARGE_INTEGER {
+    struct {
+        DWORD LowPart;
+        DWORD HighPart;
+    } u;
+    uint64_t QuadPart;
+} ULARGE_INTEGER;
+
+typedef struct _GUID {
+    uint32_t Data1;
+    uint16_t Data2;
+    uint16_t Data3;
+    uint8_t Data4[8];
+} GUID;
+typedef GUID IID;
+typedef GUID CLSID;
+typedef const IID &REFIID;
+typedef const CLSID &REFCLSID;
+
+static inline bool IsEqualIID(REFIID a, REFIID b)
+{
+    return memcmp(&a, &b, sizeof(GUID)) == 0;
+}
+
+static inline bool IsEqualGUID(const GUID &a, const GUID &b)
+{
+    return memcmp(&a, &b, sizeof(GUID)) == 0;
+}
+
+static inline bool operator==(const GUID &a, const GUID &b)
+{
+    return IsEqualGUID(a, b);
+}
+
+static inline bool operator!=(const GUID &a, const GUID &b)
+{
+    return !IsEqualGUID(a, b);
+}
+
+static const IID IID_IUnknown =
+    { 0x00000000, 0x0000, 0x0000, { 0xC0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x46 } };
+static const IID IID_IStream =
+    { 0x0000000C, 0x0000, 0x0000, { 0xC0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x46 } };
+static const CLSID CLSID_NULL =
+    { 0x00000000, 0x0000, 0x0000, { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 } };
+
+typedef ULONG PROPID;
+typedef uint16_t VARTYPE;
+
+enum VARENUM {
+    VT_EMPTY = 0,
+    VT_I4 = 3,
+    VT_BSTR = 8,
+    VT_UI1 = 17,
+    VT_UI2 = 18,
+    VT_UI4 = 19,
+    VT_CLSID = 72,
+    VT_VECTOR = 0x1000,
+};
+
+typedef struct tagCAL {
+    ULONG cElems;
+    LONG *pElems;
+} CAL;
+
+typedef struct tagCABSTR {
+    ULONG cElems;
+    BSTR *pElems;
+} CABSTR;
+
+typedef struct tagPROPVARIANT {
+    VARTYPE vt;
+    union {
+        LONG lVal;
+        ULONG ulVal;
+        BSTR bstrVal;
+        CLSID *puuid;
+        CAL cal;
+        CABSTR cabstr;
+    };
+} PROPVARIANT;
+
+#define PRSPEC_PROPID 1
+
+typedef struct tagPROPSPEC {
+    ULONG ulKind;
+    union {
+        PROPID propid;
+        LPOLESTR lpwstr;
+    };
+} PROPSPEC;
+
+static inline void *CoTaskMemAlloc(size_t size)
+{
+    return malloc(size);
+}
+
+static inline void CoTaskMemFree(void *ptr)
+{
+    free(ptr);
+}
+
+static inline BSTR SysAllocString(const WCHAR *str)
+{
+    size_t len = wcslen(str);
+    BSTR out = (BSTR)malloc((len + 1) * sizeof(WCHAR));
+
+    memcpy(out, str, (len + 1) * sizeof(WCHAR));
+    return out;
+}
+
+static inline void SysFreeString(BSTR str)
+{
+    free(str);
+}
+
+static inline unsigned int SysStringLen(BSTR str)
+{
+    return (str == NULL ? 0 : (unsigned int)wcslen(str));
+}
+
+static inline void PropVariantInit(PROPVARIANT *value)
+{
+    memset(value, 0, sizeof(*value));
+}
+
+// Only the types the WIA code reads
+static inline HRESULT FreePropVariantArray(ULONG nb, PROPVARIANT *values)
+{
+    ULONG i, j;
+
+    for (i = 0 ; i < nb ; i++) {
+        switch (values[i].vt) {
+            case VT_BSTR:
+                SysFreeString(values[i].bstrVal);
+                break;
+            case VT_CLSID:
+                CoTaskMemFree(values[i].puuid);
+                break;
+            case VT_VECTOR | VT_I4:
+            case VT_VECTOR | VT_UI4:
+                CoTaskMemFree(values[i].cal.pElems);
+                break;
+            case VT_VECTOR | VT_BSTR:
+                for (j = 0 ; j < values[i].cabstr.cElems ; j++) {
+                    SysFreeString(values[i].cabstr.pElems[j]);
+                }
+                CoTaskMemFree(values[i].cabstr.pElems);
+                break;
+        }
+        memset(&values[i], 0, sizeof(values[i]));
+    }
+    return S_OK;
+}
+
+typedef struct _SYSTEMTIME {
+    WORD wYear;
+    WORD wMonth;
+    WORD wDayOfWeek;
+    WORD wDay;
+    WORD wHour;
+    WORD wMinute;
+    WORD wSecond;
+    WORD wMilliseconds;
+} SYSTEMTIME;
+
+typedef struct _FILETIME {
+    DWORD dwLowDateTime;
+    DWORD dwHighDateTime;
+} FILETIME;
+
+static inline void GetSystemTime(SYSTEMTIME *out)
+{
+    time_t now = time(NULL);
+    struct tm tm;
+
+    gmtime_r(&now, &tm);
+    out->wYear = tm.tm_year + 1900;
+    out->wMonth = tm.tm_mon + 1;
+    out->wDayOfWeek = tm.tm_wday;
+    out->wDay = tm.tm_mday;
+    out->wHour = tm.tm_hour;
+    out->wMinute = tm.tm_min;
+    out->wSecond = tm.tm_sec;
+    out->wMilliseconds = 0;
+}
+
+static inline bool SystemTimeToFileTime(const SYSTEMTIME *, FILETIME *out)
+{
+    // nobody looks at it
+    memset(out, 0, sizeof(*out));
+    return true;
+}
+
+enum tagSTGTY {
+    STGTY_STORAGE = 1,
+    STGTY_STREAM = 2,
+};
+
+enum tagLOCKTYPE {
+    LOCK_WRITE = 1,
+    LOCK_EXCLUSIVE = 2,
+    LOCK_ONLYONCE = 4,
+};
+
+enum tagSTREAM_SEEK {
+    STREAM_SEEK_SET = 0,
+    STREAM_SEEK_CUR = 1,
+    STREAM_SEEK_END = 2,
+};
+
+typedef struct tagSTATSTG {
+    LPOLESTR pwcsName;
+    DWORD type;
+    ULARGE_INTEGER cbSize;
+    FILETIME mtime;
+    FILETIME ctime;
+    FILETIME atime;
+    DWORD grfMode;
+    DWORD grfLocksSupported;
+    CLSID clsid;
+    DWORD grfStateBits;
+    DWORD reserved;
+} STATSTG;
+
+// Only mutexes
+
+#define INFINITE 0xFFFFFFFF
+#define WAIT_OBJECT_0 0
+
+static inline HANDLE CreateMutex(void *, BOOL, const char *)
+{
+    return new std::recursive_mutex();
+}
+
+static inline DWORD WaitForSingleObject(HANDLE mutex, DWORD)
+{
+    ((std::recursive_mutex *)mutex)->lock();
+    return WAIT_OBJECT_0;
+}
+
+static inline BOOL ReleaseMutex(HANDLE mutex)
+{
+    ((std::recursive_mutex *)mutex)->unlock();
+    return TRUE;
+}
+
+static inline BOOL CloseHandle(HANDLE mutex)
+{
+    delete (std::recursive_mutex *)mutex;
+    return TRUE;
+}
+
+struct IUnknown
+{
+    virtual ~IUnknown() { }
+    virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppvObject) = 0;
+    virtual ULONG STDMETHODCALLTYPE AddRef() = 0;
+    virtual ULONG STDMETHODCALLTYPE Release() = 0;
+};
+
+struct ISequentialStream : public IUnknown
+{
+    virtual HRESULT STDMETHODCALLTYPE Read(void *pv, ULONG cb, ULONG *pcbRead) = 0;
+    virtual HRESULT STDMETHODCALLTYPE Write(void const *pv, ULONG cb, ULONG *pcbWritten) = 0;
+};
+
+struct IStream : public ISequentialStream
+{
+    virtual HRESULT STDMETHODCALLTYPE Seek(LARGE_INTEGER dlibMove, DWORD dwOrigin,
+            ULARGE_INTEGER *plibNewPosition) = 0;
+    virtual HRESULT STDMETHODCALLTYPE SetSize(ULARGE_INTEGER libNewSize) = 0;
+    virtual HRESULT STDMETHODCALLTYPE CopyTo(IStream *pstm, ULARGE_INTEGER cb,
+            ULARGE_INTEGER *pcbRead, ULARGE_INTEGER *pcbWritten) = 0;
+    virtual HRESULT STDMETHODCALLTYPE Commit(DWORD grfCommitFlags) = 0;
+    virtual HRESULT STDMETHODCALLTYPE Revert() = 0;
+    virtual HRESULT STDMETHODCALLTYPE LockRegion(ULARGE_INTEGER libOffset, ULARGE_INTEGER cb,
+            DWORD dwLockType) = 0;
+    virtual HRESULT STDMETHODCALLTYPE UnlockRegion(ULARGE_INTEGER libOffset, ULARGE_INTEGER cb,
+            DWORD dwLockType) = 0;
+    virtual HRESULT STDMETHODCALLTYPE Stat(STATSTG *pstatstg, DWORD grfStatFlag) = 0;
+    virtual HRESULT STDMETHODCALLTYPE Clone(IStream **ppstm) = 0;
+};
+
+// IID of the interface T (see CComPtr in compat/atlbase.h)
+template<typename T> const IID &compat_uuidof();
+
+#define CLSCTX_ALL 0x17
+
+// Implemented by the mock WIA driver (pyinsane2/wia/mock.cpp)
+HRESULT CoInitialize(void *reserved);
+void CoUninitialize(void);
+HRESULT CoCreateInstance(REFCLSID clsid, IUnknown *outer, DWORD context, REFIID iid,
+        void **out);
+
+#endif
@@ -0,0 +1,186 @@
+#include <assert.h>
+
+#include <mutex>
+
+#include "devices.h"
+
+// Protects the references and the maps of all the pools: handles may be
+// dropped from any thread, including after the destruction of their pool.
+static std::mutex g_pools_mutex;
+
+
+PyinsaneDevicePool::PyinsaneDevicePool()
+    : mOwner(std::this_thread::get_id()), mNbOpened(0), mNbReused(0)
+{
+}
+
+
+PyinsaneDevicePool::~PyinsaneDevicePool()
+{
+    std::vector<struct device_pool_entry *> entries;
+    std::map<std::wstring, struct device_pool_entry *>::iterator it;
+    size_t i;
+
+    assert(std::this_thread::get_id() == mOwner);
+
+    {
+        std::lock_guard<std::mutex> lock(g_pools_mutex);
+        for (it = mDevices.begin() ; it != mDevices.end() ; it++) {
+            entries.push_back(it->second);
+        }
+        mDevices.clear();
+    }
+
+    for (i = 0 ; i < entries.size() ; i++) {
+        ReleaseItems(entries[i]);
+        std::lock_guard<std::mutex> lock(g_pools_mutex);
+        if (entries[i]->refs > 0) {
+            // still used: freed by the last Release()
+            entries[i]->pool = NULL;
+            entries[i] = NULL;
+        }
+    }
+    for (i = 0 ; i < entries.size() ; i++) {
+        delete entries[i];
+    }
+}
+
+
+HRESULT PyinsaneDevicePool::Open(const std::wstring &devid, device_pool_opener opener,
+        void *cb_data, struct device_pool_entry **entry)
+{
+    std::map<std::wstring, struct device_pool_entry *>::iterator it;
+    IUnknown *device = NULL;
+    bool reused = false;
+    HRESULT hr;
+
+    assert(std::this_thread::get_id() == mOwner);
+
+    {
+        std::lock_guard<std::mutex> lock(g_pools_mutex);
+        it = mDevices.find(devid);
+        if (it != mDevices.end()) {
+            // may be unused: not released yet, so still usable
+            it->second->refs++;
+            mNbReused++;
+            *entry = it->second;
+            reused = true;
+        }
+    }
+    // the others
+    Flush();
+    if (reused) {
+        return S_OK;
+    }
+
+    // only this thread adds devices: nobody can open it in the meantime
+    hr = opener(devid, &device, cb_data);
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    *entry = new device_pool_entry();
+    (*entry)->pool = this;
+    (*entry)->devid = devid;
+    (*entry)->device = device;
+    (*entry)->has_sources = false;
+    (*entry)->refs = 1;
+
+    std::lock_guard<std::mutex> lock(g_pools_mutex);
+    mDevices[devid] = *entry;
+    mNbOpened++;
+    return S_OK;
+}
+
+
+void PyinsaneDevicePool::Flush()
+{
+    std::vector<struct device_pool_entry *> unused;
+    std::map<std::wstring, struct device_pool_entry *>::iterator it;
+    size_t i;
+
+    assert(std::this_thread::get_id() == mOwner);
+
+    {
+        std::lock_guard<std::mutex> lock(g_pools_mutex);
+        for (it = mDevices.begin() ; it != mDevices.end() ; ) {
+            if (it->second->refs > 0) {
+                it++;
+                continue;
+            }
+            unused.push_back(it->second);
+            mDevices.erase(it++);
+        }
+    }
+
+    for (i = 0 ; i < unused.size() ; i++) {
+        ReleaseItems(unused[i]);
+        delete unused[i];
+    }
+}
+
+
+void PyinsaneDevicePool::GetStats(struct device_pool_stats *out) const
+{
+    std::map<std::wstring, struct device_pool_entry *>::const_iterator it;
+
+    std::lock_guard<std::mutex> lock(g_pools_mutex);
+    out->devices = mDevices.size();
+    out->unused = 0;
+    for (it = mDevices.begin() ; it != mDevices.end() ; it++) {
+        if (it->second->refs == 0)
+            out->unused++;
+    }
+    out->opened = mNbOpened;
+    out->reused = mNbReused;
+}
+
+
+void PyinsaneDevicePool::AddRef(struct device_pool_entry *entry)
+{
+    std::lock_guard<std::mutex> lock(g_pools_mutex);
+    entry->refs++;
+}
+
+
+void PyinsaneDevicePool::Release(struct device_pool_entry *entry)
+{
+    PyinsaneDevicePool *pool;
+
+    {
+        std::lock_guard<std::mutex> lock(g_pools_mutex);
+        assert(entry->refs > 0);
+        entry->refs--;
+        if (entry->refs > 0) {
+            return;
+        }
+        pool = entry->pool;
+        if (pool != NULL) {
+            if (std::this_thread::get_id() != pool->mOwner) {
+                // wrong thread: left to Flush()
+                return;
+            }
+            pool->mDevices.erase(entry->devid);
+        }
+    }
+
+    // pool == NULL: the items have already been released with the pool
+    ReleaseItems(entry);
+    delete entry;
+}
+
+
+void PyinsaneDevicePool::ReleaseItems(struct device_pool_entry *entry)
+{
+    size_t i;
+
+    for (i = 0 ; i < entry->sources.size() ; i++) {
+        entry->sources[i].item->Release();
+    }
+    entry->sources.clear();
+    entry->has_sources = false;
+    if (entry->device != NULL) {
+        entry->device->Release();
+        entry->device = NULL;
+    }
+}
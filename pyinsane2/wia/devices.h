@@ -0,0 +1,83 @@
+#ifndef __PYINSANE_WIA_DEVICES_H
+#define __PYINSANE_WIA_DEVICES_H
+
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <windows.h>
+
+class PyinsaneDevicePool;
+
+struct device_pool_source {
+    std::wstring name;
+    IUnknown *item; // IWiaItem2
+    int type; // enum wia_src_type
+};
+
+struct device_pool_entry {
+    PyinsaneDevicePool *pool; // NULL once the pool is gone
+    std::wstring devid;
+    IUnknown *device; // IWiaItem2 ; NULL once released
+    // filled by the first get_sources(), released with the device
+    bool has_sources;
+    std::vector<struct device_pool_source> sources;
+    unsigned long refs; // handles (capsules) pointing to this entry
+};
+
+struct device_pool_stats {
+    size_t devices; // currently opened
+    size_t unused; // opened, but only waiting for Flush()
+    unsigned long opened; // calls to the opener
+    unsigned long reused; // Open() that didn't have to call the opener
+};
+
+// Opens the device 'devid': returns a new reference in 'device'
+typedef HRESULT (*device_pool_opener)(const std::wstring &devid, IUnknown **device,
+        void *cb_data);
+
+/*!
+ * Devices opened on one COM thread, shared by all the handles pointing to
+ * them: opening a device that is already opened only takes a reference on
+ * the existing entry. The device and its sources are released when the last
+ * handle is dropped.
+ *
+ * COM objects must only be used (and released) from the thread that created
+ * them. Handles can be dropped from any thread: if the last one is dropped
+ * from another thread, the device is kept until the next Open() or Flush() on
+ * the thread of the pool (and reused if reopened before that).
+ *
+ * Destroying the pool releases all the devices right away. The entries still
+ * referenced are kept, with 'device' set to NULL, until their last handle is
+ * dropped.
+ *
+ * Open(), Flush() and the destructor must be called from the thread that
+ * created the pool. AddRef() and Release() can be called from any thread.
+ */
+class PyinsaneDevicePool
+{
+public:
+    PyinsaneDevicePool();
+    ~PyinsaneDevicePool();
+
+    // 'entry' gets a new reference on success
+    HRESULT Open(const std::wstring &devid, device_pool_opener opener, void *cb_data,
+            struct device_pool_entry **entry);
+    // Releases the devices whose last handle was dropped from another thread
+    void Flush();
+    void GetStats(struct device_pool_stats *out) const;
+
+    static void AddRef(struct device_pool_entry *entry);
+    static void Release(struct device_pool_entry *entry);
+
+private:
+    static void ReleaseItems(struct device_pool_entry *entry);
+
+    std::thread::id mOwner;
+    std::map<std::wstring, struct device_pool_entry *> mDevices;
+    unsigned long mNbOpened;
+    unsigned long mNbReused;
+};
+
+#endif
@@ -0,0 +1,995 @@
+/*
+ * Mock WIA driver: device manager, devices, sources, property storages and
+ * transfers, implementing the interfaces of compat/wia.h. rawapi.cpp is built
+ * on top of it as pyinsane2.wia._mockapi, so the WIA backend (rawapi.py
+ * included) can be run and measured without Windows nor a scanner.
+ *
+ * Each device has a flatbed and a feeder. Their downloads send synthetic BMP
+ * pages (one from the flatbed, 'nb_pages' from the feeder), or memory BMP
+ * pages if WIA_IPA_FORMAT says so, written in chunks of the configured
+ * sizes, at the configured rate. Or they replay a recorded
+ * transfer (see record.h): same chunks, same progress, same pages, same
+ * result, at the original speed or faster. See mock_configure().
+ */
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <Python.h>
+
+#include <windows.h>
+#include <wia.h>
+#include <Sti.h>
+
+#include "mock.h"
+#include "properties.h"
+#include "record.h"
+
+#define MOCK_MAX_DEVICES 64
+#define MOCK_BMP_FILE_HEADER_SIZE 14
+
+struct mock_config {
+    int nb_devices;
+    int width; // pixels
+    int height; // lines
+    int depth; // 1, 8 or 24
+    int nb_pages; // per download from the feeder
+    std::vector<size_t> chunks; // sizes of the successive writes, repeated
+    double rate; // bytes/s ; <= 0: as fast as possible
+    double open_delay; // seconds taken by CreateDevice()
+    // BMP file of each page, built by mock_configure()
+    std::shared_ptr<const std::vector<uint8_t> > page;
+    // if set, replayed by the downloads instead of the pages above
+    std::shared_ptr<const PyinsaneTransferReplay> replay;
+    double replay_speed; // <= 0: as fast as possible
+};
+
+struct mock_stats {
+    unsigned long devices_opened;
+    unsigned long downloads;
+    unsigned long pages;
+    unsigned long chunks;
+    uint64_t bytes;
+    unsigned long reads; // ReadMultiple() and GetPropertyAttributes()
+    unsigned long writes; // WriteMultiple()
+};
+
+static std::mutex g_mock_mutex;
+static struct mock_config g_config;
+static struct mock_stats g_stats;
+static std::atomic<long> g_nb_alive(0); // COM objects not released yet
+// replay: first event of the next download
+static size_t g_replay_position = 0;
+
+static WCHAR g_mock_string[] = L"fake";
+
+
+void mock_property_store_init(struct mock_property_store *store)
+{
+    const struct wia_property *spec;
+    const struct wia_prop_int *ints;
+    PROPVARIANT empty;
+    std::vector<LONG> *list;
+    int nb_properties = wia_get_nb_properties();
+    int idx;
+    int i;
+
+    memset(&empty, 0, sizeof(empty));
+    store->values.assign(nb_properties, empty);
+    store->attributes.assign(nb_properties, 0);
+    store->constraints.assign(nb_properties, empty);
+    store->lists.resize(nb_properties);
+    store->clsids.resize(nb_properties);
+
+    for (idx = 0 ; idx < nb_properties ; idx++) {
+        spec = &g_wia_all_properties[idx];
+        list = &store->lists[idx];
+        store->attributes[idx] = WIA_PROP_READ | (spec->rw ? WIA_PROP_WRITE : 0);
+
+        switch(spec->vartype) {
+            case VT_I4:
+            case VT_UI4:
+                store->values[idx].vt = spec->vartype;
+                ints = (const struct wia_prop_int *)spec->possible_values;
+                if (ints != NULL) {
+                    store->values[idx].lVal = ints[0].value;
+                    for (i = 0 ; ints[i].name != NULL ; i++) {
+                        list->push_back(ints[i].value);
+                    }
+                    store->attributes[idx] |= WIA_PROP_LIST;
+                } else {
+                    store->values[idx].lVal = idx;
+                    // min, nominal, max, step
+                    list->push_back(0);
+                    list->push_back(1000);
+                    list->push_back(1000);
+                    list->push_back(1);
+                    store->attributes[idx] |= WIA_PROP_RANGE;
+                }
+                store->constraints[idx].vt = VT_VECTOR | VT_I4;
+                store->constraints[idx].cal.cElems = (ULONG)list->size();
+                store->constraints[idx].cal.pElems = list->data();
+                break;
+            case VT_BSTR:
+                store->values[idx].vt = VT_BSTR;
+                store->values[idx].bstrVal = g_mock_string;
+                break;
+            case VT_CLSID:
+                if (spec->possible_values == NULL)
+                    break; // any CLSID: none that we could decode
+                store->clsids[idx] = ((const struct wia_prop_clsid *)spec->possible_values)[0].value;
+                store->values[idx].vt = VT_CLSID;
+                store->values[idx].puuid = &store->clsids[idx];
+                break;
+            default:
+                // not available
+                break;
+        }
+    }
+}
+
+
+// Same as what a driver returns: the caller frees it with
+// FreePropVariantArray()
+static void copy_propvariant(const PROPVARIANT *src, PROPVARIANT *dst)
+{
+    size_t size;
+
+    PropVariantInit(dst);
+    dst->vt = src->vt;
+    switch (src->vt) {
+        case VT_BSTR:
+            dst->bstrVal = SysAllocString(src->bstrVal);
+            break;
+        case VT_CLSID:
+            dst->puuid = (CLSID *)CoTaskMemAlloc(sizeof(CLSID));
+            *dst->puuid = *src->puuid;
+            break;
+        case VT_VECTOR | VT_I4:
+        case VT_VECTOR | VT_UI4:
+            size = src->cal.cElems * sizeof(LONG);
+            dst->cal.cElems = src->cal.cElems;
+            dst->cal.pElems = (LONG *)CoTaskMemAlloc(size);
+            memcpy(dst->cal.pElems, src->cal.pElems, size);
+            break;
+        default:
+            dst->lVal = src->lVal;
+            break;
+    }
+}
+
+
+template<typename Interface>
+class MockObject : public Interface
+{
+public:
+    MockObject() : mRefCount(1)
+    {
+        g_nb_alive++;
+    }
+
+    virtual ~MockObject()
+    {
+        g_nb_alive--;
+    }
+
+    virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppvObject)
+    {
+        if (IsEqualIID(riid, IID_IUnknown) || IsEqualIID(riid, compat_uuidof<Interface>())) {
+            *ppvObject = static_cast<Interface *>(this);
+            this->AddRef();
+            return S_OK;
+        }
+        *ppvObject = NULL;
+        return E_NOINTERFACE;
+    }
+
+    virtual ULONG STDMETHODCALLTYPE AddRef()
+    {
+        return ++mRefCount;
+    }
+
+    virtual ULONG STDMETHODCALLTYPE Release()
+    {
+        ULONG refs = --mRefCount;
+        if (refs == 0)
+            delete this;
+        return refs;
+    }
+
+private:
+    std::atomic<ULONG> mRefCount;
+};
+
+
+enum mock_item_kind {
+    MOCK_ROOT = 0,
+    MOCK_FLATBED,
+    MOCK_FEEDER,
+};
+
+/*!
+ * Device (root item) or one of its sources. Like WIA items, the same object
+ * is also their property storage, and their transfer for the sources.
+ */
+class MockItem : public IWiaItem2, public IWiaPropertyStorage, public IWiaTransfer
+{
+public:
+    MockItem(int device, enum mock_item_kind kind);
+    virtual ~MockItem();
+
+    // IUnknown
+    virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppvObject);
+    virtual ULONG STDMETHODCALLTYPE AddRef();
+    virtual ULONG STDMETHODCALLTYPE Release();
+
+    // IWiaItem2
+    virtual HRESULT STDMETHODCALLTYPE EnumChildItems(const GUID *pCategoryGUID,
+            IEnumWiaItem2 **ppIEnumWiaItem2);
+
+    // IWiaPropertyStorage
+    virtual HRESULT STDMETHODCALLTYPE ReadMultiple(ULONG cpspec, const PROPSPEC rgpspec[],
+            PROPVARIANT rgpropvar[]);
+    virtual HRESULT STDMETHODCALLTYPE WriteMultiple(ULONG cpspec, const PROPSPEC rgpspec[],
+            const PROPVARIANT rgpropvar[], PROPID propidNameFirst);
+    virtual HRESULT STDMETHODCALLTYPE GetPropertyAttributes(ULONG cpspec, PROPSPEC rgpspec[],
+            ULONG rgflags[], PROPVARIANT rgpropvar[]);
+
+    // IWiaTransfer
+    virtual HRESULT STDMETHODCALLTYPE Download(LONG lFlags,
+            IWiaTransferCallback *pIWiaTransferCallback);
+
+private:
+    void SetString(PROPID id, const std::wstring &value);
+    void SetInt(PROPID id, LONG value);
+    void SetClsid(PROPID id, const CLSID &value);
+    bool CheckValue(int idx, const PROPVARIANT *value) const;
+
+    std::atomic<ULONG> mRefCount;
+    enum mock_item_kind mKind;
+    std::mutex mMutex; // protects mStore
+    struct mock_property_store mStore;
+    std::map<int, std::wstring> mStrings; // BSTR values of mStore
+    std::vector<MockItem *> mChildren;
+};
+
+
+class MockItemEnum : public MockObject<IEnumWiaItem2>
+{
+public:
+    MockItemEnum(const std::vector<MockItem *> &items) : mItems(items), mNext(0)
+    {
+        size_t i;
+
+        for (i = 0 ; i < mItems.size() ; i++) {
+            static_cast<IWiaItem2 *>(mItems[i])->AddRef();
+        }
+    }
+
+    virtual ~MockItemEnum()
+    {
+        size_t i;
+
+        for (i = 0 ; i < mItems.size() ; i++) {
+            static_cast<IWiaItem2 *>(mItems[i])->Release();
+        }
+    }
+
+    virtual HRESULT STDMETHODCALLTYPE Next(ULONG cElt, IWiaItem2 **ppIWiaItem2,
+            ULONG *pcEltFetched)
+    {
+        ULONG i;
+
+        for (i = 0 ; i < cElt && mNext < mItems.size() ; i++, mNext++) {
+            ppIWiaItem2[i] = mItems[mNext];
+            ppIWiaItem2[i]->AddRef();
+        }
+        if (pcEltFetched != NULL)
+            *pcEltFetched = i;
+        return (i == cElt ? S_OK : S_FALSE);
+    }
+
+private:
+    std::vector<MockItem *> mItems;
+    size_t mNext;
+};
+
+
+MockItem::MockItem(int device, enum mock_item_kind kind)
+    : mRefCount(1), mKind(kind)
+{
+    struct mock_config config;
+    wchar_t name[64];
+
+    g_nb_alive++;
+    {
+        std::lock_guard<std::mutex> lock(g_mock_mutex);
+        config = g_config;
+    }
+
+    mock_property_store_init(&mStore);
+
+    swprintf(name, sizeof(name) / sizeof(name[0]), L"mock:%d", device);
+    SetString(WIA_DIP_DEV_ID, name);
+    swprintf(name, sizeof(name) / sizeof(name[0]), L"Mock scanner %d", device);
+    SetString(WIA_DIP_DEV_NAME, name);
+    SetString(WIA_DIP_VEND_DESC, L"Pyinsane");
+    SetString(WIA_DIP_DEV_DESC, L"Mock device");
+    SetInt(WIA_DIP_DEV_TYPE, StiDeviceTypeScanner << 16);
+
+    SetInt(WIA_IPA_DEPTH, config.depth);
+    SetInt(WIA_IPA_PIXELS_PER_LINE, config.width);
+    SetInt(WIA_IPA_NUMBER_OF_LINES, config.height);
+    SetInt(WIA_IPA_BYTES_PER_LINE, ((config.width * config.depth + 31) / 32) * 4);
+    SetClsid(WIA_IPA_FORMAT, WiaImgFmt_BMP);
+
+    switch (kind) {
+        case MOCK_ROOT:
+            SetString(WIA_IPA_FULL_ITEM_NAME, L"0000\\Root");
+            SetClsid(WIA_IPA_ITEM_CATEGORY, WIA_CATEGORY_ROOT);
+            mChildren.push_back(new MockItem(device, MOCK_FLATBED));
+            mChildren.push_back(new MockItem(device, MOCK_FEEDER));
+            break;
+        case MOCK_FLATBED:
+            SetString(WIA_IPA_FULL_ITEM_NAME, L"0000\\Root\\Flatbed");
+            SetClsid(WIA_IPA_ITEM_CATEGORY, WIA_CATEGORY_FLATBED);
+            break;
+        case MOCK_FEEDER:
+            SetString(WIA_IPA_FULL_ITEM_NAME, L"0000\\Root\\Feeder");
+            SetClsid(WIA_IPA_ITEM_CATEGORY, WIA_CATEGORY_FEEDER);
+            break;
+    }
+}
+
+
+MockItem::~MockItem()
+{
+    size_t i;
+
+    for (i = 0 ; i < mChildren.size() ; i++) {
+        static_cast<IWiaItem2 *>(mChildren[i])->Release();
+    }
+    g_nb_alive--;
+}
+
+
+void MockItem::SetString(PROPID id, const std::wstring &value)
+{
+    int idx = wia_find_property_by_id(id);
+
+    if (idx < 0)
+        return;
+    mStrings[idx] = value;
+    mStore.values[idx].vt = VT_BSTR;
+    mStore.values[idx].bstrVal = (BSTR)mStrings[idx].c_str();
+}
+
+
+void MockItem::SetInt(PROPID id, LONG value)
+{
+    int idx = wia_find_property_by_id(id);
+
+    if (idx >= 0)
+        mStore.values[idx].lVal = value;
+}
+
+
+void MockItem::SetClsid(PROPID id, const CLSID &value)
+{
+    int idx = wia_find_property_by_id(id);
+
+    if (idx < 0)
+        return;
+    mStore.clsids[idx] = value;
+    mStore.values[idx].vt = VT_CLSID;
+    mStore.values[idx].puuid = &mStore.clsids[idx];
+}
+
+
+HRESULT STDMETHODCALLTYPE MockItem::QueryInterface(REFIID riid, void **ppvObject)
+{
+    if (IsEqualIID(riid, IID_IUnknown) || IsEqualIID(riid, IID_IWiaItem2))
+        *ppvObject = static_cast<IWiaItem2 *>(this);
+    else if (IsEqualIID(riid, IID_IWiaPropertyStorage))
+        *ppvObject = static_cast<IWiaPropertyStorage *>(this);
+    else if (IsEqualIID(riid, IID_IWiaTransfer) && mKind != MOCK_ROOT)
+        *ppvObject = static_cast<IWiaTransfer *>(this);
+    else {
+        *ppvObject = NULL;
+        return E_NOINTERFACE;
+    }
+    AddRef();
+    return S_OK;
+}
+
+
+ULONG STDMETHODCALLTYPE MockItem::AddRef()
+{
+    return ++mRefCount;
+}
+
+
+ULONG STDMETHODCALLTYPE MockItem::Release()
+{
+    ULONG refs = --mRefCount;
+    if (refs == 0)
+        delete this;
+    return refs;
+}
+
+
+HRESULT STDMETHODCALLTYPE MockItem::EnumChildItems(const GUID *, IEnumWiaItem2 **ppIEnumWiaItem2)
+{
+    *ppIEnumWiaItem2 = new MockItemEnum(mChildren);
+    return S_OK;
+}
+
+
+HRESULT STDMETHODCALLTYPE MockItem::ReadMultiple(ULONG cpspec, const PROPSPEC rgpspec[],
+        PROPVARIANT rgpropvar[])
+{
+    ULONG i;
+    int idx;
+
+    {
+        std::lock_guard<std::mutex> lock(g_mock_mutex);
+        g_stats.reads++;
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (i = 0 ; i < cpspec ; i++) {
+        idx = wia_find_property_by_id(rgpspec[i].propid);
+        if (idx < 0) {
+            PropVariantInit(&rgpropvar[i]);
+            continue;
+        }
+        copy_propvariant(&mStore.values[idx], &rgpropvar[i]);
+    }
+    return S_OK;
+}
+
+
+bool MockItem::CheckValue(int idx, const PROPVARIANT *value) const
+{
+    const std::vector<LONG> &list = mStore.lists[idx];
+    size_t i;
+
+    if (!(mStore.attributes[idx] & WIA_PROP_WRITE))
+        return false;
+
+    switch (g_wia_all_properties[idx].vartype) {
+        case VT_I4:
+        case VT_UI4:
+            if (value->vt != VT_I4 && value->vt != VT_UI4)
+                return false;
+            if (mStore.attributes[idx] & WIA_PROP_RANGE)
+                return (value->lVal >= list[0] && value->lVal <= list[2]);
+            for (i = 0 ; i < list.size() ; i++) {
+                if (list[i] == value->lVal)
+                    return true;
+            }
+            return false;
+        case VT_CLSID:
+            return (value->vt == VT_CLSID);
+        default:
+            return false;
+    }
+}
+
+
+HRESULT STDMETHODCALLTYPE MockItem::WriteMultiple(ULONG cpspec, const PROPSPEC rgpspec[],
+        const PROPVARIANT rgpropvar[], PROPID)
+{
+    std::vector<int> indexes;
+    ULONG i;
+    int idx;
+
+    {
+        std::lock_guard<std::mutex> lock(g_mock_mutex);
+        g_stats.writes++;
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    // all or nothing
+    for (i = 0 ; i < cpspec ; i++) {
+        idx = wia_find_property_by_id(rgpspec[i].propid);
+        if (idx < 0 || !CheckValue(idx, &rgpropvar[i]))
+            return E_INVALIDARG;
+        indexes.push_back(idx);
+    }
+    for (i = 0 ; i < cpspec ; i++) {
+        idx = indexes[i];
+        if (rgpropvar[i].vt == VT_CLSID) {
+            mStore.clsids[idx] = *rgpropvar[i].puuid;
+        } else {
+            mStore.values[idx].lVal = rgpropvar[i].lVal;
+        }
+    }
+    return S_OK;
+}
+
+
+HRESULT STDMETHODCALLTYPE MockItem::GetPropertyAttributes(ULONG cpspec, PROPSPEC rgpspec[],
+        ULONG rgflags[], PROPVARIANT rgpropvar[])
+{
+    ULONG i;
+    int idx;
+
+    {
+        std::lock_guard<std::mutex> lock(g_mock_mutex);
+        g_stats.reads++;
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (i = 0 ; i < cpspec ; i++) {
+        idx = wia_find_property_by_id(rgpspec[i].propid);
+        if (idx < 0) {
+            rgflags[i] = 0;
+            PropVariantInit(&rgpropvar[i]);
+            continue;
+        }
+        rgflags[i] = mStore.attributes[idx];
+        copy_propvariant(&mStore.constraints[idx], &rgpropvar[i]);
+    }
+    return S_OK;
+}
+
+
+static HRESULT send_status(IWiaTransferCallback *callbacks, LONG message, LONG percent,
+        ULONG64 bytes)
+{
+    WiaTransferParams params;
+
+    memset(&params, 0, sizeof(params));
+    params.lMessage = message;
+    params.lPercentComplete = percent;
+    params.ulTransferredBytes = bytes;
+    return callbacks->TransferCallback(0, &params);
+}
+
+
+// Each download replays the recording up to the end of the next recorded
+// download, so sessions made of one download per page are replayed the same
+// way. Once everything was replayed, the feeder is empty.
+static HRESULT replay_download(const struct mock_config *config,
+        IWiaTransferCallback *callbacks, unsigned long *nb_chunks, uint64_t *sent)
+{
+    const std::vector<struct record_event> &events = config->replay->GetEvents();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<uint8_t> chunk;
+    IStream *stream = NULL;
+    ULONG written;
+    HRESULT hr = S_OK;
+    int nb_pages = 0, page = 0;
+    size_t first, last, i;
+    double base;
+
+    {
+        std::lock_guard<std::mutex> lock(g_mock_mutex);
+        first = g_replay_position;
+        for (last = first ; last < events.size() ; last++) {
+            if (events[last].type == RECORD_END_OF_SCAN)
+                break;
+        }
+        g_replay_position = std::min(last + 1, events.size());
+    }
+    if (first >= events.size())
+        return WIA_ERROR_PAPER_EMPTY;
+    base = (first > 0 ? events[first - 1].time : 0.0);
+
+    for (i = first ; i <= last && i < events.size() ; i++) {
+        if (events[i].type == RECORD_END_OF_PAGE)
+            nb_pages++;
+    }
+
+    for (i = first ; i <= last && i < events.size() && hr == S_OK ; i++) {
+        const struct record_event *event = &events[i];
+
+        if (config->replay_speed > 0) {
+            std::this_thread::sleep_until(start + std::chrono::duration_cast<
+                    std::chrono::steady_clock::duration>(
+                        std::chrono::duration<double>(
+                            (event->time - base) / config->replay_speed)));
+        }
+        switch (event->type) {
+            case RECORD_CHUNK:
+                if (stream == NULL) {
+                    hr = callbacks->GetNextStream(0, NULL, NULL, &stream);
+                    if (FAILED(hr))
+                        return hr;
+                }
+                chunk.resize(event->size);
+                config->replay->GetChunk(event, chunk.data());
+                hr = stream->Write(chunk.data(), (ULONG)chunk.size(), &written);
+                (*nb_chunks)++;
+                *sent += event->size;
+                break;
+            case RECORD_STATUS:
+                hr = send_status(callbacks, WIA_TRANSFER_MSG_STATUS, (LONG)event->values[0],
+                        event->values[1]);
+                break;
+            case RECORD_END_OF_PAGE:
+                if (stream != NULL) {
+                    stream->Release();
+                    stream = NULL;
+                }
+                page++;
+                send_status(callbacks, (page < nb_pages ? WIA_TRANSFER_MSG_END_OF_STREAM
+                            : WIA_TRANSFER_MSG_END_OF_TRANSFER), 100, 0);
+                break;
+            case RECORD_END_OF_SCAN:
+                // same result as the recorded driver (paper empty, etc)
+                hr = (HRESULT)event->values[0];
+                if (hr == S_OK)
+                    goto end;
+                break;
+            default:
+                break;
+        }
+    }
+end:
+    if (stream != NULL)
+        stream->Release();
+    return hr;
+}
+
+
+HRESULT STDMETHODCALLTYPE MockItem::Download(LONG, IWiaTransferCallback *callbacks)
+{
+    struct mock_config config;
+    std::chrono::steady_clock::time_point start;
+    const uint8_t *page;
+    size_t page_size, offset, nb, chunk;
+    unsigned long nb_chunks = 0;
+    uint64_t sent = 0;
+    IStream *stream;
+    ULONG written;
+    HRESULT hr = S_OK;
+    int nb_pages, i, idx;
+
+    {
+        std::lock_guard<std::mutex> lock(g_mock_mutex);
+        config = g_config;
+        g_stats.downloads++;
+    }
+    if (config.replay) {
+        hr = replay_download(&config, callbacks, &nb_chunks, &sent);
+        std::lock_guard<std::mutex> lock(g_mock_mutex);
+        g_stats.chunks += nb_chunks;
+        g_stats.bytes += sent;
+        return hr;
+    }
+    page = config.page->data();
+    page_size = config.page->size();
+    idx = wia_find_property_by_id(WIA_IPA_FORMAT);
+    if (idx >= 0 && IsEqualGUID(mStore.clsids[idx], WiaImgFmt_MEMORYBMP)) {
+        // same bitmap, without the file header
+        page += MOCK_BMP_FILE_HEADER_SIZE;
+        page_size -= MOCK_BMP_FILE_HEADER_SIZE;
+    }
+    nb_pages = (mKind == MOCK_FEEDER ? config.nb_pages : 1);
+    start = std::chrono::steady_clock::now();
+
+    for (i = 0 ; i < nb_pages ; i++) {
+        hr = callbacks->GetNextStream(0, NULL, NULL, &stream);
+        if (FAILED(hr))
+            break;
+
+        for (offset = 0 ; offset < page_size ; offset += nb, nb_chunks++) {
+            hr = send_status(callbacks, WIA_TRANSFER_MSG_STATUS,
+                    (LONG)(offset * 100 / page_size), offset);
+            if (hr == S_FALSE)
+                break; // cancelled by the application
+
+            chunk = config.chunks[nb_chunks % config.chunks.size()];
+            nb = std::min(chunk, page_size - offset);
+            hr = stream->Write(page + offset, (ULONG)nb, &written);
+            if (FAILED(hr))
+                break;
+            sent += nb;
+
+            if (config.rate > 0) {
+                std::this_thread::sleep_until(start + std::chrono::duration_cast<
+                        std::chrono::steady_clock::duration>(
+                            std::chrono::duration<double>(sent / config.rate)));
+            }
+        }
+        stream->Release();
+        if (hr != S_OK)
+            break;
+
+        send_status(callbacks, WIA_TRANSFER_MSG_STATUS, 100, page_size);
+        if (i + 1 < nb_pages)
+            send_status(callbacks, WIA_TRANSFER_MSG_END_OF_STREAM, 100, page_size);
+        std::lock_guard<std::mutex> lock(g_mock_mutex);
+        g_stats.pages++;
+    }
+    if (hr == S_OK)
+        send_status(callbacks, WIA_TRANSFER_MSG_END_OF_TRANSFER, 100, 0);
+
+    std::lock_guard<std::mutex> lock(g_mock_mutex);
+    g_stats.chunks += nb_chunks;
+    g_stats.bytes += sent;
+    return hr;
+}
+
+
+class MockDevInfoEnum : public MockObject<IEnumWIA_DEV_INFO>
+{
+public:
+    MockDevInfoEnum(int nbDevices) : mNbDevices(nbDevices), mNext(0) { }
+
+    virtual HRESULT STDMETHODCALLTYPE Next(ULONG celt, IWiaPropertyStorage **rgelt,
+            ULONG *pceltFetched)
+    {
+        ULONG i;
+
+        for (i = 0 ; i < celt && mNext < mNbDevices ; i++, mNext++) {
+            rgelt[i] = new MockItem(mNext, MOCK_ROOT);
+        }
+        if (pceltFetched != NULL)
+            *pceltFetched = i;
+        return (i == celt ? S_OK : S_FALSE);
+    }
+
+    virtual HRESULT STDMETHODCALLTYPE GetCount(ULONG *celt)
+    {
+        *celt = mNbDevices;
+        return S_OK;
+    }
+
+private:
+    int mNbDevices;
+    int mNext;
+};
+
+
+class MockDevMgr : public MockObject<IWiaDevMgr2>
+{
+public:
+    virtual HRESULT STDMETHODCALLTYPE EnumDeviceInfo(LONG, IEnumWIA_DEV_INFO **ppIEnum)
+    {
+        std::lock_guard<std::mutex> lock(g_mock_mutex);
+        *ppIEnum = new MockDevInfoEnum(g_config.nb_devices);
+        return S_OK;
+    }
+
+    virtual HRESULT STDMETHODCALLTYPE CreateDevice(LONG, BSTR bstrDeviceID,
+            IWiaItem2 **ppWiaItem2Root)
+    {
+        double delay;
+        int device;
+
+        {
+            std::lock_guard<std::mutex> lock(g_mock_mutex);
+            if (swscanf(bstrDeviceID, L"mock:%d", &device) != 1
+                    || device < 0 || device >= g_config.nb_devices) {
+                return WIA_ERROR_OFFLINE;
+            }
+            delay = g_config.open_delay;
+            g_stats.devices_opened++;
+        }
+        // sleeping network scanners, etc
+        if (delay > 0)
+            std::this_thread::sleep_for(std::chrono::duration<double>(delay));
+
+        *ppWiaItem2Root = new MockItem(device, MOCK_ROOT);
+        return S_OK;
+    }
+};
+
+
+HRESULT CoInitialize(void *)
+{
+    return S_OK;
+}
+
+
+void CoUninitialize(void)
+{
+}
+
+
+HRESULT CoCreateInstance(REFCLSID clsid, IUnknown *, DWORD, REFIID iid, void **out)
+{
+    *out = NULL;
+    if (!IsEqualGUID(clsid, CLSID_WiaDevMgr2) || !IsEqualIID(iid, IID_IWiaDevMgr2))
+        return REGDB_E_CLASSNOTREG;
+    *out = static_cast<IWiaDevMgr2 *>(new MockDevMgr());
+    return S_OK;
+}
+
+
+static std::shared_ptr<const std::vector<uint8_t> > make_page(int width, int height, int depth)
+{
+    std::vector<uint8_t> *page;
+    size_t stride = ((width * depth + 31) / 32) * 4;
+    size_t nb_colors = (depth <= 8 ? ((size_t)1 << depth) : 0);
+    size_t header_size = MOCK_BMP_FILE_HEADER_SIZE + 40 + nb_colors * 4;
+    size_t i;
+    uint8_t *h;
+
+    page = new std::vector<uint8_t>(header_size + stride * height);
+    h = page->data();
+
+#define PUT16(off, v) do { h[(off)] = (uint8_t)(v); h[(off) + 1] = (uint8_t)((v) >> 8); } while(0)
+#define PUT32(off, v) do { PUT16((off), (v)); PUT16((off) + 2, (uint32_t)(v) >> 16); } while(0)
+    // BITMAPFILEHEADER
+    h[0] = 'B';
+    h[1] = 'M';
+    PUT32(2, (uint32_t)page->size());
+    PUT32(10, (uint32_t)header_size);
+    // BITMAPINFOHEADER (bottom-up)
+    PUT32(14, 40);
+    PUT32(18, (uint32_t)width);
+    PUT32(22, (uint32_t)height);
+    PUT16(26, 1);
+    PUT16(28, depth);
+    PUT32(34, (uint32_t)(stride * height));
+    PUT32(38, 11811); // 300 dpi
+    PUT32(42, 11811);
+    PUT32(46, (uint32_t)nb_colors);
+#undef PUT32
+#undef PUT16
+    // grayscale palette
+    for (i = 0 ; i < nb_colors ; i++) {
+        memset(h + 54 + i * 4, (int)(i * 255 / (nb_colors - 1)), 3);
+    }
+
+    for (i = header_size ; i < page->size() ; i++) {
+        h[i] = (uint8_t)((i - header_size) % 251);
+    }
+    return std::shared_ptr<const std::vector<uint8_t> >(page);
+}
+
+
+// Applied to the devices opened afterwards (and to all the downloads started
+// afterwards). 'replay': path of a recording, or None to go back to the
+// synthetic pages.
+static PyObject *mock_configure(PyObject *, PyObject *args, PyObject *kwargs)
+{
+    static const char *keywords[] = {
+        "nb_devices", "width", "height", "depth", "nb_pages", "chunks", "rate", "open_delay",
+        "replay", "replay_speed", NULL,
+    };
+    struct mock_config config;
+    PyObject *chunks = NULL;
+    PyObject *replay = NULL;
+    PyinsaneTransferReplay *loaded;
+    const char *replay_path;
+    bool ok;
+    PyObject *fast;
+    Py_ssize_t i;
+    long chunk;
+
+    {
+        std::lock_guard<std::mutex> lock(g_mock_mutex);
+        config = g_config;
+    }
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|iiiiiOddOd", (char **)keywords,
+                &config.nb_devices, &config.width, &config.height, &config.depth,
+                &config.nb_pages, &chunks, &config.rate, &config.open_delay, &replay,
+                &config.replay_speed)) {
+        return NULL;
+    }
+    if (config.nb_devices < 0 || config.nb_devices > MOCK_MAX_DEVICES
+            || config.width <= 0 || config.height <= 0 || config.nb_pages < 0
+            || (config.depth != 1 && config.depth != 8 && config.depth != 24)) {
+        PyErr_SetString(PyExc_ValueError, "mock_configure(): invalid configuration");
+        return NULL;
+    }
+
+    if (chunks != NULL) {
+        fast = PySequence_Fast(chunks, "mock_configure(): chunks must be a sequence");
+        if (fast == NULL) {
+            return NULL;
+        }
+        config.chunks.clear();
+        for (i = 0 ; i < PySequence_Fast_GET_SIZE(fast) ; i++) {
+            chunk = PyLong_AsLong(PySequence_Fast_GET_ITEM(fast, i));
+            if (chunk <= 0) {
+                Py_DECREF(fast);
+                if (!PyErr_Occurred())
+                    PyErr_SetString(PyExc_ValueError, "mock_configure(): chunks must be > 0");
+                return NULL;
+            }
+            config.chunks.push_back((size_t)chunk);
+        }
+        Py_DECREF(fast);
+        if (config.chunks.empty()) {
+            PyErr_SetString(PyExc_ValueError, "mock_configure(): no chunk size");
+            return NULL;
+        }
+    }
+
+    if (replay == Py_None) {
+        config.replay.reset();
+    } else if (replay != NULL) {
+        replay_path = PyUnicode_AsUTF8(replay);
+        if (replay_path == NULL) {
+            return NULL;
+        }
+        loaded = new PyinsaneTransferReplay();
+        Py_BEGIN_ALLOW_THREADS;
+        ok = loaded->Load(replay_path);
+        Py_END_ALLOW_THREADS;
+        if (!ok) {
+            delete loaded;
+            PyErr_SetString(PyExc_IOError, "mock_configure(): not a valid recording");
+            return NULL;
+        }
+        config.replay.reset(loaded);
+    }
+
+    config.page = make_page(config.width, config.height, config.depth);
+
+    std::lock_guard<std::mutex> lock(g_mock_mutex);
+    if (replay != NULL)
+        g_replay_position = 0; // from the start
+    g_config = config;
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *mock_get_stats(PyObject *, PyObject *)
+{
+    struct mock_stats stats;
+    size_t page_size;
+
+    {
+        std::lock_guard<std::mutex> lock(g_mock_mutex);
+        stats = g_stats;
+        page_size = g_config.page->size();
+    }
+    return Py_BuildValue(
+        "{s:k,s:k,s:k,s:k,s:K,s:k,s:k,s:l,s:n}",
+        "devices_opened", stats.devices_opened,
+        "downloads", stats.downloads,
+        "pages", stats.pages,
+        "chunks", stats.chunks,
+        "bytes", (unsigned long long)stats.bytes,
+        "reads", stats.reads,
+        "writes", stats.writes,
+        "alive", g_nb_alive.load(),
+        "page_size", (Py_ssize_t)page_size
+    );
+}
+
+
+PyMethodDef g_wia_mock_methods[] = {
+    {"mock_configure", (PyCFunction)(void (*)(void))mock_configure, METH_VARARGS | METH_KEYWORDS, NULL},
+    {"mock_get_stats", mock_get_stats, METH_NOARGS, NULL},
+    {NULL, NULL, 0, NULL},
+};
+
+
+// Default configuration: one A4 flatbed scanner, 150dpi, RGB
+static struct mock_init {
+    mock_init()
+    {
+        g_config.nb_devices = 1;
+        g_config.width = 1240;
+        g_config.height = 1754;
+        g_config.depth = 24;
+        g_config.nb_pages = 1;
+        g_config.chunks.assign(1, 64 * 1024);
+        g_config.rate = 0;
+        g_config.open_delay = 0;
+        g_config.replay_speed = 1.0;
+        g_config.page = make_page(g_config.width, g_config.height, g_config.depth);
+        memset(&g_stats, 0, sizeof(g_stats));
+    }
+} g_mock_init;
@@ -0,0 +1,32 @@
+#ifndef __PYINSANE_WIA_MOCK_H
+#define __PYINSANE_WIA_MOCK_H
+
+#include <vector>
+
+#include <Python.h>
+
+#include <windows.h>
+#include <wia.h>
+
+/*!
+ * What IWiaPropertyStorage would return for an item having all the properties
+ * of the registry, in the same order: the first possible value of each
+ * property (lists), or a value in [0 ; 1000] (ranges).
+ *
+ * 'values' and 'constraints' point to 'lists' and 'clsids': a store must be
+ * initialized in place, and never copied.
+ */
+struct mock_property_store {
+    std::vector<PROPVARIANT> values;
+    std::vector<ULONG> attributes;
+    std::vector<PROPVARIANT> constraints;
+    std::vector<std::vector<LONG> > lists; // data of the constraints
+    std::vector<CLSID> clsids;
+};
+
+void mock_property_store_init(struct mock_property_store *store);
+
+// mock_configure() and mock_get_stats(), added to pyinsane2.wia._mockapi
+extern PyMethodDef g_wia_mock_methods[];
+
+#endif
@@ -4,6 +4,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <bitset>
+#include <string>
+#include <vector>
+
 #include <windows.h>
 #include <wia.h>
 #include <Sti.h>
@@ -11,6 +15,8 @@
 #include <Python.h>
 
 #include "properties.h"
+#include "registry.h"
+#include "snapshot.h"
 #include "util.h"
 
 static const struct wia_prop_int g_possible_connect_status[] = {
@@ -78,7 +84,7 @@ static const struct wia_prop_clsid g_possible_format[] = {
     { WiaImgFmt_RAW, "raw", },
     { WiaImgFmt_RAWRGB, "rawrgb", },
     { WiaImgFmt_TIFF, "tiff", },
-    { NULL, NULL, },
+    { CLSID_NULL, NULL, },
 };
 
 static const struct wia_prop_clsid g_possible_item_category[] = {
@@ -90,7 +96,7 @@ static const struct wia_prop_clsid g_possible_item_category[] = {
     { WIA_CATEGORY_FILM, "film", },
     { WIA_CATEGORY_FOLDER, "folder", },
     { WIA_CATEGORY_FINISHED_FILE, "finished_file", },
-    { NULL, NULL, },
+    { CLSID_NULL, NULL, },
 };
 
 static const struct wia_prop_int g_possible_item_flags[] = {
@@ -775,38 +781,486 @@ static const struct wia_property _g_wia_all_properties[] =
 
 const struct wia_property *g_wia_all_properties = _g_wia_all_properties;
 
-static PyObject *get_possible_values_int(const struct wia_property *propspec)
+/*
+ * Lookups in the tables above. They are indexed when the module is loaded:
+ * the GUIDs come from wiaguid.lib, so the tables are only complete once the
+ * static initialization of this file is done (in order of definition), and
+ * the indexes must be defined after them.
+ */
+
+// Values made of independent bits: decoded bit by bit when there is no exact
+// match
+static const struct wia_prop_int *g_flag_tables[] = {
+    g_possible_access_rights,
+    g_possible_document_handling_capabilities,
+    g_possible_document_handling_select,
+    g_possible_document_handling_status,
+    g_possible_hw_config,
+    g_possible_intent,
+    g_possible_item_flags,
+    NULL,
+};
+
+#define WIA_NB_FLAG_BITS 32
+
+/*!
+ * Value <-> name(s) of the values of a wia_prop_int table.
+ */
+class PyinsaneIntCodec
 {
-    struct wia_prop_int *values = (struct wia_prop_int *)propspec->possible_values;
-    PyObject *list;
-    PyObject *value;
+public:
+    PyinsaneIntCodec(const struct wia_prop_int *values, int nbValues, bool flags)
+        : mValues(values), mNbValues(nbValues), mByValue(nbValues), mByName(nbValues),
+        mFlags(flags), mNames(nbValues, (PyObject *)NULL), mPossibleValues(NULL)
+    {
+        struct registry_name name;
+        int i, bit;
 
-    list = PyList_New(0);
+        for (bit = 0 ; bit < WIA_NB_FLAG_BITS ; bit++) {
+            mBitNames[bit] = -1;
+        }
+        for (i = 0 ; i < nbValues ; i++) {
+            mByValue.Add(values[i].value, i);
+            name.str = values[i].name;
+            name.len = strlen(values[i].name);
+            mByName.Add(name, i);
+            if (flags && values[i].value > 0) {
+                std::bitset<WIA_NB_FLAG_BITS> bits((unsigned long)values[i].value);
+                if (bits.count() == 1) {
+                    for (bit = 0 ; !bits.test(bit) ; bit++) { }
+                    if (!mKnownBits.test(bit)) {
+                        mKnownBits.set(bit);
+                        mBitNames[bit] = i;
+                    }
+                }
+            }
+        }
+    }
 
-    while(values->name != NULL) {
-        value = PyUnicode_FromString(values->name);
-        PyList_Append(list, value);
-        values++;
+    const struct wia_prop_int *GetValues() const
+    {
+        return mValues;
     }
 
-    return list;
-}
+    bool InitPython()
+    {
+        int i;
 
-static PyObject *get_possible_values_clsid(const struct wia_property *propspec)
+        mPossibleValues = PyTuple_New(mNbValues);
+        if (mPossibleValues == NULL)
+            return false;
+        for (i = 0 ; i < mNbValues ; i++) {
+            mNames[i] = PyUnicode_InternFromString(mValues[i].name);
+            if (mNames[i] == NULL)
+                return false;
+            Py_INCREF(mNames[i]);
+            PyTuple_SET_ITEM(mPossibleValues, i, mNames[i]);
+        }
+        return true;
+    }
+
+    // Borrowed reference
+    PyObject *GetPossibleValues() const
+    {
+        return mPossibleValues;
+    }
+
+    // New reference
+    PyObject *Decode(long value) const
+    {
+        std::bitset<WIA_NB_FLAG_BITS> bits((unsigned long)(uint32_t)value);
+        std::string names;
+        int bit;
+        int i;
+
+        i = mByValue.Find(value);
+        if (i >= 0) {
+            Py_INCREF(mNames[i]);
+            return mNames[i];
+        }
+        if (!mFlags || bits.none() || (bits & ~mKnownBits).any())
+            return PyLong_FromLong(value);
+
+        for (bit = 0 ; bit < WIA_NB_FLAG_BITS ; bit++) {
+            if (!bits.test(bit))
+                continue;
+            if (!names.empty())
+                names += ',';
+            names += mValues[mBitNames[bit]].name;
+        }
+        return PyUnicode_FromStringAndSize(names.data(), names.size());
+    }
+
+    // "name" or "name,name,...": the values are ORed. Unknown names are
+    // ignored, as long as at least one of them is known.
+    bool Encode(const char *str, size_t len, int *out) const
+    {
+        struct registry_name token;
+        const char *end = str + len;
+        const char *sep;
+        bool match = false;
+        int val = 0;
+        int i;
+
+        while (str <= end) {
+            sep = (const char *)memchr(str, ',', end - str);
+            if (sep == NULL)
+                sep = end;
+            token.str = str;
+            token.len = sep - str;
+            i = mByName.Find(token);
+            if (i >= 0) {
+                val |= mValues[i].value;
+                match = true;
+            }
+            str = sep + 1;
+        }
+        if (match)
+            *out = val;
+        return match;
+    }
+
+private:
+    const struct wia_prop_int *mValues;
+    int mNbValues;
+    PyinsaneRegistryIndex<RegistryIntKey> mByValue;
+    PyinsaneRegistryIndex<RegistryNameKey> mByName;
+    bool mFlags;
+    std::bitset<WIA_NB_FLAG_BITS> mKnownBits;
+    int mBitNames[WIA_NB_FLAG_BITS]; // single-bit entry of each bit
+    std::vector<PyObject *> mNames; // interned
+    PyObject *mPossibleValues; // tuple of mNames
+};
+
+/*!
+ * CLSID <-> name of the values of a wia_prop_clsid table.
+ */
+class PyinsaneClsidCodec
 {
-    struct wia_prop_clsid *values = (struct wia_prop_clsid *)propspec->possible_values;
-    PyObject *list;
-    PyObject *value;
+public:
+    PyinsaneClsidCodec(const struct wia_prop_clsid *values, int nbValues)
+        : mValues(values), mNbValues(nbValues), mByValue(nbValues), mByName(nbValues),
+        mNames(nbValues, (PyObject *)NULL), mPossibleValues(NULL)
+    {
+        struct registry_name name;
+        int i;
+
+        for (i = 0 ; i < nbValues ; i++) {
+            mByValue.Add(values[i].value, i);
+            name.str = values[i].name;
+            name.len = strlen(values[i].name);
+            mByName.Add(name, i);
+        }
+    }
+
+    const struct wia_prop_clsid *GetValues() const
+    {
+        return mValues;
+    }
+
+    bool InitPython()
+    {
+        int i;
+
+        mPossibleValues = PyTuple_New(mNbValues);
+        if (mPossibleValues == NULL)
+            return false;
+        for (i = 0 ; i < mNbValues ; i++) {
+            mNames[i] = PyUnicode_InternFromString(mValues[i].name);
+            if (mNames[i] == NULL)
+                return false;
+            Py_INCREF(mNames[i]);
+            PyTuple_SET_ITEM(mPossibleValues, i, mNames[i]);
+        }
+        return true;
+    }
+
+    // Borrowed reference
+    PyObject *GetPossibleValues() const
+    {
+        return mPossibleValues;
+    }
+
+    // New reference ; NULL if unknown
+    PyObject *Decode(const CLSID &value) const
+    {
+        int i = mByValue.Find(value);
+
+        if (i < 0)
+            return NULL;
+        Py_INCREF(mNames[i]);
+        return mNames[i];
+    }
+
+    // NULL if unknown
+    const CLSID *Encode(const char *str, size_t len) const
+    {
+        struct registry_name name;
+        int i;
+
+        name.str = str;
+        name.len = len;
+        i = mByName.Find(name);
+        return (i >= 0 ? &mValues[i].value : NULL);
+    }
+
+private:
+    const struct wia_prop_clsid *mValues;
+    int mNbValues;
+    PyinsaneRegistryIndex<RegistryClsidKey> mByValue;
+    PyinsaneRegistryIndex<RegistryNameKey> mByName;
+    std::vector<PyObject *> mNames; // interned
+    PyObject *mPossibleValues; // tuple of mNames
+};
+
+/*!
+ * Name / PROPID -> position in g_wia_all_properties, and the codec of each
+ * property. The codecs are shared by the properties using the same table.
+ *
+ * The Python objects (names, possible values) can only be created once the
+ * interpreter is there: see InitPython(). They are never freed: they are
+ * shared by all the results returned to Python.
+ */
+class PyinsanePropertyRegistry
+{
+public:
+    PyinsanePropertyRegistry(const struct wia_property *properties)
+        : mProperties(properties), mNbProperties(Count(properties)),
+        mByName(mNbProperties), mById(mNbProperties),
+        mIntCodecs(mNbProperties, (const PyinsaneIntCodec *)NULL),
+        mClsidCodecs(mNbProperties, (const PyinsaneClsidCodec *)NULL),
+        mInitialized(false), mNames(mNbProperties, (PyObject *)NULL),
+        mPossibleValues(mNbProperties, (PyObject *)NULL)
+    {
+        const struct wia_property *property;
+        struct registry_name name;
+        int i;
+
+        for (i = 0 ; i < mNbProperties ; i++) {
+            property = &properties[i];
+            name.str = property->name;
+            name.len = strlen(property->name);
+            mByName.Add(name, i);
+            mById.Add((long)property->id, i);
+
+            if (property->possible_values == NULL)
+                continue;
+            if (property->vartype == VT_CLSID)
+                mClsidCodecs[i] = MakeClsidCodec(
+                    (const struct wia_prop_clsid *)property->possible_values
+                );
+            else
+                mIntCodecs[i] = MakeIntCodec(
+                    (const struct wia_prop_int *)property->possible_values
+                );
+        }
+    }
+
+    ~PyinsanePropertyRegistry()
+    {
+        size_t i;
+
+        for (i = 0 ; i < mOwnedIntCodecs.size() ; i++) {
+            delete mOwnedIntCodecs[i];
+        }
+        for (i = 0 ; i < mOwnedClsidCodecs.size() ; i++) {
+            delete mOwnedClsidCodecs[i];
+        }
+    }
+
+    bool InitPython()
+    {
+        size_t i;
+        int idx;
+        const struct wia_property *property;
+
+        if (mInitialized)
+            return true;
+
+        for (i = 0 ; i < mOwnedIntCodecs.size() ; i++) {
+            if (!mOwnedIntCodecs[i]->InitPython())
+                return false;
+        }
+        for (i = 0 ; i < mOwnedClsidCodecs.size() ; i++) {
+            if (!mOwnedClsidCodecs[i]->InitPython())
+                return false;
+        }
+        mAccessRights[0] = PyUnicode_InternFromString("ro");
+        mAccessRights[1] = PyUnicode_InternFromString("rw");
+        if (mAccessRights[0] == NULL || mAccessRights[1] == NULL)
+            return false;
+        for (idx = 0 ; idx < mNbProperties ; idx++) {
+            property = &mProperties[idx];
+            mNames[idx] = PyUnicode_InternFromString(property->name);
+            mPossibleValues[idx] = property->get_possible_values(property);
+            if (mNames[idx] == NULL || mPossibleValues[idx] == NULL)
+                return false;
+        }
+        mInitialized = true;
+        return true;
+    }
+
+    int GetNbProperties() const
+    {
+        return mNbProperties;
+    }
+
+    // Borrowed references
+
+    PyObject *GetName(int idx) const
+    {
+        assert(mInitialized);
+        return mNames[idx];
+    }
+
+    PyObject *GetAccessRight(int idx) const
+    {
+        assert(mInitialized);
+        return mAccessRights[mProperties[idx].rw ? 1 : 0];
+    }
+
+    PyObject *GetPossibleValues(int idx) const
+    {
+        assert(mInitialized);
+        return mPossibleValues[idx];
+    }
+
+    int Find(const char *name, size_t len) const
+    {
+        struct registry_name key;
+
+        key.str = name;
+        key.len = len;
+        return mByName.Find(key);
+    }
+
+    int FindById(PROPID id) const
+    {
+        return mById.Find((long)id);
+    }
+
+    // NULL if the property has no table of possible values
+    const PyinsaneIntCodec *GetIntCodec(const struct wia_property *property) const
+    {
+        return mIntCodecs[GetPosition(property)];
+    }
+
+    const PyinsaneClsidCodec *GetClsidCodec(const struct wia_property *property) const
+    {
+        return mClsidCodecs[GetPosition(property)];
+    }
+
+private:
+    static int Count(const struct wia_property *properties)
+    {
+        int nb;
+
+        for (nb = 0 ; properties[nb].name != NULL ; nb++) { }
+        return nb;
+    }
+
+    int GetPosition(const struct wia_property *property) const
+    {
+        assert(property >= mProperties && property < mProperties + mNbProperties);
+        return (int)(property - mProperties);
+    }
+
+    PyinsaneIntCodec *MakeIntCodec(const struct wia_prop_int *values)
+    {
+        size_t i;
+        int nb;
+        bool flags = false;
+
+        for (i = 0 ; i < mOwnedIntCodecs.size() ; i++) {
+            if (mOwnedIntCodecs[i]->GetValues() == values)
+                return mOwnedIntCodecs[i];
+        }
+        for (i = 0 ; g_flag_tables[i] != NULL ; i++) {
+            if (g_flag_tables[i] == values)
+                flags = true;
+        }
+        for (nb = 0 ; values[nb].name != NULL ; nb++) { }
+        mOwnedIntCodecs.push_back(new PyinsaneIntCodec(values, nb, flags));
+        return mOwnedIntCodecs.back();
+    }
 
-    list = PyList_New(0);
+    PyinsaneClsidCodec *MakeClsidCodec(const struct wia_prop_clsid *values)
+    {
+        size_t i;
+        int nb;
 
-    while(values->name != NULL) {
-        value = PyUnicode_FromString(values->name);
-        PyList_Append(list, value);
-        values++;
+        for (i = 0 ; i < mOwnedClsidCodecs.size() ; i++) {
+            if (mOwnedClsidCodecs[i]->GetValues() == values)
+                return mOwnedClsidCodecs[i];
+        }
+        for (nb = 0 ; values[nb].name != NULL ; nb++) { }
+        mOwnedClsidCodecs.push_back(new PyinsaneClsidCodec(values, nb));
+        return mOwnedClsidCodecs.back();
     }
 
-    return list;
+    const struct wia_property *mProperties;
+    int mNbProperties;
+    PyinsaneRegistryIndex<RegistryNameKey> mByName;
+    PyinsaneRegistryIndex<RegistryIntKey> mById;
+    std::vector<const PyinsaneIntCodec *> mIntCodecs; // per property
+    std::vector<const PyinsaneClsidCodec *> mClsidCodecs; // per property
+    std::vector<PyinsaneIntCodec *> mOwnedIntCodecs;
+    std::vector<PyinsaneClsidCodec *> mOwnedClsidCodecs;
+    bool mInitialized;
+    std::vector<PyObject *> mNames; // interned
+    PyObject *mAccessRights[2]; // "ro", "rw"
+    std::vector<PyObject *> mPossibleValues;
+};
+
+static PyinsanePropertyRegistry g_registry(_g_wia_all_properties);
+
+int wia_properties_init(void)
+{
+    return g_registry.InitPython() ? 1 : 0;
+}
+
+int wia_get_nb_properties(void)
+{
+    return g_registry.GetNbProperties();
+}
+
+int wia_find_property(const char *name, size_t len)
+{
+    return g_registry.Find(name, len);
+}
+
+int wia_find_property_by_id(PROPID id)
+{
+    return g_registry.FindById(id);
+}
+
+PyObject *wia_get_property_name(int idx)
+{
+    return g_registry.GetName(idx);
+}
+
+// Only called by PyinsanePropertyRegistry::InitPython(): the results are
+// cached
+
+static PyObject *get_possible_values_int(const struct wia_property *propspec)
+{
+    const PyinsaneIntCodec *codec = g_registry.GetIntCodec(propspec);
+
+    if (codec == NULL)
+        Py_RETURN_NONE;
+    Py_INCREF(codec->GetPossibleValues());
+    return codec->GetPossibleValues();
+}
+
+static PyObject *get_possible_values_clsid(const struct wia_property *propspec)
+{
+    const PyinsaneClsidCodec *codec = g_registry.GetClsidCodec(propspec);
+
+    // prop_stream_compat_id: any CLSID
+    if (codec == NULL)
+        Py_RETURN_NONE;
+    Py_INCREF(codec->GetPossibleValues());
+    return codec->GetPossibleValues();
 }
 
 static PyObject *get_possible_values_none(const struct wia_property*)
@@ -816,56 +1270,29 @@ static PyObject *get_possible_values_none(const struct wia_property*)
 
 PyObject *int_to_pyobject(const struct wia_property *property, long value)
 {
-    const struct wia_prop_int *values;
-    int i;
-    PyObject *out;
+    const PyinsaneIntCodec *codec = g_registry.GetIntCodec(property);
 
-    if (property->possible_values == NULL)
+    if (codec == NULL)
         return PyLong_FromLong(value);
-    values = (const struct wia_prop_int *)property->possible_values;
-    for (i = 0 ; values[i].name != NULL ; i++) {
-        if (values[i].value == value)
-            return PyUnicode_FromString(values[i].name);
-    }
-
-    char str[256];
-    str[0] = '\0';
-    str[sizeof(str)-1] = '\0';
-
-    for (i = 0 ; values[i].name != NULL ; i++) {
-        if (value & values[i].value) {
-            if (str[0] == '\0')
-                strncpy_s(str, values[i].name, sizeof(str) - 1);
-            else {
-                strncat_s(str, ",", sizeof(str) - 1);
-                strncat_s(str, values[i].name, sizeof(str) - 1);
-            }
-        }
-    }
-    if (str[0] != '\0') {
-        out = PyUnicode_FromString(str);
-        return out;
-    }
-
-    return PyLong_FromLong(value);
+    return codec->Decode(value);
 }
 
 
 PyObject *clsid_to_pyobject(const struct wia_property *property, CLSID value)
 {
-    const struct wia_prop_clsid *values;
-    int i;
+    const PyinsaneClsidCodec *codec = g_registry.GetClsidCodec(property);
+    PyObject *name;
 
-    assert(property->possible_values != NULL);
-    values = (const struct wia_prop_clsid *)property->possible_values;
-    for (i = 0 ; NULL != values[i].name ; i++) {
-        if (values[i].value == value)
-            return PyUnicode_FromString(values[i].name);
+    if (codec != NULL) {
+        name = codec->Decode(value);
+        if (name != NULL)
+            return name;
     }
     WIA_WARNING("Pyinsane: WARNING: Got unknown clsid from driver");
     return NULL;
 }
 
+
 PyObject *int_vector_to_pyobject_list(const CAL *values)
 {
     PyObject *out = PyList_New(values->cElems);
@@ -882,15 +1309,11 @@ PyObject *int_vector_to_pyobject_list(const CAL *values)
 
 PyObject *int_vector_to_pyobject_tuple(const CAL *values)
 {
-    PyObject *out;
-    PyObject *val[2];
     if (values->cElems < 2) {
         WIA_WARNING("Got a range with not enough elements !");
         return NULL;
     }
-    val[0] = PyLong_FromLong(values->pElems[0]);
-    val[1] = PyLong_FromLong(values->pElems[1]);
-    return PyTuple_Pack(2, val[0], val[1]);
+    return Py_BuildValue("(ll)", (long)values->pElems[0], (long)values->pElems[1]);
 }
 
 PyObject *str_vector_to_pyobject(const CABSTR *values)
@@ -900,52 +1323,31 @@ PyObject *str_vector_to_pyobject(const CABSTR *values)
     ULONG i;
     
     for (i = 0 ; i < values->cElems ; i++) {
-        //val = PyLong_FromLong(values->pElems[i]);
-        val = PyUnicode_FromWideChar(SysAllocString(values->pElems[i]), SysStringLen(values->pElems[i]));
+        val = PyUnicode_FromWideChar(values->pElems[i], SysStringLen(values->pElems[i]));
         PyList_SetItem(out, i, val);
     }
 
     return out;
 }
 
+
 int pyobject_to_int(const struct wia_property *property_spec, PyObject *pyvalue, int fail_value)
 {
-    char str[256];
-    char *pstr, *nstr;
-    int has_match;
+    const PyinsaneIntCodec *codec;
+    const char *str;
+    Py_ssize_t len;
     int val;
-    int i;
-    const struct wia_prop_int *str2int;
 
     if (PyLong_Check(pyvalue))
         return PyLong_AsLong(pyvalue);
 
-    str2int = (const struct wia_prop_int *)property_spec->possible_values;
-    if (PyUnicode_Check(pyvalue) && str2int != NULL) {
-        // parse string
-        strncpy_s(str, PyUnicode_AsUTF8(pyvalue), sizeof(str));
-        val = 0;
-        has_match = 0;
-        pstr = str;
-        while(pstr) {
-            nstr = strchr(pstr, ',');
-            if (nstr) {
-                nstr[0] = '\0';
-                nstr++;
-            }
-            for (i = 0 ; str2int[i].name != NULL ; i++) {
-                if (strcmp(pstr, str2int[i].name) == 0) {
-                    val |= str2int[i].value;
-                    has_match = 1;
-                    break;
-                }
-            }
-            pstr = nstr;
-        }
-
-        if (has_match) {
+    codec = g_registry.GetIntCodec(property_spec);
+    if (PyUnicode_Check(pyvalue) && codec != NULL) {
+        str = PyUnicode_AsUTF8AndSize(pyvalue, &len);
+        if (str == NULL)
+            PyErr_Clear();
+        else if (codec->Encode(str, (size_t)len, &val))
             return val;
-        }
     }
 
     WIA_WARNING("Pyinsane: WARNING: set_property(): Failed to parse value");
@@ -954,27 +1356,242 @@ int pyobject_to_int(const struct wia_property *property_spec, PyObject *pyvalue,
 
 int pyobject_to_clsid(const struct wia_property *property_spec, PyObject *pyvalue, CLSID **out)
 {
-    const struct wia_prop_clsid *str2clsid;
-    int i;
+    const PyinsaneClsidCodec *codec;
+    const CLSID *clsid;
     const char *value;
+    Py_ssize_t len;
 
     if (!PyUnicode_Check(pyvalue)) {
         WIA_WARNING("Pyinsane: WARNING: set_property(): Invalid type for clsid property");
         return 0;
     }
 
-    str2clsid = (const struct wia_prop_clsid *)property_spec->possible_values;
-    assert(str2clsid != NULL);
-
-    value = PyUnicode_AsUTF8(pyvalue);
-
-    for (i = 0 ; str2clsid[i].name != NULL ; i++) {
-        if (strcmp(value, str2clsid[i].name) == 0) {
-            *out = (CLSID *)&str2clsid[i].value;
+    codec = g_registry.GetClsidCodec(property_spec);
+    value = PyUnicode_AsUTF8AndSize(pyvalue, &len);
+    if (value == NULL) {
+        PyErr_Clear();
+    } else if (codec != NULL) {
+        clsid = codec->Encode(value, (size_t)len);
+        if (clsid != NULL) {
+            *out = (CLSID *)clsid;
             return 1;
         }
     }
 
     WIA_WARNING("Pyinsane: WARNING: set_property(): Invalid value for clsid property");
     return 0;
-}
\ No newline at end of file
+}
+
+PyObject *property_to_pyobject(int idx, const PROPVARIANT *value)
+{
+    const struct wia_property *spec = &g_wia_all_properties[idx];
+    PyObject *propvalue;
+    PyObject *prop;
+
+    if (value->vt == 0)
+        return NULL;
+    if (value->vt != spec->vartype) {
+        WIA_WARNING("Pyinsane: WARNING: A property has a type different from the one expected");
+        return NULL;
+    }
+    switch(value->vt) {
+        case VT_I4:
+            propvalue = int_to_pyobject(spec, value->lVal);
+            break;
+        case VT_UI4:
+            propvalue = int_to_pyobject(spec, value->ulVal);
+            break;
+        case VT_VECTOR | VT_UI2:
+            // TODO
+            return NULL;
+        case VT_UI1 | VT_VECTOR:
+            // TODO
+            return NULL;
+        case VT_BSTR:
+            propvalue = PyUnicode_FromWideChar(value->bstrVal, SysStringLen(value->bstrVal));
+            break;
+        case VT_CLSID:
+            propvalue = clsid_to_pyobject(spec, *value->puuid);
+            break;
+        default:
+            WIA_WARNING("Pyinsane: WARNING: Unknown var type");
+            assert(0);
+            return NULL;
+    }
+    if (propvalue == NULL)
+        return NULL;
+
+    prop = PyTuple_Pack(4, g_registry.GetName(idx), propvalue, g_registry.GetAccessRight(idx),
+            g_registry.GetPossibleValues(idx));
+    Py_DECREF(propvalue);
+    return prop;
+}
+
+
+PyObject *constraint_to_pyobject(int idx, ULONG attributes, const PROPVARIANT *value)
+{
+    const struct wia_property *spec = &g_wia_all_properties[idx];
+    PyObject *constraint = NULL;
+
+    switch(value->vt) {
+        case 0:
+            return NULL;
+        case VT_I4:
+            constraint = int_to_pyobject(spec, value->lVal);
+            break;
+        case VT_UI4:
+            constraint = int_to_pyobject(spec, value->ulVal);
+            break;
+        case VT_VECTOR | VT_UI4: /* FALLTHROUGH */
+        case VT_VECTOR | VT_I4:
+            if (attributes & WIA_PROP_RANGE)
+                constraint = int_vector_to_pyobject_tuple(&value->cal);
+            else
+                constraint = int_vector_to_pyobject_list(&value->cal);
+            break;
+        case VT_VECTOR | VT_UI2:
+            WIA_WARNING("Pyinsane: WARNING: Got VECTOR|UI2 as constraint. Not supported yet");
+            // TODO
+            return NULL;
+        case VT_UI1 | VT_VECTOR:
+            WIA_WARNING("Pyinsane: WARNING: Got VECTOR|UI1 as constraint. Not supported yet");
+            // TODO
+            return NULL;
+        case VT_BSTR:
+            constraint = PyUnicode_FromWideChar(value->bstrVal, SysStringLen(value->bstrVal));
+            break;
+        case VT_BSTR | VT_VECTOR:
+            constraint = str_vector_to_pyobject(&value->cabstr);
+            break;
+        case VT_CLSID:
+            constraint = clsid_to_pyobject(spec, *value->puuid);
+            break;
+        default:
+            WIA_WARNING("Pyinsane: WARNING: Unknown var type for constraint");
+            return NULL;
+    }
+    if (constraint == NULL) {
+        fprintf(stderr, "Pyinsane: Failed to parse constraint of [%s]\n", spec->name);
+        return NULL;
+    }
+    if (PyList_Check(constraint) && PyList_Sort(constraint) < 0) {
+        // values that can't be compared: keep the order of the driver
+        PyErr_Clear();
+    }
+    return constraint;
+}
+
+
+PyObject *properties_to_pylist(PyinsanePropertySnapshot *snapshot, const PROPVARIANT *values,
+        std::vector<int> *changes, PyObject *removed)
+{
+    PyObject *all_props;
+    PyObject *prop;
+    int nb_properties = wia_get_nb_properties();
+    int i;
+    bool changed;
+
+    all_props = PyList_New(0);
+    if (all_props == NULL)
+        return NULL;
+    for (i = 0 ; i < nb_properties ; i++) {
+        prop = property_to_pyobject(i, &values[i]);
+        Py_XINCREF(prop); // kept by the snapshot
+        changed = snapshot->UpdateValue(i, prop);
+        if (changes != NULL) {
+            if (!changed && !snapshot->IsWritten(i)) {
+                Py_XDECREF(prop);
+                continue;
+            }
+            changes->push_back(i);
+            if (prop == NULL && changed)
+                PyList_Append(removed, g_registry.GetName(i));
+        }
+        if (prop == NULL)
+            continue;
+        PyList_Append(all_props, prop);
+        Py_DECREF(prop);
+    }
+    return all_props;
+}
+
+
+PyObject *constraints_to_pylist(PyinsanePropertySnapshot *snapshot,
+        const std::vector<int> *indexes, const ULONG *attributes, const PROPVARIANT *constraints)
+{
+    PyObject *all_constraints;
+    PyObject *constraint;
+    PyObject *prop;
+    int nb_properties;
+    int i;
+    int idx;
+    bool changed;
+
+    nb_properties = (indexes != NULL ? (int)indexes->size() : wia_get_nb_properties());
+    all_constraints = PyList_New(0);
+    if (all_constraints == NULL)
+        return NULL;
+    for (i = 0 ; i < nb_properties ; i++) {
+        idx = (indexes != NULL ? (*indexes)[i] : i);
+        constraint = constraint_to_pyobject(idx, attributes[i], &constraints[i]);
+        Py_XINCREF(constraint); // kept by the snapshot
+        changed = snapshot->UpdateConstraint(idx, constraint);
+        if (constraint == NULL)
+            continue;
+        if (indexes != NULL && !changed) {
+            Py_DECREF(constraint);
+            continue;
+        }
+        prop = PyTuple_Pack(2, g_registry.GetName(idx), constraint);
+        Py_DECREF(constraint);
+        PyList_Append(all_constraints, prop);
+        Py_DECREF(prop);
+    }
+    return all_constraints;
+}
+
+
+PyObject *options_to_pydict(PyinsanePropertySnapshot *snapshot, const PROPVARIANT *values,
+        const ULONG *attributes, const PROPVARIANT *constraints)
+{
+    PyObject *all_options;
+    PyObject *prop;
+    PyObject *constraint;
+    PyObject *option;
+    int nb_properties = wia_get_nb_properties();
+    int i;
+
+    all_options = PyDict_New();
+    if (all_options == NULL)
+        return NULL;
+    for (i = 0 ; i < nb_properties ; i++) {
+        prop = property_to_pyobject(i, &values[i]);
+        Py_XINCREF(prop); // kept by the snapshot
+        snapshot->UpdateValue(i, prop);
+        constraint = NULL;
+        if (constraints != NULL) {
+            constraint = constraint_to_pyobject(i, attributes[i], &constraints[i]);
+            Py_XINCREF(constraint); // kept by the snapshot
+            snapshot->UpdateConstraint(i, constraint);
+        }
+        if (prop == NULL) {
+            Py_XDECREF(constraint);
+            continue;
+        }
+
+        option = Py_BuildValue(
+            "{s:O,s:O,s:O}",
+            "value", PyTuple_GET_ITEM(prop, 1),
+            "accessright", PyTuple_GET_ITEM(prop, 2),
+            "possible_values", PyTuple_GET_ITEM(prop, 3)
+        );
+        if (option != NULL && constraint != NULL)
+            PyDict_SetItemString(option, "constraint", constraint);
+        if (option != NULL)
+            PyDict_SetItem(all_options, PyTuple_GET_ITEM(prop, 0), option);
+        Py_XDECREF(option);
+        Py_XDECREF(constraint);
+        Py_DECREF(prop);
+    }
+    return all_options;
+}
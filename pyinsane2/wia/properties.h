@@ -1,10 +1,14 @@
 #ifndef __PYINSANE_WIA_PROPERTIES_H
 #define __PYINSANE_WIA_PROPERTIES_H
 
+#include <vector>
+
 #include <Python.h>
 
 #include <windows.h>
 
+#include "snapshot.h"
+
 struct wia_prop_int {
     int value;
     const char *name;
@@ -26,6 +30,20 @@ struct wia_property {
 
 extern const struct wia_property *g_wia_all_properties;
 
+// Number of entries in g_wia_all_properties
+int wia_get_nb_properties(void);
+// Position in g_wia_all_properties ; -1 if unknown. If several properties
+// have the same name or the same ID, the first one is returned.
+int wia_find_property(const char *name, size_t len);
+int wia_find_property_by_id(PROPID id);
+
+// Creates the Python objects shared by all the results: interned names,
+// possible values. Must be called by the module init, with the GIL. Returns 0
+// on error, with an exception set.
+int wia_properties_init(void);
+// Borrowed reference (interned)
+PyObject *wia_get_property_name(int idx);
+
 PyObject *int_to_pyobject(const struct wia_property *property, long value);
 PyObject *clsid_to_pyobject(const struct wia_property *property, CLSID value);
 PyObject *int_vector_to_pyobject_list(const CAL *values);
@@ -34,4 +52,33 @@ PyObject *str_vector_to_pyobject(const CABSTR *values);
 int pyobject_to_int(const struct wia_property *property_spec, PyObject *pyvalue, int fail_value);
 int pyobject_to_clsid(const struct wia_property *property_spec, PyObject *pyvalue, CLSID **out);
 
+// Returns a new tuple (name, value, access right, possible values), or NULL
+// if the property is not available. The name, the access right and the
+// possible values (a tuple, or None) are shared by all the results.
+PyObject *property_to_pyobject(int idx, const PROPVARIANT *value);
+// Returns a new reference, or NULL if the property has no constraint
+PyObject *constraint_to_pyobject(int idx, ULONG attributes, const PROPVARIANT *value);
+
+/*
+ * Results of the reads of the properties of an item (all of them, in the
+ * order of g_wia_all_properties), updating its snapshot. Return a new
+ * reference, or NULL on error.
+ */
+
+// List of the properties. If 'changes' is not NULL, only the properties that
+// changed or were written since the previous read are returned: 'changes'
+// receives their indexes and 'removed' the names of those that are not
+// available anymore.
+PyObject *properties_to_pylist(PyinsanePropertySnapshot *snapshot, const PROPVARIANT *values,
+        std::vector<int> *changes, PyObject *removed);
+// List of (name, constraint). If 'indexes' is not NULL, the constraints are
+// those of the properties at these indexes, and only the constraints that
+// changed are returned.
+PyObject *constraints_to_pylist(PyinsanePropertySnapshot *snapshot,
+        const std::vector<int> *indexes, const ULONG *attributes, const PROPVARIANT *constraints);
+// {name: {'value', 'accessright', 'possible_values'[, 'constraint']}}.
+// 'constraints' may be NULL if they couldn't be read.
+PyObject *options_to_pydict(PyinsanePropertySnapshot *snapshot, const PROPVARIANT *values,
+        const ULONG *attributes, const PROPVARIANT *constraints);
+
 #endif
\ No newline at end of file
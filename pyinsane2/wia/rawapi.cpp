@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <vector>
 
 #include <atlbase.h>
 #include <comdef.h>
@@ -13,7 +14,13 @@
 
 #include <Python.h>
 
+#include "devices.h"
+#ifdef WIA_MOCK
+#include "mock.h"
+#endif
 #include "properties.h"
+#include "ring.h"
+#include "snapshot.h"
 #include "transfer.h"
 #include "util.h"
 
@@ -21,9 +28,11 @@
 #define WIA_PYCAPSULE_SRC_NAME "WIA source"
 #define WIA_PYCAPSULE_SCAN_NAME "WIA scan"
 
+// Each capsule has its own snapshot: get_property_changes() returns what
+// changed since the previous read through the same handle
 struct wia_device {
-    IWiaDevMgr2 *dev_manager;
-    IWiaItem2 *device;
+    struct device_pool_entry *entry;
+    PyinsanePropertySnapshot *snapshot;
 };
 
 enum wia_src_type {
@@ -34,10 +43,40 @@ enum wia_src_type {
 
 struct wia_source {
     wia_src_type type;
-    struct wia_device *dev;
-    IWiaItem2 *source;
+    struct device_pool_entry *entry; // of the device
+    IWiaItem2 *source; // owned by the entry
+    PyinsanePropertySnapshot *snapshot;
+};
+
+// One per COM thread, from init() to exit(): all the devices opened on a
+// thread share the same device manager, and a device opened twice on the same
+// thread is only opened once (see PyinsaneDevicePool).
+struct com_thread {
+    CComPtr<IWiaDevMgr2> dev_manager; // created on first use
+    PyinsaneDevicePool devices;
 };
 
+static thread_local struct com_thread *g_com_thread = NULL;
+
+
+static IWiaDevMgr2 *get_dev_manager()
+{
+    HRESULT hr;
+
+    if (g_com_thread == NULL) {
+        WIA_WARNING("Pyinsane: WARNING: init() not called on this thread");
+        return NULL;
+    }
+    if (g_com_thread->dev_manager == NULL) {
+        hr = g_com_thread->dev_manager.CoCreateInstance(CLSID_WiaDevMgr2);
+        if (FAILED(hr)) {
+            WIA_WARNING("Pyinsane: WARNING: CoCreateInstance failed");
+            return NULL;
+        }
+    }
+    return g_com_thread->dev_manager;
+}
+
 
 static PyObject *init(PyObject *, PyObject* args)
 {
@@ -53,6 +92,9 @@ static PyObject *init(PyObject *, PyObject* args)
         Py_RETURN_NONE;
     }
 
+    if (g_com_thread == NULL)
+        g_com_thread = new com_thread();
+
     Py_RETURN_NONE;
 }
 
@@ -93,6 +135,8 @@ static HRESULT get_device_basic_infos(IWiaPropertyStorage *properties,
     devname = PyUnicode_FromWideChar(output[1].bstrVal, -1);
 
     *out_tuple = PyTuple_Pack(2, devid, devname);
+    Py_DECREF(devid);
+    Py_DECREF(devname);
 
     FreePropVariantArray(2, output);
 
@@ -103,9 +147,9 @@ static HRESULT get_device_basic_infos(IWiaPropertyStorage *properties,
 static PyObject *get_devices(PyObject *, PyObject* args)
 {
     HRESULT hr;
-    CComPtr<IWiaDevMgr2> wia_dev_manager;
+    IWiaDevMgr2 *wia_dev_manager;
     CComPtr<IEnumWIA_DEV_INFO> wia_dev_info_enum;
-    unsigned long nb_devices;
+    ULONG nb_devices;
     PyObject *dev_infos;
     PyObject *all_devs;
 
@@ -113,10 +157,7 @@ static PyObject *get_devices(PyObject *, PyObject* args)
         return NULL;
     }
 
-    // Create a connection to the local WIA device manager
-    hr = wia_dev_manager.CoCreateInstance(CLSID_WiaDevMgr2);
-    if (FAILED(hr)) {
-        WIA_WARNING("Pyinsane: WARNING: CoCreateInstance failed");
+    if ((wia_dev_manager = get_dev_manager()) == NULL) {
         Py_RETURN_NONE;
     }
 
@@ -143,6 +184,7 @@ static PyObject *get_devices(PyObject *, PyObject* args)
             break;
 
         hr = get_device_basic_infos(properties, &dev_infos);
+        properties->Release();
         if (FAILED(hr)) {
             break;
         }
@@ -151,12 +193,10 @@ static PyObject *get_devices(PyObject *, PyObject* args)
             continue;
         }
 
-        properties->Release();
-
         PyList_Append(all_devs, dev_infos);
+        Py_DECREF(dev_infos);
     }
 
-    // wia_dev_info_enum->Release(); // TODO(Jflesch) ?
     return all_devs;
 }
 
@@ -165,16 +205,43 @@ static void free_device(PyObject *device)
     struct wia_device *wia_dev;
 
     wia_dev = (struct wia_device *)PyCapsule_GetPointer(device, WIA_PYCAPSULE_DEV_NAME);
-    // TODO
+    if (wia_dev == NULL)
+        return;
+    // may be dropped from any thread: the pool takes care of it
+    PyinsaneDevicePool::Release(wia_dev->entry);
+    delete wia_dev->snapshot;
     free(wia_dev);
 }
 
+static HRESULT create_device(const std::wstring &devid, IUnknown **device, void *cb_data)
+{
+    IWiaDevMgr2 *wia_dev_manager = (IWiaDevMgr2 *)cb_data;
+    IWiaItem2 *item = NULL;
+    BSTR bstr_devid;
+    HRESULT hr;
+
+    bstr_devid = SysAllocString(devid.c_str());
+    // may take seconds (sleeping network scanners): get_devices() probes the
+    // devices in parallel
+    Py_BEGIN_ALLOW_THREADS;
+    hr = wia_dev_manager->CreateDevice(0, bstr_devid, &item);
+    Py_END_ALLOW_THREADS;
+    SysFreeString(bstr_devid);
+    if (FAILED(hr)) {
+        WIA_WARNING("Pyinsane: WARNING: WiaDevMgr->CreateDevice() failed");
+        return hr;
+    }
+    *device = item;
+    return S_OK;
+}
+
 static PyObject *open_device(PyObject *, PyObject *args)
 {
     char *devid;
-    CComPtr<IWiaDevMgr2> wia_dev_manager;
+    IWiaDevMgr2 *wia_dev_manager;
+    struct device_pool_entry *entry;
     struct wia_device *dev;
-    BSTR bstr_devid;
+    PyObject *capsule;
     HRESULT hr;
     USES_CONVERSION;
 
@@ -182,83 +249,71 @@ static PyObject *open_device(PyObject *, PyObject *args)
         return NULL;
     }
 
-    hr = wia_dev_manager.CoCreateInstance(CLSID_WiaDevMgr2);
+    if ((wia_dev_manager = get_dev_manager()) == NULL) {
+        Py_RETURN_NONE;
+    }
+
+    // reuses the device if it is already opened on this thread
+    hr = g_com_thread->devices.Open(A2W(devid), create_device, wia_dev_manager, &entry);
     if (FAILED(hr)) {
-        WIA_WARNING("Pyinsane: WARNING: CoCreateInstance failed");
         Py_RETURN_NONE;
     }
 
     dev = (struct wia_device *)calloc(1, sizeof(struct wia_device));
-    dev->dev_manager = wia_dev_manager;
+    dev->entry = entry;
 
-    bstr_devid = SysAllocString(A2W(devid)); // TODO(Jflesch): Does any of this allocate anything ? oO
-    hr = wia_dev_manager->CreateDevice(0, bstr_devid, &dev->device);
-    if (FAILED(hr)) {
-        WIA_WARNING("Pyinsane: WARNING: WiaDevMgr->CreateDevice() failed");
+    capsule = PyCapsule_New(dev, WIA_PYCAPSULE_DEV_NAME, free_device);
+    if (capsule == NULL) {
+        PyinsaneDevicePool::Release(entry);
         free(dev);
-        Py_RETURN_NONE;
     }
-
-    return PyCapsule_New(dev, WIA_PYCAPSULE_DEV_NAME, free_device);
+    return capsule;
 }
 
 static void free_source(PyObject *source)
 {
     struct wia_source *wia_src;
 
-    wia_src = (struct wia_source *)PyCapsule_GetPointer(source, WIA_PYCAPSULE_DEV_NAME);
-    // TODO
+    wia_src = (struct wia_source *)PyCapsule_GetPointer(source, WIA_PYCAPSULE_SRC_NAME);
+    if (wia_src == NULL)
+        return;
+    // the item itself belongs to the device entry
+    PyinsaneDevicePool::Release(wia_src->entry);
+    delete wia_src->snapshot;
     free(wia_src);
 }
 
-static PyObject *get_sources(PyObject *, PyObject *args)
+/*!
+ * Lists the scan sources of the device, the first time only: they are kept
+ * (and released) with the device.
+ */
+static HRESULT list_sources(struct device_pool_entry *entry)
 {
-    struct wia_device *dev;
-    IEnumWiaItem2 *enum_item;
+    IWiaItem2 *device = static_cast<IWiaItem2 *>(entry->device);
+    CComPtr<IEnumWiaItem2> enum_item;
     IWiaItem2 *child;
-    PyObject *source_name;
-    PyObject *capsule;
-    PyObject *tuple;
-    PyObject *all_sources;
-    struct wia_source *source;
+    struct device_pool_source source;
     PROPSPEC input[2] = {0};
     PROPVARIANT output[2] = {0};
     HRESULT hr;
 
+    if (entry->has_sources)
+        return S_OK;
+
     input[0].ulKind = PRSPEC_PROPID;
     input[0].propid = WIA_IPA_FULL_ITEM_NAME;
     input[1].ulKind = PRSPEC_PROPID;
     input[1].propid = WIA_IPA_ITEM_CATEGORY;
 
-    if (!PyArg_ParseTuple(args, "O", &capsule)) {
-        WIA_WARNING("Pyinsane: get_sources(): Invalid args");
-        return NULL;
-    }
-    if (!PyCapsule_CheckExact(capsule)) {
-        WIA_WARNING("Pyinsane: WARNING: get_sources(): invalid argument type (not a pycapsule)");
-        Py_RETURN_NONE;
-    }
-
-    if ((dev = (struct wia_device *)PyCapsule_GetPointer(capsule, WIA_PYCAPSULE_DEV_NAME)) == NULL) {
-        WIA_WARNING("Pyinsane: WARNING: get_sources(): invalid argument type");
-        Py_RETURN_NONE;
+    hr = device->EnumChildItems(NULL, &enum_item);
+    if (FAILED(hr)) {
+        WIA_WARNING("Pyinsane: WARNING: device->EnumChildItems() failed");
+        return hr;
     }
 
-    all_sources = PyList_New(0);
-
-    hr = dev->device->EnumChildItems(NULL, &enum_item);
-    while(hr == S_OK) {
-        hr = enum_item->Next(1, &child, NULL);
-        if (hr != S_OK) {
-            continue;
-        }
-
+    while (enum_item->Next(1, &child, NULL) == S_OK) {
         CComQIPtr<IWiaPropertyStorage> child_properties(child);
 
-        source = (struct wia_source *)calloc(2, sizeof(struct wia_source));
-        source->dev = dev;
-        source->source = child;
-
         hr = child_properties->ReadMultiple(2 /* nb_properties */, input, output);
         if (FAILED(hr)) {
             WIA_WARNING("Pyinsane: WiaPropertyStorage->ReadMultiple() failed");
@@ -272,21 +327,91 @@ static PyObject *get_sources(PyObject *, PyObject *args)
         if (*output[1].puuid == WIA_CATEGORY_FINISHED_FILE
                     || *output[1].puuid == WIA_CATEGORY_FOLDER
                     || *output[1].puuid == WIA_CATEGORY_ROOT) {
-                free(source);
+                FreePropVariantArray(2, output);
+                child->Release();
                 continue;
         } else if (*output[1].puuid == WIA_CATEGORY_AUTO) {
-                source->type = WIA_SRC_AUTO;
+                source.type = WIA_SRC_AUTO;
         } else if (*output[1].puuid == WIA_CATEGORY_FEEDER
                     || *output[1].puuid == WIA_CATEGORY_FEEDER_BACK
                     || *output[1].puuid == WIA_CATEGORY_FEEDER_FRONT) {
-                source->type = WIA_SRC_FEEDER;
+                source.type = WIA_SRC_FEEDER;
         } else {
-            source->type = WIA_SRC_FLATBED;
+            source.type = WIA_SRC_FLATBED;
         }
 
-        source_name = PyUnicode_FromWideChar(output[0].bstrVal, -1);
+        source.name = output[0].bstrVal;
+        source.item = child;
+        FreePropVariantArray(2, output);
+        entry->sources.push_back(source);
+    }
+
+    entry->has_sources = true;
+    return S_OK;
+}
+
+static PyObject *get_sources(PyObject *, PyObject *args)
+{
+    struct wia_device *dev;
+    struct device_pool_entry *entry;
+    PyObject *source_name;
+    PyObject *capsule;
+    PyObject *tuple;
+    PyObject *all_sources;
+    struct wia_source *source;
+    size_t i;
+
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        WIA_WARNING("Pyinsane: get_sources(): Invalid args");
+        return NULL;
+    }
+    if (!PyCapsule_CheckExact(capsule)) {
+        WIA_WARNING("Pyinsane: WARNING: get_sources(): invalid argument type (not a pycapsule)");
+        Py_RETURN_NONE;
+    }
+
+    if ((dev = (struct wia_device *)PyCapsule_GetPointer(capsule, WIA_PYCAPSULE_DEV_NAME)) == NULL) {
+        WIA_WARNING("Pyinsane: WARNING: get_sources(): invalid argument type");
+        Py_RETURN_NONE;
+    }
+    entry = dev->entry;
+    if (entry->device == NULL) {
+        WIA_WARNING("Pyinsane: WARNING: get_sources(): device already closed");
+        Py_RETURN_NONE;
+    }
+
+    if (FAILED(list_sources(entry))) {
+        Py_RETURN_NONE;
+    }
+
+    all_sources = PyList_New(0);
+    if (all_sources == NULL)
+        return NULL;
+
+    for (i = 0 ; i < entry->sources.size() ; i++) {
+        source = (struct wia_source *)calloc(1, sizeof(struct wia_source));
+        source->type = (wia_src_type)entry->sources[i].type;
+        source->entry = entry;
+        source->source = static_cast<IWiaItem2 *>(entry->sources[i].item);
+        PyinsaneDevicePool::AddRef(entry);
+
         capsule = PyCapsule_New(source, WIA_PYCAPSULE_SRC_NAME, free_source);
+        if (capsule == NULL) {
+            PyinsaneDevicePool::Release(entry);
+            free(source);
+            Py_DECREF(all_sources);
+            return NULL;
+        }
+        source_name = PyUnicode_FromWideChar(entry->sources[i].name.c_str(),
+                entry->sources[i].name.size());
+        if (source_name == NULL) {
+            Py_DECREF(capsule);
+            Py_DECREF(all_sources);
+            return NULL;
+        }
         tuple = PyTuple_Pack(2, source_name, capsule);
+        Py_DECREF(source_name);
+        Py_DECREF(capsule);
 
         PyList_Append(all_sources, tuple);
         Py_DECREF(tuple);
@@ -296,10 +421,12 @@ static PyObject *get_sources(PyObject *, PyObject *args)
 }
 
 
-static IWiaItem2 *capsule2item(PyObject *capsule)
+static IWiaItem2 *capsule2item(PyObject *capsule, PyinsanePropertySnapshot **snapshot = NULL)
 {
     struct wia_device *wia_dev;
     struct wia_source *wia_src;
+    IWiaItem2 *item = NULL;
+    PyinsanePropertySnapshot **item_snapshot = NULL;
 
     if (!PyCapsule_CheckExact(capsule)) {
         WIA_WARNING("Pyinsane: WARNING: invalid argument type (not a pycapsule)");
@@ -308,51 +435,52 @@ static IWiaItem2 *capsule2item(PyObject *capsule)
 
     if (strcmp(PyCapsule_GetName(capsule), WIA_PYCAPSULE_DEV_NAME) == 0) {
         wia_dev = (struct wia_device *)PyCapsule_GetPointer(capsule, WIA_PYCAPSULE_DEV_NAME);
-        if (wia_dev != NULL)
-            return wia_dev->device;
+        if (wia_dev != NULL && wia_dev->entry->device != NULL) {
+            item = static_cast<IWiaItem2 *>(wia_dev->entry->device);
+            item_snapshot = &wia_dev->snapshot;
+        }
+    } else if (strcmp(PyCapsule_GetName(capsule), WIA_PYCAPSULE_SRC_NAME) == 0) {
+        wia_src = (struct wia_source *)PyCapsule_GetPointer(capsule, WIA_PYCAPSULE_SRC_NAME);
+        if (wia_src != NULL && wia_src->entry->device != NULL) {
+            item = wia_src->source;
+            item_snapshot = &wia_src->snapshot;
+        }
     }
 
-    if (strcmp(PyCapsule_GetName(capsule), WIA_PYCAPSULE_SRC_NAME) == 0) {
-        wia_src = (struct wia_source *)PyCapsule_GetPointer(capsule, WIA_PYCAPSULE_SRC_NAME);
-        if (wia_src != NULL)
-            return wia_src->source;
+    if (item == NULL) {
+        WIA_WARNING("Pyinsane: WARNING: Invalid argument type (not a known pycapsule type, or closed)");
+        return NULL;
     }
 
-    WIA_WARNING("Pyinsane: WARNING: Invalid argument type (not a known pycapsule type)");
-    return NULL;
+    if (snapshot != NULL) {
+        // created on the first read of the item
+        if (*item_snapshot == NULL)
+            *item_snapshot = new PyinsanePropertySnapshot(wia_get_nb_properties());
+        *snapshot = *item_snapshot;
+    }
+    return item;
 }
 
 
-static PyObject *get_properties(PyObject *, PyObject *args)
+/*!
+ * Reads all the properties of the item with a single ReadMultiple() and
+ * updates its snapshot. Returns the list of the properties, or NULL on error.
+ *
+ * If 'changes' is not NULL, only the properties that changed or were written
+ * since the previous read are returned: 'changes' receives their indexes and
+ * 'removed' the names of those that are not available anymore.
+ */
+static PyObject *read_properties(IWiaItem2 *item, PyinsanePropertySnapshot *snapshot,
+        std::vector<int> *changes, PyObject *removed)
 {
-    PyObject *capsule;
-    IWiaItem2 *item;
     PROPSPEC *input;
     PROPVARIANT *output;
     int i;
     int nb_properties;
     HRESULT hr;
     PyObject *all_props;
-    PyObject *propname;
-    PyObject *propvalue;
-    PyObject *prop;
-    PyObject *ro;
-    PyObject *rw;
-    PyObject *access_right;
-    PyObject *possible_values;
-
 
-    if (!PyArg_ParseTuple(args, "O", &capsule)) {
-        WIA_WARNING("Pyinsane: WARNING: get_sources(): Invalid args");
-        return NULL;
-    }
-
-    item = capsule2item(capsule);
-    if (item == NULL)
-        Py_RETURN_NONE;
-
-    for (nb_properties = 0 ; g_wia_all_properties[nb_properties].name != NULL ; nb_properties++)
-    { }
+    nb_properties = wia_get_nb_properties();
 
     input = (PROPSPEC *)calloc(nb_properties, sizeof(PROPSPEC));
     output = (PROPVARIANT *)calloc(nb_properties, sizeof(PROPVARIANT));
@@ -364,97 +492,96 @@ static PyObject *get_properties(PyObject *, PyObject *args)
 
     CComQIPtr<IWiaPropertyStorage> properties(item);
     hr = properties->ReadMultiple(nb_properties, input, output);
+    free(input);
     if (FAILED(hr)) {
         WIA_WARNING("Pyinsane: WARNING: WiaPropertyStorage->ReadMultiple() failed");
-        free(input);
         free(output);
-        Py_RETURN_NONE;
+        return NULL;
     }
-    free(input);
 
-    ro = PyUnicode_FromString("ro");
-    rw = PyUnicode_FromString("rw");
-
-    all_props = PyList_New(0);
-    for (i = 0 ; i < nb_properties ; i++) {
-        if (output[i].vt == 0)
-            continue;
-        if (output[i].vt != g_wia_all_properties[i].vartype) {
-            WIA_WARNING("Pyinsane: WARNING: A property has a type different from the one expected");
-            continue;
-        }
-        switch(output[i].vt) {
-            case VT_I4:
-                propvalue = int_to_pyobject(&g_wia_all_properties[i], output[i].lVal);
-                break;
-            case VT_UI4:
-                propvalue = int_to_pyobject(&g_wia_all_properties[i], output[i].ulVal);
-                break;
-            case VT_VECTOR | VT_UI2:
-                // TODO
-                continue;
-            case VT_UI1 | VT_VECTOR:
-                // TODO
-                continue;
-            case VT_BSTR:
-                propvalue = PyUnicode_FromWideChar(output[i].bstrVal, -1);
-                break;
-            case VT_CLSID:
-                propvalue = clsid_to_pyobject(&g_wia_all_properties[i], *output[i].puuid);
-                break;
-            default:
-                WIA_WARNING("Pyinsane: WARNING: Unknown var type");
-                assert(0);
-                continue;
-        }
-        if (propvalue == NULL)
-            continue;
-        propname = PyUnicode_FromString(g_wia_all_properties[i].name);
-
-        access_right = (g_wia_all_properties[i].rw ? rw : ro);
-        Py_INCREF(access_right); // PyTuple_Pack steals the ref
-
-        possible_values = g_wia_all_properties[i].get_possible_values(&g_wia_all_properties[i]);
-
-        prop = PyTuple_Pack(4, propname, propvalue, access_right, possible_values);
-        PyList_Append(all_props, prop);
-        Py_DECREF(prop);
-    }
+    all_props = properties_to_pylist(snapshot, output, changes, removed);
 
+    FreePropVariantArray(nb_properties, output);
     free(output);
     return all_props;
 }
 
-static PyObject *get_constraints(PyObject *, PyObject *args)
+
+/*!
+ * Reads the constraints of the properties at the given indexes (all of them
+ * if 'indexes' is NULL) and updates the snapshot. Returns the list of
+ * (name, constraint), or NULL on error. If 'indexes' is not NULL, only the
+ * constraints that changed are returned.
+ */
+static PyObject *read_constraints(IWiaItem2 *item, PyinsanePropertySnapshot *snapshot,
+        const std::vector<int> *indexes)
 {
-    PyObject *capsule;
-    IWiaItem2 *item;
     PROPSPEC *input;
     ULONG *prop_attributes;
     PROPVARIANT *output;
     int i;
+    int idx;
     int nb_properties;
     HRESULT hr;
     PyObject *all_constraints;
-    PyObject *constraint;
-    PyObject *propname;
-    PyObject *prop;
 
-    if (!PyArg_ParseTuple(args, "O", &capsule)) {
-        WIA_WARNING("Pyinsane: WARNING: get_sources(): Invalid args");
+    nb_properties = (indexes != NULL ? (int)indexes->size() : wia_get_nb_properties());
+    if (nb_properties == 0)
+        return PyList_New(0);
+
+    input = (PROPSPEC *)calloc(nb_properties, sizeof(PROPSPEC));
+    prop_attributes = (ULONG *)calloc(nb_properties, sizeof(ULONG));
+    output = (PROPVARIANT *)calloc(nb_properties, sizeof(PROPVARIANT));
+
+    for (i = 0 ; i < nb_properties ; i++) {
+        idx = (indexes != NULL ? (*indexes)[i] : i);
+        input[i].ulKind = PRSPEC_PROPID;
+        input[i].propid = g_wia_all_properties[idx].id;
+    }
+
+    CComQIPtr<IWiaPropertyStorage> properties(item);
+    hr = properties->GetPropertyAttributes(nb_properties, input, prop_attributes, output);
+    free(input);
+    if (FAILED(hr)) {
+        WIA_WARNING("Pyinsane: WARNING: WiaPropertyStorage->GetPropertyAttribute() failed. Will use defaults");
+        free(prop_attributes);
+        free(output);
         return NULL;
     }
 
-    item = capsule2item(capsule);
-    if (item == NULL)
-        Py_RETURN_NONE;
+    all_constraints = constraints_to_pylist(snapshot, indexes, prop_attributes, output);
 
-    for (nb_properties = 0 ; g_wia_all_properties[nb_properties].name != NULL ; nb_properties++)
-    { }
+    FreePropVariantArray(nb_properties, output);
+    free(prop_attributes);
+    free(output);
+    return all_constraints;
+}
+
+
+/*!
+ * Reads the values and the constraints of all the properties of the item
+ * with the same PROPSPECs, and updates its snapshot. Returns
+ * {name: {'value', 'accessright', 'possible_values'[, 'constraint']}}, or
+ * NULL on error.
+ */
+static PyObject *read_options(IWiaItem2 *item, PyinsanePropertySnapshot *snapshot)
+{
+    PROPSPEC *input;
+    PROPVARIANT *values;
+    ULONG *prop_attributes;
+    PROPVARIANT *constraints;
+    int i;
+    int nb_properties;
+    bool has_constraints = true;
+    HRESULT hr;
+    PyObject *all_options;
+
+    nb_properties = wia_get_nb_properties();
 
     input = (PROPSPEC *)calloc(nb_properties, sizeof(PROPSPEC));
+    values = (PROPVARIANT *)calloc(nb_properties, sizeof(PROPVARIANT));
     prop_attributes = (ULONG *)calloc(nb_properties, sizeof(ULONG));
-    output = (PROPVARIANT *)calloc(nb_properties, sizeof(PROPVARIANT));
+    constraints = (PROPVARIANT *)calloc(nb_properties, sizeof(PROPVARIANT));
 
     for (i = 0 ; i < nb_properties ; i++) {
         input[i].ulKind = PRSPEC_PROPID;
@@ -462,97 +589,167 @@ static PyObject *get_constraints(PyObject *, PyObject *args)
     }
 
     CComQIPtr<IWiaPropertyStorage> properties(item);
-    hr = properties->GetPropertyAttributes(nb_properties, input, prop_attributes, output);
+    hr = properties->ReadMultiple(nb_properties, input, values);
     if (FAILED(hr)) {
-        WIA_WARNING("Pyinsane: WARNING: WiaPropertyStorage->GetPropertyAttribute() failed. Will use defaults");
+        WIA_WARNING("Pyinsane: WARNING: WiaPropertyStorage->ReadMultiple() failed");
         free(input);
+        free(values);
         free(prop_attributes);
-        free(output);
-        Py_RETURN_NONE;
+        free(constraints);
+        return NULL;
+    }
+    hr = properties->GetPropertyAttributes(nb_properties, input, prop_attributes, constraints);
+    if (FAILED(hr)) {
+        WIA_WARNING("Pyinsane: WARNING: WiaPropertyStorage->GetPropertyAttribute() failed. Will use defaults");
+        has_constraints = false;
     }
     free(input);
 
-    all_constraints = PyList_New(0);
-    for (i = 0 ; i < nb_properties ; i++) {
-        if (output[i].vt == 0) {
-            continue;
-        }
-        constraint = NULL;
-        switch(output[i].vt) {
-            case VT_I4:
-                constraint = int_to_pyobject(&g_wia_all_properties[i], output[i].lVal);
-                break;
-            case VT_UI4:
-                constraint = int_to_pyobject(&g_wia_all_properties[i], output[i].ulVal);
-                break;
-            case VT_VECTOR | VT_UI4: /* FALLTHROUGH */
-            case VT_VECTOR | VT_I4:
-                if (prop_attributes[i] & WIA_PROP_RANGE)
-                    constraint = int_vector_to_pyobject_tuple(&output[i].cal);
-                else
-                    constraint = int_vector_to_pyobject_list(&output[i].cal);
-                break;
-            case VT_VECTOR | VT_UI2:
-                WIA_WARNING("Pyinsane: WARNING: Got VECTOR|UI2 as constraint. Not supported yet");
-                // TODO
-                continue;
-            case VT_UI1 | VT_VECTOR:
-                WIA_WARNING("Pyinsane: WARNING: Got VECTOR|UI1 as constraint. Not supported yet");
-                // TODO
-                continue;
-            case VT_BSTR:
-                constraint = PyUnicode_FromWideChar(SysAllocString(output[i].bstrVal), SysStringLen(output[i].bstrVal));
-                break;
-            case VT_BSTR | VT_VECTOR:
-                constraint = str_vector_to_pyobject(&output[i].cabstr);
-                break;
-            case VT_CLSID:
-                constraint = clsid_to_pyobject(&g_wia_all_properties[i], *output[i].puuid);
-                break;
-            default:
-                WIA_WARNING("Pyinsane: WARNING: Unknown var type for constraint");
-                continue;
-        }
-        if (constraint == NULL) {
-            fprintf(stderr, "Pyinsane: Failed to parse constraint of [%s]\n", g_wia_all_properties[i].name);
-            continue;
-        }
-        propname = PyUnicode_FromString(g_wia_all_properties[i].name);
-        prop = PyTuple_Pack(2, propname, constraint);
-        PyList_Append(all_constraints, prop);
-        Py_DECREF(prop);
-    }
+    all_options = options_to_pydict(snapshot, values, prop_attributes,
+            (has_constraints ? constraints : NULL));
 
+    FreePropVariantArray(nb_properties, values);
+    if (has_constraints)
+        FreePropVariantArray(nb_properties, constraints);
+    free(values);
     free(prop_attributes);
-    free(output);
+    free(constraints);
+    return all_options;
+}
+
+
+static PyObject *get_properties(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    IWiaItem2 *item;
+    PyinsanePropertySnapshot *snapshot;
+    PyObject *all_props;
+
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        WIA_WARNING("Pyinsane: WARNING: get_sources(): Invalid args");
+        return NULL;
+    }
+
+    item = capsule2item(capsule, &snapshot);
+    if (item == NULL)
+        Py_RETURN_NONE;
+
+    all_props = read_properties(item, snapshot, NULL, NULL);
+    if (all_props == NULL)
+        Py_RETURN_NONE;
+    return all_props;
+}
+
+static PyObject *get_constraints(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    IWiaItem2 *item;
+    PyinsanePropertySnapshot *snapshot;
+    PyObject *all_constraints;
+
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        WIA_WARNING("Pyinsane: WARNING: get_sources(): Invalid args");
+        return NULL;
+    }
+
+    item = capsule2item(capsule, &snapshot);
+    if (item == NULL)
+        Py_RETURN_NONE;
+
+    all_constraints = read_constraints(item, snapshot, NULL);
+    if (all_constraints == NULL)
+        Py_RETURN_NONE;
     return all_constraints;
 }
 
+static PyObject *get_options(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    IWiaItem2 *item;
+    PyinsanePropertySnapshot *snapshot;
+    PyObject *all_options;
 
-static int _set_property(IWiaItem2 *item, const struct wia_property *property_spec, PyObject *pyvalue)
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        WIA_WARNING("Pyinsane: WARNING: get_options(): Invalid args");
+        return NULL;
+    }
+
+    item = capsule2item(capsule, &snapshot);
+    if (item == NULL)
+        Py_RETURN_NONE;
+
+    all_options = read_options(item, snapshot);
+    if (all_options == NULL)
+        Py_RETURN_NONE;
+    return all_options;
+}
+
+/*!
+ * Returns ([properties], [constraints], [names of removed properties]) with
+ * only what changed since the previous read of the item. The values are all
+ * read again (WIA doesn't tell which properties the driver updated when
+ * validating a write), but the constraints are only read for the properties
+ * whose value changed or that were written.
+ */
+static PyObject *get_property_changes(PyObject *, PyObject *args)
 {
-    HRESULT hr;
-    PROPSPEC propspec;
-    PROPVARIANT propvalue;
+    PyObject *capsule;
+    IWiaItem2 *item;
+    PyinsanePropertySnapshot *snapshot;
+    std::vector<int> changes;
+    std::vector<int>::iterator it;
+    PyObject *all_props;
+    PyObject *all_constraints;
+    PyObject *removed;
 
-    propspec.ulKind = PRSPEC_PROPID;
-    propspec.propid = property_spec->id;
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        WIA_WARNING("Pyinsane: WARNING: get_property_changes(): Invalid args");
+        return NULL;
+    }
+
+    item = capsule2item(capsule, &snapshot);
+    if (item == NULL)
+        Py_RETURN_NONE;
+
+    removed = PyList_New(0);
+    all_props = read_properties(item, snapshot, &changes, removed);
+    if (all_props == NULL) {
+        Py_DECREF(removed);
+        Py_RETURN_NONE;
+    }
+
+    all_constraints = read_constraints(item, snapshot, &changes);
+    if (all_constraints == NULL) {
+        // will be read again next time
+        for (it = changes.begin() ; it != changes.end() ; it++) {
+            snapshot->MarkWritten(*it);
+        }
+        all_constraints = PyList_New(0);
+    }
+
+    return Py_BuildValue("(NNN)", all_props, all_constraints, removed);
+}
+
+
+// The CLSIDs point to static values: the PROPVARIANT must not be cleared
+static int pyobject_to_propvariant(const struct wia_property *property_spec, PyObject *pyvalue,
+        PROPVARIANT *propvalue)
+{
+    PropVariantInit(propvalue);
+    propvalue->vt = property_spec->vartype;
 
-    PropVariantInit(&propvalue);
-    propvalue.vt = property_spec->vartype;
-    
     switch(property_spec->vartype) {
         case VT_I4:
-            propvalue.lVal = pyobject_to_int(property_spec, pyvalue, -1);
-            if (propvalue.lVal == -1) {
+            propvalue->lVal = pyobject_to_int(property_spec, pyvalue, -1);
+            if (propvalue->lVal == -1) {
                 WIA_WARNING("Pyinsane: pyobject_to_int() failed");
                 return 0;
             }
             break;
         case VT_UI4:
-            propvalue.vt = VT_I4;
-            propvalue.lVal = pyobject_to_int(property_spec, pyvalue, -1);
-            if (propvalue.lVal == -1) {
+            propvalue->vt = VT_I4;
+            propvalue->lVal = pyobject_to_int(property_spec, pyvalue, -1);
+            if (propvalue->lVal == -1) {
                 WIA_WARNING("Pyinsane: pyobject_to_int() failed");
                 return 0;
             }
@@ -567,7 +764,7 @@ static int _set_property(IWiaItem2 *item, const struct wia_property *property_sp
             // TODO
             return 0;
         case VT_CLSID:
-            if (!pyobject_to_clsid(property_spec, pyvalue, &propvalue.puuid)) {
+            if (!pyobject_to_clsid(property_spec, pyvalue, &propvalue->puuid)) {
                 WIA_WARNING("Pyinsane: pyobject_to_clsid() failed");
                 return 0;
             }
@@ -578,46 +775,166 @@ static int _set_property(IWiaItem2 *item, const struct wia_property *property_sp
             return 0;
     }
 
+    return 1;
+}
+
+static int write_properties(IWiaItem2 *item, int nb_properties, const PROPSPEC *propspecs,
+        const PROPVARIANT *propvalues)
+{
+    HRESULT hr;
+
     CComQIPtr<IWiaPropertyStorage> properties(item);
-    hr = properties->WriteMultiple(1, &propspec, &propvalue, WIA_IPA_FIRST);
+    hr = properties->WriteMultiple(nb_properties, propspecs, propvalues, WIA_IPA_FIRST);
     if (FAILED(hr)) {
         WIA_WARNING("Pyinsane: WARNING: properties->WriteMultiple() failed");
-        fprintf(stderr, "Pyinsane: WARNING: properties->WriteMultiple() failed: %s : 0x%X\n", property_spec->name, hr);
+        fprintf(stderr, "Pyinsane: WARNING: properties->WriteMultiple() failed: %d properties : 0x%X\n",
+                nb_properties, hr);
+        return 0;
+    }
+    return 1;
+}
+
+static int _set_property(IWiaItem2 *item, const struct wia_property *property_spec, PyObject *pyvalue)
+{
+    PROPSPEC propspec;
+    PROPVARIANT propvalue;
+
+    propspec.ulKind = PRSPEC_PROPID;
+    propspec.propid = property_spec->id;
+
+    if (!pyobject_to_propvariant(property_spec, pyvalue, &propvalue))
+        return 0;
+
+    if (!write_properties(item, 1, &propspec, &propvalue)) {
+        fprintf(stderr, "Pyinsane: WARNING: Failed to set %s\n", property_spec->name);
         return 0;
     }
 
     return 1;
 }
 
+static int find_property(PyObject *py_propname)
+{
+    const char *propname;
+    Py_ssize_t len;
+
+    if (!PyUnicode_Check(py_propname))
+        return -1;
+    propname = PyUnicode_AsUTF8AndSize(py_propname, &len);
+    if (propname == NULL) {
+        PyErr_Clear();
+        return -1;
+    }
+    return wia_find_property(propname, (size_t)len);
+}
+
 static PyObject *set_property(PyObject *, PyObject *args)
 {
     PyObject *capsule;
     PyObject *py_propname;
     PyObject *py_propvalue;
     IWiaItem2 *item;
-    const char *propname;
+    PyinsanePropertySnapshot *snapshot;
     int i;
 
     if (!PyArg_ParseTuple(args, "OOO", &capsule, &py_propname, &py_propvalue)) {
         WIA_WARNING("Pyinsane: WARNING: get_sources(): Invalid args");
         return NULL;
     }
-    item = capsule2item(capsule);
+    item = capsule2item(capsule, &snapshot);
     if (item == NULL)
         Py_RETURN_FALSE;
 
-    propname = PyUnicode_AsUTF8(py_propname);
-    for (i = 0 ; g_wia_all_properties[i].name != NULL ; i++) {
-        if (strcmp(g_wia_all_properties[i].name, propname) != 0)
+    i = find_property(py_propname);
+    if (i < 0) {
+        WIA_WARNING("Pyinsame: WARNING: set_property(): Property not found");
+        Py_RETURN_FALSE;
+    }
+    if (!_set_property(item, &g_wia_all_properties[i], py_propvalue)) {
+        Py_RETURN_FALSE;
+    }
+    // the driver may have adjusted it: see get_property_changes()
+    snapshot->MarkWritten(i);
+    Py_RETURN_TRUE;
+}
+
+/*!
+ * Writes all the properties of {name: value} with a single WriteMultiple(),
+ * so the driver validates them together. If the driver rejects them, they
+ * are written again one by one, in order, to find the culprits.
+ * Returns the list of the names of the properties that couldn't be set
+ * (empty on success), or None if the item is invalid.
+ */
+static PyObject *set_properties(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyObject *py_props;
+    PyObject *py_propname;
+    PyObject *py_propvalue;
+    Py_ssize_t pos = 0;
+    IWiaItem2 *item;
+    PyinsanePropertySnapshot *snapshot;
+    PyObject *failed;
+    PROPSPEC *propspecs;
+    PROPVARIANT *propvalues;
+    std::vector<int> indexes;
+    int nb_properties;
+    int i;
+    int idx;
+
+    if (!PyArg_ParseTuple(args, "OO!", &capsule, &PyDict_Type, &py_props)) {
+        WIA_WARNING("Pyinsane: WARNING: set_properties(): Invalid args");
+        return NULL;
+    }
+    item = capsule2item(capsule, &snapshot);
+    if (item == NULL)
+        Py_RETURN_NONE;
+
+    failed = PyList_New(0);
+    nb_properties = (int)PyDict_Size(py_props);
+    if (nb_properties == 0)
+        return failed;
+
+    propspecs = (PROPSPEC *)calloc(nb_properties, sizeof(PROPSPEC));
+    propvalues = (PROPVARIANT *)calloc(nb_properties, sizeof(PROPVARIANT));
+
+    nb_properties = 0;
+    while (PyDict_Next(py_props, &pos, &py_propname, &py_propvalue)) {
+        idx = find_property(py_propname);
+        if (idx < 0) {
+            WIA_WARNING("Pyinsame: WARNING: set_properties(): Property not found");
+            PyList_Append(failed, py_propname);
             continue;
-        if (!_set_property(item, &g_wia_all_properties[i], py_propvalue)) {
-            Py_RETURN_FALSE;
         }
-        Py_RETURN_TRUE;
+        if (!pyobject_to_propvariant(&g_wia_all_properties[idx], py_propvalue,
+                    &propvalues[nb_properties])) {
+            PyList_Append(failed, py_propname);
+            continue;
+        }
+        propspecs[nb_properties].ulKind = PRSPEC_PROPID;
+        propspecs[nb_properties].propid = g_wia_all_properties[idx].id;
+        indexes.push_back(idx);
+        nb_properties++;
+    }
+
+    if (nb_properties > 0 && !write_properties(item, nb_properties, propspecs, propvalues)) {
+        for (i = 0 ; i < nb_properties ; i++) {
+            if (!write_properties(item, 1, &propspecs[i], &propvalues[i])) {
+                PyList_Append(failed, wia_get_property_name(indexes[i]));
+                // rejected: left as it was
+                indexes[i] = -1;
+            }
+        }
+    }
+    for (i = 0 ; i < nb_properties ; i++) {
+        // the driver may have adjusted them: see get_property_changes()
+        if (indexes[i] >= 0)
+            snapshot->MarkWritten(indexes[i]);
     }
 
-    WIA_WARNING("Pyinsame: WARNING: set_property(): Property not found");
-    Py_RETURN_FALSE;
+    free(propspecs);
+    free(propvalues);
+    return failed;
 }
 
 struct wia_scan {
@@ -627,154 +944,214 @@ struct wia_scan {
     PyinsaneImageStream *current_stream;
 };
 
-static void end_scan(PyObject *capsule)
-{
-    struct wia_scan *scan;
-
-    scan = (struct wia_scan *)PyCapsule_GetPointer(capsule, WIA_PYCAPSULE_SCAN_NAME);
-    if (scan == NULL)
-        return;
-    scan->transfer->Release();
-    delete scan->callbacks;
-    free(scan);
-}
 
+// Writes of the driver are coalesced until one of those thresholds is reached
+// (or a whole line if the caller gives its size).
+#define DOWNLOAD_MIN_BYTES (64 * 1024)
+#define DOWNLOAD_MAX_DELAY_MS 100
 
 struct download {
     HANDLE mutex; // because it seems that the callbacks can be called from many threads !
-    Py_buffer buffer;
-    PyObject *get_data_cb;
-    PyObject *end_of_page_cb;
-    PyObject *end_of_scan_cb;
-    PyThreadState *_save;
+    PyinsaneRing *ring;
 };
 
 
-static void get_data_wrapper(const void *data, int nb_bytes, void *cb_data)
+// The driver thread never takes the GIL: it only fills the ring.
+// Scan.read() drains it from the other side.
+
+static int get_data_wrapper(const void *data, int nb_bytes, void *cb_data)
 {
     struct download *download = (struct download *)cb_data;
-    const char *cdata = (const char *)data; // because Visual C++ says "unknown size" for (void) elements.
-    int nb;
-    PyObject *arglist;
-    PyObject *res;
-
-    WaitForSingleObject(download->mutex, 0);
+    int r;
 
-    PyEval_RestoreThread(download->_save);
-
-    for ( ; nb_bytes > 0 ; nb_bytes -= nb, cdata += nb) {
-        nb = (int)WIA_MIN(nb_bytes, download->buffer.len);
-        memcpy(download->buffer.buf, cdata, nb);
+    WaitForSingleObject(download->mutex, INFINITE);
+    r = download->ring->Write(data, nb_bytes);
+    ReleaseMutex(download->mutex);
+    return r;
+}
 
-        arglist = Py_BuildValue("(i)", nb);
-        res = PyEval_CallObject(download->get_data_cb, arglist);
-        if (res == NULL) {
-            WIA_WARNING("Pyinsane: WARNING: Got exception from callback download->get_data_cb !");
-        }
-        Py_XDECREF(res);
-    }
 
-    download->_save = PyEval_SaveThread();
+static int end_of_page_wrapper(void *cb_data)
+{
+    struct download *download = (struct download *)cb_data;
+    int r;
 
+    WaitForSingleObject(download->mutex, INFINITE);
+    r = download->ring->EndOfPage();
     ReleaseMutex(download->mutex);
+    return r;
 }
 
 
-static void end_of_page_wrapper(void *cb_data)
+static int status_wrapper(int, void *cb_data)
 {
     struct download *download = (struct download *)cb_data;
-    PyObject *res;
-
-    WaitForSingleObject(download->mutex, 0);
-
-    PyEval_RestoreThread(download->_save);
-    res = PyEval_CallObject(download->end_of_page_cb, NULL);
-    if (res == NULL) {
-        WIA_WARNING("Pyinsane: WARNING: Got exception from callback download->end_of_page_cb !");
-    }
-    Py_XDECREF(res);
-    download->_save = PyEval_SaveThread();
+    int r;
 
+    // publish what the driver wrote so far if it is late
+    WaitForSingleObject(download->mutex, INFINITE);
+    r = download->ring->Tick();
     ReleaseMutex(download->mutex);
+    return r;
 }
 
 
-static void end_of_scan_wrapper(void *cb_data)
+static int end_of_scan_wrapper(void *cb_data)
 {
     struct download *download = (struct download *)cb_data;
-    PyObject *res;
+    int r;
+
+    WaitForSingleObject(download->mutex, INFINITE);
+    r = download->ring->EndOfScan();
+    ReleaseMutex(download->mutex);
+    return r;
+}
 
-    WaitForSingleObject(download->mutex, 0);
 
-    PyEval_RestoreThread(download->_save);
-    res = PyEval_CallObject(download->end_of_scan_cb, NULL);
-    if (res == NULL) {
-        WIA_WARNING("Pyinsane: WARNING: Got exception from callback download->end_of_scan_cb !");
-    }
-    Py_XDECREF(res);
-    download->_save = PyEval_SaveThread();
+// Frame parameters of the recording, from the properties of the item
+static void record_parameters(IWiaItem2 *item, PyinsaneTransferRecorder *recorder)
+{
+    CComQIPtr<IWiaPropertyStorage> properties(item);
+    struct record_parameters parameters = { 0 };
+    PROPSPEC input[4] = {0};
+    PROPVARIANT output[4] = {0};
+    static const PROPID ids[4] = {
+        WIA_IPA_BYTES_PER_LINE, WIA_IPA_PIXELS_PER_LINE, WIA_IPA_NUMBER_OF_LINES,
+        WIA_IPA_DEPTH,
+    };
+    int i;
 
-    ReleaseMutex(download->mutex);
+    parameters.format = -1;
+    parameters.lastFrame = 1;
+    for (i = 0 ; i < 4 ; i++) {
+        input[i].ulKind = PRSPEC_PROPID;
+        input[i].propid = ids[i];
+    }
+    if (!properties || FAILED(properties->ReadMultiple(4, input, output))) {
+        WIA_WARNING("Pyinsane: WARNING: download(): failed to read the frame parameters");
+    } else {
+        // not available: 0
+        parameters.bytesPerLine = output[0].lVal;
+        parameters.pixelsPerLine = output[1].lVal;
+        parameters.lines = output[2].lVal;
+        parameters.depth = output[3].lVal;
+        FreePropVariantArray(4, output);
+    }
+    recorder->OnParameters(&parameters);
 }
 
 
 static PyObject *download(PyObject *, PyObject *args)
 {
     PyObject *capsule;
+    PyObject *ring_capsule;
     struct download dl_data = { 0 };
     struct wia_scan scan;
     HRESULT hr;
     struct wia_source *src;
+    Py_ssize_t min_bytes = DOWNLOAD_MIN_BYTES;
+    Py_ssize_t row_size = 0;
+    unsigned int max_delay_ms = DOWNLOAD_MAX_DELAY_MS;
+    int mapped = 0;
+    const char *map_directory = NULL;
+    PyObject *telemetry_capsule = Py_None;
+    PyinsaneTransferTelemetry *telemetry = NULL;
+    PyObject *recorder_capsule = Py_None;
+    PyinsaneTransferRecorder *recorder = NULL;
+
+    if (!PyArg_ParseTuple(args, "OO|nnIizOO", &capsule, &ring_capsule,
+                &min_bytes, &row_size, &max_delay_ms, &mapped, &map_directory,
+                &telemetry_capsule, &recorder_capsule)) {
+        WIA_WARNING("Pyinsane: WARNING: download(): Invalid args");
+        return NULL;
+    }
 
-    if (!PyEval_ThreadsInitialized()) {
-        WIA_WARNING("Python thread not yet initialized ?!");
-        PyEval_InitThreads();
+    dl_data.ring = (PyinsaneRing *)PyCapsule_GetPointer(ring_capsule, NATIVE_PYCAPSULE_RING_NAME);
+    if (dl_data.ring == NULL) {
+        WIA_WARNING("Pyinsane: WARNING: download(): wrong param type. Expected a ring");
+        return NULL;
     }
+    // From now on, the reader must be woken up if the scan doesn't start
 
-    if (!PyArg_ParseTuple(args, "OOOOy*",
-                &capsule,
-                &dl_data.get_data_cb, &dl_data.end_of_page_cb, &dl_data.end_of_scan_cb,
-                &dl_data.buffer
-            )) {
-        WIA_WARNING("Pyinsane: WARNING: download(): Invalid args");
+    if (min_bytes < 0 || row_size < 0) {
+        dl_data.ring->Abort();
+        PyErr_SetString(PyExc_ValueError, "download(): sizes must be >= 0");
         return NULL;
     }
 
     src = (struct wia_source *)PyCapsule_GetPointer(capsule, WIA_PYCAPSULE_SRC_NAME);
     if (src == NULL) {
         WIA_WARNING("Pyinsane: WARNING: wrong param type. Expected a scan source");
+        dl_data.ring->Abort();
         return NULL;
     }
-
-    if (!PyCallable_Check(dl_data.get_data_cb)
-            || !PyCallable_Check(dl_data.end_of_page_cb)
-            || !PyCallable_Check(dl_data.end_of_scan_cb)) {
-        WIA_WARNING("Pyinsane: WARNING: download(): wrong param type. Expected callback(s)");
+    if (src->entry->device == NULL) {
+        WIA_WARNING("Pyinsane: WARNING: download(): device already closed");
+        dl_data.ring->Abort();
         Py_RETURN_NONE;
     }
 
+    if (telemetry_capsule != Py_None) {
+        telemetry = (PyinsaneTransferTelemetry *)PyCapsule_GetPointer(
+            telemetry_capsule, NATIVE_PYCAPSULE_TELEMETRY_NAME
+        );
+        if (telemetry == NULL) {
+            WIA_WARNING("Pyinsane: WARNING: download(): wrong param type. Expected a telemetry");
+            dl_data.ring->Abort();
+            return NULL;
+        }
+    }
+
+    if (recorder_capsule != Py_None) {
+        recorder = (PyinsaneTransferRecorder *)PyCapsule_GetPointer(
+            recorder_capsule, NATIVE_PYCAPSULE_RECORDER_NAME
+        );
+        if (recorder == NULL) {
+            WIA_WARNING("Pyinsane: WARNING: download(): wrong param type. Expected a recorder");
+            dl_data.ring->Abort();
+            return NULL;
+        }
+        record_parameters(src->source, recorder);
+    }
+
+    dl_data.ring->SetCoalescing(min_bytes, row_size, max_delay_ms);
     dl_data.mutex = CreateMutex(NULL, FALSE, NULL);
 
     hr = src->source->QueryInterface(IID_IWiaTransfer, (void**)&scan.transfer);
     if (FAILED(hr)) {
         WIA_WARNING("source->QueryInterface(WiaTransfer) failed");
+        dl_data.ring->Abort();
+        CloseHandle(dl_data.mutex);
         Py_RETURN_NONE;
     }
 
+    // Scan.cancel() aborts the ring: the next call of the driver to our
+    // callbacks makes it stop
     scan.callbacks = new PyinsaneWiaTransferCallback(
-        get_data_wrapper, end_of_page_wrapper, end_of_scan_wrapper,
-        &dl_data
+        get_data_wrapper, end_of_page_wrapper, end_of_scan_wrapper, status_wrapper,
+        &dl_data, mapped != 0, map_directory, dl_data.ring->GetCancelToken(), telemetry,
+        recorder
     );
 
-    dl_data._save = PyEval_SaveThread();
+    Py_BEGIN_ALLOW_THREADS;
     hr = scan.transfer->Download(0, scan.callbacks);
+    if (recorder != NULL)
+        recorder->OnEndOfScan(hr);
+    Py_END_ALLOW_THREADS;
+
+    // frees the device for the next scan, even if this one was cancelled
+    scan.callbacks->Release();
+    scan.transfer->Release();
 
-    if (hr == WIA_ERROR_PAPER_EMPTY) {
+    if (dl_data.ring->IsAborted()) {
+        // cancelled: not an error
+        CloseHandle(dl_data.mutex);
+        Py_RETURN_FALSE;
+    } else if (hr == WIA_ERROR_PAPER_EMPTY) {
         end_of_scan_wrapper((void *)&dl_data);
-        PyEval_RestoreThread(dl_data._save);
-        Py_RETURN_NONE;
+        CloseHandle(dl_data.mutex);
+        Py_RETURN_TRUE;
     } else if (FAILED(hr)) {
-        PyEval_RestoreThread(dl_data._save);
         _com_error err(hr);
         LPCTSTR errMsg = err.ErrorMessage();
 
@@ -782,10 +1159,26 @@ static PyObject *download(PyObject *, PyObject *args)
 
         std::cerr << "Pyinsane: WARNING: source->transfer->Download() failed: " << hr << " ; " << errMsg << std::endl;
 
-        scan.transfer->Release();
-    } else {
-        PyEval_RestoreThread(dl_data._save);
+        // wake up the reader, if any
+        dl_data.ring->Abort();
+        CloseHandle(dl_data.mutex);
+        Py_RETURN_NONE;
     }
+
+    end_of_scan_wrapper((void *)&dl_data);
+    CloseHandle(dl_data.mutex);
+    Py_RETURN_TRUE;
+}
+
+static PyObject *flush(PyObject *, PyObject* args)
+{
+    if (!PyArg_ParseTuple(args, "")) {
+        return NULL;
+    }
+
+    if (g_com_thread != NULL)
+        g_com_thread->devices.Flush();
+
     Py_RETURN_NONE;
 }
 
@@ -795,6 +1188,11 @@ static PyObject *exit(PyObject *, PyObject* args)
         return NULL;
     }
 
+    // COM objects must be released before CoUninitialize(). Handles still
+    // alive are kept, but can't be used anymore.
+    delete g_com_thread;
+    g_com_thread = NULL;
+
     CoUninitialize();
 
     Py_RETURN_NONE;
@@ -806,35 +1204,71 @@ static PyMethodDef rawapi_methods[] = {
     {"get_devices", get_devices, METH_VARARGS, NULL},
     {"get_properties", get_properties, METH_VARARGS, NULL},
     {"get_constraints", get_constraints, METH_VARARGS, NULL},
+    {"get_options", get_options, METH_VARARGS, NULL},
+    {"get_property_changes", get_property_changes, METH_VARARGS, NULL},
     {"get_sources", get_sources, METH_VARARGS, NULL},
     {"open", open_device, METH_VARARGS, NULL},
     {"download", download, METH_VARARGS, NULL},
     {"set_property", set_property, METH_VARARGS, NULL},
+    {"set_properties", set_properties, METH_VARARGS, NULL},
+    {"flush", flush, METH_VARARGS, NULL},
     {"exit", exit, METH_VARARGS, NULL},
     {NULL, NULL, 0, NULL},
 };
 
+#ifdef WIA_MOCK
+// Same module, on top of the mock driver (mock.cpp), plus its configuration
+# define WIA_MODULE_NAME "_mockapi"
+# define WIA_MODULE_INIT2 init_mockapi
+# define WIA_MODULE_INIT3 PyInit__mockapi
+#else
+# define WIA_MODULE_NAME "_rawapi"
+# define WIA_MODULE_INIT2 init_rawapi
+# define WIA_MODULE_INIT3 PyInit__rawapi
+#endif
+
+static PyObject *add_mock_methods(PyObject *module)
+{
+#ifdef WIA_MOCK
+    PyMethodDef *def;
+
+    if (module == NULL)
+        return NULL;
+    for (def = g_wia_mock_methods ; def->ml_name != NULL ; def++) {
+        if (PyModule_AddObject(module, def->ml_name, PyCFunction_New(def, NULL)) < 0) {
+            Py_DECREF(module);
+            return NULL;
+        }
+    }
+#endif
+    return module;
+}
+
 #if PY_VERSION_HEX < 0x03000000
 
 PyMODINIT_FUNC
-init_rawapi(void)
+WIA_MODULE_INIT2(void)
 {
-    Py_InitModule("_rawapi", rawapi_methods);
+    if (!wia_properties_init())
+        return;
+    add_mock_methods(Py_InitModule(WIA_MODULE_NAME, rawapi_methods));
 }
 
 #else
 
 static struct PyModuleDef rawapi_module = {
     PyModuleDef_HEAD_INIT,
-    "_rawapi",
+    WIA_MODULE_NAME,
     NULL /* doc */,
     -1,
     rawapi_methods,
 };
 
-PyMODINIT_FUNC PyInit__rawapi(void)
+PyMODINIT_FUNC WIA_MODULE_INIT3(void)
 {
-    return PyModule_Create(&rawapi_module);
+    if (!wia_properties_init())
+        return NULL;
+    return add_mock_methods(PyModule_Create(&rawapi_module));
 }
 
 #endif
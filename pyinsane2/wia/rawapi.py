@@ -1,9 +1,10 @@
-from collections import deque
-import queue
+import atexit
+import functools
 import threading
 
 from . import _rawapi
 from .. import util
+from ..native import _core
 
 
 class WIAException(util.PyinsaneException):
@@ -11,61 +12,80 @@ class WIAException(util.PyinsaneException):
         super(WIAException, self).__init__("WIA: {}".format(msg))
 
 
-class WiaAction(object):
-    def __init__(self, func, **kwargs):
-        self.func = func
-        self.kwargs = kwargs
-        self.result = None
-        self.exception = None
-        self.__sem = threading.Semaphore(0)
+class WiaWorker(object):
+    # Native thread with COM initialized on it (see _core.worker_new()).
+    # COM objects must be used from the thread that created them. Each
+    # opened device gets its own worker, so a long download on a scanner
+    # doesn't block the other ones. Everything else (enumeration, opening
+    # devices) goes through the main worker.
+    # Actions queued while the worker is busy are run in a single batch.
+    def __init__(self):
+        self.worker = _core.worker_new(_rawapi.init, _rawapi.exit)
 
-    def start(self):
-        global wia_thread
-        global wia_action_queue
+    def call(self, func, **kwargs):
+        if self.worker is None:
+            raise WIAException("WIA thread died unexpectidly !")
+        return _core.worker_call(self.worker, functools.partial(func, **kwargs))
 
-        if wia_thread is None or not wia_thread.is_alive():
+    def post(self, func, **kwargs):
+        # don't wait
+        if self.worker is None:
             raise WIAException("WIA thread died unexpectidly !")
-        wia_action_queue.put(self)
+        _core.worker_post(self.worker, functools.partial(func, **kwargs))
+
+    def stop(self):
+        # waits for the remaining actions
+        if self.worker is not None:
+            _core.worker_stop(self.worker)
+            self.worker = None
+
+
+class WiaHandle(object):
+    # Device or source, and the worker that created it
+    def __init__(self, obj, worker):
+        self.obj = obj
+        self.worker = worker
+
+    def __del__(self):
+        # Devices are shared by all their handles on the same worker (opening
+        # a device twice only opens it once). The device is released when its
+        # last handle is dropped, but only by the thread of its worker.
+        self.obj = None
+        try:
+            self.worker.post(_rawapi.flush)
+        except Exception:
+            # worker already stopped (exit()): everything has been released
+            pass
 
-    def wait(self):
-        self.start()
-        self.__sem.acquire()
-        if self.exception is not None:
-            raise self.exception
-        return self.result
 
-    def do(self):
-        try:
-            self.result = self.func(**self.kwargs)
-        except Exception as exc:
-            self.exception = exc
-        self.__sem.release()
+workers_lock = threading.Lock()
+main_worker = None
+device_workers = {}  # devid --> WiaWorker
 
 
-class WiaWorker(threading.Thread):
-    def run(self):
-        global wia_action_queue
-        while True:
-            try:
-                action = wia_action_queue.get(block=True, timeout=1)
-                action.do()
-            except queue.Empty:
-                if not parent_thread.is_alive():
-                    return
+def _get_main_worker():
+    global main_worker
+    with workers_lock:
+        if main_worker is None:
+            main_worker = WiaWorker()
+        return main_worker
 
 
-parent_thread = threading.current_thread()
-wia_action_queue = queue.Queue()
-wia_thread = WiaWorker()
-wia_thread.start()
+def _get_worker(dev_or_src):
+    if isinstance(dev_or_src, WiaHandle):
+        return dev_or_src.worker
+    return _get_main_worker()
 
 
-def _init():
-    _rawapi.init()
+def _get_obj(dev_or_src):
+    if isinstance(dev_or_src, WiaHandle):
+        return dev_or_src.obj
+    return dev_or_src
 
 
 def init():
-    return WiaAction(_init).wait()
+    # COM is initialized by each worker on its own thread
+    _get_main_worker()
 
 
 def _open(devid):
@@ -76,7 +96,20 @@ def _open(devid):
 
 
 def open(devid):
-    return WiaAction(_open, devid=devid).wait()
+    with workers_lock:
+        worker = device_workers.get(devid)
+        new_worker = worker is None
+        if new_worker:
+            worker = WiaWorker()
+            device_workers[devid] = worker
+    try:
+        return WiaHandle(worker.call(_open, devid=devid), worker)
+    except WIAException:
+        if new_worker:
+            with workers_lock:
+                device_workers.pop(devid, None)
+            worker.stop()
+        raise
 
 
 def _get_devices():
@@ -87,7 +120,7 @@ def _get_devices():
 
 
 def get_devices():
-    return WiaAction(_get_devices).wait()
+    return _get_main_worker().call(_get_devices)
 
 
 def _get_sources(dev):
@@ -98,7 +131,12 @@ def _get_sources(dev):
 
 
 def get_sources(dev):
-    return WiaAction(_get_sources, dev=dev).wait()
+    # sources are used from the worker of their device
+    worker = _get_worker(dev)
+    return [
+        (srcid, WiaHandle(src, worker))
+        for (srcid, src) in worker.call(_get_sources, dev=_get_obj(dev))
+    ]
 
 
 def _get_properties(dev_or_src):
@@ -109,7 +147,9 @@ def _get_properties(dev_or_src):
 
 
 def get_properties(dev_or_src):
-    return WiaAction(_get_properties, dev_or_src=dev_or_src).wait()
+    return _get_worker(dev_or_src).call(
+        _get_properties, dev_or_src=_get_obj(dev_or_src)
+    )
 
 
 def _get_constraints(dev_or_src):
@@ -120,7 +160,39 @@ def _get_constraints(dev_or_src):
 
 
 def get_constraints(dev_or_src):
-    return WiaAction(_get_constraints, dev_or_src=dev_or_src).wait()
+    return _get_worker(dev_or_src).call(
+        _get_constraints, dev_or_src=_get_obj(dev_or_src)
+    )
+
+
+def _get_options(dev_or_src):
+    options = _rawapi.get_options(dev_or_src)
+    if options is None:
+        raise WIAException("Failed to get scanner properties")
+    return options
+
+
+def get_options(dev_or_src):
+    # Properties and constraints, read together:
+    # {name: {'value', 'accessright', 'possible_values'[, 'constraint']}}
+    return _get_worker(dev_or_src).call(
+        _get_options, dev_or_src=_get_obj(dev_or_src)
+    )
+
+
+def _get_property_changes(dev_or_src):
+    changes = _rawapi.get_property_changes(dev_or_src)
+    if changes is None:
+        raise WIAException("Failed to get scanner properties")
+    return changes
+
+
+def get_property_changes(dev_or_src):
+    # (properties, constraints, removed property names): only what changed
+    # since the previous read of dev_or_src
+    return _get_worker(dev_or_src).call(
+        _get_property_changes, dev_or_src=_get_obj(dev_or_src)
+    )
 
 
 def _set_property(dev_or_src, propname, propvalue):
@@ -130,77 +202,132 @@ def _set_property(dev_or_src, propname, propvalue):
 
 
 def set_property(dev_or_src, propname, propvalue):
-    return WiaAction(_set_property, dev_or_src=dev_or_src,
-                     propname=propname, propvalue=propvalue).wait()
+    return _get_worker(dev_or_src).call(
+        _set_property, dev_or_src=_get_obj(dev_or_src),
+        propname=propname, propvalue=propvalue
+    )
 
 
-class WiaCallbacks(object):
-    def __init__(self):
-        super(WiaCallbacks, self).__init__()
-        self.received = deque()
-        self.condition = threading.Condition()
-        self.buffer = 512000 * b"\0"
+def _set_properties(dev_or_src, props):
+    failed = _rawapi.set_properties(dev_or_src, props)
+    if failed is None:
+        raise WIAException("Failed to set scanner properties")
+    return failed
 
-    def get_data_cb(self, nb_bytes):
-        self.condition.acquire()
-        try:
-            data = self.buffer[:nb_bytes]
-            self.received.append(data)
-            self.condition.notify_all()
-        finally:
-            self.condition.release()
-
-    def end_of_page_cb(self):
-        self.condition.acquire()
-        try:
-            self.received.append(
-                EOFError()
-            )
-            self.condition.notify_all()
-        finally:
-            self.condition.release()
-
-    def end_of_scan_cb(self):
-        self.condition.acquire()
-        try:
-            self.received.append(
-                StopIteration()
-            )
-            self.condition.notify_all()
-        finally:
-            self.condition.release()
+
+def set_properties(dev_or_src, props):
+    # props: {name: value}, written at once.
+    # Returns the names of the properties that couldn't be set
+    return _get_worker(dev_or_src).call(
+        _set_properties, dev_or_src=_get_obj(dev_or_src), props=props
+    )
+
+
+class WiaReader(object):
+    # Maximum amount of data buffered between the driver and read().
+    # Once reached, the driver thread is paused until read() catches up.
+    MAX_BUFFERED = 64 * 1024 * 1024
+
+    # Small writes of the driver are coalesced: read() only returns once
+    # COALESCE_BYTES (or a whole line of 'row_size' bytes, if known) are
+    # available, or once the oldest byte is COALESCE_DELAY_MS old.
+    COALESCE_BYTES = 64 * 1024
+    COALESCE_DELAY_MS = 100
+
+    def __init__(self, max_buffered=MAX_BUFFERED,
+                 coalesce_bytes=COALESCE_BYTES, row_size=0,
+                 coalesce_delay_ms=COALESCE_DELAY_MS,
+                 mapped=False, map_directory=None, recorder=None):
+        super(WiaReader, self).__init__()
+        self.ring = _core.ring_new(max_buffered)
+        self.coalesce_bytes = coalesce_bytes
+        self.row_size = row_size
+        self.coalesce_delay_ms = coalesce_delay_ms
+        # mapped=True: the driver gets a seekable stream (required by some
+        # drivers for TIFF, multipage, etc). Each page is returned at once,
+        # when complete. It is kept in an anonymous memory mapping, or in a
+        # temporary file in 'map_directory' if specified.
+        self.mapped = mapped
+        self.map_directory = map_directory
+        self.cancelled = False
+        # set if the download couldn't even start
+        self.error = None
+        # updated by the thread of the driver (see get_telemetry())
+        self.telemetry = _core.telemetry_new()
+        # if set, everything the driver does is written to it (see
+        # _core.recorder_new()). Can be played back with the mock driver
+        # (_mockapi.mock_configure(replay=...)).
+        self.recorder = recorder
 
     def read(self):
-        self.condition.acquire()
+        # Returns a _core.Buffer: a read-only view on the data written by the
+        # driver (see the buffer protocol). The underlying memory is recycled
+        # once the buffer is freed.
+        # will raise EOFError at the end of each page
+        # will raise StopIteration when all the pages are done
         try:
-            if len(self.received) <= 0:
-                self.condition.wait()
-            popped = self.received.popleft()
-            if isinstance(popped, Exception):
-                raise popped
-            return popped
-        finally:
-            self.condition.release()
+            return _core.ring_read(self.ring)
+        except IOError:
+            if self.cancelled:
+                raise StopIteration()
+            if self.error is not None:
+                raise self.error
+            raise WIAException("Scan failed")
+
+    def get_telemetry(self):
+        # What the driver reported so far and how fast it actually sent the
+        # data: progress, bytes/s, time to first byte, number of callbacks,
+        # chunk sizes, time the driver spent waiting for us ('blocked'), and
+        # a summary of each page already transferred. Can be called at any
+        # time, including while the scan is running.
+        return _core.telemetry_get_stats(self.telemetry)
+
+    def cancel(self):
+        # The driver stops at its next call to our callbacks, without waiting
+        # for the end of the page. What was buffered is freed by the next
+        # read().
+        self.cancelled = True
+        _core.ring_abort(self.ring)
 
 
 def _start_scan(src, out):
-    ret = _rawapi.download(
-        src,
-        out.get_data_cb,
-        out.end_of_page_cb,
-        out.end_of_scan_cb,
-        out.buffer,
-    )
+    # nobody waits for us: errors are reported by out.read(), which must be
+    # woken up if the scan doesn't even start
+    try:
+        ret = _rawapi.download(src, out.ring, out.coalesce_bytes,
+                               out.row_size, out.coalesce_delay_ms,
+                               out.mapped, out.map_directory, out.telemetry,
+                               out.recorder)
+    except Exception as exc:
+        out.error = WIAException("Failed to start scan: {}".format(exc))
+        _core.ring_abort(out.ring)
+        return
     if ret is None:
-        raise WIAException("Failed to start scan")
-    return ret
+        out.error = WIAException("Failed to start scan")
+        _core.ring_abort(out.ring)
 
 
-def start_scan(src):
-    out = WiaCallbacks()
-    WiaAction(_start_scan, src=src, out=out).start()  # don't wait
+def start_scan(src, max_buffered=WiaReader.MAX_BUFFERED,
+               coalesce_bytes=WiaReader.COALESCE_BYTES, row_size=0,
+               coalesce_delay_ms=WiaReader.COALESCE_DELAY_MS,
+               mapped=False, map_directory=None, recorder=None):
+    out = WiaReader(max_buffered, coalesce_bytes, row_size, coalesce_delay_ms,
+                    mapped, map_directory, recorder)
+    _get_worker(src).post(_start_scan, src=_get_obj(src), out=out)
     return out
 
 
 def exit():
-    _rawapi.exit()
+    global main_worker
+    with workers_lock:
+        workers = list(device_workers.values())
+        device_workers.clear()
+        if main_worker is not None:
+            workers.append(main_worker)
+            main_worker = None
+    for worker in workers:
+        worker.stop()
+
+
+# native threads don't stop by themselves with the interpreter
+atexit.register(exit)
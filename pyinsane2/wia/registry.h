@@ -0,0 +1,133 @@
+#ifndef __PYINSANE_WIA_REGISTRY_H
+#define __PYINSANE_WIA_REGISTRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+#include <windows.h>
+
+/*!
+ * Hash index over an existing table: maps keys to their position in the
+ * table (open addressing, linear probing, load factor <= 0.5).
+ *
+ * Filled once, then read-only: it can be used from any thread without
+ * locking. If several entries have the same key, the first one added wins,
+ * exactly like a linear search would.
+ */
+template<typename KeyTraits>
+class PyinsaneRegistryIndex
+{
+public:
+    typedef typename KeyTraits::Key Key;
+
+    PyinsaneRegistryIndex(size_t nbKeys)
+    {
+        size_t size = 4;
+
+        while (size < 2 * nbKeys) {
+            size *= 2;
+        }
+        mMask = size - 1;
+        mPositions.assign(size, -1);
+        mKeys.resize(size);
+    }
+
+    void Add(const Key &key, int position)
+    {
+        size_t slot = KeyTraits::Hash(key) & mMask;
+
+        while (mPositions[slot] >= 0) {
+            if (KeyTraits::Equal(mKeys[slot], key))
+                return;
+            slot = (slot + 1) & mMask;
+        }
+        mPositions[slot] = position;
+        mKeys[slot] = key;
+    }
+
+    // -1 if not found
+    int Find(const Key &key) const
+    {
+        size_t slot = KeyTraits::Hash(key) & mMask;
+
+        while (mPositions[slot] >= 0) {
+            if (KeyTraits::Equal(mKeys[slot], key))
+                return mPositions[slot];
+            slot = (slot + 1) & mMask;
+        }
+        return -1;
+    }
+
+private:
+    size_t mMask;
+    std::vector<int> mPositions; // -1 == empty slot
+    std::vector<Key> mKeys;
+};
+
+static inline size_t registry_hash_bytes(const void *data, size_t nb_bytes)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    uint32_t hash = 2166136261U; // FNV-1a
+    size_t i;
+
+    for (i = 0 ; i < nb_bytes ; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+// Names are not always NUL-terminated (tokens of "a,b,c")
+struct registry_name {
+    const char *str;
+    size_t len;
+};
+
+struct RegistryNameKey {
+    typedef struct registry_name Key;
+
+    static size_t Hash(const Key &key)
+    {
+        return registry_hash_bytes(key.str, key.len);
+    }
+
+    static bool Equal(const Key &a, const Key &b)
+    {
+        return a.len == b.len && memcmp(a.str, b.str, a.len) == 0;
+    }
+};
+
+struct RegistryIntKey {
+    typedef long Key;
+
+    static size_t Hash(const Key &key)
+    {
+        // Fibonacci hashing: the values are often small and consecutive, or
+        // powers of 2
+        return (size_t)(((uint32_t)key * 2654435769U) >> 8);
+    }
+
+    static bool Equal(const Key &a, const Key &b)
+    {
+        return a == b;
+    }
+};
+
+struct RegistryClsidKey {
+    typedef CLSID Key;
+
+    static size_t Hash(const Key &key)
+    {
+        return registry_hash_bytes(&key, sizeof(key));
+    }
+
+    static bool Equal(const Key &a, const Key &b)
+    {
+        return IsEqualGUID(a, b) ? true : false;
+    }
+};
+
+#endif
@@ -0,0 +1,1011 @@
+/*
+ * Fake WIA transfers: a thread plays the role of IWiaTransfer::Download() and
+ * drives PyinsaneWiaTransferCallback exactly like a WIA driver would.
+ *
+ * Also gives access to the property registry (properties.cpp), with the
+ * stand-in values of compat/wia.h, and to a fake property store: what
+ * IWiaPropertyStorage would return for an item having all the properties
+ * (see mock.h).
+ * And to the device pool (devices.cpp), with fake items.
+ *
+ * Built only on the platforms where WIA is not available, on top of
+ * compat/windows.h, so the transfer code can be tested without Windows nor a
+ * scanner.
+ */
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <Python.h>
+
+#include <windows.h>
+#include <wia.h>
+
+#include "devices.h"
+#include "mock.h"
+#include "properties.h"
+#include "ring.h"
+#include "snapshot.h"
+#include "telemetry.h"
+#include "transfer.h"
+
+#define WIA_PYCAPSULE_FAKE_DOWNLOAD_NAME "Pyinsane fake WIA download"
+#define WIA_PYCAPSULE_FAKE_STORE_NAME "Pyinsane fake WIA property store"
+#define WIA_PYCAPSULE_FAKE_POOL_NAME "Pyinsane fake WIA device pool"
+#define WIA_PYCAPSULE_FAKE_HANDLE_NAME "Pyinsane fake WIA handle"
+
+// how the fake driver tells where the pages end
+enum fake_page_end {
+    // end of transfer after each page: one page per download
+    FAKE_END_OF_TRANSFER = 0,
+    // end of stream after each page, end of transfer at the end: multi-page
+    // download (feeder, WIA_IPS_PAGES = 0)
+    FAKE_END_OF_STREAM = 1,
+    // nothing but the next call to GetNextStream(), end of transfer at the
+    // end
+    FAKE_NEXT_STREAM = 2,
+};
+
+struct fake_download {
+    std::thread thread;
+    PyObject *ring_capsule;
+    PyinsaneRing *ring;
+    PyObject *telemetry_capsule; // may be Py_None
+    PyinsaneTransferTelemetry *telemetry; // may be NULL
+    size_t page_size;
+    int nb_pages;
+    size_t chunk_size;
+    bool mapped;
+    enum fake_page_end page_end;
+
+    // results
+    HRESULT hr;
+    size_t written;
+    // calls made once the scan was cancelled that were still accepted
+    int nb_calls_after_cancel;
+    ULONG callbacks_refcount; // after the last Release(): must be 0
+    int joined;
+};
+
+
+static int get_data_wrapper(const void *data, int nb_bytes, void *cb_data)
+{
+    return ((struct fake_download *)cb_data)->ring->Write(data, nb_bytes);
+}
+
+
+static int end_of_page_wrapper(void *cb_data)
+{
+    return ((struct fake_download *)cb_data)->ring->EndOfPage();
+}
+
+
+static int end_of_scan_wrapper(void *cb_data)
+{
+    return ((struct fake_download *)cb_data)->ring->EndOfScan();
+}
+
+
+static int status_wrapper(int, void *cb_data)
+{
+    return ((struct fake_download *)cb_data)->ring->Tick();
+}
+
+
+/* Same as fill_pattern() in pyinsane2/native/testing.cpp */
+static void fill_pattern(uint8_t *out, size_t nb_bytes, size_t offset, int page)
+{
+    size_t i;
+
+    for (i = 0 ; i < nb_bytes ; i++) {
+        out[i] = (uint8_t)((offset + i + page * 7) % 251);
+    }
+}
+
+
+static HRESULT fake_transfer(struct fake_download *fd, IWiaTransferCallback *callbacks)
+{
+    PyinsaneCancelToken *token = fd->ring->GetCancelToken();
+    WiaTransferParams params;
+    IStream *stream;
+    uint8_t *chunk;
+    size_t offset, nb;
+    ULONG written;
+    HRESULT hr = S_OK;
+    bool cancelled;
+    int page;
+
+    chunk = (uint8_t *)malloc(fd->chunk_size);
+
+    for (page = 0 ; page < fd->nb_pages ; page++) {
+        hr = callbacks->GetNextStream(0, NULL, NULL, &stream);
+        if (FAILED(hr))
+            goto end;
+
+        for (offset = 0 ; offset < fd->page_size ; offset += nb) {
+            memset(&params, 0, sizeof(params));
+            params.lMessage = WIA_TRANSFER_MSG_STATUS;
+            params.lPercentComplete = (LONG)(offset * 100 / fd->page_size);
+            params.ulTransferredBytes = offset;
+            cancelled = token->IsCancelled();
+            hr = callbacks->TransferCallback(0, &params);
+            if (hr == S_FALSE) {
+                // cancelled by the application
+                stream->Release();
+                goto end;
+            }
+            if (cancelled)
+                fd->nb_calls_after_cancel++;
+
+            nb = fd->chunk_size;
+            if (nb > fd->page_size - offset)
+                nb = fd->page_size - offset;
+            fill_pattern(chunk, nb, offset, page);
+            cancelled = token->IsCancelled();
+            hr = stream->Write(chunk, (ULONG)nb, &written);
+            if (FAILED(hr)) {
+                stream->Release();
+                goto end;
+            }
+            if (cancelled)
+                fd->nb_calls_after_cancel++;
+            fd->written += written;
+        }
+
+        stream->Release();
+        memset(&params, 0, sizeof(params));
+        params.lMessage = WIA_TRANSFER_MSG_STATUS;
+        params.lPercentComplete = 100;
+        params.ulTransferredBytes = fd->page_size;
+        callbacks->TransferCallback(0, &params);
+
+        // warming up, paper jam, etc: reported, but not fatal
+        memset(&params, 0, sizeof(params));
+        params.lMessage = WIA_TRANSFER_MSG_DEVICE_STATUS;
+        params.hrErrorStatus = WIA_STATUS_WARMING_UP;
+        callbacks->TransferCallback(0, &params);
+
+        if (fd->page_end == FAKE_NEXT_STREAM)
+            continue;
+        memset(&params, 0, sizeof(params));
+        params.lMessage = (fd->page_end == FAKE_END_OF_STREAM
+                ? WIA_TRANSFER_MSG_END_OF_STREAM : WIA_TRANSFER_MSG_END_OF_TRANSFER);
+        params.lPercentComplete = 100;
+        params.ulTransferredBytes = fd->page_size;
+        callbacks->TransferCallback(0, &params);
+    }
+
+    if (fd->page_end != FAKE_END_OF_TRANSFER) {
+        memset(&params, 0, sizeof(params));
+        params.lMessage = WIA_TRANSFER_MSG_END_OF_TRANSFER;
+        params.lPercentComplete = 100;
+        callbacks->TransferCallback(0, &params);
+    }
+
+end:
+    free(chunk);
+    return hr;
+}
+
+
+static void run_fake_download(struct fake_download *fd)
+{
+    PyinsaneWiaTransferCallback *callbacks;
+
+    // same sequence as download() in rawapi.cpp
+    callbacks = new PyinsaneWiaTransferCallback(
+        get_data_wrapper, end_of_page_wrapper, end_of_scan_wrapper, status_wrapper,
+        fd, fd->mapped, NULL, fd->ring->GetCancelToken(), fd->telemetry
+    );
+    fd->hr = fake_transfer(fd, callbacks);
+    fd->callbacks_refcount = callbacks->Release();
+    if (!fd->ring->IsAborted())
+        end_of_scan_wrapper(fd);
+}
+
+
+static void free_fake_download(PyObject *capsule)
+{
+    struct fake_download *fd;
+
+    fd = (struct fake_download *)PyCapsule_GetPointer(capsule, WIA_PYCAPSULE_FAKE_DOWNLOAD_NAME);
+    if (!fd->joined) {
+        fd->ring->Abort();
+        Py_BEGIN_ALLOW_THREADS;
+        fd->thread.join();
+        Py_END_ALLOW_THREADS;
+        Py_DECREF(fd->ring_capsule);
+        Py_DECREF(fd->telemetry_capsule);
+    }
+    delete fd;
+}
+
+
+static PyObject *fake_download(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyinsaneRing *ring;
+    Py_ssize_t page_size, chunk_size;
+    int nb_pages;
+    int mapped = 0;
+    PyObject *telemetry_capsule = Py_None;
+    PyinsaneTransferTelemetry *telemetry = NULL;
+    int page_end = FAKE_END_OF_TRANSFER;
+    struct fake_download *fd;
+
+    if (!PyArg_ParseTuple(args, "Onin|iOi", &capsule, &page_size, &nb_pages, &chunk_size,
+                &mapped, &telemetry_capsule, &page_end)) {
+        return NULL;
+    }
+    if (page_end < FAKE_END_OF_TRANSFER || page_end > FAKE_NEXT_STREAM) {
+        PyErr_SetString(PyExc_ValueError, "fake_download(): invalid page end");
+        return NULL;
+    }
+    ring = (PyinsaneRing *)PyCapsule_GetPointer(capsule, NATIVE_PYCAPSULE_RING_NAME);
+    if (ring == NULL) {
+        return NULL;
+    }
+    if (telemetry_capsule != Py_None) {
+        telemetry = (PyinsaneTransferTelemetry *)PyCapsule_GetPointer(
+            telemetry_capsule, NATIVE_PYCAPSULE_TELEMETRY_NAME
+        );
+        if (telemetry == NULL) {
+            return NULL;
+        }
+    }
+    if (page_size <= 0 || nb_pages < 0 || chunk_size <= 0) {
+        PyErr_SetString(PyExc_ValueError, "fake_download(): invalid sizes");
+        return NULL;
+    }
+
+    fd = new struct fake_download();
+    fd->ring_capsule = capsule;
+    Py_INCREF(capsule);
+    fd->ring = ring;
+    fd->telemetry_capsule = telemetry_capsule;
+    Py_INCREF(telemetry_capsule);
+    fd->telemetry = telemetry;
+    fd->page_size = page_size;
+    fd->nb_pages = nb_pages;
+    fd->chunk_size = chunk_size;
+    fd->mapped = (mapped != 0);
+    fd->page_end = (enum fake_page_end)page_end;
+    fd->hr = S_OK;
+    fd->written = 0;
+    fd->nb_calls_after_cancel = 0;
+    fd->callbacks_refcount = 1;
+    fd->joined = 0;
+    fd->thread = std::thread(run_fake_download, fd);
+
+    return PyCapsule_New(fd, WIA_PYCAPSULE_FAKE_DOWNLOAD_NAME, free_fake_download);
+}
+
+
+static PyObject *fake_download_join(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    struct fake_download *fd;
+
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        return NULL;
+    }
+    fd = (struct fake_download *)PyCapsule_GetPointer(capsule, WIA_PYCAPSULE_FAKE_DOWNLOAD_NAME);
+    if (fd == NULL) {
+        return NULL;
+    }
+
+    if (!fd->joined) {
+        Py_BEGIN_ALLOW_THREADS;
+        fd->thread.join();
+        Py_END_ALLOW_THREADS;
+        fd->joined = 1;
+        Py_DECREF(fd->ring_capsule);
+        Py_DECREF(fd->telemetry_capsule);
+    }
+
+    return Py_BuildValue(
+        "{s:l,s:n,s:i,s:k}",
+        "hr", (long)fd->hr,
+        "written", (Py_ssize_t)fd->written,
+        "calls_after_cancel", fd->nb_calls_after_cancel,
+        "callbacks_refcount", (unsigned long)fd->callbacks_refcount
+    );
+}
+
+
+/*!
+ * mapped_stream_copy_to(data, position, nb, cancel_dst=False): what
+ * IStream::CopyTo() does from a mapped stream holding 'data' (pointer at
+ * 'position') to another one (refusing any write if 'cancel_dst').
+ */
+static PyObject *mapped_stream_copy_to(PyObject *, PyObject *args)
+{
+    Py_buffer data;
+    Py_ssize_t position;
+    unsigned long long nb;
+    int cancel_dst = 0;
+    PyinsaneMappedStore *src_store, *dst_store;
+    PyinsaneMappedImageStream *src, *dst;
+    PyinsaneCancelToken *token;
+    ULARGE_INTEGER cb, nb_read, nb_written;
+    HRESULT hr;
+    PyObject *out;
+
+    if (!PyArg_ParseTuple(args, "s*nK|i", &data, &position, &nb, &cancel_dst)) {
+        return NULL;
+    }
+    src_store = new PyinsaneMappedStore();
+    dst_store = new PyinsaneMappedStore();
+    if (!src_store->IsValid() || !dst_store->IsValid()
+            || !src_store->Write(data.buf, data.len)
+            || !src_store->Seek(position, MAPPED_SEEK_SET, NULL)) {
+        delete src_store;
+        delete dst_store;
+        PyBuffer_Release(&data);
+        PyErr_SetString(PyExc_ValueError, "mapped_stream_copy_to(): invalid arguments");
+        return NULL;
+    }
+    PyBuffer_Release(&data);
+
+    token = new PyinsaneCancelToken();
+    if (cancel_dst)
+        token->Cancel();
+    src = new PyinsaneMappedImageStream(src_store, NULL, NULL);
+    dst = new PyinsaneMappedImageStream(dst_store, NULL, NULL, token);
+    token->Release();
+
+    cb.QuadPart = nb;
+    nb_read.QuadPart = nb_written.QuadPart = 0xDEADBEEF;
+    Py_BEGIN_ALLOW_THREADS;
+    hr = src->CopyTo(dst, cb, &nb_read, &nb_written);
+    Py_END_ALLOW_THREADS;
+
+    out = Py_BuildValue(
+        "{s:l,s:K,s:K,s:K,s:N}",
+        "hr", (long)hr,
+        "read", (unsigned long long)nb_read.QuadPart,
+        "written", (unsigned long long)nb_written.QuadPart,
+        "position", (unsigned long long)src_store->GetPosition(),
+        "copied", PyBytes_FromStringAndSize(dst_store->GetData(), dst_store->GetSize())
+    );
+    src->Release();
+    dst->Release();
+    return out;
+}
+
+
+static const struct wia_property *get_property(int idx)
+{
+    if (idx < 0 || idx >= wia_get_nb_properties()) {
+        PyErr_SetString(PyExc_IndexError, "Invalid property index");
+        return NULL;
+    }
+    return &g_wia_all_properties[idx];
+}
+
+
+static PyObject *property_count(PyObject *, PyObject *)
+{
+    return PyLong_FromLong(wia_get_nb_properties());
+}
+
+
+static PyObject *property_info(PyObject *, PyObject *args)
+{
+    const struct wia_property *property;
+    int idx;
+
+    if (!PyArg_ParseTuple(args, "i", &idx)) {
+        return NULL;
+    }
+    property = get_property(idx);
+    if (property == NULL) {
+        return NULL;
+    }
+    return Py_BuildValue("(sk)", property->name, (unsigned long)property->id);
+}
+
+
+static PyObject *property_find(PyObject *, PyObject *args)
+{
+    const char *name;
+
+    if (!PyArg_ParseTuple(args, "s", &name)) {
+        return NULL;
+    }
+    return PyLong_FromLong(wia_find_property(name, strlen(name)));
+}
+
+
+static PyObject *property_find_by_id(PyObject *, PyObject *args)
+{
+    unsigned long id;
+
+    if (!PyArg_ParseTuple(args, "k", &id)) {
+        return NULL;
+    }
+    return PyLong_FromLong(wia_find_property_by_id((PROPID)id));
+}
+
+
+static PyObject *property_decode(PyObject *, PyObject *args)
+{
+    const struct wia_property *property;
+    int idx;
+    long value;
+
+    if (!PyArg_ParseTuple(args, "il", &idx, &value)) {
+        return NULL;
+    }
+    property = get_property(idx);
+    if (property == NULL) {
+        return NULL;
+    }
+    return int_to_pyobject(property, value);
+}
+
+
+static PyObject *property_encode(PyObject *, PyObject *args)
+{
+    const struct wia_property *property;
+    PyObject *pyvalue;
+    int idx;
+    int value;
+
+    if (!PyArg_ParseTuple(args, "iO", &idx, &pyvalue)) {
+        return NULL;
+    }
+    property = get_property(idx);
+    if (property == NULL) {
+        return NULL;
+    }
+    value = pyobject_to_int(property, pyvalue, INT_MIN);
+    if (PyErr_Occurred()) {
+        // warnings turned into errors
+        return NULL;
+    }
+    if (value == INT_MIN) {
+        Py_RETURN_NONE;
+    }
+    return PyLong_FromLong(value);
+}
+
+
+// name -> CLSID -> name
+static PyObject *property_clsid_roundtrip(PyObject *, PyObject *args)
+{
+    const struct wia_property *property;
+    PyObject *pyvalue;
+    CLSID *clsid;
+    int idx;
+
+    if (!PyArg_ParseTuple(args, "iO", &idx, &pyvalue)) {
+        return NULL;
+    }
+    property = get_property(idx);
+    if (property == NULL) {
+        return NULL;
+    }
+    if (property->vartype != VT_CLSID) {
+        PyErr_SetString(PyExc_ValueError, "Not a CLSID property");
+        return NULL;
+    }
+    if (!pyobject_to_clsid(property, pyvalue, &clsid)) {
+        if (PyErr_Occurred()) {
+            return NULL;
+        }
+        Py_RETURN_NONE;
+    }
+    return clsid_to_pyobject(property, *clsid);
+}
+
+
+// Results of ReadMultiple() and GetPropertyAttributes() for all the
+// properties of the registry, in the same order
+struct fake_property_store : public mock_property_store {
+    PyinsanePropertySnapshot *snapshot;
+};
+
+static void free_fake_property_store(PyObject *capsule)
+{
+    struct fake_property_store *store;
+
+    store = (struct fake_property_store *)PyCapsule_GetPointer(capsule, WIA_PYCAPSULE_FAKE_STORE_NAME);
+    delete store->snapshot;
+    delete store;
+}
+
+
+static struct fake_property_store *capsule2store(PyObject *capsule, int idx)
+{
+    struct fake_property_store *store;
+
+    store = (struct fake_property_store *)PyCapsule_GetPointer(capsule, WIA_PYCAPSULE_FAKE_STORE_NAME);
+    if (store == NULL) {
+        return NULL;
+    }
+    if (idx < -1 || idx >= (int)store->values.size()) {
+        PyErr_SetString(PyExc_IndexError, "Invalid property index");
+        return NULL;
+    }
+    return store;
+}
+
+
+static PyObject *fake_property_store_new(PyObject *, PyObject *)
+{
+    struct fake_property_store *store;
+
+    store = new fake_property_store();
+    mock_property_store_init(store);
+    store->snapshot = new PyinsanePropertySnapshot(wia_get_nb_properties());
+
+    return PyCapsule_New(store, WIA_PYCAPSULE_FAKE_STORE_NAME, free_fake_property_store);
+}
+
+
+// Changes the value of an integer property (None: not available anymore),
+// like the driver would. If 'written' is true, like the application would
+// (see set_property() in rawapi.cpp)
+static PyObject *fake_property_store_set(PyObject *, PyObject *args)
+{
+    struct fake_property_store *store;
+    PyObject *capsule;
+    PyObject *value;
+    int idx;
+    int written = 0;
+
+    if (!PyArg_ParseTuple(args, "OiO|p", &capsule, &idx, &value, &written)) {
+        return NULL;
+    }
+    store = capsule2store(capsule, idx);
+    if (store == NULL) {
+        return NULL;
+    }
+    if (idx < 0) {
+        PyErr_SetString(PyExc_IndexError, "Invalid property index");
+        return NULL;
+    }
+
+    if (value == Py_None) {
+        store->values[idx].vt = 0;
+    } else {
+        if (g_wia_all_properties[idx].vartype != VT_I4
+                && g_wia_all_properties[idx].vartype != VT_UI4) {
+            PyErr_SetString(PyExc_ValueError, "Not an integer property");
+            return NULL;
+        }
+        store->values[idx].vt = g_wia_all_properties[idx].vartype;
+        store->values[idx].lVal = PyLong_AsLong(value);
+        if (PyErr_Occurred()) {
+            return NULL;
+        }
+    }
+    if (written) {
+        store->snapshot->MarkWritten(idx);
+    }
+    Py_RETURN_NONE;
+}
+
+
+// Same as get_options() in rawapi.cpp
+static PyObject *fake_get_options(PyObject *, PyObject *args)
+{
+    struct fake_property_store *store;
+    PyObject *capsule;
+
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        return NULL;
+    }
+    store = capsule2store(capsule, -1);
+    if (store == NULL) {
+        return NULL;
+    }
+    return options_to_pydict(store->snapshot, store->values.data(), store->attributes.data(),
+            store->constraints.data());
+}
+
+
+// Same as get_properties() in rawapi.cpp
+static PyObject *fake_get_properties(PyObject *, PyObject *args)
+{
+    struct fake_property_store *store;
+    PyObject *capsule;
+
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        return NULL;
+    }
+    store = capsule2store(capsule, -1);
+    if (store == NULL) {
+        return NULL;
+    }
+    return properties_to_pylist(store->snapshot, store->values.data(), NULL, NULL);
+}
+
+
+// Same as get_property_changes() in rawapi.cpp
+static PyObject *fake_get_property_changes(PyObject *, PyObject *args)
+{
+    struct fake_property_store *store;
+    PyObject *capsule;
+    std::vector<int> changes;
+    std::vector<ULONG> attributes;
+    std::vector<PROPVARIANT> constraints;
+    size_t i;
+    PyObject *all_props;
+    PyObject *all_constraints;
+    PyObject *removed;
+
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        return NULL;
+    }
+    store = capsule2store(capsule, -1);
+    if (store == NULL) {
+        return NULL;
+    }
+
+    removed = PyList_New(0);
+    if (removed == NULL) {
+        return NULL;
+    }
+    all_props = properties_to_pylist(store->snapshot, store->values.data(), &changes, removed);
+    if (all_props == NULL) {
+        Py_DECREF(removed);
+        return NULL;
+    }
+    // the constraints are only read for the properties that changed
+    for (i = 0 ; i < changes.size() ; i++) {
+        attributes.push_back(store->attributes[changes[i]]);
+        constraints.push_back(store->constraints[changes[i]]);
+    }
+    all_constraints = constraints_to_pylist(store->snapshot, &changes, attributes.data(),
+            constraints.data());
+    if (all_constraints == NULL) {
+        Py_DECREF(all_props);
+        Py_DECREF(removed);
+        return NULL;
+    }
+    return Py_BuildValue("(NNN)", all_props, all_constraints, removed);
+}
+
+
+// What the lookups used to be: linear searches. Only kept as a baseline for
+// benchmarks/bench_properties.py.
+
+static PyObject *property_find_linear(PyObject *, PyObject *args)
+{
+    const char *name;
+    int i;
+
+    if (!PyArg_ParseTuple(args, "s", &name)) {
+        return NULL;
+    }
+    for (i = 0 ; g_wia_all_properties[i].name != NULL ; i++) {
+        if (strcmp(g_wia_all_properties[i].name, name) == 0)
+            return PyLong_FromLong(i);
+    }
+    return PyLong_FromLong(-1);
+}
+
+
+static PyObject *property_find_by_id_linear(PyObject *, PyObject *args)
+{
+    unsigned long id;
+    int i;
+
+    if (!PyArg_ParseTuple(args, "k", &id)) {
+        return NULL;
+    }
+    for (i = 0 ; g_wia_all_properties[i].name != NULL ; i++) {
+        if (g_wia_all_properties[i].id == (PROPID)id)
+            return PyLong_FromLong(i);
+    }
+    return PyLong_FromLong(-1);
+}
+
+
+static PyObject *property_decode_linear(PyObject *, PyObject *args)
+{
+    const struct wia_property *property;
+    const struct wia_prop_int *values;
+    int idx;
+    long value;
+    int i;
+
+    if (!PyArg_ParseTuple(args, "il", &idx, &value)) {
+        return NULL;
+    }
+    property = get_property(idx);
+    if (property == NULL) {
+        return NULL;
+    }
+    values = (const struct wia_prop_int *)property->possible_values;
+    for (i = 0 ; values != NULL && values[i].name != NULL ; i++) {
+        if (values[i].value == value)
+            return PyUnicode_FromString(values[i].name);
+    }
+    return PyLong_FromLong(value);
+}
+
+
+// Device pool, with fake items standing for IWiaItem2 (devices and their
+// sources)
+
+static std::atomic<long> g_fake_items_alive(0);
+
+class FakeWiaItem : public IUnknown
+{
+public:
+    FakeWiaItem() : mRefCount(1)
+    {
+        g_fake_items_alive++;
+    }
+
+    virtual ~FakeWiaItem()
+    {
+        g_fake_items_alive--;
+    }
+
+    virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID, void **ppvObject)
+    {
+        *ppvObject = NULL;
+        return E_NOINTERFACE;
+    }
+
+    virtual ULONG STDMETHODCALLTYPE AddRef()
+    {
+        return ++mRefCount;
+    }
+
+    virtual ULONG STDMETHODCALLTYPE Release()
+    {
+        ULONG refs = --mRefCount;
+        if (refs == 0)
+            delete this;
+        return refs;
+    }
+
+private:
+    std::atomic<ULONG> mRefCount;
+};
+
+struct fake_device_pool {
+    PyinsaneDevicePool *pool;
+    int nb_sources; // of each device
+};
+
+
+static HRESULT fake_create_device(const std::wstring &devid, IUnknown **device, void *)
+{
+    if (devid.empty())
+        return E_FAIL; // no such device
+    *device = new FakeWiaItem();
+    return S_OK;
+}
+
+
+static void free_fake_device_pool(PyObject *capsule)
+{
+    struct fake_device_pool *fake;
+
+    fake = (struct fake_device_pool *)PyCapsule_GetPointer(capsule, WIA_PYCAPSULE_FAKE_POOL_NAME);
+    delete fake->pool;
+    delete fake;
+}
+
+
+static PyObject *device_pool_new(PyObject *, PyObject *args)
+{
+    struct fake_device_pool *fake;
+    int nb_sources = 2;
+
+    if (!PyArg_ParseTuple(args, "|i", &nb_sources)) {
+        return NULL;
+    }
+    fake = new fake_device_pool();
+    fake->pool = new PyinsaneDevicePool();
+    fake->nb_sources = nb_sources;
+    return PyCapsule_New(fake, WIA_PYCAPSULE_FAKE_POOL_NAME, free_fake_device_pool);
+}
+
+
+// Handle on a device or one of its sources (what the capsules of _rawapi
+// are)
+static void free_fake_handle(PyObject *capsule)
+{
+    struct device_pool_entry *entry;
+
+    entry = (struct device_pool_entry *)PyCapsule_GetPointer(capsule, WIA_PYCAPSULE_FAKE_HANDLE_NAME);
+    PyinsaneDevicePool::Release(entry);
+}
+
+
+static PyObject *device_pool_open(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    struct fake_device_pool *fake;
+    struct device_pool_entry *entry;
+    struct device_pool_source source;
+    const char *devid;
+    HRESULT hr;
+    int i;
+
+    if (!PyArg_ParseTuple(args, "Os", &capsule, &devid)) {
+        return NULL;
+    }
+    fake = (struct fake_device_pool *)PyCapsule_GetPointer(capsule, WIA_PYCAPSULE_FAKE_POOL_NAME);
+    if (fake == NULL) {
+        return NULL;
+    }
+
+    hr = fake->pool->Open(std::wstring(devid, devid + strlen(devid)), fake_create_device, NULL,
+            &entry);
+    if (FAILED(hr)) {
+        Py_RETURN_NONE;
+    }
+    if (!entry->has_sources) {
+        for (i = 0 ; i < fake->nb_sources ; i++) {
+            source.name = L"source";
+            source.item = new FakeWiaItem();
+            source.type = 0;
+            entry->sources.push_back(source);
+        }
+        entry->has_sources = true;
+    }
+    return PyCapsule_New(entry, WIA_PYCAPSULE_FAKE_HANDLE_NAME, free_fake_handle);
+}
+
+
+static PyObject *device_pool_get_sources(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    PyObject *sources;
+    struct device_pool_entry *entry;
+    size_t i;
+
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        return NULL;
+    }
+    entry = (struct device_pool_entry *)PyCapsule_GetPointer(capsule, WIA_PYCAPSULE_FAKE_HANDLE_NAME);
+    if (entry == NULL) {
+        return NULL;
+    }
+
+    sources = PyList_New(entry->sources.size());
+    if (sources == NULL) {
+        return NULL;
+    }
+    for (i = 0 ; i < entry->sources.size() ; i++) {
+        PyinsaneDevicePool::AddRef(entry);
+        capsule = PyCapsule_New(entry, WIA_PYCAPSULE_FAKE_HANDLE_NAME, free_fake_handle);
+        if (capsule == NULL) {
+            PyinsaneDevicePool::Release(entry);
+            Py_DECREF(sources);
+            return NULL;
+        }
+        PyList_SET_ITEM(sources, i, capsule);
+    }
+    return sources;
+}
+
+
+static PyObject *device_pool_is_open(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    struct device_pool_entry *entry;
+
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        return NULL;
+    }
+    entry = (struct device_pool_entry *)PyCapsule_GetPointer(capsule, WIA_PYCAPSULE_FAKE_HANDLE_NAME);
+    if (entry == NULL) {
+        return NULL;
+    }
+    return PyBool_FromLong(entry->device != NULL);
+}
+
+
+static PyObject *device_pool_flush(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    struct fake_device_pool *fake;
+
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        return NULL;
+    }
+    fake = (struct fake_device_pool *)PyCapsule_GetPointer(capsule, WIA_PYCAPSULE_FAKE_POOL_NAME);
+    if (fake == NULL) {
+        return NULL;
+    }
+    fake->pool->Flush();
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *device_pool_stats(PyObject *, PyObject *args)
+{
+    PyObject *capsule;
+    struct fake_device_pool *fake;
+    struct device_pool_stats stats;
+
+    if (!PyArg_ParseTuple(args, "O", &capsule)) {
+        return NULL;
+    }
+    fake = (struct fake_device_pool *)PyCapsule_GetPointer(capsule, WIA_PYCAPSULE_FAKE_POOL_NAME);
+    if (fake == NULL) {
+        return NULL;
+    }
+    fake->pool->GetStats(&stats);
+    return Py_BuildValue(
+        "{s:n,s:n,s:k,s:k,s:l}",
+        "devices", (Py_ssize_t)stats.devices,
+        "unused", (Py_ssize_t)stats.unused,
+        "opened", stats.opened,
+        "reused", stats.reused,
+        // all pools included
+        "items_alive", g_fake_items_alive.load()
+    );
+}
+
+
+static PyMethodDef testing_methods[] = {
+    {"fake_download", fake_download, METH_VARARGS, NULL},
+    {"fake_download_join", fake_download_join, METH_VARARGS, NULL},
+    {"mapped_stream_copy_to", mapped_stream_copy_to, METH_VARARGS, NULL},
+    {"property_count", property_count, METH_NOARGS, NULL},
+    {"property_info", property_info, METH_VARARGS, NULL},
+    {"property_find", property_find, METH_VARARGS, NULL},
+    {"property_find_by_id", property_find_by_id, METH_VARARGS, NULL},
+    {"property_decode", property_decode, METH_VARARGS, NULL},
+    {"property_encode", property_encode, METH_VARARGS, NULL},
+    {"property_clsid_roundtrip", property_clsid_roundtrip, METH_VARARGS, NULL},
+    {"fake_property_store_new", fake_property_store_new, METH_NOARGS, NULL},
+    {"fake_property_store_set", fake_property_store_set, METH_VARARGS, NULL},
+    {"fake_get_options", fake_get_options, METH_VARARGS, NULL},
+    {"fake_get_properties", fake_get_properties, METH_VARARGS, NULL},
+    {"fake_get_property_changes", fake_get_property_changes, METH_VARARGS, NULL},
+    {"property_find_linear", property_find_linear, METH_VARARGS, NULL},
+    {"property_find_by_id_linear", property_find_by_id_linear, METH_VARARGS, NULL},
+    {"property_decode_linear", property_decode_linear, METH_VARARGS, NULL},
+    {"device_pool_new", device_pool_new, METH_VARARGS, NULL},
+    {"device_pool_open", device_pool_open, METH_VARARGS, NULL},
+    {"device_pool_get_sources", device_pool_get_sources, METH_VARARGS, NULL},
+    {"device_pool_is_open", device_pool_is_open, METH_VARARGS, NULL},
+    {"device_pool_flush", device_pool_flush, METH_VARARGS, NULL},
+    {"device_pool_stats", device_pool_stats, METH_VARARGS, NULL},
+    {NULL, NULL, 0, NULL},
+};
+
+#if PY_VERSION_HEX < 0x03000000
+
+PyMODINIT_FUNC
+init_testing(void)
+{
+    if (!wia_properties_init())
+        return;
+    Py_InitModule("_testing", testing_methods);
+}
+
+#else
+
+static struct PyModuleDef testing_module = {
+    PyModuleDef_HEAD_INIT,
+    "_testing",
+    NULL /* doc */,
+    -1,
+    testing_methods,
+};
+
+PyMODINIT_FUNC PyInit__testing(void)
+{
+    if (!wia_properties_init())
+        return NULL;
+    return PyModule_Create(&testing_module);
+}
+
+#endif
@@ -17,17 +17,42 @@
 #define TRACE()
 
 
+// hands data over to 'getData' and accounts for the time the driver spends
+// waiting for it
+static int get_data(data_cb getData, const void *data, ULONG nbBytes, void *cbData,
+        PyinsaneTransferTelemetry *telemetry, PyinsaneTransferRecorder *recorder)
+{
+    std::chrono::steady_clock::time_point start;
+    int r;
+
+    if (recorder != NULL)
+        recorder->OnChunk(data, nbBytes);
+    if (telemetry == NULL)
+        return getData(data, nbBytes, cbData);
+    start = std::chrono::steady_clock::now();
+    r = getData(data, nbBytes, cbData);
+    telemetry->OnBlocked(std::chrono::steady_clock::now() - start);
+    return r;
+}
+
+
 PyinsaneImageStream::PyinsaneImageStream(
-        data_cb getData, void *cbData
-    ) : mGetData(getData), mCbData(cbData), mRefCount(1), mWritten(0)
+        data_cb getData, void *cbData, PyinsaneCancelToken *cancel,
+        PyinsaneTransferTelemetry *telemetry, PyinsaneTransferRecorder *recorder
+    ) : mWritten(0), mRefCount(1), mGetData(getData), mCbData(cbData), mCancel(cancel),
+    mTelemetry(telemetry), mRecorder(recorder)
 {
     TRACE();
+    if (mCancel != NULL)
+        mCancel->AddRef();
 }
 
 
 PyinsaneImageStream::~PyinsaneImageStream()
 {
     TRACE();
+    if (mCancel != NULL)
+        mCancel->Release();
 }
 
 
@@ -75,13 +100,22 @@ HRESULT STDMETHODCALLTYPE PyinsaneImageStream::Read(void *, ULONG, ULONG *)
 
 HRESULT STDMETHODCALLTYPE PyinsaneImageStream::Write(void const* pv, ULONG cb, ULONG* pcbWritten)
 {
+    if (mCancel != NULL && mCancel->IsCancelled()) {
+        *pcbWritten = 0;
+        return E_ABORT;
+    }
     if (cb == 0) {
         // Brother MFC-7360N ....
         *pcbWritten = 0;
         return S_OK;
     }
     TRACE();
-    mGetData(pv, cb, mCbData);
+    if (mTelemetry != NULL)
+        mTelemetry->OnChunk(cb);
+    if (!get_data(mGetData, pv, cb, mCbData, mTelemetry, mRecorder)) {
+        *pcbWritten = 0;
+        return STG_E_MEDIUMFULL;
+    }
     TRACE();
     mWritten += cb;
     *pcbWritten = cb;
@@ -182,22 +216,306 @@ ULONG STDMETHODCALLTYPE PyinsaneImageStream::Release()
     if (mRefCount == 0) {
         TRACE();
         delete this;
+        return 0;
+    }
+    return mRefCount;
+}
+
+
+PyinsaneMappedImageStream::PyinsaneMappedImageStream(
+        PyinsaneMappedStore *store, data_cb getData, void *cbData,
+        PyinsaneCancelToken *cancel, PyinsaneTransferTelemetry *telemetry,
+        PyinsaneTransferRecorder *recorder
+    ) : mStore(store), mRefCount(1), mGetData(getData), mCbData(cbData), mCancel(cancel),
+    mTelemetry(telemetry), mRecorder(recorder)
+{
+    TRACE();
+    if (mCancel != NULL)
+        mCancel->AddRef();
+}
+
+
+PyinsaneMappedImageStream::~PyinsaneMappedImageStream()
+{
+    TRACE();
+    delete mStore;
+    if (mCancel != NULL)
+        mCancel->Release();
+}
+
+
+bool PyinsaneMappedImageStream::Deliver()
+{
+    const char *data = mStore->GetData();
+    uint64_t size = mStore->GetSize();
+    uint64_t offset;
+    ULONG nb;
+
+    TRACE();
+    for (offset = 0 ; offset < size ; offset += nb) {
+        nb = (size - offset > 0x10000000 ? 0x10000000 : (ULONG)(size - offset));
+        if (!get_data(mGetData, data + offset, nb, mCbData, mTelemetry, mRecorder))
+            return false;
+    }
+    return true;
+}
+
+
+HRESULT STDMETHODCALLTYPE PyinsaneMappedImageStream::Clone(IStream **)
+{
+    fprintf(stderr, "Pyinsane: WARNING: IStream::Clone() not implemented but called !\n");
+    return E_NOTIMPL;
+}
+
+
+HRESULT STDMETHODCALLTYPE PyinsaneMappedImageStream::Commit(DWORD)
+{
+    TRACE();
+    return S_OK;
+}
+
+
+HRESULT STDMETHODCALLTYPE PyinsaneMappedImageStream::CopyTo(
+        IStream *dst, ULARGE_INTEGER cb, ULARGE_INTEGER *pcbRead, ULARGE_INTEGER *pcbWritten)
+{
+    uint64_t size = mStore->GetSize();
+    uint64_t position = mStore->GetPosition();
+    uint64_t nb = size - (position < size ? position : size);
+    uint64_t copied = 0;
+    ULONG chunk, written;
+    HRESULT hr = S_OK;
+
+    TRACE();
+    if (nb > cb.QuadPart)
+        nb = cb.QuadPart;
+    while (copied < nb) {
+        // Write() takes a ULONG
+        chunk = (nb - copied > (ULONG)-1 ? (ULONG)-1 : (ULONG)(nb - copied));
+        written = 0;
+        hr = dst->Write(mStore->GetData() + position + copied, chunk, &written);
+        if (FAILED(hr))
+            break;
+        if (written > chunk)
+            written = chunk;
+        mStore->Seek(written, MAPPED_SEEK_CUR, NULL);
+        copied += written;
+        if (written < chunk)
+            break; // destination full
+    }
+    if (pcbRead != NULL)
+        pcbRead->QuadPart = copied;
+    if (pcbWritten != NULL)
+        pcbWritten->QuadPart = copied;
+    return hr;
+}
+
+
+HRESULT STDMETHODCALLTYPE PyinsaneMappedImageStream::LockRegion(ULARGE_INTEGER, ULARGE_INTEGER, DWORD)
+{
+    return STG_E_INVALIDFUNCTION;
+}
+
+
+HRESULT STDMETHODCALLTYPE PyinsaneMappedImageStream::UnlockRegion(ULARGE_INTEGER, ULARGE_INTEGER, DWORD)
+{
+    return STG_E_INVALIDFUNCTION;
+}
+
+
+HRESULT STDMETHODCALLTYPE PyinsaneMappedImageStream::Read(void *pv, ULONG cb, ULONG *pcbRead)
+{
+    ULONG nb;
+
+    TRACE();
+    nb = (ULONG)mStore->Read(pv, cb);
+    if (pcbRead != NULL)
+        *pcbRead = nb;
+    return (nb < cb ? S_FALSE : S_OK);
+}
+
+
+HRESULT STDMETHODCALLTYPE PyinsaneMappedImageStream::Write(void const* pv, ULONG cb, ULONG* pcbWritten)
+{
+    TRACE();
+    if (mCancel != NULL && mCancel->IsCancelled()) {
+        if (pcbWritten != NULL)
+            *pcbWritten = 0;
+        return E_ABORT;
+    }
+    if (mTelemetry != NULL)
+        mTelemetry->OnChunk(cb);
+    if (!mStore->Write(pv, cb)) {
+        if (pcbWritten != NULL)
+            *pcbWritten = 0;
+        return STG_E_MEDIUMFULL;
+    }
+    if (pcbWritten != NULL)
+        *pcbWritten = cb;
+    return S_OK;
+}
+
+
+HRESULT STDMETHODCALLTYPE PyinsaneMappedImageStream::Revert()
+{
+    fprintf(stderr, "Pyinsane: WARNING: IStream::Revert() not implemented but called !\n");
+    return E_NOTIMPL;
+}
+
+
+HRESULT STDMETHODCALLTYPE PyinsaneMappedImageStream::Seek(
+        LARGE_INTEGER dlibMove, DWORD dwOrigin, ULARGE_INTEGER *plibNewPosition
+    )
+{
+    enum mapped_origin origin;
+    uint64_t position;
+
+    TRACE();
+    switch (dwOrigin) {
+        case STREAM_SEEK_SET:
+            origin = MAPPED_SEEK_SET;
+            break;
+        case STREAM_SEEK_CUR:
+            origin = MAPPED_SEEK_CUR;
+            break;
+        case STREAM_SEEK_END:
+            origin = MAPPED_SEEK_END;
+            break;
+        default:
+            return STG_E_INVALIDFUNCTION;
+    }
+    if (!mStore->Seek(dlibMove.QuadPart, origin, &position))
+        return STG_E_INVALIDFUNCTION;
+    if (plibNewPosition != NULL)
+        plibNewPosition->QuadPart = position;
+    return S_OK;
+}
+
+
+HRESULT STDMETHODCALLTYPE PyinsaneMappedImageStream::SetSize(ULARGE_INTEGER size)
+{
+    TRACE();
+    return (mStore->SetSize(size.QuadPart) ? S_OK : STG_E_MEDIUMFULL);
+}
+
+
+HRESULT STDMETHODCALLTYPE PyinsaneMappedImageStream::Stat(STATSTG *pstatstg, DWORD)
+{
+    SYSTEMTIME systemTime;
+    FILETIME fileTime;
+
+    GetSystemTime(&systemTime);
+    SystemTimeToFileTime(&systemTime, &fileTime);
+
+    TRACE();
+
+    memset(pstatstg, 0, sizeof(STATSTG));
+
+    pstatstg->type = STGTY_STREAM;
+    pstatstg->mtime = fileTime;
+    pstatstg->atime = fileTime;
+    pstatstg->grfLocksSupported = 0;
+    pstatstg->cbSize.QuadPart = mStore->GetSize();
+    pstatstg->clsid = CLSID_NULL;
+    return S_OK;
+}
+
+
+HRESULT STDMETHODCALLTYPE PyinsaneMappedImageStream::QueryInterface(REFIID riid, void **ppvObject)
+{
+    assert(NULL != ppvObject);
+
+    TRACE();
+
+    if (IsEqualIID(riid, IID_IUnknown))
+    {
+        *ppvObject = static_cast<IUnknown*>(this);
+    }
+    else if (IsEqualIID(riid, IID_IStream))
+    {
+        *ppvObject = static_cast<IStream*>(this);
+    }
+    else
+    {
+        *ppvObject = NULL;
+        fprintf(stderr, "Pyinsane: MappedStream::QueryInterface(): Unknown interface requested\n");
+        return E_NOINTERFACE;
+    }
+
+    reinterpret_cast<IUnknown*>(*ppvObject)->AddRef();
+    return S_OK;
+}
+
+
+ULONG STDMETHODCALLTYPE PyinsaneMappedImageStream::AddRef()
+{
+    TRACE();
+    mRefCount++;
+    return mRefCount;
+}
+
+
+ULONG STDMETHODCALLTYPE PyinsaneMappedImageStream::Release()
+{
+    TRACE();
+    mRefCount--;
+    if (mRefCount == 0) {
+        TRACE();
+        delete this;
+        return 0;
     }
     return mRefCount;
 }
 
 
 PyinsaneWiaTransferCallback::PyinsaneWiaTransferCallback(
-        data_cb getData, end_of_page_cb eop, end_of_scan_cb eos, void *cbData
-    ) : mGetData(getData), mEop(eop), mEos(eos), mCbData(cbData), mRefCount(1)
+        data_cb getData, end_of_page_cb eop, end_of_scan_cb eos, status_cb status,
+        void *cbData, bool mapped, const char *mapDirectory, PyinsaneCancelToken *cancel,
+        PyinsaneTransferTelemetry *telemetry, PyinsaneTransferRecorder *recorder
+    ) : mGetData(getData), mEop(eop), mEos(eos), mStatus(status), mCbData(cbData),
+    mRefCount(1), mMapped(mapped), mMapDirectory(mapDirectory), mCurrentStream(NULL),
+    mPageOpen(false), mCancel(cancel), mTelemetry(telemetry), mRecorder(recorder)
 {
     TRACE();
+    if (mCancel != NULL)
+        mCancel->AddRef();
+    if (mTelemetry != NULL)
+        mTelemetry->Start();
 }
 
 
 PyinsaneWiaTransferCallback::~PyinsaneWiaTransferCallback()
 {
     TRACE();
+    if (mCurrentStream != NULL)
+        mCurrentStream->Release();
+    if (mCancel != NULL)
+        mCancel->Release();
+}
+
+
+bool PyinsaneWiaTransferCallback::IsCancelled() const
+{
+    return (mCancel != NULL && mCancel->IsCancelled());
+}
+
+
+void PyinsaneWiaTransferCallback::EndOfPage()
+{
+    if (!mPageOpen)
+        return;
+    mPageOpen = false;
+    if (mCurrentStream != NULL) {
+        // the driver won't seek back anymore: hand over the whole page
+        mCurrentStream->Deliver();
+        mCurrentStream->Release();
+        mCurrentStream = NULL;
+    }
+    // before the reader can see the end of the page
+    if (mTelemetry != NULL)
+        mTelemetry->OnEndOfPage();
+    if (mRecorder != NULL)
+        mRecorder->OnEndOfPage();
+    mEop(mCbData); // mark the current page as finished
 }
 
 HRESULT PyinsaneWiaTransferCallback::GetNextStream(
@@ -206,8 +524,34 @@ HRESULT PyinsaneWiaTransferCallback::GetNextStream(
 #if 0
     return SHCreateStreamOnFileEx(L"C:\\pouet.bmp", STGM_READWRITE | STGM_CREATE, FILE_ATTRIBUTE_NORMAL, TRUE, NULL, ppDestination);
 #else
+    PyinsaneMappedStore *store;
+
     TRACE();
-    *ppDestination = new PyinsaneImageStream(mGetData, mCbData);
+    if (IsCancelled()) {
+        *ppDestination = NULL;
+        return E_ABORT;
+    }
+    // the previous page didn't get any end of stream / end of transfer
+    EndOfPage();
+    if (!mMapped) {
+        *ppDestination = new PyinsaneImageStream(mGetData, mCbData, mCancel, mTelemetry,
+                mRecorder);
+        mPageOpen = true;
+        return S_OK;
+    }
+
+    store = new PyinsaneMappedStore(mMapDirectory);
+    if (!store->IsValid()) {
+        fprintf(stderr, "Pyinsane: WARNING: failed to create the mapped stream\n");
+        delete store;
+        return E_OUTOFMEMORY;
+    }
+    mPageOpen = true;
+    // one reference for the driver, one for us (see TransferCallback())
+    mCurrentStream = new PyinsaneMappedImageStream(store, mGetData, mCbData, mCancel,
+            mTelemetry, mRecorder);
+    mCurrentStream->AddRef();
+    *ppDestination = mCurrentStream;
     TRACE();
     return S_OK;
 #endif
@@ -217,8 +561,35 @@ HRESULT PyinsaneWiaTransferCallback::GetNextStream(
 HRESULT PyinsaneWiaTransferCallback::TransferCallback(LONG, WiaTransferParams *params)
 {
     TRACE();
-    if (params->lMessage == WIA_TRANSFER_MSG_END_OF_TRANSFER) {
-        mEop(mCbData); // mark the current page as finished
+    if (mTelemetry != NULL) {
+        mTelemetry->OnCallback();
+        if (params->hrErrorStatus != S_OK)
+            mTelemetry->OnError(params->hrErrorStatus);
+        if (params->lMessage == WIA_TRANSFER_MSG_STATUS)
+            mTelemetry->OnProgress(params->lPercentComplete, params->ulTransferredBytes);
+    }
+    if (mRecorder != NULL && params->lMessage == WIA_TRANSFER_MSG_STATUS)
+        mRecorder->OnStatus(params->lPercentComplete, params->ulTransferredBytes);
+    if (IsCancelled()) {
+        // a scan wrongly started must not hold the device until the end of
+        // the page
+        if (mCurrentStream != NULL) {
+            mCurrentStream->Release();
+            mCurrentStream = NULL;
+        }
+        mPageOpen = false;
+        return S_FALSE;
+    }
+    if (params->lMessage == WIA_TRANSFER_MSG_END_OF_STREAM
+            || params->lMessage == WIA_TRANSFER_MSG_END_OF_TRANSFER) {
+        // With multi-page transfers (feeder, WIA_IPS_PAGES = 0), drivers
+        // send an end of stream after each page, and the end of transfer
+        // once all the pages are done. Others only send an end of transfer
+        // after each page.
+        EndOfPage();
+    } else if (params->lMessage == WIA_TRANSFER_MSG_STATUS) {
+        if (!mStatus(params->lPercentComplete, mCbData))
+            return S_FALSE; // cancel the transfer
     }
     return S_OK;
 }
@@ -267,6 +638,7 @@ ULONG STDMETHODCALLTYPE PyinsaneWiaTransferCallback::Release()
     if (mRefCount == 0) {
         TRACE();
         delete this;
+        return 0;
     }
     return mRefCount;
 }
@@ -7,14 +7,24 @@
 #include <wia.h>
 #include <Sti.h>
 
-typedef void (*data_cb)(const void *data, int nb_bytes, void *cb_data);
-typedef void (*end_of_page_cb)(void *cb_data);
-typedef void (*end_of_scan_cb)(void *cb_data);
+#include "cancel.h"
+#include "mapped.h"
+#include "record.h"
+#include "telemetry.h"
+
+// callbacks return 0 if the transfer must be interrupted
+typedef int (*data_cb)(const void *data, int nb_bytes, void *cb_data);
+typedef int (*end_of_page_cb)(void *cb_data);
+typedef int (*end_of_scan_cb)(void *cb_data);
+// called each time the driver reports its progress
+typedef int (*status_cb)(int percent, void *cb_data);
 
 class PyinsaneImageStream : public IStream
 {
 public:
-    PyinsaneImageStream(data_cb getData, void *cbData);
+    PyinsaneImageStream(data_cb getData, void *cbData, PyinsaneCancelToken *cancel = NULL,
+            PyinsaneTransferTelemetry *telemetry = NULL,
+            PyinsaneTransferRecorder *recorder = NULL);
     ~PyinsaneImageStream();
 
     virtual HRESULT STDMETHODCALLTYPE Clone(IStream **);
@@ -38,12 +48,72 @@ private:
     int mRefCount;
     data_cb mGetData;
     void *mCbData;
+    PyinsaneCancelToken *mCancel;
+    PyinsaneTransferTelemetry *mTelemetry;
+    PyinsaneTransferRecorder *mRecorder;
+};
+
+/*!
+ * Seekable stream, for the drivers that need to go back and patch what they
+ * wrote (TIFF, multipage, some PNG / JPEG writers). The page is kept in a
+ * memory mapping (see PyinsaneMappedStore) and handed to 'getData' at once,
+ * when the driver reports the end of the transfer (see Deliver()).
+ */
+class PyinsaneMappedImageStream : public IStream
+{
+public:
+    PyinsaneMappedImageStream(PyinsaneMappedStore *store, data_cb getData, void *cbData,
+            PyinsaneCancelToken *cancel = NULL, PyinsaneTransferTelemetry *telemetry = NULL,
+            PyinsaneTransferRecorder *recorder = NULL);
+    ~PyinsaneMappedImageStream();
+
+    bool Deliver();
+
+    virtual HRESULT STDMETHODCALLTYPE Clone(IStream **);
+    virtual HRESULT STDMETHODCALLTYPE Commit(DWORD);
+    virtual HRESULT STDMETHODCALLTYPE CopyTo(IStream*, ULARGE_INTEGER, ULARGE_INTEGER*, ULARGE_INTEGER*);
+    virtual HRESULT STDMETHODCALLTYPE LockRegion(ULARGE_INTEGER, ULARGE_INTEGER, DWORD);
+    virtual HRESULT STDMETHODCALLTYPE Read(void* pv, ULONG cb, ULONG* pcbRead);
+    virtual HRESULT STDMETHODCALLTYPE Revert();
+    virtual HRESULT STDMETHODCALLTYPE Seek(LARGE_INTEGER liDistanceToMove, DWORD dwOrigin,
+            ULARGE_INTEGER* lpNewFilePointer);
+    virtual HRESULT STDMETHODCALLTYPE SetSize(ULARGE_INTEGER);
+    virtual HRESULT STDMETHODCALLTYPE Stat(STATSTG* pStatstg, DWORD grfStatFlag);
+    virtual HRESULT STDMETHODCALLTYPE UnlockRegion(ULARGE_INTEGER, ULARGE_INTEGER, DWORD);
+    virtual HRESULT STDMETHODCALLTYPE Write(void const* pv, ULONG cb, ULONG* pcbWritten);
+    virtual HRESULT STDMETHODCALLTYPE QueryInterface(const IID &,void **);
+    virtual ULONG STDMETHODCALLTYPE AddRef();
+    virtual ULONG STDMETHODCALLTYPE Release();
+
+private:
+    PyinsaneMappedStore *mStore;
+    int mRefCount;
+    data_cb mGetData;
+    void *mCbData;
+    PyinsaneCancelToken *mCancel;
+    PyinsaneTransferTelemetry *mTelemetry;
+    PyinsaneTransferRecorder *mRecorder;
 };
 
 class PyinsaneWiaTransferCallback : public IWiaTransferCallback
 {
 public:
-    PyinsaneWiaTransferCallback(data_cb getData, end_of_page_cb eop, end_of_scan_cb eos, void *cbData);
+    // If 'mapped' is true, the driver gets seekable streams backed by a memory
+    // mapping: anonymous if 'mapDirectory' is NULL, in a temporary file in
+    // 'mapDirectory' otherwise.
+    // Once 'cancel' is cancelled, the next call of the driver to
+    // TransferCallback() or to IStream::Write() stops the transfer.
+    // If 'telemetry' is not NULL, it is restarted and then updated with
+    // everything the driver reports (see PyinsaneTransferTelemetry). It must
+    // outlive the transfer.
+    // If 'recorder' is not NULL, the data, the progress and the page
+    // boundaries are written to it as they come (the pages of mapped streams
+    // when they are handed over). It must outlive the transfer too.
+    PyinsaneWiaTransferCallback(data_cb getData, end_of_page_cb eop, end_of_scan_cb eos,
+            status_cb status, void *cbData, bool mapped = false,
+            const char *mapDirectory = NULL, PyinsaneCancelToken *cancel = NULL,
+            PyinsaneTransferTelemetry *telemetry = NULL,
+            PyinsaneTransferRecorder *recorder = NULL);
     ~PyinsaneWiaTransferCallback();
 
     // interface methods
@@ -54,11 +124,23 @@ public:
     virtual ULONG STDMETHODCALLTYPE Release();
 
 private:
+    bool IsCancelled() const;
+    // hands over the current page, if any
+    void EndOfPage();
+
     data_cb mGetData;
     end_of_page_cb mEop;
     end_of_scan_cb mEos;
+    status_cb mStatus;
     void *mCbData;
     int mRefCount;
+    bool mMapped;
+    const char *mMapDirectory;
+    PyinsaneMappedImageStream *mCurrentStream;
+    bool mPageOpen; // a stream was given to the driver, and its page not handed over yet
+    PyinsaneCancelToken *mCancel;
+    PyinsaneTransferTelemetry *mTelemetry;
+    PyinsaneTransferRecorder *mRecorder;
 };
 
 #endif
\ No newline at end of file
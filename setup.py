@@ -12,14 +12,56 @@ else:
     DEFAULT_ATL_WINDDK_LIB_DIR = "c:\\winddk\\7600.16385.1\\lib\\ATL\\i386"
 
 if os.name == "nt":
-    extensions = [
+    NATIVE_COMPILE_ARGS = []
+    NATIVE_LINK_ARGS = []
+else:
+    NATIVE_COMPILE_ARGS = ['-std=c++11', '-pthread']
+    NATIVE_LINK_ARGS = ['-pthread']
+
+# Portable parts of the transfer pipeline. Built on all platforms: they are
+# used by the backends and they can be tested without any scanner.
+extensions = [
+    Extension(
+        'pyinsane2.native._core', [
+            'pyinsane2/native/buffer.cpp',
+            'pyinsane2/native/cancel.cpp',
+            'pyinsane2/native/core.cpp',
+            'pyinsane2/native/decode.cpp',
+            'pyinsane2/native/dib.cpp',
+            'pyinsane2/native/mapped.cpp',
+            'pyinsane2/native/pixels.cpp',
+            'pyinsane2/native/pool.cpp',
+            'pyinsane2/native/record.cpp',
+            'pyinsane2/native/ring.cpp',
+            'pyinsane2/native/snapshot.cpp',
+            'pyinsane2/native/telemetry.cpp',
+            'pyinsane2/native/testing.cpp',
+            'pyinsane2/native/worker.cpp',
+        ],
+        extra_compile_args=NATIVE_COMPILE_ARGS,
+        extra_link_args=NATIVE_LINK_ARGS,
+        undef_macros=['NDEBUG'],
+    ),
+]
+
+if os.name == "nt":
+    extensions += [
         Extension(
             'pyinsane2.wia._rawapi', [
+                'pyinsane2/native/cancel.cpp',
+                'pyinsane2/native/mapped.cpp',
+                'pyinsane2/native/pool.cpp',
+                'pyinsane2/native/record.cpp',
+                'pyinsane2/native/ring.cpp',
+                'pyinsane2/native/snapshot.cpp',
+                'pyinsane2/native/telemetry.cpp',
+                'pyinsane2/wia/devices.cpp',
                 'pyinsane2/wia/properties.cpp',
                 'pyinsane2/wia/rawapi.cpp',
                 'pyinsane2/wia/transfer.cpp',
             ],
             include_dirs=[
+                "pyinsane2/native",
                 # Yeah, I know.
                 os.getenv(
                     "WINDDK_INCLUDE_DIR",
@@ -39,7 +81,79 @@ if os.name == "nt":
         ),
     ]
 else:
-    extensions = []
+    # Native side of the SANE backend: reads the frames on its own thread
+    # (see pyinsane2/sane/reader.h). libsane is still loaded by rawapi.py.
+    extensions += [
+        Extension(
+            'pyinsane2.sane._rawapi', [
+                'pyinsane2/native/cancel.cpp',
+                'pyinsane2/native/pool.cpp',
+                'pyinsane2/native/record.cpp',
+                'pyinsane2/native/ring.cpp',
+                'pyinsane2/native/telemetry.cpp',
+                'pyinsane2/sane/rawapi.cpp',
+                'pyinsane2/sane/reader.cpp',
+            ],
+            include_dirs=[
+                "pyinsane2/native",
+            ],
+            extra_compile_args=NATIVE_COMPILE_ARGS,
+            extra_link_args=NATIVE_LINK_ARGS,
+            undef_macros=['NDEBUG'],
+        ),
+    ]
+    # The WIA backend, built on top of a COM shim (wia/compat) and of a mock
+    # driver (wia/mock.cpp), so it can be tested and benchmarked without
+    # Windows: _testing gives access to its parts, _mockapi is _rawapi itself.
+    extensions += [
+        Extension(
+            'pyinsane2.wia._testing', [
+                'pyinsane2/native/cancel.cpp',
+                'pyinsane2/native/mapped.cpp',
+                'pyinsane2/native/pool.cpp',
+                'pyinsane2/native/record.cpp',
+                'pyinsane2/native/ring.cpp',
+                'pyinsane2/native/snapshot.cpp',
+                'pyinsane2/native/telemetry.cpp',
+                'pyinsane2/wia/devices.cpp',
+                'pyinsane2/wia/mock.cpp',
+                'pyinsane2/wia/properties.cpp',
+                'pyinsane2/wia/testing.cpp',
+                'pyinsane2/wia/transfer.cpp',
+            ],
+            include_dirs=[
+                "pyinsane2/wia/compat",
+                "pyinsane2/native",
+            ],
+            extra_compile_args=NATIVE_COMPILE_ARGS,
+            extra_link_args=NATIVE_LINK_ARGS,
+            undef_macros=['NDEBUG'],
+        ),
+        Extension(
+            'pyinsane2.wia._mockapi', [
+                'pyinsane2/native/cancel.cpp',
+                'pyinsane2/native/mapped.cpp',
+                'pyinsane2/native/pool.cpp',
+                'pyinsane2/native/record.cpp',
+                'pyinsane2/native/ring.cpp',
+                'pyinsane2/native/snapshot.cpp',
+                'pyinsane2/native/telemetry.cpp',
+                'pyinsane2/wia/devices.cpp',
+                'pyinsane2/wia/mock.cpp',
+                'pyinsane2/wia/properties.cpp',
+                'pyinsane2/wia/rawapi.cpp',
+                'pyinsane2/wia/transfer.cpp',
+            ],
+            include_dirs=[
+                "pyinsane2/wia/compat",
+                "pyinsane2/native",
+            ],
+            define_macros=[('WIA_MOCK', None)],
+            extra_compile_args=NATIVE_COMPILE_ARGS,
+            extra_link_args=NATIVE_LINK_ARGS,
+            undef_macros=['NDEBUG'],
+        ),
+    ]
 
 setup(
     name="pyinsane2",
@@ -83,6 +197,6 @@ setup(
         "Pillow",
     ],
     ext_modules=extensions,
-    zip_safe=(os.name != "nt"),
+    zip_safe=False,
     setup_requires=['nose>=1.0'],
 )
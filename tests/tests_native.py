@@ -0,0 +1,1995 @@
+import ctypes
+import functools
+import io
+import os
+import struct
+import sys
+import tempfile
+import threading
+import time
+import unittest
+import warnings
+
+import PIL.Image
+
+from pyinsane2.native import _core
+from pyinsane2.sane import abstract as sane_abstract
+from pyinsane2.sane import rawapi as sane_rawapi
+from pyinsane2.sane import replay as sane_replay
+
+try:
+    # only built where WIA is not available
+    from pyinsane2.wia import _testing as _wia_testing
+except ImportError:
+    _wia_testing = None
+
+try:
+    # the WIA backend on top of the mock driver (pyinsane2/wia/mock.cpp)
+    from pyinsane2.wia import _mockapi
+    sys.modules['pyinsane2.wia._rawapi'] = _mockapi
+    from pyinsane2.wia import rawapi as wia_rawapi
+    from pyinsane2.wia import abstract as wia_abstract
+except ImportError:
+    _mockapi = None
+
+
+def get_pattern(page, size):
+    # must match fill_pattern() in pyinsane2/native/testing.cpp
+    period = bytes(bytearray((i + page * 7) % 251 for i in range(251)))
+    return (period * (size // 251 + 1))[:size]
+
+
+class TestRing(unittest.TestCase):
+    def read_page(self, ring):
+        chunks = []
+        try:
+            while True:
+                chunks.append(_core.ring_read(ring))
+        except EOFError:
+            pass
+        return b"".join(chunks)
+
+    def test_invalid_args(self):
+        self.assertRaises(ValueError, _core.ring_new, 0)
+        self.assertRaises(ValueError, _core.ring_read, "crapobj")
+
+    def test_stress(self):
+        page_size = 3 * 1024 * 1024 + 17
+        nb_pages = 3
+        ring = _core.ring_new(64 * 1024)
+        producer = _core.ring_produce(ring, page_size, nb_pages, 8192)
+        for page in range(nb_pages):
+            data = self.read_page(ring)
+            self.assertEqual(len(data), page_size)
+            self.assertEqual(data, get_pattern(page, page_size))
+        self.assertRaises(StopIteration, _core.ring_read, ring)
+        # keeps saying so
+        self.assertRaises(StopIteration, _core.ring_read, ring)
+        self.assertEqual(_core.producer_join(producer), page_size * nb_pages)
+        self.assertEqual(_core.ring_get_stats(ring)['buffered'], 0)
+
+    def test_backpressure(self):
+        max_buffered = 32 * 1024
+        page_size = 1024 * 1024
+        ring = _core.ring_new(max_buffered)
+        producer = _core.ring_produce(ring, page_size, 1, 4096)
+        data = b""
+        try:
+            while True:
+                # slow consumer: the producer must wait for us
+                time.sleep(0.001)
+                stats = _core.ring_get_stats(ring)
+                self.assertTrue(stats['buffered'] <= max_buffered)
+                data += _core.ring_read(ring)
+        except EOFError:
+            pass
+        self.assertEqual(data, get_pattern(0, page_size))
+        _core.producer_join(producer)
+
+    def test_abort_wakes_up_reader(self):
+        ring = _core.ring_new(1024)
+        thread = threading.Timer(0.1, _core.ring_abort, args=(ring,))
+        thread.start()
+        self.assertRaises(IOError, _core.ring_read, ring)
+        thread.join()
+
+    def test_abort_wakes_up_producer(self):
+        ring = _core.ring_new(1024)
+        producer = _core.ring_produce(ring, 1024 * 1024, 1, 512)
+        time.sleep(0.1)
+        _core.ring_abort(ring)
+        # must not block
+        self.assertTrue(_core.producer_join(producer) < 1024 * 1024)
+
+
+class TestCoalescing(unittest.TestCase):
+    def read_all(self, ring):
+        pages = []
+        data = bytearray()
+        nb_reads = 0
+        while True:
+            try:
+                data += _core.ring_read(ring)
+                nb_reads += 1
+            except EOFError:
+                pages.append(data)
+                data = bytearray()
+            except StopIteration:
+                return (pages, nb_reads)
+
+    def test_small_writes(self):
+        page_size = 1024 * 1024
+        ring = _core.ring_new(4 * 1024 * 1024)
+        _core.ring_set_coalescing(ring, 64 * 1024, 0, 0)
+        producer = _core.ring_produce(ring, page_size, 2, 32)
+        (pages, nb_reads) = self.read_all(ring)
+        _core.producer_join(producer)
+        self.assertEqual(len(pages), 2)
+        self.assertEqual(pages[0], get_pattern(0, page_size))
+        self.assertEqual(pages[1], get_pattern(1, page_size))
+        # 64K per record, with the end of each slab and each page flushed
+        # on their own
+        stats = _core.ring_get_stats(ring)
+        self.assertTrue(stats['records'] <= 2 * (16 + 2 + 1) + 1)
+        self.assertTrue(nb_reads <= stats['records'])
+
+    def test_row_size(self):
+        ring = _core.ring_new(4 * 1024 * 1024)
+        _core.ring_set_coalescing(ring, 1024 * 1024, 3000, 0)
+        producer = _core.ring_produce(ring, 30000, 1, 16)
+        _core.producer_join(producer)
+        # published line by line (+ the rest of the last line, + end of page,
+        # + end of scan), even though min_bytes is never reached
+        nb_records = _core.ring_get_stats(ring)['records']
+        self.assertTrue(10 + 2 <= nb_records <= 10 + 3)
+
+    def test_deadline(self):
+        page_size = 2 * 1024 * 1024
+        ring = _core.ring_new(8 * 1024 * 1024, 4 * 1024 * 1024)
+        _core.ring_set_coalescing(ring, 8 * 1024 * 1024, 0, 1)
+        # 1 byte per write: without the deadline, nothing would be published
+        # before the end of the page
+        producer = _core.ring_produce(ring, page_size, 1, 1)
+        buf = _core.ring_read(ring)
+        self.assertTrue(len(buf) < page_size)
+        self.assertRaises(ValueError, _core.ring_set_coalescing, ring, -1, 0, 0)
+        del producer
+
+
+class TestBufferPool(unittest.TestCase):
+    def test_buffer_protocol(self):
+        ring = _core.ring_new(1024 * 1024, 4096)
+        producer = _core.ring_produce(ring, 10000, 1, 10000)
+        buf = _core.ring_read(ring)
+        self.assertTrue(isinstance(buf, _core.Buffer))
+        view = memoryview(buf)
+        self.assertTrue(view.readonly)
+        self.assertEqual(len(view), len(buf))
+        self.assertTrue(len(buf) <= 4096)
+        self.assertEqual(view.tobytes(), get_pattern(0, len(buf)))
+        _core.producer_join(producer)
+
+    def test_slabs_are_recycled(self):
+        slab_size = 64 * 1024
+        page_size = 8 * 1024 * 1024
+        ring = _core.ring_new(4 * slab_size, slab_size)
+        producer = _core.ring_produce(ring, page_size, 1, 16 * 1024)
+        data = bytearray()
+        try:
+            while True:
+                data += _core.ring_read(ring)
+        except EOFError:
+            pass
+        _core.producer_join(producer)
+        self.assertEqual(data, get_pattern(0, page_size))
+        stats = _core.ring_get_stats(ring)
+        # 128 slabs went through the ring, but only a few were allocated
+        self.assertTrue(stats['slabs_allocated'] <= 8)
+        self.assertTrue(stats['slabs_recycled'] >= 120)
+
+    def test_buffer_outlives_ring(self):
+        ring = _core.ring_new(1024 * 1024, 4096)
+        producer = _core.ring_produce(ring, 4096, 1, 4096)
+        buf = _core.ring_read(ring)
+        _core.producer_join(producer)
+        del producer
+        del ring
+        self.assertEqual(bytes(buf), get_pattern(0, len(buf)))
+
+
+class TestDibDecoder(unittest.TestCase):
+    def make_bmp(self, mode, size):
+        img = PIL.Image.new(mode, size)
+        img.putdata([
+            (x * 7 + y * 3) % 256 if mode in ("L", "P") else
+            ((x + y) % 2) * 255 if mode == "1" else
+            ((x * 5) % 256, (y * 3) % 256, (x + y) % 256)
+            for y in range(size[1]) for x in range(size[0])
+        ])
+        if mode == "P":
+            img.putpalette([(i * 37) % 256 for i in range(256 * 3)])
+        out = io.BytesIO()
+        img.save(out, "BMP")
+        return (img, out.getvalue())
+
+    def feed(self, dib, data, chunk_size):
+        for offset in range(0, len(data), chunk_size):
+            _core.dib_feed(dib, data[offset:offset + chunk_size])
+
+    def get_lines(self, dib, start, end):
+        (mode, rawmode, size, data, palette) = _core.dib_get_lines(dib, start, end)
+        img = PIL.Image.frombytes(mode, size, data, "raw", rawmode)
+        if palette is not None:
+            img.putpalette(palette)
+        return img
+
+    def assertSameImage(self, a, b):
+        self.assertEqual(a.size, b.size)
+        self.assertEqual(a.convert("RGB").tobytes(), b.convert("RGB").tobytes())
+
+    def test_formats(self):
+        for mode in ("RGB", "L", "P", "1"):
+            for size in ((1, 1), (13, 7), (64, 5)):
+                (img, bmp) = self.make_bmp(mode, size)
+                dib = _core.dib_new()
+                self.feed(dib, bmp, 5)
+                infos = _core.dib_get_infos(dib)
+                self.assertTrue(infos['supported'])
+                self.assertEqual((infos['width'], infos['height']), size)
+                self.assertEqual(infos['expected_size'], len(bmp))
+                self.assertEqual(_core.dib_get_available_lines(dib), (0, size[1]))
+                self.assertSameImage(self.get_lines(dib, 0, size[1]), img)
+
+    def test_incremental(self):
+        (img, bmp) = self.make_bmp("RGB", (31, 20))
+        line_size = 32 * 3  # 31 * 3 + padding
+        header_size = len(bmp) - (20 * line_size)
+        dib = _core.dib_new()
+
+        _core.dib_feed(dib, bmp[:10])
+        self.assertEqual(_core.dib_get_infos(dib), None)
+        self.assertEqual(_core.dib_get_available_lines(dib), (0, 0))
+
+        _core.dib_feed(dib, bmp[10:header_size + (3 * line_size) + 1])
+        # bottom-up bitmap: the last lines come first
+        self.assertEqual(_core.dib_get_available_lines(dib), (17, 20))
+        self.assertSameImage(self.get_lines(dib, 17, 20),
+                             img.crop((0, 17, 31, 20)))
+        # not received yet --> black
+        self.assertEqual(self.get_lines(dib, 0, 1).getextrema(),
+                         ((0, 0), (0, 0), (0, 0)))
+
+        _core.dib_feed(dib, bmp[header_size + (3 * line_size) + 1:])
+        self.assertEqual(_core.dib_get_available_lines(dib), (0, 20))
+        self.assertSameImage(self.get_lines(dib, 2, 9), img.crop((0, 2, 31, 9)))
+        self.assertEqual(_core.dib_get_raw(dib), bmp)
+
+    def test_top_down(self):
+        (img, bmp) = self.make_bmp("L", (10, 4))
+        # memory BMP (no file header) with a negative height
+        height = struct.unpack("<i", bmp[22:26])[0]
+        dib_bytes = bmp[14:22] + struct.pack("<i", -height) + bmp[26:]
+        stride = 12
+        header_size = len(dib_bytes) - 4 * stride
+        rows = [dib_bytes[header_size + (i * stride):][:stride] for i in range(4)]
+        dib_bytes = dib_bytes[:header_size] + b"".join(reversed(rows))
+
+        dib = _core.dib_new()
+        _core.dib_feed(dib, dib_bytes[:header_size + stride])
+        self.assertEqual(_core.dib_get_available_lines(dib), (0, 1))
+        _core.dib_feed(dib, dib_bytes[header_size + stride:])
+        self.assertSameImage(self.get_lines(dib, 0, 4), img)
+
+    def test_unsupported(self):
+        dib = _core.dib_new()
+        _core.dib_feed(dib, b"\0" * 64)
+        self.assertEqual(_core.dib_get_infos(dib), None)
+        self.assertRaises(ValueError, _core.dib_get_lines, dib, 0, 1)
+
+        (img, bmp) = self.make_bmp("RGB", (4, 4))
+        dib = _core.dib_new()
+        _core.dib_feed(dib, bmp)
+        self.assertRaises(ValueError, _core.dib_get_lines, dib, 0, 5)
+
+    def test_garbage_header(self):
+        (img, bmp) = self.make_bmp("RGB", (4, 4))
+        for (width, height, bpp) in ((0x7FFFFFFF, 4, 24), (4, -0x80000000, 24),
+                                     (4, 0x7FFFFFFF, 24), (1 << 20, 1 << 20, 32),
+                                     (4, 4, 0xFFFF)):
+            header = (bmp[:18] + struct.pack("<iiHH", width, height, 1, bpp) +
+                      bmp[30:])
+            for packed in (False, True):
+                dib = _core.dib_new(packed)
+                _core.dib_feed(dib, header)
+                self.assertEqual(_core.dib_get_infos(dib), None)
+                self.assertEqual(_core.dib_get_available_lines(dib), (0, 0))
+
+    def test_packed(self):
+        # lines converted as they arrive: same result, whatever the chunks
+        for mode in ("RGB", "L", "P", "1"):
+            for size in ((1, 1), (13, 7), (64, 5)):
+                (img, bmp) = self.make_bmp(mode, size)
+                for chunk_size in (5, 61, len(bmp)):
+                    dib = _core.dib_new(True)
+                    self.feed(dib, bmp, chunk_size)
+                    self.assertEqual(_core.dib_get_size(dib), len(bmp))
+                    self.assertEqual(_core.dib_get_available_lines(dib),
+                                     (0, size[1]))
+                    self.assertSameImage(self.get_lines(dib, 0, size[1]), img)
+                    # only the headers are kept
+                    raw = _core.dib_get_raw(dib)
+                    self.assertLess(len(raw), len(bmp))
+                    self.assertTrue(bmp.startswith(raw))
+
+    def test_packed_incremental(self):
+        (img, bmp) = self.make_bmp("RGB", (31, 20))
+        line_size = 32 * 3
+        header_size = len(bmp) - (20 * line_size)
+        dib = _core.dib_new(True)
+        _core.dib_feed(dib, bmp[:header_size + (3 * line_size) + 1])
+        self.assertEqual(_core.dib_get_available_lines(dib), (17, 20))
+        self.assertSameImage(self.get_lines(dib, 17, 20),
+                             img.crop((0, 17, 31, 20)))
+        _core.dib_feed(dib, bmp[header_size + (3 * line_size) + 1:] + b"junk")
+        self.assertSameImage(self.get_lines(dib, 0, 20), img)
+
+
+class TestPixels(unittest.TestCase):
+    # (layout, input bits per pixel, output bytes per pixel)
+    LAYOUTS = [
+        (_core.PIXELS_COPY, 8, 1),
+        (_core.PIXELS_BGR, 24, 3),
+        (_core.PIXELS_BGRX, 32, 3),
+        (_core.PIXELS_BITS, 1, 1),
+        (_core.PIXELS_16_TO_LE, 16, 2),
+        (_core.PIXELS_16_TO_8, 16, 1),
+    ]
+
+    def setUp(self):
+        self.simd = _core.pixels_get_simd()
+
+    def tearDown(self):
+        _core.pixels_set_simd(self.simd)
+
+    def get_simds(self):
+        # all the instruction sets this CPU supports
+        simds = []
+        for simd in ("none", "sse2", "ssse3", "avx2", "neon"):
+            if _core.pixels_set_simd(simd) == simd:
+                simds.append(simd)
+        _core.pixels_set_simd(self.simd)
+        return simds
+
+    def reference(self, layout, line, nb, lut=None):
+        if layout == _core.PIXELS_COPY:
+            return line[:nb]
+        if layout in (_core.PIXELS_16_TO_LE, _core.PIXELS_16_TO_8):
+            samples = struct.unpack("=%dH" % nb, line[:2 * nb])
+            if layout == _core.PIXELS_16_TO_LE:
+                return struct.pack("<%dH" % nb, *samples)
+            if lut is not None:
+                return bytes(bytearray(bytearray(lut)[v] for v in samples))
+            return bytes(bytearray(v >> 8 for v in samples))
+        if layout == _core.PIXELS_BITS:
+            line = bytearray(line)
+            return bytes(bytearray(
+                0x00 if (line[x // 8] >> (7 - (x % 8))) & 1 else 0xFF
+                for x in range(nb)
+            ))
+        bpp = 3 if layout == _core.PIXELS_BGR else 4
+        out = bytearray()
+        for x in range(nb):
+            out += line[x * bpp:x * bpp + 3][::-1]
+        return bytes(out)
+
+    def test_simd(self):
+        self.assertIn(_core.pixels_get_simd(),
+                      ("avx2", "ssse3", "sse2", "neon", "none"))
+        self.assertIn("none", self.get_simds())
+        self.assertRaises(ValueError, _core.pixels_set_simd, "mmx")
+
+    def test_kernels(self):
+        # every width around the SIMD block sizes, with padded lines
+        for simd in self.get_simds():
+            _core.pixels_set_simd(simd)
+            for (layout, in_bits, out_bpp) in self.LAYOUTS:
+                for nb in list(range(0, 70)) + list(range(120, 270)):
+                    stride = ((nb * in_bits + 31) // 32) * 4 + 4
+                    data = bytes(bytearray(os.urandom(stride * 3)))
+                    lines = [data[y * stride:(y + 1) * stride]
+                             for y in range(3)]
+                    expected = [self.reference(layout, l, nb) for l in lines]
+                    for scalar in (False, True):
+                        out = _core.pixels_convert(data, layout, nb, stride,
+                                                   3, False, scalar)
+                        self.assertEqual(out, b"".join(expected),
+                                         (simd, layout, nb))
+                        out = _core.pixels_convert(data, layout, nb, stride,
+                                                   3, True, scalar)
+                        self.assertEqual(out, b"".join(reversed(expected)))
+
+    def test_lut16(self):
+        lut = _core.pixels_lut16(0x1000, 0xF000, 2.0)
+        self.assertEqual(len(lut), 65536 + 4)
+        lut = bytearray(lut)
+        self.assertEqual(lut[0], 0)
+        self.assertEqual(lut[0x1000], 0)
+        self.assertEqual(lut[0xF000], 255)
+        self.assertEqual(lut[0xFFFF], 255)
+        # gamma 2: the middle gets brighter
+        self.assertEqual(lut[0x8000], int((0.5 ** 0.5) * 255 + 0.5))
+        self.assertEqual(sorted(lut[:65536]), list(lut[:65536]))
+        identity = bytearray(_core.pixels_lut16(0, 0xFFFF, 1.0))
+        self.assertEqual(identity[0x8080], 0x80)
+
+        lut = bytes(lut)
+        for simd in self.get_simds():
+            _core.pixels_set_simd(simd)
+            for nb in list(range(0, 40)) + [255, 256, 257]:
+                data = bytes(bytearray(os.urandom(2 * nb * 2)))
+                expected = b"".join(
+                    self.reference(_core.PIXELS_16_TO_8, data[y * 2 * nb:],
+                                   nb, lut)
+                    for y in range(2)
+                )
+                for scalar in (False, True):
+                    out = _core.pixels_convert(data, _core.PIXELS_16_TO_8, nb,
+                                               2 * nb, 2, False, scalar, lut)
+                    self.assertEqual(out, expected, (simd, nb))
+
+        self.assertRaises(ValueError, _core.pixels_lut16, 10, 10, 1.0)
+        self.assertRaises(ValueError, _core.pixels_lut16, 0, 65536, 1.0)
+        self.assertRaises(ValueError, _core.pixels_lut16, 0, 100, 0.0)
+        # wrong size, wrong layout
+        self.assertRaises(ValueError, _core.pixels_convert, b"\0" * 8,
+                          _core.PIXELS_16_TO_8, 4, 8, 1, 0, 0, b"\0" * 256)
+        self.assertRaises(ValueError, _core.pixels_convert, b"\0" * 8,
+                          _core.PIXELS_COPY, 4, 8, 1, 0, 0, lut)
+
+    def test_interleave(self):
+        for simd in self.get_simds():
+            _core.pixels_set_simd(simd)
+            for sample_size in (1, 2):
+                for nb in list(range(0, 40)) + [255, 256, 257]:
+                    stride = nb * sample_size + 5
+                    planes = [bytes(bytearray(os.urandom(stride * 2)))
+                              for _ in range(3)]
+                    expected = b"".join(
+                        planes[p][y * stride + x * sample_size:
+                                  y * stride + (x + 1) * sample_size]
+                        for y in range(2) for x in range(nb) for p in range(3)
+                    )
+                    for scalar in (False, True):
+                        out = _core.pixels_interleave(
+                            planes[0], planes[1], planes[2], nb, stride, 2,
+                            sample_size, scalar
+                        )
+                        self.assertEqual(out, expected,
+                                         (simd, sample_size, nb))
+        self.assertRaises(ValueError, _core.pixels_interleave, b"\0" * 8,
+                          b"\0" * 8, b"\0" * 4, 4, 4, 2)
+        self.assertRaises(ValueError, _core.pixels_interleave, b"\0" * 8,
+                          b"\0" * 8, b"\0" * 8, 4, 8, 1, 3)
+
+    def test_unpack_1_to_8(self):
+        # 1-bit SANE frame: lines of 13 pixels, padded to 4 bytes
+        packed = bytes(bytearray([0xA5, 0x0F, 0xFF, 0x00] * 3))
+        unpacked = sane_abstract.ImgUtil.unpack_1_to_8(packed, 13, 4)
+        line = (b"\x00\xff\x00\xff\xff\x00\xff\x00"
+                b"\xff\xff\xff\xff\x00")
+        self.assertEqual(unpacked, line * 3)
+
+    def test_invalid_args(self):
+        self.assertRaises(ValueError, _core.pixels_convert, b"\0" * 8, 42,
+                          1, 4, 1)
+        # stride shorter than a line
+        self.assertRaises(ValueError, _core.pixels_convert, b"\0" * 64,
+                          _core.PIXELS_BGRX, 4, 12, 1)
+        # not enough lines
+        self.assertRaises(ValueError, _core.pixels_convert, b"\0" * 24,
+                          _core.PIXELS_BGR, 2, 8, 4)
+        # lines going backward, before the data
+        data = bytes(bytearray(range(8)))
+        self.assertRaises(ValueError, _core.pixels_convert, data,
+                          _core.PIXELS_COPY, 4, -4, 2)
+        self.assertRaises(ValueError, _core.pixels_interleave, data, data,
+                          data, 4, -4, 2)
+        # stride * lines overflowing
+        huge = sys.maxsize // 2 + 1
+        self.assertRaises(ValueError, _core.pixels_convert, data,
+                          _core.PIXELS_COPY, 4, huge, 5)
+        self.assertRaises(ValueError, _core.pixels_interleave, data, data,
+                          data, 4, huge, 5)
+        # pixels * bytes per pixel overflowing
+        self.assertRaises(ValueError, _core.pixels_convert, data,
+                          _core.PIXELS_BGRX, sys.maxsize // 2, sys.maxsize, 1)
+        self.assertRaises(ValueError, _core.pixels_interleave, data, data,
+                          data, sys.maxsize // 2, sys.maxsize, 1, 2)
+
+
+class FakeTiffWriter(object):
+    """
+    Writes like a TIFF encoder does: a placeholder header first, the pages,
+    and then it goes back to patch the header with the offset of the
+    directory.
+    """
+
+    def __init__(self, store):
+        self.store = store
+
+    def write(self, pages):
+        _core.mapped_write(self.store, b"II*\0" + struct.pack("<I", 0))
+        offsets = []
+        for page in pages:
+            offsets.append(_core.mapped_seek(self.store, 0, os.SEEK_CUR))
+            _core.mapped_write(self.store, page)
+        directory = _core.mapped_seek(self.store, 0, os.SEEK_END)
+        _core.mapped_write(self.store, struct.pack("<H", len(offsets)))
+        for offset in offsets:
+            _core.mapped_write(self.store, struct.pack("<I", offset))
+        _core.mapped_seek(self.store, 4, os.SEEK_SET)
+        _core.mapped_write(self.store, struct.pack("<I", directory))
+        _core.mapped_seek(self.store, 0, os.SEEK_END)
+
+
+class TestMappedStore(unittest.TestCase):
+    def read_all(self, store):
+        _core.mapped_seek(store, 0, os.SEEK_SET)
+        return _core.mapped_read(store, _core.mapped_get_stats(store)['size'])
+
+    def check_fake_tiff(self, store):
+        pages = [get_pattern(page, 700 * 1024 + page) for page in range(4)]
+        FakeTiffWriter(store).write(pages)
+
+        data = self.read_all(store)
+        self.assertEqual(data[:4], b"II*\0")
+        directory = struct.unpack("<I", data[4:8])[0]
+        nb_pages = struct.unpack("<H", data[directory:directory + 2])[0]
+        self.assertEqual(nb_pages, 4)
+        for (idx, page) in enumerate(pages):
+            offset = struct.unpack(
+                "<I", data[directory + 2 + (4 * idx):directory + 6 + (4 * idx)]
+            )[0]
+            self.assertEqual(data[offset:offset + len(page)], page)
+
+        stats = _core.mapped_get_stats(store)
+        self.assertEqual(stats['size'], len(data))
+        self.assertTrue(stats['capacity'] >= len(data))
+
+    def test_anonymous(self):
+        self.check_fake_tiff(_core.mapped_new())
+
+    def test_file_backed(self):
+        directory = tempfile.mkdtemp()
+        try:
+            self.check_fake_tiff(_core.mapped_new(directory))
+            # the backing file is never visible
+            self.assertEqual(os.listdir(directory), [])
+        finally:
+            os.rmdir(directory)
+
+    def test_invalid_directory(self):
+        self.assertRaises(IOError, _core.mapped_new, "/nonexistent/directory")
+
+    def test_sparse_and_resize(self):
+        store = _core.mapped_new()
+        self.assertEqual(_core.mapped_seek(store, 10, os.SEEK_SET), 10)
+        _core.mapped_write(store, b"abc")
+        self.assertEqual(self.read_all(store), b"\0" * 10 + b"abc")
+
+        _core.mapped_set_size(store, 5)
+        self.assertEqual(self.read_all(store), b"\0" * 5)
+        # what was truncated must not come back
+        _core.mapped_set_size(store, 13)
+        self.assertEqual(self.read_all(store), b"\0" * 13)
+
+        _core.mapped_set_size(store, 3 * 1024 * 1024)
+        self.assertEqual(_core.mapped_get_stats(store)['size'], 3 * 1024 * 1024)
+        self.assertEqual(_core.mapped_seek(store, -3, os.SEEK_END), 3 * 1024 * 1024 - 3)
+        self.assertEqual(_core.mapped_read(store, 10), b"\0" * 3)
+        self.assertRaises(ValueError, _core.mapped_seek, store, -1, os.SEEK_SET)
+
+
+def decode_page(data):
+    img = PIL.Image.open(io.BytesIO(data))
+    img.load()
+    return img
+
+
+class TestDecodePool(unittest.TestCase):
+    def get_compressed_pages(self):
+        pages = []
+        for (idx, (fmt, mode)) in enumerate([
+                    ("JPEG", "RGB"), ("PNG", "RGB"), ("PNG", "L"),
+                    ("TIFF", "1"), ("JPEG", "L"), ("PNG", "RGB"),
+                ]):
+            img = PIL.Image.new(mode, (200 + idx, 300))
+            img.putdata([(x * y + idx) % 256 if mode != "1" else (x + y) % 2
+                         for y in range(300) for x in range(200 + idx)]
+                        if mode != "RGB" else
+                        [(x % 256, y % 256, idx) for y in range(300)
+                         for x in range(200 + idx)])
+            out = io.BytesIO()
+            img.save(out, fmt, **({"compression": "group4"}
+                                  if fmt == "TIFF" else {}))
+            pages.append(out.getvalue())
+        return pages
+
+    def test_decode(self):
+        pages = self.get_compressed_pages()
+        pool = _core.decode_pool_new(decode_page, 3)
+        for page in pages:
+            _core.decode_pool_submit(pool, page)
+        for page in pages:
+            img = _core.decode_pool_get(pool)
+            expected = decode_page(page)
+            self.assertEqual(img.size, expected.size)
+            self.assertEqual(img.mode, expected.mode)
+            self.assertEqual(img.tobytes(), expected.tobytes())
+        self.assertRaises(IndexError, _core.decode_pool_get, pool)
+        self.assertEqual(_core.decode_pool_get_stats(pool),
+                         {'workers': 3, 'pending': 0})
+
+    def test_order(self):
+        def decoder(data):
+            if data == b"slow":
+                time.sleep(0.2)
+            return data
+
+        pool = _core.decode_pool_new(decoder, 2)
+        for data in [b"slow", b"a", b"b", b"c"]:
+            _core.decode_pool_submit(pool, data)
+        self.assertEqual([_core.decode_pool_get(pool) for x in range(4)],
+                         [b"slow", b"a", b"b", b"c"])
+
+    def test_errors(self):
+        self.assertRaises(ValueError, _core.decode_pool_new, "crap", 2)
+        self.assertRaises(ValueError, _core.decode_pool_new, decode_page, 0)
+
+        pool = _core.decode_pool_new(decode_page, 2)
+        pages = self.get_compressed_pages()[:1]
+        _core.decode_pool_submit(pool, b"not an image")
+        _core.decode_pool_submit(pool, pages[0])
+        self.assertRaises(IOError, _core.decode_pool_get, pool)
+        # the next pages are not affected
+        self.assertEqual(_core.decode_pool_get(pool).size, (200, 300))
+
+    def test_destroy_with_pending_pages(self):
+        pool = _core.decode_pool_new(decode_page, 2)
+        for page in self.get_compressed_pages():
+            _core.decode_pool_submit(pool, page)
+        del pool
+
+
+@unittest.skipIf(_wia_testing is None, "WIA fake driver not built")
+class TestWiaCancellation(unittest.TestCase):
+    def read_all(self, ring):
+        pages = []
+        data = bytearray()
+        while True:
+            try:
+                data += _core.ring_read(ring)
+            except EOFError:
+                pages.append(bytes(data))
+                data = bytearray()
+            except StopIteration:
+                return pages
+
+    def check_transfer(self, mapped):
+        page_size = 512 * 1024 + 3
+        ring = _core.ring_new(64 * 1024)
+        download = _wia_testing.fake_download(ring, page_size, 2, 4096, mapped)
+        pages = self.read_all(ring)
+        self.assertEqual(len(pages), 2)
+        self.assertEqual(pages[0], get_pattern(0, page_size))
+        self.assertEqual(pages[1], get_pattern(1, page_size))
+        self.assertEqual(_wia_testing.fake_download_join(download), {
+            'hr': 0,
+            'written': 2 * page_size,
+            'calls_after_cancel': 0,
+            'callbacks_refcount': 0,
+        })
+
+    def test_transfer(self):
+        self.check_transfer(False)
+
+    def test_mapped_transfer(self):
+        self.check_transfer(True)
+
+    def check_cancel(self, mapped):
+        page_size = 4 * 1024 * 1024
+        nb_pages = 3
+        ring = _core.ring_new(64 * 1024)
+        download = _wia_testing.fake_download(ring, page_size, nb_pages, 512,
+                                              mapped)
+        # the transfer is in progress once its first page reaches us
+        _core.ring_read(ring)
+        _core.ring_abort(ring)
+        result = _wia_testing.fake_download_join(download)
+        # the driver is told to stop at its very next call
+        self.assertNotEqual(result['hr'], 0)
+        self.assertTrue(result['written'] < nb_pages * page_size)
+        self.assertEqual(result['calls_after_cancel'], 0)
+        self.assertEqual(result['callbacks_refcount'], 0)
+        # what was still buffered is dropped
+        self.assertRaises(IOError, _core.ring_read, ring)
+        self.assertEqual(_core.ring_get_stats(ring)['buffered'], 0)
+
+    def test_cancel(self):
+        self.check_cancel(False)
+
+    def test_mapped_cancel(self):
+        self.check_cancel(True)
+
+    def test_mapped_copy_to(self):
+        data = get_pattern(0, 100)
+        result = _wia_testing.mapped_stream_copy_to(data, 10, 30)
+        self.assertEqual(result, {'hr': 0, 'read': 30, 'written': 30,
+                                  'position': 40, 'copied': data[10:40]})
+        # up to the end of the stream only
+        result = _wia_testing.mapped_stream_copy_to(data, 90, 30)
+        self.assertEqual(result['read'], 10)
+        self.assertEqual(result['copied'], data[90:])
+        self.assertEqual(result['position'], 100)
+        # the destination refuses the data: nothing consumed
+        result = _wia_testing.mapped_stream_copy_to(data, 10, 30, True)
+        self.assertNotEqual(result['hr'], 0)
+        self.assertEqual(result['read'], 0)
+        self.assertEqual(result['written'], 0)
+        self.assertEqual(result['position'], 10)
+
+
+@unittest.skipIf(_wia_testing is None, "WIA fake driver not built")
+class TestWiaTelemetry(unittest.TestCase):
+    PAGE_SIZE = 512 * 1024 + 3
+    CHUNK_SIZE = 4096
+
+    def read_all(self, ring):
+        pages = 0
+        while True:
+            try:
+                _core.ring_read(ring)
+            except EOFError:
+                pages += 1
+            except StopIteration:
+                return pages
+
+    def check_transfer(self, mapped):
+        telemetry = _core.telemetry_new()
+        ring = _core.ring_new(64 * 1024)
+        download = _wia_testing.fake_download(
+            ring, self.PAGE_SIZE, 2, self.CHUNK_SIZE, mapped, telemetry
+        )
+        self.assertEqual(self.read_all(ring), 2)
+        _wia_testing.fake_download_join(download)
+
+        nb_chunks = self.PAGE_SIZE // self.CHUNK_SIZE + 1
+        stats = _core.telemetry_get_stats(telemetry)
+        self.assertEqual(stats['percent'], 100)
+        self.assertEqual(stats['driver_bytes'], self.PAGE_SIZE)
+        self.assertEqual(stats['bytes'], 2 * self.PAGE_SIZE)
+        self.assertEqual(stats['chunks'], 2 * nb_chunks)
+        self.assertEqual(stats['chunk_sizes'], {
+            self.CHUNK_SIZE: 2 * (nb_chunks - 1),
+            2: 2,  # the last 3 bytes of each page
+        })
+        # 1 status per chunk, then 100%, device status and end of transfer
+        self.assertEqual(stats['callbacks'], 2 * (nb_chunks + 3))
+        self.assertEqual(stats['last_error'], 0x00210001)  # warming up
+        self.assertTrue(0 <= stats['time_to_first_byte'] <= stats['elapsed'])
+        self.assertTrue(stats['throughput'] > 0)
+        self.assertTrue(stats['blocked'] >= 0)
+
+        self.assertEqual(len(stats['pages']), 2)
+        for page in stats['pages']:
+            self.assertEqual(page['bytes'], self.PAGE_SIZE)
+            self.assertEqual(page['chunks'], nb_chunks)
+            self.assertTrue(0 <= page['time_to_first_byte'] <= page['duration'])
+            self.assertTrue(page['blocked'] <= page['duration'])
+
+    def test_transfer(self):
+        self.check_transfer(False)
+
+    def test_mapped_transfer(self):
+        self.check_transfer(True)
+
+    def test_no_data(self):
+        stats = _core.telemetry_get_stats(_core.telemetry_new())
+        self.assertEqual(stats['bytes'], 0)
+        self.assertEqual(stats['time_to_first_byte'], -1.0)
+        self.assertEqual(stats['throughput'], 0.0)
+        self.assertEqual(stats['chunk_sizes'], {})
+        self.assertEqual(stats['pages'], [])
+        self.assertRaises(ValueError, _core.telemetry_get_stats, "crap")
+
+    def test_while_running(self):
+        # the driver is held back by a slow reader: this is what 'blocked'
+        # measures
+        telemetry = _core.telemetry_new()
+        ring = _core.ring_new(64 * 1024)
+        download = _wia_testing.fake_download(
+            ring, self.PAGE_SIZE, 1, self.CHUNK_SIZE, False, telemetry
+        )
+        _core.ring_read(ring)
+        time.sleep(0.2)
+        stats = _core.telemetry_get_stats(telemetry)
+        self.assertTrue(0 < stats['bytes'] < self.PAGE_SIZE)
+        self.assertTrue(0 < stats['percent'] < 100)
+        self.assertEqual(stats['pages'], [])
+        self.assertEqual(self.read_all(ring), 1)
+        _wia_testing.fake_download_join(download)
+
+        stats = _core.telemetry_get_stats(telemetry)
+        self.assertTrue(stats['blocked'] >= 0.15)
+        self.assertEqual(len(stats['pages']), 1)
+        self.assertTrue(stats['pages'][0]['blocked'] >= 0.15)
+
+
+class TestWorker(unittest.TestCase):
+    def test_call(self):
+        hooks = []
+        worker = _core.worker_new(
+            lambda: hooks.append(("init", threading.get_ident())),
+            lambda: hooks.append(("exit", threading.get_ident())),
+        )
+        tid = _core.worker_call(worker, threading.get_ident)
+        self.assertNotEqual(tid, threading.get_ident())
+        self.assertEqual(_core.worker_call(worker, lambda: 42), 42)
+        self.assertRaises(ZeroDivisionError, _core.worker_call, worker,
+                          lambda: 1 // 0)
+        _core.worker_stop(worker)
+        self.assertEqual(hooks, [("init", tid), ("exit", tid)])
+        self.assertRaises(RuntimeError, _core.worker_call, worker, lambda: 42)
+        self.assertRaises(RuntimeError, _core.worker_post, worker, lambda: 42)
+        self.assertTrue(_core.worker_get_stats(worker)['stopped'])
+
+    def test_invalid_args(self):
+        self.assertRaises(ValueError, _core.worker_new, "crap")
+        worker = _core.worker_new()
+        self.assertRaises(ValueError, _core.worker_call, worker, "crap")
+        self.assertRaises(ValueError, _core.worker_call, "crap", lambda: 42)
+
+    def test_independent_workers(self):
+        # a long action on a worker (a download) doesn't delay the others
+        worker_a = _core.worker_new()
+        worker_b = _core.worker_new()
+        _core.worker_post(worker_a, lambda: time.sleep(0.5))
+        start = time.time()
+        self.assertEqual(_core.worker_call(worker_b, lambda: "b"), "b")
+        self.assertTrue(time.time() - start < 0.25)
+        _core.worker_stop(worker_a)
+        _core.worker_stop(worker_b)
+
+    def test_batches(self):
+        worker = _core.worker_new()
+        results = []
+        _core.worker_post(worker, lambda: time.sleep(0.2))
+        for i in range(100):
+            _core.worker_post(worker, functools.partial(results.append, i))
+        self.assertEqual(_core.worker_call(worker, lambda: len(results)), 100)
+        self.assertEqual(results, list(range(100)))
+        stats = _core.worker_get_stats(worker)
+        # the 101 actions queued during the sleep are run in one go
+        self.assertEqual(stats['actions'], 102)
+        self.assertTrue(stats['wakeups'] <= 3)
+        _core.worker_stop(worker)
+
+    def test_call_doesnt_wait_for_batch(self):
+        worker = _core.worker_new()
+        times = {}
+
+        def slow():
+            time.sleep(0.5)
+            times['slow'] = time.time()
+
+        def call():
+            _core.worker_call(worker, lambda: None)
+            times['call'] = time.time()
+
+        _core.worker_post(worker, lambda: time.sleep(0.5))
+        thread = threading.Thread(target=call)
+        thread.start()
+        time.sleep(0.2)
+        _core.worker_post(worker, slow)
+        thread.join()
+        _core.worker_stop(worker)
+        # the call and the slow action were run in the same batch
+        self.assertEqual(_core.worker_get_stats(worker)['wakeups'], 2)
+        self.assertTrue(times['call'] < times['slow'])
+
+    def test_reentrant_call(self):
+        worker = _core.worker_new()
+        self.assertEqual(_core.worker_call(
+            worker, lambda: _core.worker_call(worker, lambda: "inner")
+        ), "inner")
+        _core.worker_stop(worker)
+
+    def test_stop_runs_pending_actions(self):
+        worker = _core.worker_new()
+        results = []
+        for i in range(10):
+            _core.worker_post(worker, functools.partial(results.append, i))
+        _core.worker_stop(worker)
+        self.assertEqual(results, list(range(10)))
+        # can be stopped many times, and freed afterwards
+        _core.worker_stop(worker)
+        del worker
+
+
+@unittest.skipIf(_wia_testing is None, "WIA fake driver not built")
+class TestWiaMultipage(unittest.TestCase):
+    # how the fake driver tells where the pages end (see wia/testing.cpp)
+    END_OF_TRANSFER = 0
+    END_OF_STREAM = 1
+    NEXT_STREAM = 2
+
+    def read_all(self, ring):
+        pages = []
+        data = bytearray()
+        while True:
+            try:
+                data += _core.ring_read(ring)
+            except EOFError:
+                pages.append(bytes(data))
+                data = bytearray()
+            except StopIteration:
+                self.assertEqual(len(data), 0)
+                return pages
+
+    def check_download(self, page_end, mapped):
+        # a whole feeder in a single download
+        page_size = 128 * 1024 + 5
+        nb_pages = 5
+        telemetry = _core.telemetry_new()
+        ring = _core.ring_new(64 * 1024)
+        download = _wia_testing.fake_download(
+            ring, page_size, nb_pages, 4096, mapped, telemetry, page_end
+        )
+        pages = self.read_all(ring)
+        self.assertEqual(_wia_testing.fake_download_join(download)['hr'], 0)
+        self.assertEqual(len(pages), nb_pages)
+        for (idx, page) in enumerate(pages):
+            self.assertEqual(page, get_pattern(idx, page_size))
+        stats = _core.telemetry_get_stats(telemetry)
+        self.assertEqual([page['bytes'] for page in stats['pages']],
+                         [page_size] * nb_pages)
+
+    def test_end_of_transfer(self):
+        self.check_download(self.END_OF_TRANSFER, False)
+        self.check_download(self.END_OF_TRANSFER, True)
+
+    def test_end_of_stream(self):
+        self.check_download(self.END_OF_STREAM, False)
+        self.check_download(self.END_OF_STREAM, True)
+
+    def test_next_stream(self):
+        self.check_download(self.NEXT_STREAM, False)
+        self.check_download(self.NEXT_STREAM, True)
+
+    def test_invalid_page_end(self):
+        ring = _core.ring_new(64 * 1024)
+        self.assertRaises(ValueError, _wia_testing.fake_download,
+                          ring, 1024, 1, 512, False, None, 3)
+
+
+class TestPropertySnapshot(unittest.TestCase):
+    def test_values(self):
+        snapshot = _core.snapshot_new(3)
+        self.assertTrue(_core.snapshot_update(snapshot, 0, ("xres", 300)))
+        self.assertFalse(_core.snapshot_update(snapshot, 1, None))
+        # same value, but not the same object
+        self.assertFalse(_core.snapshot_update(snapshot, 0, ("xres", 300)))
+        self.assertTrue(_core.snapshot_update(snapshot, 0, ("xres", 150)))
+        # removed
+        self.assertTrue(_core.snapshot_update(snapshot, 0, None))
+        self.assertFalse(_core.snapshot_update(snapshot, 0, None))
+
+    def test_constraints(self):
+        snapshot = _core.snapshot_new(3)
+        self.assertTrue(_core.snapshot_update(snapshot, 2, 300))
+        # tracked apart from the value
+        self.assertTrue(_core.snapshot_update(snapshot, 2, [75, 150], True))
+        self.assertFalse(_core.snapshot_update(snapshot, 2, [75, 150], True))
+        self.assertTrue(_core.snapshot_update(snapshot, 2, (0, 8500), True))
+
+    def test_written(self):
+        snapshot = _core.snapshot_new(3)
+        _core.snapshot_mark_written(snapshot, 1)
+        self.assertTrue(_core.snapshot_is_written(snapshot, 1))
+        self.assertFalse(_core.snapshot_is_written(snapshot, 0))
+        # values don't tell if the constraint is still valid
+        _core.snapshot_update(snapshot, 1, 300)
+        self.assertTrue(_core.snapshot_is_written(snapshot, 1))
+        _core.snapshot_update(snapshot, 1, (0, 8500), True)
+        self.assertFalse(_core.snapshot_is_written(snapshot, 1))
+
+    def test_invalid_index(self):
+        snapshot = _core.snapshot_new(3)
+        self.assertRaises(IndexError, _core.snapshot_update, snapshot, 3, 1)
+        self.assertRaises(IndexError, _core.snapshot_mark_written,
+                          snapshot, -1)
+
+
+@unittest.skipIf(_wia_testing is None, "WIA fake driver not built")
+class TestWiaPropertyRegistry(unittest.TestCase):
+    def _find(self, name):
+        idx = _wia_testing.property_find(name)
+        self.assertGreaterEqual(idx, 0)
+        return idx
+
+    def test_lookups(self):
+        for idx in range(_wia_testing.property_count()):
+            (name, propid) = _wia_testing.property_info(idx)
+            self.assertEqual(_wia_testing.property_find(name),
+                             _wia_testing.property_find_linear(name))
+            self.assertEqual(_wia_testing.property_find_by_id(propid),
+                             _wia_testing.property_find_by_id_linear(propid))
+        self.assertEqual(_wia_testing.property_find("nope"), -1)
+        self.assertEqual(_wia_testing.property_find(""), -1)
+
+    def test_duplicates(self):
+        # WIA_IPA_BUFFER_SIZE and WIA_IPA_MIN_BUFFER_SIZE: same ID, same
+        # name. The first one wins, like with a linear search.
+        idx = self._find("buffer_size")
+        (name, propid) = _wia_testing.property_info(idx)
+        self.assertEqual(_wia_testing.property_find_by_id(propid), idx)
+        others = [
+            other for other in range(idx + 1, _wia_testing.property_count())
+            if _wia_testing.property_info(other) == (name, propid)
+        ]
+        self.assertNotEqual(others, [])
+
+    def test_flags(self):
+        idx = self._find("item_flags")
+        self.assertEqual(_wia_testing.property_decode(idx, 0), "free")
+        self.assertEqual(_wia_testing.property_decode(idx, 0x9), "image,root")
+        self.assertEqual(_wia_testing.property_encode(idx, "image,root"), 0x9)
+        idx = self._find("access_rights")
+        self.assertEqual(_wia_testing.property_decode(idx, 0x7),
+                         "read_write_can_be_deleted")
+        self.assertEqual(_wia_testing.property_decode(idx, 0x3), "read,write")
+        # unknown bit
+        self.assertEqual(_wia_testing.property_decode(idx, 0x9), 0x9)
+
+    def test_enum(self):
+        idx = self._find("page_size")
+        self.assertEqual(_wia_testing.property_decode(idx, 0), "a4")
+        self.assertEqual(_wia_testing.property_encode(idx, "a4"), 0)
+        # not ORed with whatever overlaps
+        self.assertEqual(_wia_testing.property_decode(idx, 0x12345), 0x12345)
+        self.assertEqual(_wia_testing.property_encode(idx, 42), 42)
+
+    def test_unknown_names(self):
+        idx = self._find("document_handling_select")
+        self.assertEqual(
+            _wia_testing.property_encode(idx, "feeder,nope"),
+            _wia_testing.property_encode(idx, "feeder")
+        )
+        with warnings.catch_warnings():
+            warnings.simplefilter("ignore")
+            self.assertIsNone(_wia_testing.property_encode(idx, "nope"))
+
+    def test_clsid(self):
+        idx = self._find("format")
+        self.assertEqual(
+            _wia_testing.property_clsid_roundtrip(idx, "png"), "png"
+        )
+        with warnings.catch_warnings():
+            warnings.simplefilter("ignore")
+            self.assertIsNone(
+                _wia_testing.property_clsid_roundtrip(idx, "nope")
+            )
+
+
+@unittest.skipIf(_wia_testing is None, "WIA fake driver not built")
+class TestWiaPropertyStore(unittest.TestCase):
+    def test_options(self):
+        store = _wia_testing.fake_property_store_new()
+        options = _wia_testing.fake_get_options(store)
+        self.assertEqual(options['page_size']['value'], "a4")
+        self.assertEqual(options['page_size']['accessright'], "rw")
+        self.assertIn("letter", options['page_size']['possible_values'])
+        self.assertIsNone(options['xres']['possible_values'])
+        self.assertEqual(options['format']['value'], "bmp")
+
+    def test_shared_objects(self):
+        store = _wia_testing.fake_property_store_new()
+        first = _wia_testing.fake_get_options(store)
+        second = _wia_testing.fake_get_options(store)
+        self.assertIs(first['page_size']['possible_values'],
+                      second['page_size']['possible_values'])
+        self.assertIs(first['page_size']['value'],
+                      second['page_size']['value'])
+        (name, _) = list(first.items())[0]
+        self.assertIs(name, list(second.keys())[0])
+
+    def test_changes(self):
+        store = _wia_testing.fake_property_store_new()
+        _wia_testing.fake_get_options(store)
+        self.assertEqual(_wia_testing.fake_get_property_changes(store),
+                         ([], [], []))
+        _wia_testing.fake_property_store_set(
+            store, _wia_testing.property_find("xres"), 300
+        )
+        _wia_testing.fake_property_store_set(
+            store, _wia_testing.property_find("contrast"), None
+        )
+        (props, constraints, removed) = \
+            _wia_testing.fake_get_property_changes(store)
+        self.assertEqual(props, [("xres", 300, "rw", None)])
+        self.assertEqual(constraints, [])
+        self.assertEqual(removed, ["contrast"])
+
+    def test_no_leak(self):
+        store = _wia_testing.fake_property_store_new()
+        idx = _wia_testing.property_find("xres")
+        for func in [
+                    _wia_testing.fake_get_options,
+                    _wia_testing.fake_get_properties,
+                    _wia_testing.fake_get_property_changes,
+                ]:
+            for i in range(100):
+                func(store)
+            before = sys.getallocatedblocks()
+            for i in range(3000):
+                # something to report for get_property_changes()
+                _wia_testing.fake_property_store_set(store, idx, i % 2)
+                func(store)
+            # a leak would be at least one block per call
+            self.assertLess(sys.getallocatedblocks() - before, 100)
+
+
+@unittest.skipIf(_wia_testing is None, "WIA fake driver not built")
+class TestWiaDevicePool(unittest.TestCase):
+    def setUp(self):
+        # 2 sources per device
+        self.pool = _wia_testing.device_pool_new(2)
+        self.alive = self._stats()['items_alive']
+
+    def tearDown(self):
+        self.pool = None
+        self.assertEqual(self._stats_alive(), self.alive)
+
+    def _stats(self):
+        return _wia_testing.device_pool_stats(self.pool)
+
+    def _stats_alive(self):
+        return _wia_testing.device_pool_stats(
+            _wia_testing.device_pool_new()
+        )['items_alive']
+
+    def test_reuse(self):
+        dev = _wia_testing.device_pool_open(self.pool, "dev0")
+        srcs = _wia_testing.device_pool_get_sources(dev)
+        self.assertEqual(len(srcs), 2)
+        dev2 = _wia_testing.device_pool_open(self.pool, "dev0")
+        other = _wia_testing.device_pool_open(self.pool, "dev1")
+        stats = self._stats()
+        self.assertEqual(stats['devices'], 2)
+        self.assertEqual(stats['opened'], 2)
+        self.assertEqual(stats['reused'], 1)
+        # 2 devices + their sources
+        self.assertEqual(stats['items_alive'] - self.alive, 6)
+        dev = dev2 = srcs = other = None
+
+    def test_release(self):
+        dev = _wia_testing.device_pool_open(self.pool, "dev0")
+        srcs = _wia_testing.device_pool_get_sources(dev)
+        dev = None
+        # the sources keep the device opened
+        self.assertEqual(self._stats()['devices'], 1)
+        self.assertEqual(self._stats()['items_alive'] - self.alive, 3)
+        srcs = None
+        stats = self._stats()
+        self.assertEqual(stats['devices'], 0)
+        self.assertEqual(stats['items_alive'], self.alive)
+        # closed: opened again
+        dev = _wia_testing.device_pool_open(self.pool, "dev0")
+        self.assertEqual(self._stats()['opened'], 2)
+        self.assertEqual(self._stats()['reused'], 0)
+        dev = None
+
+    def test_open_failure(self):
+        self.assertIsNone(_wia_testing.device_pool_open(self.pool, ""))
+        self.assertEqual(self._stats()['devices'], 0)
+
+    def test_release_other_thread(self):
+        handles = [_wia_testing.device_pool_open(self.pool, "dev0")]
+        thread = threading.Thread(target=handles.pop)
+        thread.start()
+        thread.join()
+        # COM objects are only released by the thread of the pool
+        stats = self._stats()
+        self.assertEqual(stats['unused'], 1)
+        self.assertEqual(stats['items_alive'] - self.alive, 3)
+        # still there: reused
+        dev = _wia_testing.device_pool_open(self.pool, "dev0")
+        self.assertEqual(self._stats()['reused'], 1)
+        self.assertEqual(self._stats()['unused'], 0)
+        handles.append(dev)
+        dev = None
+        thread = threading.Thread(target=handles.pop)
+        thread.start()
+        thread.join()
+        _wia_testing.device_pool_flush(self.pool)
+        stats = self._stats()
+        self.assertEqual(stats['devices'], 0)
+        self.assertEqual(stats['items_alive'], self.alive)
+
+    def test_pool_destroyed_first(self):
+        dev = _wia_testing.device_pool_open(self.pool, "dev0")
+        srcs = _wia_testing.device_pool_get_sources(dev)
+        self.pool = None
+        # everything released with the pool, handles left unusable
+        self.assertEqual(self._stats_alive(), self.alive)
+        self.assertFalse(_wia_testing.device_pool_is_open(dev))
+        self.assertFalse(_wia_testing.device_pool_is_open(srcs[0]))
+        dev = srcs = None
+
+
+class TestTransferRecording(unittest.TestCase):
+    def setUp(self):
+        self.tmpdir = tempfile.mkdtemp()
+        self.path = os.path.join(self.tmpdir, "scan.rec")
+
+    def tearDown(self):
+        for name in os.listdir(self.tmpdir):
+            os.unlink(os.path.join(self.tmpdir, name))
+        os.rmdir(self.tmpdir)
+
+    def record(self, with_data):
+        rec = _core.recorder_new(self.path, _core.RECORD_SANE, with_data)
+        for page in range(2):
+            _core.recorder_parameters(rec, 1, 1, 30, 10, 5, 8)
+            _core.recorder_chunk(rec, get_pattern(page, 100))
+            _core.recorder_status(rec, 66, 100)
+            _core.recorder_chunk(rec, get_pattern(page, 150)[100:])
+            _core.recorder_end_of_page(rec)
+        _core.recorder_end_of_scan(rec, 7)
+        self.assertTrue(_core.recorder_close(rec))
+
+    def replay(self):
+        rep = _core.replay_open(self.path)
+        events = []
+        while True:
+            event = _core.replay_next(rep)
+            if event is None:
+                return events
+            events.append(event)
+
+    def check_events(self, events):
+        self.assertEqual(len(events), 11)
+        self.assertEqual(events[0], ("parameters", (1, 1, 30, 10, 5, 8)))
+        self.assertEqual(events[2], ("status", (66, 100)))
+        self.assertEqual(events[4], ("end_of_page", None))
+        self.assertEqual(events[10], ("end_of_scan", 7))
+        pages = [
+            b"".join(event[1] for event in events[x:x + 5]
+                     if event[0] == "chunk")
+            for x in (0, 5)
+        ]
+        self.assertEqual(pages, [get_pattern(0, 150), get_pattern(1, 150)])
+
+    def test_round_trip(self):
+        self.record(True)
+        infos = _core.replay_get_infos(_core.replay_open(self.path))
+        self.assertEqual(infos['backend'], 'sane')
+        self.assertTrue(infos['with_data'])
+        self.assertEqual(infos['pages'], 2)
+        self.assertEqual(infos['chunks'], 4)
+        self.assertEqual(infos['bytes'], 300)
+        self.assertEqual(infos['parameters'], (1, 1, 30, 10, 5, 8))
+        self.check_events(self.replay())
+
+    def test_without_data(self):
+        self.record(False)
+        self.assertLess(os.path.getsize(self.path), 100)
+        # generated with the same pattern as the fake drivers
+        self.check_events(self.replay())
+
+    def test_timing(self):
+        rec = _core.recorder_new(self.path, _core.RECORD_WIA)
+        _core.recorder_chunk(rec, b"a")
+        time.sleep(0.1)
+        _core.recorder_end_of_page(rec)
+        self.assertTrue(_core.recorder_close(rec))
+
+        rep = _core.replay_open(self.path)
+        start = time.time()
+        while _core.replay_next(rep, 1.0) is not None:
+            pass
+        self.assertGreaterEqual(time.time() - start, 0.09)
+
+        _core.replay_rewind(rep)
+        start = time.time()
+        while _core.replay_next(rep, 0) is not None:
+            pass
+        self.assertLess(time.time() - start, 0.05)
+
+    def test_truncated(self):
+        self.record(True)
+        with open(self.path, "rb") as fd:
+            data = fd.read()
+        with open(self.path, "wb") as fd:
+            fd.write(data[:-10])
+        # replayed up to where it stops
+        events = self.replay()
+        self.assertGreater(len(events), 5)
+        self.assertEqual(events[4], ("end_of_page", None))
+
+        with open(self.path, "wb") as fd:
+            fd.write(b"garbage")
+        self.assertRaises(IOError, _core.replay_open, self.path)
+
+
+@unittest.skipIf(_mockapi is None, "WIA mock driver not built")
+class TestWiaMock(unittest.TestCase):
+    def setUp(self):
+        _mockapi.mock_configure(nb_devices=2, width=100, height=20, depth=24,
+                                nb_pages=3, chunks=(1000, 37), rate=0)
+
+    def tearDown(self):
+        wia_rawapi.exit()
+        self.assertEqual(_mockapi.mock_get_stats()['alive'], 0)
+
+    def _read_pages(self, src):
+        reader = wia_rawapi.start_scan(src)
+        pages = []
+        page = b""
+        while True:
+            try:
+                page += bytes(reader.read())
+            except EOFError:
+                pages.append(page)
+                page = b""
+            except StopIteration:
+                return pages
+
+    def test_devices(self):
+        devices = wia_rawapi.get_devices()
+        self.assertEqual(devices, [
+            ('mock:0', 'Mock scanner 0'),
+            ('mock:1', 'Mock scanner 1'),
+        ])
+        self.assertRaises(wia_rawapi.WIAException, wia_rawapi.open, "mock:2")
+
+    def test_download(self):
+        dev = wia_rawapi.open("mock:1")
+        srcs = dict(wia_rawapi.get_sources(dev))
+        self.assertEqual(sorted(srcs.keys()), [
+            '0000\\Root\\Feeder', '0000\\Root\\Flatbed'
+        ])
+        page_size = _mockapi.mock_get_stats()['page_size']
+
+        pages = self._read_pages(srcs['0000\\Root\\Flatbed'])
+        self.assertEqual(len(pages), 1)
+        self.assertEqual(len(pages[0]), page_size)
+        img = PIL.Image.open(io.BytesIO(pages[0]))
+        self.assertEqual(img.size, (100, 20))
+        self.assertEqual(img.mode, "RGB")
+
+        pages = self._read_pages(srcs['0000\\Root\\Feeder'])
+        self.assertEqual(len(pages), 3)
+        self.assertEqual(pages[2], pages[0])
+
+    def test_download_not_started(self):
+        dev = wia_rawapi.open("mock:0")
+        srcs = dict(wia_rawapi.get_sources(dev))
+        # not a source: download() fails before doing anything
+        reader = wia_rawapi.start_scan(dev)
+        self.assertRaises(wia_rawapi.WIAException, reader.read)
+        # device closed behind the back of its handles
+        dev.worker.call(_mockapi.exit)
+        reader = wia_rawapi.start_scan(srcs['0000\\Root\\Flatbed'])
+        self.assertRaises(wia_rawapi.WIAException, reader.read)
+
+    def test_memory_bitmap(self):
+        dev = wia_rawapi.open("mock:0")
+        src = dict(wia_rawapi.get_sources(dev))['0000\\Root\\Flatbed']
+        bmp = self._read_pages(src)[0]
+        self.assertEqual(wia_rawapi.set_properties(src, {'format': 'memorybmp'}),
+                         [])
+        # same bitmap, without the file header
+        page = self._read_pages(src)[0]
+        self.assertEqual(page, bmp[14:])
+        dib = _core.dib_new(True)
+        for offset in range(0, len(page), 37):
+            _core.dib_feed(dib, page[offset:offset + 37])
+        (mode, rawmode, size, data, palette) = _core.dib_get_lines(dib, 0, 20)
+        self.assertEqual(
+            PIL.Image.frombytes(mode, size, data, "raw", rawmode).tobytes(),
+            PIL.Image.open(io.BytesIO(bmp)).tobytes()
+        )
+
+    def test_options(self):
+        dev = wia_rawapi.open("mock:0")
+        srcs = wia_rawapi.get_sources(dev)
+        src = srcs[0][1]
+        options = wia_rawapi.get_options(src)
+        self.assertEqual(options['depth']['value'], 24)
+        self.assertEqual(options['pixels_per_line']['value'], 100)
+        # out of range: refused by the driver
+        failed = wia_rawapi.set_properties(src, {'depth': 8, 'xres': 5000})
+        self.assertEqual(failed, ['xres'])
+        changes = wia_rawapi.get_property_changes(src)
+        self.assertIn('depth', [prop[0] for prop in changes[0]])
+
+    def _wait_probes(self, nb_threads):
+        # the probes that timed out keep running in the background
+        for _ in range(100):
+            if threading.active_count() <= nb_threads:
+                return
+            time.sleep(0.05)
+        self.fail("probes still running")
+
+    def test_probe(self):
+        opened = _mockapi.mock_get_stats()['devices_opened']
+        scanners = wia_abstract.get_devices()
+        self.assertEqual([s.name for s in scanners], ['mock:0', 'mock:1'])
+        self.assertEqual(_mockapi.mock_get_stats()['devices_opened'],
+                         opened + 2)
+
+    def test_probe_timeout(self):
+        nb_threads = threading.active_count()
+        opened = _mockapi.mock_get_stats()['devices_opened']
+        _mockapi.mock_configure(open_delay=0.5)
+        try:
+            with self.assertLogs('pyinsane2.wia.abstract', 'WARNING') as logs:
+                scanners = wia_abstract.get_devices(probe_timeout=0.1)
+            self.assertEqual(scanners, [])
+            self.assertEqual(len(logs.output), 2)
+            self._wait_probes(nb_threads)
+            # opened eventually, but too late
+            self.assertEqual(_mockapi.mock_get_stats()['devices_opened'],
+                             opened + 2)
+            self.assertEqual(scanners, [])
+        finally:
+            _mockapi.mock_configure(open_delay=0)
+
+    def test_get_options(self):
+        dev = wia_rawapi.open("mock:0")
+        src = dict(wia_rawapi.get_sources(dev))['0000\\Root\\Flatbed']
+        reads = _mockapi.mock_get_stats()['reads']
+        options = wia_rawapi.get_options(src)
+        # values and constraints: ReadMultiple() + GetPropertyAttributes()
+        self.assertEqual(_mockapi.mock_get_stats()['reads'], reads + 2)
+        self.assertEqual(options['xres'], {
+            'value': 120, 'accessright': 'rw', 'possible_values': None,
+            'constraint': (0, 1000),
+        })
+        self.assertEqual(options['pixels_per_line']['accessright'], 'ro')
+        self.assertEqual(options['format']['value'], 'bmp')
+        # sorted natively
+        possible_values = options['format']['possible_values']
+        self.assertIn('jpeg', possible_values)
+        self.assertEqual(list(possible_values), sorted(possible_values))
+        options = wia_rawapi.get_options(dev)
+        self.assertEqual(options['dev_id']['value'], 'mock:0')
+
+    def test_lazy_options(self):
+        opened = _mockapi.mock_get_stats()['devices_opened']
+        scanner = wia_abstract.get_devices(probe_timeout=None)[1]
+        stats = _mockapi.mock_get_stats()
+        self.assertEqual(scanner.name, 'mock:1')
+        self.assertEqual(scanner.nice_name, 'Mock scanner 1')
+        # not even opened
+        self.assertEqual(stats['devices_opened'], opened)
+
+        self.assertEqual(scanner.options['depth'].value, 24)
+        self.assertEqual(scanner.options['pixels_per_line'].value, 100)
+        self.assertEqual(_mockapi.mock_get_stats()['devices_opened'],
+                         opened + 1)
+        reads = _mockapi.mock_get_stats()['reads']
+        self.assertTrue(reads > stats['reads'])
+        # loaded once
+        scanner.options['xres']
+        self.assertEqual(_mockapi.mock_get_stats()['reads'], reads)
+
+    def test_set_properties(self):
+        dev = wia_rawapi.open("mock:0")
+        src = dict(wia_rawapi.get_sources(dev))['0000\\Root\\Flatbed']
+        writes = _mockapi.mock_get_stats()['writes']
+        self.assertEqual(
+            wia_rawapi.set_properties(src, {'depth': 8, 'xres': 150}), []
+        )
+        # one call for all of them
+        self.assertEqual(_mockapi.mock_get_stats()['writes'], writes + 1)
+        options = wia_rawapi.get_options(src)
+        self.assertEqual(options['depth']['value'], 8)
+        self.assertEqual(options['xres']['value'], 150)
+
+    def test_set_properties_fallback(self):
+        dev = wia_rawapi.open("mock:0")
+        src = dict(wia_rawapi.get_sources(dev))['0000\\Root\\Flatbed']
+        writes = _mockapi.mock_get_stats()['writes']
+        # the driver rejects the whole batch because of 'xres': the
+        # properties are written again one by one
+        self.assertEqual(
+            wia_rawapi.set_properties(src, {'depth': 8, 'xres': 5000}),
+            ['xres']
+        )
+        self.assertEqual(_mockapi.mock_get_stats()['writes'], writes + 3)
+        options = wia_rawapi.get_options(src)
+        self.assertEqual(options['depth']['value'], 8)
+        self.assertNotEqual(options['xres']['value'], 5000)
+
+    def test_set_options(self):
+        scanner = wia_abstract.get_devices(probe_timeout=None)[0]
+        scanner.set_options({'depth': 8, 'xres': 150})
+        self.assertEqual(scanner.options['depth'].value, 8)
+        self.assertEqual(scanner.options['xres'].value, 150)
+        self.assertRaises(wia_abstract.WIAException, scanner.set_options,
+                          {'depth': 24, 'xres': 5000})
+        # accepted when written alone
+        self.assertEqual(scanner.options['depth'].value, 24)
+        self.assertEqual(scanner.options['xres'].value, 150)
+
+    def test_device_reused(self):
+        opened = _mockapi.mock_get_stats()['devices_opened']
+        dev = wia_rawapi.open("mock:0")
+        srcs = wia_rawapi.get_sources(dev)
+        dev2 = wia_rawapi.open("mock:0")
+        self.assertEqual(_mockapi.mock_get_stats()['devices_opened'],
+                         opened + 1)
+        # released by tearDown(): exit() must release all the COM objects,
+        # even those of the handles still alive
+        self.handles = [dev, dev2, srcs]
+
+    def test_record_replay(self):
+        tmpdir = tempfile.mkdtemp()
+        path = os.path.join(tmpdir, "scan.rec")
+        try:
+            dev = wia_rawapi.open("mock:0")
+            src = dict(wia_rawapi.get_sources(dev))['0000\\Root\\Feeder']
+            recorder = _core.recorder_new(path, _core.RECORD_WIA)
+            reader = wia_rawapi.start_scan(src, recorder=recorder)
+            pages = []
+            page = b""
+            while True:
+                try:
+                    page += bytes(reader.read())
+                except EOFError:
+                    pages.append(page)
+                    page = b""
+                except StopIteration:
+                    break
+            self.assertTrue(_core.recorder_close(recorder))
+
+            infos = _core.replay_get_infos(_core.replay_open(path))
+            self.assertEqual(infos['backend'], 'wia')
+            self.assertEqual(infos['pages'], 3)
+            self.assertEqual(infos['bytes'], sum(len(p) for p in pages))
+            self.assertEqual(infos['parameters'][1:], (1, 300, 100, 20, 24))
+
+            # the mock driver plays the recording instead of its own pages
+            _mockapi.mock_configure(nb_pages=1, replay=path, replay_speed=0)
+            self.assertEqual(self._read_pages(src), pages)
+            # everything has been replayed
+            self.assertEqual(self._read_pages(src), [])
+        finally:
+            _mockapi.mock_configure(replay=None)
+            os.unlink(path)
+            os.rmdir(tmpdir)
+
+    def test_batch_short_page(self):
+        # a feeder page too short to be one, between two real pages
+        dev = wia_rawapi.open("mock:0")
+        page = self._read_pages(dict(wia_rawapi.get_sources(dev))[
+            '0000\\Root\\Flatbed'
+        ])[0]
+        tmpdir = tempfile.mkdtemp()
+        path = os.path.join(tmpdir, "scan.rec")
+        try:
+            rec = _core.recorder_new(path, _core.RECORD_WIA)
+            for data in (page, b"x" * 56, page):
+                _core.recorder_chunk(rec, data)
+                _core.recorder_end_of_page(rec)
+            _core.recorder_end_of_scan(rec, 0)
+            self.assertTrue(_core.recorder_close(rec))
+            _mockapi.mock_configure(replay=path, replay_speed=0)
+
+            scanner = wia_abstract.get_devices(probe_timeout=None)[0]
+            scanner.options['source'].value = '0000\\Root\\Feeder'
+            session = scanner.scan(multiple=True, batch=True)
+            self.assertTrue(session.batch)
+            nb_pages = 0
+            while True:
+                try:
+                    session.scan.read()
+                    # returns only once it got some data of a page
+                    self.assertGreater(_core.dib_get_size(session.scan._dib),
+                                       0)
+                except EOFError:
+                    nb_pages += 1
+                except StopIteration:
+                    break
+            self.assertEqual(nb_pages, 2)
+            self.assertEqual([img.size for img in session.images],
+                             [(100, 20), (100, 20)])
+        finally:
+            _mockapi.mock_configure(replay=None)
+            os.unlink(path)
+            os.rmdir(tmpdir)
+
+
+class TestSaneReplay(unittest.TestCase):
+    def setUp(self):
+        self.tmpdir = tempfile.mkdtemp()
+        self.src = os.path.join(self.tmpdir, "src.rec")
+        self.dst = os.path.join(self.tmpdir, "dst.rec")
+        # what a sheetfed scanner returns for 2 pages of 10x4 grayscale
+        rec = _core.recorder_new(self.src, _core.RECORD_SANE)
+        for page in range(2):
+            _core.recorder_parameters(rec, 0, 1, 10, 10, 4, 8)
+            _core.recorder_chunk(rec, get_pattern(page, 25))
+            _core.recorder_chunk(rec, get_pattern(page, 40)[25:])
+            _core.recorder_end_of_page(rec)
+        _core.recorder_end_of_scan(rec, sane_abstract.SaneStatus.NO_DOCS)
+        _core.recorder_end_of_scan(rec, sane_abstract.SaneStatus.CANCELLED)
+        self.assertTrue(_core.recorder_close(rec))
+
+    def tearDown(self):
+        for name in os.listdir(self.tmpdir):
+            os.unlink(os.path.join(self.tmpdir, name))
+        os.rmdir(self.tmpdir)
+
+    def test_replay(self):
+        lib = sane_replay.ReplayLib(self.src, speed=0)
+        self.assertEqual(lib.nb_pages, 2)
+        with lib.installed():
+            devices = sane_abstract.get_devices()
+            self.assertEqual([dev.name for dev in devices], ["replay"])
+            scanner = sane_abstract.Scanner("replay")
+            self.assertEqual(scanner.options['source'].value, "ADF")
+            # recorded again while replayed
+            session = scanner.scan(multiple=True, record=self.dst)
+            try:
+                while True:
+                    try:
+                        session.scan.read()
+                    except EOFError:
+                        pass
+            except StopIteration:
+                pass
+            scanner._force_close()
+
+        self.assertEqual(len(session.images), 2)
+        for (page, img) in enumerate(session.images):
+            self.assertEqual(img.size, (10, 4))
+            self.assertEqual(img.tobytes(), get_pattern(page, 40))
+
+        infos = _core.replay_get_infos(_core.replay_open(self.dst))
+        self.assertEqual(infos['pages'], 2)
+        self.assertEqual(infos['bytes'], 80)
+        self.assertEqual(infos['parameters'], (0, 1, 10, 10, 4, 8))
+
+
+class TestSane16Bits(unittest.TestCase):
+    # 10x4 grayscale, 16 bits per sample, lines padded to 24 bytes
+    SAMPLES = [(i * 1621) % 65536 for i in range(40)]
+
+    def setUp(self):
+        self.tmpdir = tempfile.mkdtemp()
+        self.path = os.path.join(self.tmpdir, "16bits.rec")
+        data = b"".join(
+            struct.pack("=10H", *self.SAMPLES[y * 10:(y + 1) * 10]) +
+            b"\xAA\xBB\xCC\xDD"
+            for y in range(4)
+        )
+        rec = _core.recorder_new(self.path, _core.RECORD_SANE)
+        _core.recorder_parameters(rec, 0, 1, 24, 10, 4, 16)
+        # chunks cutting the lines anywhere
+        for offset in range(0, len(data), 7):
+            _core.recorder_chunk(rec, data[offset:offset + 7])
+        _core.recorder_end_of_page(rec)
+        _core.recorder_end_of_scan(rec, sane_abstract.SaneStatus.CANCELLED)
+        self.assertTrue(_core.recorder_close(rec))
+
+    def tearDown(self):
+        os.unlink(self.path)
+        os.rmdir(self.tmpdir)
+
+    def _scan(self, to_8bits):
+        lib = sane_replay.ReplayLib(self.path, speed=0)
+        with lib.installed():
+            scanner = sane_abstract.Scanner("replay")
+            session = scanner.scan(to_8bits=to_8bits)
+            try:
+                while True:
+                    session.scan.read()
+            except EOFError:
+                pass
+            raw = bytes(session.scan.get_raw_lines())
+            scanner._force_close()
+        self.assertEqual(len(session.images), 1)
+        return (session.images[0], raw)
+
+    def test_16bits(self):
+        (img, raw) = self._scan(False)
+        self.assertEqual(img.mode, "I;16")
+        self.assertEqual(img.size, (10, 4))
+        self.assertEqual(list(img.getdata()), self.SAMPLES)
+        # little endian, padding included
+        self.assertEqual(struct.unpack("<10H", raw[24:44]),
+                         tuple(self.SAMPLES[10:20]))
+
+    def test_8bits(self):
+        (img, raw) = self._scan(True)
+        self.assertEqual(img.mode, "L")
+        self.assertEqual(img.size, (10, 4))
+        self.assertEqual(list(img.getdata()), [v >> 8 for v in self.SAMPLES])
+        self.assertEqual(len(raw), 40)
+
+    def test_levels(self):
+        (img, _) = self._scan((0x2000, 0xE000, 1.5))
+        lut = bytearray(_core.pixels_lut16(0x2000, 0xE000, 1.5))
+        self.assertEqual(img.mode, "L")
+        self.assertEqual(list(img.getdata()), [lut[v] for v in self.SAMPLES])
+
+    def test_rgb(self):
+        parameters = sane_abstract.FrameFormat(
+            sane_rawapi.SaneFrame.RGB, 16, 2, 12
+        )
+        raw = struct.pack("<6H", 0x1234, 0xFF00, 0x0100, 0x8000, 0x00FF,
+                          0xABCD)
+        img = sane_abstract.ImgUtil.raw_to_img(raw, parameters)
+        self.assertEqual(img.mode, "RGB")
+        self.assertEqual(img.tobytes(), b"\x12\xFF\x01\x80\x00\xAB")
+
+
+class TestSaneThreePass(unittest.TestCase):
+    # 10x4 pages, one frame per color
+    FRAMES = [
+        sane_rawapi.SaneFrame.RED,
+        sane_rawapi.SaneFrame.GREEN,
+        sane_rawapi.SaneFrame.BLUE,
+    ]
+
+    def setUp(self):
+        self.tmpdir = tempfile.mkdtemp()
+        self.path = os.path.join(self.tmpdir, "three-pass.rec")
+
+    def tearDown(self):
+        os.unlink(self.path)
+        os.rmdir(self.tmpdir)
+
+    def _record(self, planes, depth, bytes_per_line):
+        rec = _core.recorder_new(self.path, _core.RECORD_SANE)
+        for page in planes:
+            for (idx, data) in enumerate(page):
+                _core.recorder_parameters(
+                    rec, self.FRAMES[idx], idx == 2, bytes_per_line, 10, 4,
+                    depth
+                )
+                for offset in range(0, len(data), 13):
+                    _core.recorder_chunk(rec, data[offset:offset + 13])
+                _core.recorder_end_of_page(rec)
+        _core.recorder_end_of_scan(rec, sane_abstract.SaneStatus.NO_DOCS)
+        _core.recorder_end_of_scan(rec, sane_abstract.SaneStatus.CANCELLED)
+        self.assertTrue(_core.recorder_close(rec))
+
+    def _scan(self, multiple):
+        lib = sane_replay.ReplayLib(self.path, speed=0)
+        raws = []
+        with lib.installed():
+            scanner = sane_abstract.Scanner("replay")
+            session = scanner.scan(multiple=multiple)
+            try:
+                while True:
+                    try:
+                        session.scan.read()
+                    except EOFError:
+                        raws.append(bytes(session.scan.get_raw_lines()))
+                        if not multiple:
+                            break
+            except StopIteration:
+                pass
+            scanner._force_close()
+        return (session.images, raws)
+
+    def test_pages(self):
+        planes = [[get_pattern(page * 3 + color, 40) for color in range(3)]
+                  for page in range(2)]
+        self._record(planes, 8, 10)
+        (images, _) = self._scan(True)
+        # one RGB image per page, not one per frame
+        self.assertEqual(len(images), 2)
+        for (page, img) in enumerate(images):
+            self.assertEqual(img.mode, "RGB")
+            self.assertEqual(img.size, (10, 4))
+            self.assertEqual(img.tobytes(), bytes(bytearray(
+                bytearray(planes[page][color])[x]
+                for x in range(40) for color in range(3)
+            )))
+
+    def test_16bits(self):
+        samples = [[(i * 997 + color * 20000) % 65536 for i in range(40)]
+                   for color in range(3)]
+        # lines padded to 24 bytes
+        planes = [b"".join(
+            struct.pack("=10H", *samples[color][y * 10:(y + 1) * 10]) +
+            b"\0" * 4 for y in range(4)
+        ) for color in range(3)]
+        self._record([planes], 16, 24)
+        (images, raws) = self._scan(False)
+        self.assertEqual(len(images), 1)
+        self.assertEqual(images[0].mode, "RGB")
+        interleaved = [samples[color][x] for x in range(40)
+                       for color in range(3)]
+        self.assertEqual(images[0].tobytes(),
+                         bytes(bytearray(v >> 8 for v in interleaved)))
+        # full depth, little endian
+        self.assertEqual(raws[0], struct.pack("<120H", *interleaved))
+
+    def test_1bit(self):
+        planes = [get_pattern(color, 8) for color in range(3)]
+        self._record([planes], 1, 2)
+        (images, _) = self._scan(False)
+        self.assertEqual(len(images), 1)
+        expected = [sane_abstract.ImgUtil.unpack_1_to_8(plane, 10, 2)
+                    for plane in planes]
+        self.assertEqual(images[0].tobytes(), bytes(bytearray(
+            bytearray(expected[color])[x]
+            for x in range(40) for color in range(3)
+        )))
+
+
+class TestLineStore(unittest.TestCase):
+    class Parameters(object):
+        format = sane_abstract.rawapi.SaneFrame.GRAY
+        depth = 8
+        pixels_per_line = 10
+        bytes_per_line = 12  # padded
+
+    def test_preallocated(self):
+        store = sane_abstract.LineStore(12, 100)
+        buf = store._buf
+        self.assertEqual(len(buf), 1200)
+        data = get_pattern(0, 1200)
+        for offset in range(0, 1200, 7):
+            store.append(data[offset:offset + 7])
+            self.assertEqual(store.nb_lines, min(offset + 7, 1200) // 12)
+        # never reallocated
+        self.assertTrue(store._buf is buf)
+        self.assertEqual(bytes(store.get_lines(0, 100)), data)
+        self.assertEqual(bytes(store.get_lines(10, 12)), data[120:144])
+
+    def test_unknown_height(self):
+        store = sane_abstract.LineStore(12, -1)
+        data = get_pattern(0, 12 * 1000 + 5)
+        sizes = set()
+        for offset in range(0, len(data), 100):
+            store.append(data[offset:offset + 100])
+            sizes.add(len(store._buf))
+        self.assertEqual(store.nb_lines, 1000)
+        # geometric growth
+        self.assertTrue(len(sizes) <= 6, sizes)
+        self.assertEqual(bytes(store.get_lines(0, 1000)), data[:12000])
+        # incomplete lines are not returned
+        self.assertEqual(len(store.get_lines(999, 1001)), 12)
+
+    def test_images_survive_growth(self):
+        store = sane_abstract.LineStore(12, 2)
+        data = get_pattern(0, 12 * 50)
+        store.append(data[:24])
+        img = sane_abstract.ImgUtil.raw_to_img(store.get_lines(0, 2),
+                                               self.Parameters)
+        store.append(data[24:])
+        self.assertEqual(store.nb_lines, 50)
+        # padding dropped
+        expected = b"".join(data[i:i + 10] for i in range(0, len(data), 12))
+        self.assertEqual(img.size, (10, 2))
+        self.assertEqual(img.tobytes(), expected[:20])
+        img = sane_abstract.ImgUtil.raw_to_img(store.get_lines(5, 50),
+                                               self.Parameters)
+        self.assertEqual(img.size, (10, 45))
+        self.assertEqual(img.tobytes(), expected[50:])
+
+
+class FakeSaneLib(object):
+    # sane_read() returns 'size' bytes of get_pattern() in chunks of up to
+    # 'chunk_size' bytes, then 'status'
+    def __init__(self, size, chunk_size, status=sane_rawapi.SaneStatus.EOF):
+        self.data = get_pattern(0, size)
+        self.chunk_size = chunk_size
+        self.status = status
+        self.nb_calls = 0
+        self.cancelled = threading.Event()
+        self.block = False
+
+    def sane_read(self, handle, buf, max_length, length_ptr):
+        self.nb_calls += 1
+        length_ptr.contents.value = 0
+        if self.block:
+            # waits for the scanner, until cancelled
+            self.cancelled.wait()
+        if self.cancelled.is_set():
+            return sane_rawapi.SaneStatus.CANCELLED
+        if not self.data:
+            return self.status
+        data = self.data[:min(max_length, self.chunk_size)]
+        self.data = self.data[len(data):]
+        ctypes.memmove(buf, data, len(data))
+        length_ptr.contents.value = len(data)
+        return sane_rawapi.SaneStatus.GOOD
+
+    def sane_cancel(self, handle):
+        self.cancelled.set()
+
+
+@unittest.skipIf(sane_rawapi._rawapi is None, "native SANE reader not built")
+class TestSaneReader(unittest.TestCase):
+    def setUp(self):
+        self.previous = (sane_rawapi.SANE_LIB, sane_rawapi.sane_available)
+        sane_rawapi.sane_available = True
+        self.handle = ctypes.c_void_p(42)
+
+    def tearDown(self):
+        (sane_rawapi.SANE_LIB, sane_rawapi.sane_available) = self.previous
+
+    def _read_frame(self, reader):
+        data = b""
+        while True:
+            try:
+                data += bytes(reader.read())
+            except EOFError:
+                return data
+
+    def test_frame(self):
+        sane_rawapi.SANE_LIB = FakeSaneLib(1000 * 1000, 4097)
+        reader = sane_rawapi.sane_start_reader(self.handle)
+        self.assertEqual(self._read_frame(reader), get_pattern(0, 1000 * 1000))
+        self.assertEqual(reader.join(), sane_rawapi.SaneStatus.EOF)
+        telemetry = reader.get_telemetry()
+        self.assertEqual(telemetry['bytes'], 1000 * 1000)
+        self.assertEqual(len(telemetry['pages']), 1)
+        sane_rawapi.sane_cancel(self.handle)
+
+    def test_no_docs(self):
+        sane_rawapi.SANE_LIB = FakeSaneLib(
+            0, 1, status=sane_rawapi.SaneStatus.NO_DOCS
+        )
+        reader = sane_rawapi.sane_start_reader(self.handle)
+        self.assertRaises(StopIteration, reader.read)
+        self.assertRaises(StopIteration, reader.read)
+        sane_rawapi.sane_cancel(self.handle)
+
+    def test_error(self):
+        sane_rawapi.SANE_LIB = FakeSaneLib(
+            100, 7, status=sane_rawapi.SaneStatus.JAMMED
+        )
+        reader = sane_rawapi.sane_start_reader(self.handle)
+        with self.assertRaises(sane_rawapi.SaneException) as ctx:
+            self._read_frame(reader)
+        self.assertIn("jammed", str(ctx.exception))
+        sane_rawapi.sane_cancel(self.handle)
+
+    def test_reads_ahead(self):
+        # the device is read while the application does something else, up
+        # to 'max_buffered'
+        lib = FakeSaneLib(10 * 1024 * 1024, 64 * 1024)
+        sane_rawapi.SANE_LIB = lib
+        reader = sane_rawapi.sane_start_reader(
+            self.handle, max_buffered=1024 * 1024, chunk_size=64 * 1024
+        )
+        for _ in range(100):
+            if lib.nb_calls >= 16:
+                break
+            time.sleep(0.01)
+        time.sleep(0.05)
+        self.assertGreaterEqual(lib.nb_calls, 16)
+        self.assertLessEqual(lib.nb_calls, 18)
+        self.assertEqual(self._read_frame(reader),
+                         get_pattern(0, 10 * 1024 * 1024))
+        self.assertGreater(reader.get_telemetry()['blocked'], 0.0)
+        sane_rawapi.sane_cancel(self.handle)
+
+    def test_cancel_while_reading(self):
+        lib = FakeSaneLib(100, 10)
+        lib.block = True
+        sane_rawapi.SANE_LIB = lib
+        reader = sane_rawapi.sane_start_reader(self.handle)
+        # makes sane_read() return
+        sane_rawapi.sane_cancel(self.handle)
+        self.assertEqual(reader.join(), sane_rawapi.SaneStatus.CANCELLED)
+        self.assertRaises(sane_rawapi.SaneException, reader.read)